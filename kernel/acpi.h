@@ -62,4 +62,55 @@ typedef struct __attribute__ ((packed, aligned(4))) {
     }  csba[];
 } MCFG;
 
+//Entry types of the MADT
+#define MADT_LOCAL_APIC 0
+#define MADT_IO_APIC 1
+#define MADT_INTERRUPT_OVERRIDE 2
+#define MADT_LOCAL_APIC_OVERRIDE 5
+
+//Flags of a local APIC entry
+#define MADT_LOCAL_APIC_ENABLED 1 << 0
+#define MADT_LOCAL_APIC_ONLINE_CAPABLE 1 << 1
+
+typedef struct __attribute__ ((packed, aligned(4))) {
+    ACPISDTHeader h;
+    uint32_t LocalApicAddress;
+    uint32_t Flags;
+    uint8_t entries[];
+} MADT;
+
+typedef struct __attribute__ ((packed)) {
+    uint8_t type;
+    uint8_t length;
+} MADTEntryHeader;
+
+typedef struct __attribute__ ((packed)) {
+    MADTEntryHeader h;
+    uint8_t ProcessorId;
+    uint8_t ApicId;
+    uint32_t Flags;
+} MADTLocalApic;
+
+typedef struct __attribute__ ((packed)) {
+    MADTEntryHeader h;
+    uint8_t IoApicId;
+    uint8_t Reserved;
+    uint32_t Address;
+    uint32_t GlobalSystemInterruptBase;
+} MADTIoApic;
+
+typedef struct __attribute__ ((packed)) {
+    MADTEntryHeader h;
+    uint8_t Bus;
+    uint8_t Source;
+    uint32_t GlobalSystemInterrupt;
+    uint16_t Flags;
+} MADTInterruptOverride;
+
+typedef struct __attribute__ ((packed)) {
+    MADTEntryHeader h;
+    uint16_t Reserved;
+    uint64_t Address;
+} MADTLocalApicOverride;
+
 #endif //NIGHTOS_ACPI_H
@@ -10,6 +10,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include "alloc/liballoc.h"
+#include "lock.h"
 
 /**
  * Kernel modules should use this alloc function to allocate known sizes
@@ -26,8 +27,8 @@ void kfree(void* ptr);
 
 /**
  * Registers a new object size in the allocator.
- * The allocator will make sure to have at least 1 to n pre-allocated in a pool, where n is the number of division possible in one page
- * The allocator uses a 64-bit integer to track state of each element after the header. So at most n can be 64.
+ * The size gets its own slab cache instead of sharing the next power of two, one slab is allocated right away.
+ * Sizes are rounded up to 8 bytes, at most 16384 bytes are supported.
  * @param size the size of the individual object
  */
 void alloc_register_object_size(size_t size);
@@ -35,20 +36,64 @@ void alloc_init();
 
 #define SLAB_SIZE 4096
 
+/**
+ * Header at the start of every slab, the slab is a naturally aligned block of 2^order frames
+ * Free objects are linked through their first 8 bytes
+ */
 struct slab {
-    void* memory;
-    size_t object_size;
+    struct size_class* cache;
+    void* free;
     uint16_t total_objects;
     uint16_t free_objects;
-    unsigned long* bitmap;  // To track free/used objects
+    uint8_t order;
     struct slab* next;
+    struct slab* prev;
 };
 
 struct size_class {
+    const char* name;
     size_t size;
-    struct slab* slabs;
+    size_t stride; //Distance between two objects in a slab
+    size_t align;
+    size_t free_offset; //Offset of the free list link inside of a free object
+    void (*ctor)(void*);
+
+    struct slab* partial; //Slabs with at least one free object
+    struct slab* full;
+    spin_t lock;
+
+    //Statistics, allocations served by the magazines are counted there
+    uint64_t slabs;
+    uint64_t objects;
+    uint64_t allocs;
+    uint64_t frees;
 };
 
+//Alignment that keeps objects on their own cache lines
+#define KMEM_CACHE_LINE 64
+
+typedef struct size_class kmem_cache_t;
+
+/**
+ * Creates a named object cache
+ * @param name the name shown in the statistics
+ * @param size the size of the objects, at most 16384 bytes
+ * @param align the alignment of the objects, KMEM_CACHE_LINE keeps objects from sharing cache lines
+ * @param ctor called once for every object when its slab is created, objects have to be freed in constructed state
+ * @return the cache or NULL if the parameters are invalid or no caches are left
+ */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*));
+void* kmem_cache_alloc(kmem_cache_t* cache);
+/**
+ * Allocates an object and zeroes it, not useful for caches with a constructor
+ */
+void* kmem_cache_zalloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* ptr);
+/**
+ * Prints the statistics of every cache
+ */
+void kmem_cache_dump();
+
 #define OOM()
 
 #define MEM_BLOCK_MAGIC 0x1BAB0
@@ -399,6 +399,12 @@ void free(void *ptr)
 
     if ( ptr == NULL ) return;
 
+    if ( liballoc_foreign_size( ptr ) != 0 )
+    {
+        liballoc_foreign_free( ptr );
+        return;
+    }
+
     liballoc_lock();
 
 
@@ -517,10 +523,15 @@ void*   realloc(void *p, size_t size)
     }
     if ( p == NULL ) return malloc( size );
 
-    if ( liballoc_lock != NULL ) liballoc_lock();		// lockit
-    tag = (struct boundary_tag*)((unsigned int)p - sizeof( struct boundary_tag ));
-    real_size = tag->size;
-    if ( liballoc_unlock != NULL ) liballoc_unlock();
+    real_size = liballoc_foreign_size( p );
+
+    if ( real_size == 0 )
+    {
+        if ( liballoc_lock != NULL ) liballoc_lock();		// lockit
+        tag = (struct boundary_tag*)((unsigned int)p - sizeof( struct boundary_tag ));
+        real_size = tag->size;
+        if ( liballoc_unlock != NULL ) liballoc_unlock();
+    }
 
     if ( real_size > size ) real_size = size;
 
@@ -82,6 +82,17 @@ extern void* liballoc_alloc(int);
  */
 extern int liballoc_free(void*,int);
 
+/** This hook lets free and realloc accept memory that was not
+ * allocated by liballoc, e.g. objects of the kernel slab caches.
+ *
+ * \return the size of the object or 0 if it belongs to liballoc.
+ */
+extern size_t liballoc_foreign_size(void*);
+
+/** Frees memory for which liballoc_foreign_size returned a size.
+ */
+extern void liballoc_foreign_free(void*);
+
 
 
 void     *malloc(size_t);				//< The standard function.
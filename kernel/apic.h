@@ -0,0 +1,76 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+
+#ifndef NIGHTOS_APIC_H
+#define NIGHTOS_APIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//Vectors above the dynamic irqs belong to the local APIC of each cpu
+#define APIC_TIMER_VECTOR 0xF0
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+//Writing the vector into data and the address to a device raises the irq at the cpu of the APIC id
+#define MSI_ADDRESS_BASE 0xFEE00000
+
+/**
+ * Records the local APIC address found in the MADT
+ */
+void apic_set_lapic_base(uintptr_t base);
+
+/**
+ * Records an IOAPIC entry of the MADT
+ */
+void apic_add_ioapic(uint8_t id, uintptr_t address, uint32_t gsiBase);
+
+/**
+ * Records an interrupt source override, the ISA irq is wired to the gsi with polarity and trigger of the MPS flags
+ */
+void apic_add_override(uint8_t irq, uint32_t gsi, uint16_t flags);
+
+/**
+ * Switches from the 8259 PIC to the local APIC and IOAPICs, called after pci_init parsed the MADT.
+ * Lines the PIC had unmasked are routed to the boot cpu, without a MADT the PIC stays in charge.
+ */
+void apic_init();
+
+/**
+ * Enables the local APIC of the executing cpu, x2APIC mode if the boot cpu uses it
+ */
+void lapic_init_cpu();
+
+/**
+ * Makes the local APIC timer the clock event device of the executing cpu, in TSC deadline mode if the cpu has it.
+ * Needs a calibrated TSC, the boot cpu keeps the PIT unless the clocksource is valid for one shot timers.
+ */
+void lapic_timer_init();
+
+/**
+ * @return true once interrupts go through the APICs
+ */
+bool apic_enabled();
+
+/**
+ * @return the APIC id of the executing cpu
+ */
+uint32_t lapic_id();
+
+/**
+ * Sends an interprocessor interrupt and waits until the local APIC accepted it
+ */
+void lapic_send_ipi(uint32_t apic, uint32_t command);
+
+/**
+ * Signals the end of the interrupt in service on this cpu, one register write
+ */
+void lapic_eoi();
+
+/**
+ * Composes the message a device writes for an allocated irq
+ * @return 0 or -EINVAL if the irq isn't dynamic or the cpu isn't online
+ */
+int msi_compose(uint8_t irq, int cpu, uint64_t* address, uint32_t* data);
+
+#endif //NIGHTOS_APIC_H
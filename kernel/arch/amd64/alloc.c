@@ -3,234 +3,374 @@
 //
 #include "../../memmgr.h"
 #include "../../lock.h"
+#include "../../idt.h"
+#include "../../proc/process.h"
+#include "../../terminal.h"
 #include "../../../mlibc/abis/linux/errno.h"
 
 #define MAX_SIZE_CLASSES 512
 #define DEFAULT_SIZE_CLASSES 12
+#define MAX_OBJECT_SIZE 16384
+
+//Slabs grow up to 2^SLAB_MAX_ORDER pages until they hold SLAB_MIN_OBJECTS objects
+#define SLAB_MAX_ORDER 4
+#define SLAB_MIN_OBJECTS 8
+//Objects start cache line aligned after the header
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + 63) & ~63)
+//Offset of the first object, caches may ask for a larger alignment than the header provides
+#define SLAB_OBJECTS_OFFSET(cache) ((SLAB_HEADER_SIZE + (cache)->align - 1) & ~((cache)->align - 1))
+//Link to the next free object inside of a free object
+#define SLAB_FREE_LINK(cache, object) ((void**) ((char*) (object) + (cache)->free_offset))
 
 static struct size_class registeredSizeClasses[MAX_SIZE_CLASSES];
 static struct size_class defaultSizeClasses[12] = {
-        {.size = 8, .slabs = NULL},
-        {.size = 16, .slabs = NULL},
-        {.size = 32, .slabs = NULL},
-        {.size = 64, .slabs = NULL},
-        {.size = 128, .slabs = NULL},
-        {.size = 256, .slabs = NULL},
-        {.size = 512, .slabs = NULL},
-        {.size = 1024, .slabs = NULL},
-        {.size = 2048, .slabs = NULL},
-        {.size = 4096, .slabs = NULL},
-        {.size = 8192, .slabs = NULL},
-        {.size = 16384, .slabs = NULL},
+        {.name = "kmalloc-8", .size = 8, .stride = 8},
+        {.name = "kmalloc-16", .size = 16, .stride = 16},
+        {.name = "kmalloc-32", .size = 32, .stride = 32},
+        {.name = "kmalloc-64", .size = 64, .stride = 64},
+        {.name = "kmalloc-128", .size = 128, .stride = 128},
+        {.name = "kmalloc-256", .size = 256, .stride = 256},
+        {.name = "kmalloc-512", .size = 512, .stride = 512},
+        {.name = "kmalloc-1024", .size = 1024, .stride = 1024},
+        {.name = "kmalloc-2048", .size = 2048, .stride = 2048},
+        {.name = "kmalloc-4096", .size = 4096, .stride = 4096},
+        {.name = "kmalloc-8192", .size = 8192, .stride = 8192},
+        {.name = "kmalloc-16384", .size = 16384, .stride = 16384},
 };
 
 static int registeredSizeClassesCount = 0;
+//Registered size class for every object size in steps of 8 bytes, NULL if the default class is used
+static struct size_class* sizeClassLookup[MAX_OBJECT_SIZE / 8 + 1];
+static spin_t REGISTER_LOCK = ATOMIC_FLAG_INIT;
+
+//Objects are cached per cpu, so most allocations take no lock at all
+//Magazines are refilled and drained in batches of half their capacity
+struct object_magazine {
+    int count;
+    int capacity;
+    uint64_t allocs;
+    uint64_t frees;
+    void* objects[];
+};
 
-struct slab* kmalloc_for_size(struct size_class* sizeClass) {
-    uint16_t perPage = (4096 / sizeClass->size);
-    uint8_t bitmapSize = 8;
-    if(perPage > 512) {
-      bitmapSize = perPage / 64;
-      if(bitmapSize % 8 != 0) {
-        bitmapSize = (bitmapSize + 8) & ~(8 - 1);
-      }
-    }
+#define MAGAZINE_MAX_OBJECTS 64
+//A whole magazine, cache line aligned so the magazines of two cpus never share a line
+#define MAGAZINE_SIZE ((sizeof(struct object_magazine) + MAGAZINE_MAX_OBJECTS * sizeof(void*) + KMEM_CACHE_LINE - 1) & ~(KMEM_CACHE_LINE - 1))
 
-    struct slab* slab = malloc(sizeof(struct slab));
-    memset(slab, 0, sizeof(struct slab));
+//Magazine of every cpu for every default and registered size class, allocated on first use
+static struct object_magazine* magazines[MAX_CPUS][DEFAULT_SIZE_CLASSES + MAX_SIZE_CLASSES];
+//Slabs of the magazines themselves, this class takes its objects straight from the slabs
+static struct size_class magazineSizeClass = {.name = "kmalloc-magazine", .size = MAGAZINE_SIZE, .stride = MAGAZINE_SIZE, .align = KMEM_CACHE_LINE};
 
-    if(slab == NULL) {
-      return NULL;
+static void slab_list_push(struct slab** list, struct slab* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+
+    if(*list) {
+        (*list)->prev = slab;
     }
 
-    slab->total_objects = perPage;
-    slab->free_objects = perPage;
-    slab->object_size = sizeClass->size;
+    *list = slab;
+}
 
-    if(perPage >= 1) {
-      slab->memory = sbrk(4096);
-      slab->bitmap = calloc(1, bitmapSize);
+static void slab_list_remove(struct slab** list, struct slab* slab) {
+    if(slab->prev) {
+        slab->prev->next = slab->next;
     } else {
-      slab->memory = sbrk(sizeClass->size);
-      slab->bitmap = calloc(1, bitmapSize);
+        *list = slab->next;
     }
 
-    if(slab->memory == NULL || slab->bitmap == NULL) {
-      if(slab->memory) {
-        munmap(slab->memory, 4096);
-      }
+    if(slab->next) {
+        slab->next->prev = slab->prev;
+    }
 
-      if(slab->bitmap) {
-        free(slab->bitmap);
-      }
-      return NULL;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+/**
+ * Allocates a new slab for the size class and adds it to the partial list
+ * Lock of the size class must be held! It is dropped while frames are allocated, reclaim may free objects of the class
+ * @param sizeClass the size class
+ * @return the new slab or NULL if no memory is available
+ */
+struct slab* kmalloc_for_size(struct size_class* sizeClass) {
+    int order = 0;
+    size_t offset = sizeClass->align ? SLAB_OBJECTS_OFFSET(sizeClass) : SLAB_HEADER_SIZE;
+
+    while(order < SLAB_MAX_ORDER && ((SLAB_SIZE << order) - offset) / sizeClass->stride < SLAB_MIN_OBJECTS) {
+        order++;
     }
 
-    struct slab* ptr = sizeClass->slabs;
-    if(ptr == NULL) {
-        sizeClass->slabs = slab;
-    } else {
-        while(ptr->next) {
-            ptr = ptr->next;
+    spin_unlock(&sizeClass->lock);
+    uintptr_t frame = kalloc_frames(order);
+    spin_lock(&sizeClass->lock);
+
+    if(frame == 0) {
+        return NULL;
+    }
+
+    memmgr_frame_set_slab(frame, order);
+
+    struct slab* slab = memmgr_get_from_physical(frame);
+    slab->cache = sizeClass;
+    slab->order = order;
+    slab->total_objects = ((SLAB_SIZE << order) - offset) / sizeClass->stride;
+    slab->free_objects = slab->total_objects;
+    slab->free = NULL;
+
+    //Link the objects back to front, so the first object is handed out first
+    char* objects = (char*) slab + offset;
+
+    for(int i = slab->total_objects - 1; i >= 0; i--) {
+        void* object = objects + i * sizeClass->stride;
+
+        if(sizeClass->ctor) {
+            sizeClass->ctor(object);
         }
 
-        ptr->next = slab;
+        *SLAB_FREE_LINK(sizeClass, object) = slab->free;
+        slab->free = object;
     }
 
+    slab_list_push(&sizeClass->partial, slab);
+
+    sizeClass->slabs++;
+    sizeClass->objects += slab->total_objects;
+
     return slab;
 }
 
-void* kmalloc(size_t size) {
-    for(int i = 0; i < registeredSizeClassesCount; i++) {
-        if(registeredSizeClasses[i].size == size) {
-            struct slab* slab = registeredSizeClasses[i].slabs;
-
-            while(slab) {
-                if(slab->free_objects > 0) {
-                    for(int j = 0; j < slab->total_objects; j++) {
-                        int index = (j / 64);
-                        int bit = (j % 64);
-
-                        unsigned long bitmap = slab->bitmap[index];
-
-                        if((bitmap & (1 << bit)) == 0) {
-                            slab->bitmap[index] |= (1 << bit);
-                            slab->free_objects--;
-
-                            return slab->memory + (64 * index * slab->object_size) + (bit * slab->object_size);
-                        }
-                    }
-                } else {
-                    slab = slab->next;
-                }
-            }
+/**
+ * Returns the size class for an allocation
+ * @param size the size
+ * @return the registered class of the size or the next power of two, NULL if the size is too large
+ */
+static struct size_class* kmalloc_get_class(size_t size) {
+    if(size == 0) {
+        size = 1;
+    }
 
-            //If we got here, no slabs are free
-            slab = registeredSizeClasses[i].slabs;
-            while(slab->next) {
-                slab = slab->next;
-            }
+    if(size > MAX_OBJECT_SIZE) {
+        return NULL;
+    }
 
-            slab = kmalloc_for_size(&registeredSizeClasses[i]);
+    struct size_class* registered = sizeClassLookup[(size + 7) / 8];
 
-            if(slab == NULL) {
-              return NULL;
-            }
+    if(registered) {
+        return registered;
+    }
 
-            slab->bitmap[0] |= 1 << 0;
-            slab->free_objects--;
+    //Default classes are powers of two starting at 8 bytes
+    int index = size <= 8 ? 0 : 61 - __builtin_clzl(size - 1);
 
-            return slab->memory;
-        }
-    }
+    return &defaultSizeClasses[index];
+}
 
-    int shift = 0;
+/**
+ * Takes an object from the slabs of a size class
+ * Lock of the size class must be held!
+ * @return the object or NULL if no memory is available
+ */
+static void* slab_alloc_object(struct size_class* sizeClass) {
+    struct slab* slab = sizeClass->partial;
 
-    while ( shift < 10 )
-    {
-        if ( defaultSizeClasses[shift].size >= size ) break;
-        shift += 1;
+    if(slab == NULL) {
+        slab = kmalloc_for_size(sizeClass);
     }
 
-    if(defaultSizeClasses[shift].size < size) {
-        return NULL; //Size larger than a whole page, please use liballoc or direct mmap!
+    if(slab == NULL) {
+        return NULL;
+    }
+
+    void* object = slab->free;
+    slab->free = *SLAB_FREE_LINK(sizeClass, object);
+    slab->free_objects--;
+
+    if(slab->free_objects == 0) {
+        slab_list_remove(&sizeClass->partial, slab);
+        slab_list_push(&sizeClass->full, slab);
     }
 
-    if(!defaultSizeClasses[shift].slabs) {
-        defaultSizeClasses[shift].slabs = kmalloc_for_size(&defaultSizeClasses[shift]);
+    return object;
+}
+
+/**
+ * Returns an object to its slab
+ * Lock of the size class must be held!
+ * @param release slabs that became empty are added to this list, they are freed once the lock is released
+ */
+static void slab_free_object(struct size_class* sizeClass, void* ptr, struct slab** release) {
+    struct slab* slab = memmgr_get_slab(ptr);
+
+    if(slab->free_objects == 0) {
+        slab_list_remove(&sizeClass->full, slab);
+        slab_list_push(&sizeClass->partial, slab);
     }
 
-    struct slab* slab = defaultSizeClasses[shift].slabs;
+    *SLAB_FREE_LINK(sizeClass, ptr) = slab->free;
+    slab->free = ptr;
+    slab->free_objects++;
+
+    //Empty slabs go back to the page allocator, unless it's the last one with free objects
+    if(slab->free_objects == slab->total_objects && (slab->next != NULL || slab->prev != NULL)) {
+        slab_list_remove(&sizeClass->partial, slab);
+
+        sizeClass->slabs--;
+        sizeClass->objects -= slab->total_objects;
+
+        slab->next = *release;
+        *release = slab;
+    }
+}
 
+static void slab_release(struct slab* slab) {
     while(slab) {
-        if(slab->free_objects > 0) {
-            for(int j = 0; j < slab->total_objects; j++) {
-                int index = (j / 64);
-                int bit = (j % 64);
+        struct slab* next = slab->next;
+        uintptr_t frame = (uintptr_t) memmgr_get_from_virtual((uintptr_t) slab);
 
-                unsigned long bitmap = slab->bitmap[index];
+        memmgr_frame_clear_slab(frame, slab->order);
+        kfree_frames(frame, slab->order);
 
-                if((bitmap & (1 << bit)) == 0) {
-                    slab->bitmap[index] |= (1 << bit);
-                    slab->free_objects--;
+        slab = next;
+    }
+}
 
-                    return slab->memory + (64 * index * slab->object_size) + (bit * slab->object_size);
-                }
+/**
+ * Returns the magazine of the current cpu, interrupts must be disabled
+ * @return the magazine or NULL if no memory is available for it
+ */
+static struct object_magazine* kmalloc_get_magazine(struct size_class* sizeClass) {
+    int index = sizeClass >= defaultSizeClasses && sizeClass < defaultSizeClasses + DEFAULT_SIZE_CLASSES
+            ? sizeClass - defaultSizeClasses
+            : DEFAULT_SIZE_CLASSES + (sizeClass - registeredSizeClasses);
+
+    struct object_magazine** magazine = &magazines[get_current_core()][index];
+
+    if(*magazine == NULL) {
+        spin_lock(&magazineSizeClass.lock);
+        struct object_magazine* allocated = slab_alloc_object(&magazineSizeClass);
+        spin_unlock(&magazineSizeClass.lock);
+
+        if(allocated == NULL) {
+            return NULL;
+        }
+
+        //At most 32 KiB are cached per cpu and size class
+        int capacity = 32768 / sizeClass->stride;
+
+        memset(allocated, 0, MAGAZINE_SIZE);
+        allocated->capacity = capacity < 4 ? 4 : capacity > MAGAZINE_MAX_OBJECTS ? MAGAZINE_MAX_OBJECTS : capacity;
+        *magazine = allocated;
+    }
+
+    return *magazine;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    void* object = NULL;
+
+    uint64_t rflags = cli();
+    struct object_magazine* magazine = kmalloc_get_magazine(cache);
+
+    if(magazine == NULL || magazine->count == 0) {
+        spin_lock(&cache->lock);
+
+        if(magazine == NULL) {
+            object = slab_alloc_object(cache);
+
+            if(object) {
+                cache->allocs++;
             }
         } else {
-            slab = slab->next;
+            while(magazine->count < magazine->capacity / 2) {
+                void* refill = slab_alloc_object(cache);
+
+                if(refill == NULL) {
+                    break;
+                }
+
+                magazine->objects[magazine->count++] = refill;
+            }
         }
+
+        spin_unlock(&cache->lock);
     }
 
-    //If we got here, no slabs are free
-    slab = defaultSizeClasses[shift].slabs;
-    while(slab->next) {
-        slab = slab->next;
+    if(magazine != NULL && magazine->count > 0) {
+        object = magazine->objects[--magazine->count];
+        magazine->allocs++;
     }
 
-    slab = kmalloc_for_size(&defaultSizeClasses[shift]);
+    sti(rflags);
 
-    if(!slab) {
-      return NULL;
-    }
+    return object;
+}
 
-    slab->bitmap[0] |= 1 << 0;
-    slab->free_objects--;
+void* kmem_cache_zalloc(kmem_cache_t* cache) {
+    void* object = kmem_cache_alloc(cache);
+
+    if(object) {
+        memset(object, 0, cache->size);
+    }
 
-    return slab->memory;
+    return object;
 }
 
-void kfree(void* ptr) {
+void kmem_cache_free(kmem_cache_t* cache, void* ptr) {
     if (ptr == NULL) return;
 
-    //Search in default size classes first, because they are cheaper and more widespread
-    for (int i = 0; i < DEFAULT_SIZE_CLASSES; i++) {
-        if (defaultSizeClasses[i].size > 0) {
-            struct slab* slab = defaultSizeClasses[i].slabs;
-
-            while (slab) {
-                if (ptr >= slab->memory && ptr < slab->memory + 4096) {
-                    // Found the correct slab
-                    ptrdiff_t offset = (char*)ptr - (char*)slab->memory;
-                    int objectIndex = offset / slab->object_size;
-                    int bitmapIndex = objectIndex / 64;
-                    int bitOffset = objectIndex % 64;
+    struct slab* release = NULL;
 
-                    // Clear the bit in the bitmap
-                    slab->bitmap[bitmapIndex] &= ~(1UL << bitOffset);
+    uint64_t rflags = cli();
+    struct object_magazine* magazine = kmalloc_get_magazine(cache);
 
-                    slab->free_objects++;
+    if(magazine == NULL || magazine->count == magazine->capacity) {
+        spin_lock(&cache->lock);
 
-                    return;
-                }
-                slab = slab->next;
+        if(magazine == NULL) {
+            slab_free_object(cache, ptr, &release);
+            cache->frees++;
+        } else {
+            for(int i = magazine->capacity / 2; i > 0; i--) {
+                slab_free_object(cache, magazine->objects[--magazine->count], &release);
             }
         }
+
+        spin_unlock(&cache->lock);
     }
 
-    for (int i = 0; i < MAX_SIZE_CLASSES; i++) {
-        if (registeredSizeClasses[i].size > 0) {
-            struct slab* slab = registeredSizeClasses[i].slabs;
+    if(magazine != NULL) {
+        magazine->objects[magazine->count++] = ptr;
+        magazine->frees++;
+    }
 
-            while (slab) {
-                if (ptr >= slab->memory && ptr < slab->memory + 4096) {
-                    // Found the correct slab
-                    ptrdiff_t offset = (char*)ptr - (char*)slab->memory;
-                    int objectIndex = offset / slab->object_size;
-                    int bitmapIndex = objectIndex / 64;
-                    int bitOffset = objectIndex % 64;
+    sti(rflags);
 
-                    // Clear the bit in the bitmap
-                    slab->bitmap[bitmapIndex] &= ~(1UL << bitOffset);
+    slab_release(release);
+}
 
-                    slab->free_objects++;
+void* kmalloc(size_t size) {
+    struct size_class* sizeClass = kmalloc_get_class(size);
 
-                    return;
-                }
-                slab = slab->next;
-            }
-        }
+    if(sizeClass == NULL) {
+        return NULL; //Size larger than the largest class, please use liballoc or direct mmap!
+    }
+
+    return kmem_cache_alloc(sizeClass);
+}
+
+void kfree(void* ptr) {
+    if (ptr == NULL) return;
+
+    //The slab header sits at the start of the block containing the object
+    struct slab* slab = memmgr_get_slab(ptr);
+
+    if(slab == NULL) {
+        return;
     }
+
+    kmem_cache_free(slab->cache, ptr);
 }
 
 void* kcalloc(int nobj, size_t size) {
@@ -250,61 +390,101 @@ void* kcalloc(int nobj, size_t size) {
     return p;
 }
 
-void alloc_register_object_size(size_t size) {
-    for(int i = 0; i < MAX_SIZE_CLASSES; i++) {
-        if(registeredSizeClasses[i].size == size) {
-            return;
-        }
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*)) {
+    if(align < 8) {
+        align = 8;
     }
 
-    for(int i = 0; i < MAX_SIZE_CLASSES; i++) {
-        if(registeredSizeClasses[i].size == 0) {
-            registeredSizeClasses[i].size = size;
-            registeredSizeClasses[i].slabs = NULL;
+    if(size == 0 || size > MAX_OBJECT_SIZE || (align & (align - 1)) != 0 || align > SLAB_SIZE) {
+        return NULL;
+    }
 
-            kmalloc_for_size(&registeredSizeClasses[i]);
-            registeredSizeClassesCount++;
-            return;
-        }
+    uint64_t rflags = cli();
+    spin_lock(&REGISTER_LOCK);
+
+    if(registeredSizeClassesCount >= MAX_SIZE_CLASSES) {
+        spin_unlock(&REGISTER_LOCK);
+        sti(rflags);
+        return NULL;
     }
+
+    kmem_cache_t* cache = &registeredSizeClasses[registeredSizeClassesCount++];
+
+    spin_unlock(&REGISTER_LOCK);
+    sti(rflags);
+
+    cache->name = name;
+    cache->size = size;
+    cache->align = align;
+    cache->ctor = ctor;
+
+    //Constructed objects have to stay intact while they are free, so the free link goes behind the object
+    cache->free_offset = ctor ? (size + 7) & ~7ull : 0;
+    cache->stride = ctor ? cache->free_offset + sizeof(void*) : (size + 7) & ~7ull;
+    cache->stride = (cache->stride + align - 1) & ~(align - 1);
+
+    rflags = cli();
+    spin_lock(&cache->lock);
+    kmalloc_for_size(cache);
+    spin_unlock(&cache->lock);
+    sti(rflags);
+
+    return cache;
 }
 
-/**
- * Bootstraps the allocator for its own use.
- * The allocator needs 40 bytes for the slab structure and the default size
- */
-void alloc_init() {
-    uint16_t perPage = (4096 / 40);
-    uint16_t bitmapSize = perPage / 64;
-    if(bitmapSize % 8 != 0) {
-        bitmapSize = (bitmapSize + 8) & ~(8 - 1);
+void alloc_register_object_size(size_t size) {
+    size = (size + 7) & ~7;
+
+    if(size == 0 || size > MAX_OBJECT_SIZE || sizeClassLookup[size / 8] != NULL) {
+        return;
     }
 
-    struct slab* slab = sbrk(4096);
+    kmem_cache_t* cache = kmem_cache_create(NULL, size, 8, NULL);
 
-    slab->total_objects = perPage;
-    slab->free_objects = perPage;
-    slab->object_size = 40;
+    if(cache) {
+        sizeClassLookup[size / 8] = cache;
+    }
+}
 
-    slab->memory = (void*)slab;
-    slab->bitmap = sbrk(4096); //This memory will be later assigned to our 16 byte default class
-    slab->bitmap[0] = 1;
+void kmem_cache_dump() {
+    for(int i = 0; i < DEFAULT_SIZE_CLASSES + registeredSizeClassesCount; i++) {
+        kmem_cache_t* cache = i < DEFAULT_SIZE_CLASSES ? &defaultSizeClasses[i] : &registeredSizeClasses[i - DEFAULT_SIZE_CLASSES];
 
-    registeredSizeClasses[0].size = 40;
-    registeredSizeClasses[0].slabs = slab;
+        uint64_t allocs = cache->allocs;
+        uint64_t frees = cache->frees;
+        uint64_t cached = 0;
 
-    struct slab* eightByteSlab = kmalloc(sizeof(struct slab)); //Use our bootstrapped allocator to set up our second slab
-    eightByteSlab->total_objects = 512;
-    eightByteSlab->free_objects = 512;
-    eightByteSlab->object_size = 8;
-    eightByteSlab->memory = slab->bitmap;
-    eightByteSlab->bitmap = (slab->bitmap + (bitmapSize / 8));
-    eightByteSlab->bitmap[0] = 255; //First 8 slots are set
+        for(int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            struct object_magazine* magazine = magazines[cpu][i];
 
-    defaultSizeClasses[0].slabs = eightByteSlab;
+            if(magazine) {
+                allocs += magazine->allocs;
+                frees += magazine->frees;
+                cached += magazine->count;
+            }
+        }
 
-    for(int i = 1; i < DEFAULT_SIZE_CLASSES; i++) {
-        kmalloc_for_size(&defaultSizeClasses[i]);
+        printf("%s (%d bytes): %d slabs, %d objects, %d active, %d cached, %d allocs, %d frees\n",
+               cache->name ? cache->name : "kmalloc", cache->size, cache->slabs, cache->objects,
+               allocs - frees, cached, allocs, frees);
+    }
+}
+
+/**
+ * Allocates the first slab of every default size class.
+ * The slab headers live inside the slabs, so the allocator needs no bootstrapping otherwise
+ */
+void alloc_init() {
+    for(int i = 0; i < DEFAULT_SIZE_CLASSES; i++) {
+        uint64_t rflags = cli();
+        spin_lock(&defaultSizeClasses[i].lock);
+
+        if(defaultSizeClasses[i].partial == NULL) {
+            kmalloc_for_size(&defaultSizeClasses[i]);
+        }
+
+        spin_unlock(&defaultSizeClasses[i].lock);
+        sti(rflags);
     }
 }
 
@@ -339,5 +519,17 @@ int liballoc_free( void* ptr, int pages )
     return 0;
 }
 
+size_t liballoc_foreign_size( void* ptr )
+{
+    struct slab* slab = memmgr_get_slab(ptr);
+
+    return slab ? slab->cache->size : 0;
+}
+
+void liballoc_foreign_free( void* ptr )
+{
+    kfree(ptr);
+}
+
 
 
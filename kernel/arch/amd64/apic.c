@@ -0,0 +1,510 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+#include "../../apic.h"
+#include "../../idt.h"
+#include "../../smp.h"
+#include "../../memmgr.h"
+#include "../../terminal.h"
+#include "../../timer.h"
+#include "../../ktime.h"
+#include "../../hrtimer.h"
+#include "../../proc/process.h"
+#include "../../../mlibc/abis/linux/errno.h"
+#include "io.h"
+#include <stddef.h>
+
+#define MSR_APIC_BASE 0x1B
+#define APIC_BASE_X2APIC (1 << 10)
+#define APIC_BASE_ENABLE (1 << 11)
+
+//In x2APIC mode every register is the MSR 0x800 + offset / 16
+#define MSR_X2APIC_BASE 0x800
+
+#define LAPIC_ID 0x20
+#define LAPIC_TPR 0x80
+#define LAPIC_EOI 0xB0
+#define LAPIC_SVR 0xF0
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_LVT_MASKED (1 << 16)
+#define ICR_DELIVERY_PENDING (1 << 12)
+
+#define LAPIC_TIMER_PERIODIC (1 << 17)
+#define LAPIC_TIMER_TSC_DEADLINE (2 << 17)
+#define LAPIC_TIMER_DIVIDE_16 0x3
+
+#define MSR_TSC_DEADLINE 0x6E0
+#define CPUID_TSC_DEADLINE (1 << 24)
+
+#define IOAPIC_MAX 8
+#define IOAPIC_REGSEL 0x00
+#define IOAPIC_WINDOW 0x10
+#define IOAPIC_VERSION 0x01
+#define IOAPIC_REDIRECTION(pin) (0x10 + (pin) * 2)
+
+#define IOAPIC_ACTIVE_LOW (1 << 13)
+#define IOAPIC_LEVEL (1 << 15)
+#define IOAPIC_MASKED (1 << 16)
+
+//Polarity and trigger of interrupt source overrides, 0 conforms to the bus which is active high and edge for ISA
+#define MPS_POLARITY_MASK 0x3
+#define MPS_POLARITY_LOW 0x3
+#define MPS_TRIGGER_MASK 0xC
+#define MPS_TRIGGER_LEVEL 0xC
+
+typedef struct ioapic {
+    uint8_t id;
+    uintptr_t address;
+    uint32_t gsiBase;
+    uint32_t pins;
+    volatile uint32_t* mmio;
+} ioapic_t;
+
+//Where an ISA line ends up at the IOAPICs
+typedef struct isa_route {
+    uint32_t gsi;
+    uint16_t flags;
+} isa_route_t;
+
+static uintptr_t lapic_base = 0;
+static volatile uint32_t* lapic = NULL;
+static bool x2apic = false;
+static bool enabled = false;
+
+static ioapic_t ioapics[IOAPIC_MAX];
+static int ioapic_count = 0;
+
+static bool tsc_deadline = false;
+static uint64_t lapic_timer_frequency = 0; //Counts per second after the divider
+
+static isa_route_t isa_routes[IRQ_LEGACY];
+static bool isa_routes_valid = false;
+static uint16_t isa_enabled = 0;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    if(x2apic) {
+        return rdmsr(MSR_X2APIC_BASE + (reg >> 4));
+    }
+
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    if(x2apic) {
+        wrmsr(MSR_X2APIC_BASE + (reg >> 4), value);
+        return;
+    }
+
+    lapic[reg / 4] = value;
+}
+
+static uint32_t ioapic_read(ioapic_t* ioapic, uint32_t reg) {
+    ioapic->mmio[IOAPIC_REGSEL / 4] = reg;
+    return ioapic->mmio[IOAPIC_WINDOW / 4];
+}
+
+static void ioapic_write(ioapic_t* ioapic, uint32_t reg, uint32_t value) {
+    ioapic->mmio[IOAPIC_REGSEL / 4] = reg;
+    ioapic->mmio[IOAPIC_WINDOW / 4] = value;
+}
+
+static ioapic_t* ioapic_for_gsi(uint32_t gsi) {
+    for(int i = 0; i < ioapic_count; i++) {
+        if(gsi >= ioapics[i].gsiBase && gsi < ioapics[i].gsiBase + ioapics[i].pins) {
+            return &ioapics[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void isa_routes_init() {
+    if(isa_routes_valid) {
+        return;
+    }
+
+    //Without an override an ISA line is the pin of the same number
+    for(int irq = 0; irq < IRQ_LEGACY; irq++) {
+        isa_routes[irq].gsi = irq;
+        isa_routes[irq].flags = 0;
+    }
+
+    isa_routes_valid = true;
+}
+
+/**
+ * Points the redirection entry of an ISA line at a local APIC and unmasks it
+ */
+static int ioapic_route(uint8_t irq, uint32_t apic) {
+    isa_route_t* route = &isa_routes[irq];
+    ioapic_t* ioapic = ioapic_for_gsi(route->gsi);
+
+    if(ioapic == NULL) {
+        return -ENODEV;
+    }
+
+    uint32_t low = IRQ_BASE + irq;
+
+    if((route->flags & MPS_POLARITY_MASK) == MPS_POLARITY_LOW) {
+        low |= IOAPIC_ACTIVE_LOW;
+    }
+
+    if((route->flags & MPS_TRIGGER_MASK) == MPS_TRIGGER_LEVEL) {
+        low |= IOAPIC_LEVEL;
+    }
+
+    uint32_t pin = route->gsi - ioapic->gsiBase;
+
+    //Mask while both halves are inconsistent
+    ioapic_write(ioapic, IOAPIC_REDIRECTION(pin), IOAPIC_MASKED);
+    ioapic_write(ioapic, IOAPIC_REDIRECTION(pin) + 1, apic << 24);
+    ioapic_write(ioapic, IOAPIC_REDIRECTION(pin), low);
+
+    return 0;
+}
+
+void apic_set_lapic_base(uintptr_t base) {
+    lapic_base = base;
+}
+
+void apic_add_ioapic(uint8_t id, uintptr_t address, uint32_t gsiBase) {
+    if(ioapic_count == IOAPIC_MAX) {
+        printf("APIC: ignoring IOAPIC %d, at most %d are supported\n", id, IOAPIC_MAX);
+        return;
+    }
+
+    ioapics[ioapic_count].id = id;
+    ioapics[ioapic_count].address = address;
+    ioapics[ioapic_count].gsiBase = gsiBase;
+    ioapic_count++;
+}
+
+void apic_add_override(uint8_t irq, uint32_t gsi, uint16_t flags) {
+    if(irq >= IRQ_LEGACY) {
+        return;
+    }
+
+    isa_routes_init();
+
+    isa_routes[irq].gsi = gsi;
+    isa_routes[irq].flags = flags;
+}
+
+void lapic_init_cpu() {
+    uint64_t base = rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE;
+
+    if(x2apic) {
+        base |= APIC_BASE_X2APIC;
+    }
+
+    wrmsr(MSR_APIC_BASE, base);
+
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+void apic_init() {
+    if(lapic_base == 0 || ioapic_count == 0) {
+        printf("APIC: no IOAPIC in the MADT, interrupts stay on the PIC\n");
+        return;
+    }
+
+    isa_routes_init();
+
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+
+    //x2APIC replaces the MMIO page with MSRs, the ICR becomes a single write
+    x2apic = (ecx & (1 << 21)) != 0;
+
+    if(!x2apic) {
+        lapic = memmgr_map_mmio(lapic_base, 0x1000, FLAG_UCMINUS, true);
+    }
+
+    for(int i = 0; i < ioapic_count; i++) {
+        ioapic_t* ioapic = &ioapics[i];
+
+        ioapic->mmio = memmgr_map_mmio(ioapic->address, 0x1000, FLAG_UCMINUS, true);
+        ioapic->pins = ((ioapic_read(ioapic, IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+
+        for(uint32_t pin = 0; pin < ioapic->pins; pin++) {
+            ioapic_write(ioapic, IOAPIC_REDIRECTION(pin), IOAPIC_MASKED);
+        }
+    }
+
+    uint64_t rflags = cli();
+
+    lapic_init_cpu();
+
+    //Take over every line the PIC delivered so far, the cascade on line 2 has no meaning anymore
+    uint16_t picMask = pic_get_mask();
+    uint32_t apic = lapic_id();
+
+    for(int irq = 0; irq < IRQ_LEGACY; irq++) {
+        if(irq != 2 && !(picMask & (1 << irq)) && ioapic_route(irq, apic) == 0) {
+            isa_enabled |= 1 << irq;
+        }
+    }
+
+    pic_disable();
+    //The PIC was wired as virtual wire through LINT0
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+
+    enabled = true;
+
+    sti(rflags);
+
+    printf("APIC: %s, %d IOAPICs, local APIC %d\n", x2apic ? "x2APIC" : "xAPIC", ioapic_count, apic);
+
+    lapic_timer_init();
+}
+
+bool apic_enabled() {
+    return enabled;
+}
+
+uint32_t lapic_id() {
+    if(x2apic) {
+        return lapic_read(LAPIC_ID);
+    }
+
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_send_ipi(uint32_t apic, uint32_t command) {
+    if(x2apic) {
+        //No delivery status in x2APIC mode, the write itself sends it
+        wrmsr(MSR_X2APIC_BASE + (LAPIC_ICR_LOW >> 4), ((uint64_t) apic << 32) | command);
+        return;
+    }
+
+    lapic_write(LAPIC_ICR_HIGH, apic << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+
+    while(lapic_read(LAPIC_ICR_LOW) & ICR_DELIVERY_PENDING) {
+        __asm__ volatile("pause");
+    }
+}
+
+void lapic_eoi() {
+    if(x2apic) {
+        wrmsr(MSR_X2APIC_BASE + (LAPIC_EOI >> 4), 0);
+        return;
+    }
+
+    lapic[LAPIC_EOI / 4] = 0;
+}
+
+int msi_compose(uint8_t irq, int cpu, uint64_t* address, uint32_t* data) {
+    if(!enabled || irq < IRQ_LEGACY || irq >= IRQ_DYNAMIC_END || irq == IRQ_SYSCALL) {
+        return -EINVAL;
+    }
+
+    int apic = smp_apic_id(cpu);
+
+    if(apic < 0) {
+        return -EINVAL;
+    }
+
+    //Fixed delivery, edge triggered, physical destination
+    *address = MSI_ADDRESS_BASE | ((uint64_t) apic << 12);
+    *data = IRQ_BASE + irq;
+
+    return 0;
+}
+
+void irq_eoi(uint8_t irq) {
+    if(enabled) {
+        lapic_eoi();
+    } else if(irq < IRQ_LEGACY) {
+        pic_sendEOI(irq);
+    }
+}
+
+void irq_enable(uint8_t irq) {
+    if(irq >= IRQ_LEGACY) {
+        return;
+    }
+
+    if(enabled) {
+        if(ioapic_route(irq, lapic_id()) == 0) {
+            isa_enabled |= 1 << irq;
+        }
+    } else {
+        //apic_init takes the line over from the PIC mask
+        pic_enableInterrupt(irq);
+    }
+}
+
+void irq_disable(uint8_t irq) {
+    if(irq >= IRQ_LEGACY) {
+        return;
+    }
+
+    if(!enabled) {
+        pic_disableInterrupt(irq);
+        return;
+    }
+
+    ioapic_t* ioapic = ioapic_for_gsi(isa_routes[irq].gsi);
+
+    if(ioapic != NULL) {
+        uint32_t reg = IOAPIC_REDIRECTION(isa_routes[irq].gsi - ioapic->gsiBase);
+        ioapic_write(ioapic, reg, ioapic_read(ioapic, reg) | IOAPIC_MASKED);
+    }
+
+    isa_enabled &= ~(1 << irq);
+}
+
+int irq_set_affinity(uint8_t irq, int cpu) {
+    if(!enabled || irq >= IRQ_LEGACY) {
+        return -ENODEV;
+    }
+
+    int apic = smp_apic_id(cpu);
+
+    //Moving a masked line would unmask it
+    if(apic < 0 || !(isa_enabled & (1 << irq))) {
+        return -EINVAL;
+    }
+
+    return ioapic_route(irq, apic);
+}
+
+static void lapic_timer_interrupt(regs_t* regs) {
+    lapic_eoi();
+    hrtimer_interrupt(regs);
+}
+
+static void lapic_timer_set_oneshot() {
+    if(tsc_deadline) {
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_TSC_DEADLINE | APIC_TIMER_VECTOR);
+        //The MMIO write has to land before the first deadline write
+        __asm__ volatile("mfence" ::: "memory");
+        return;
+    }
+
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, APIC_TIMER_VECTOR);
+}
+
+static void lapic_timer_set_periodic() {
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, (uint32_t) (lapic_timer_frequency * TICK_NSEC / NSEC_PER_SEC));
+}
+
+static void lapic_timer_set_next_event(uint64_t expires) {
+    if(expires == UINT64_MAX) {
+        //Zero disarms both modes
+        if(tsc_deadline) {
+            wrmsr(MSR_TSC_DEADLINE, 0);
+        } else {
+            lapic_write(LAPIC_TIMER_INITIAL, 0);
+        }
+
+        return;
+    }
+
+    uint64_t now = ktime_get_ns();
+    uint64_t delta = expires > now ? expires - now : 0;
+
+    if(tsc_deadline) {
+        uint64_t cycles = (uint64_t) (((unsigned __int128) delta * tsc_get_frequency()) / NSEC_PER_SEC);
+        wrmsr(MSR_TSC_DEADLINE, rdtsc() + cycles + 1);
+        return;
+    }
+
+    uint64_t count = (uint64_t) (((unsigned __int128) delta * lapic_timer_frequency) / NSEC_PER_SEC);
+
+    //Too far out fires early, hrtimer_interrupt finds nothing expired and programs the rest
+    if(count == 0) {
+        count = 1;
+    } else if(count > UINT32_MAX) {
+        count = UINT32_MAX;
+    }
+
+    lapic_write(LAPIC_TIMER_INITIAL, count);
+}
+
+static void lapic_timer_shutdown() {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+}
+
+//Per cpu state lives in the local APIC, every cpu registers the same device
+static clock_event_device_t lapic_clockevent = {
+    .name = "lapic",
+    .rating = 200,
+    .features = CLOCK_EVT_FEAT_ONESHOT | CLOCK_EVT_FEAT_PERIODIC,
+    .set_oneshot = lapic_timer_set_oneshot,
+    .set_periodic = lapic_timer_set_periodic,
+    .set_next_event = lapic_timer_set_next_event,
+    .shutdown = lapic_timer_shutdown,
+};
+
+/**
+ * Counts the local APIC timer over 10 ms of TSC cycles, no interrupts needed
+ */
+static uint64_t lapic_timer_calibrate() {
+    uint64_t window = tsc_get_frequency() / 100;
+
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INITIAL, UINT32_MAX);
+
+    uint64_t start = rdtsc();
+
+    while(rdtsc() - start < window) {
+        __asm__ volatile("pause");
+    }
+
+    uint32_t elapsed = UINT32_MAX - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+
+    return (uint64_t) elapsed * 100;
+}
+
+void lapic_timer_init() {
+    if(!enabled || tsc_get_frequency() == 0) {
+        return;
+    }
+
+    if(get_current_core() == 0) {
+        uint32_t eax, ebx, ecx, edx;
+        __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+
+        //The deadline is an absolute TSC value, only usable if the TSC doesn't stop or drift
+        tsc_deadline = (ecx & CPUID_TSC_DEADLINE) && ktime_hres_capable();
+
+        if(tsc_deadline) {
+            lapic_clockevent.features = CLOCK_EVT_FEAT_ONESHOT;
+        } else {
+            lapic_timer_frequency = lapic_timer_calibrate();
+        }
+
+        irq_install_handler(APIC_TIMER_VECTOR - IRQ_BASE, lapic_timer_interrupt);
+
+        if(tsc_deadline) {
+            printf("APIC: timer in TSC deadline mode\n");
+        } else {
+            printf("APIC: timer at %d kHz\n", lapic_timer_frequency / 1000);
+        }
+
+        //The PIT counts the ticks of a coarse clocksource, the boot cpu can't give it up
+        if(!ktime_hres_capable()) {
+            printf("APIC: clocksource too coarse, the PIT keeps ticking\n");
+            return;
+        }
+    }
+
+    clockevent_register(&lapic_clockevent);
+}
@@ -2,13 +2,47 @@
 // Created by Jannik on 01.04.2024.
 //
 #include "../../gdt.h"
+#include "../../proc/process.h"
 #include <stdint.h>
+#include <string.h>
+#include "io.h"
+
+#define MSR_EFER 0xC0000080
+#define MSR_STAR 0xC0000081
+#define MSR_LSTAR 0xC0000082
+#define MSR_SFMASK 0xC0000084
+#define MSR_GS_BASE 0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102
+
+#define EFER_SCE 1
+
+//Cleared on syscall entry, the stub switches stacks with interrupts off
+#define SYSCALL_RFLAGS_MASK (0x100 | 0x200 | 0x400)
 
 static gdt_pointer_t pointer;
-static tss_entry_t tss;
+
+//The busy flag of the TSS lives in its descriptor, every cpu gets its own copy of the boot GDT
+static struct gdt cpu_gdt[MAX_CPUS];
+static tss_entry_t cpu_tss[MAX_CPUS];
+static cpu_local_t cpu_local[MAX_CPUS];
 
 extern void* stack_top;
 extern void reloadSegments();
+extern void syscall_stub();
+
+/**
+ * Enables the SYSCALL instruction, entering at syscall_stub on the kernel stack from cpu_local
+ * The MSRs exist once per cpu
+ */
+static void syscall_install() {
+    //SYSCALL loads CS from STAR[47:32] and SS 8 above it, SYSRET loads SS 8 and CS 16 above STAR[63:48]
+    uint64_t star = ((uint64_t)KERNEL_DATA_SELECTOR << 48) | ((uint64_t)KERNEL_CODE_SELECTOR << 32);
+
+    wrmsr(MSR_STAR, star);
+    wrmsr(MSR_LSTAR, (uintptr_t)syscall_stub);
+    wrmsr(MSR_SFMASK, SYSCALL_RFLAGS_MASK);
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+}
 
 /**
  * This functions loads the installed GDT from start.S and modifies the TSS to point towards our kernel stack
@@ -17,30 +51,57 @@ extern void reloadSegments();
 void gdt_install() {
     __asm__("sgdt %0" : "=m"(pointer) : : "memory");
 
-    struct gdt* gdt;
-    gdt = (struct gdt *) pointer.base;
+    gdt_install_cpu(0, (uintptr_t)stack_top);
+}
+
+void gdt_install_cpu(int cpu, uintptr_t stack) {
+    struct gdt* gdt = &cpu_gdt[cpu];
+    tss_entry_t* tss = &cpu_tss[cpu];
+    cpu_local_t* local = &cpu_local[cpu];
 
-    uintptr_t addr = (uintptr_t)&tss;
+    memcpy(gdt, (void*)pointer.base, sizeof(struct gdt));
 
-    gdt->tss.limit_low = sizeof(tss);
+    uintptr_t addr = (uintptr_t)tss;
+
+    gdt->tss.limit_low = sizeof(*tss);
     gdt->tss.base_low = (addr & 0xFFFF);
     gdt->tss.base_middle = (addr >> 16) & 0xFF;
     gdt->tss.base_high = (addr >> 24) & 0xFF;
     gdt->tss.base_top = (addr >> 32) & 0xFFFFFFFF;
 
-    tss.rsp[0] = (uintptr_t)stack_top;
-    tss.iomap_base = sizeof(tss);
+    tss->rsp[0] = stack;
+    tss->iomap_base = sizeof(*tss);
+
+    local->kernel_stack = stack;
+    local->self = local;
+    local->pcb = process_get_pcb(cpu);
+    local->tss = tss;
 
-    asm volatile("lgdt %0" : : "m"(pointer));
-    asm volatile("ltr %%ax" : : "a" (0x28));
+    gdt_pointer_t cpuPointer = {
+        .limit = sizeof(struct gdt) - 1,
+        .base = (uintptr_t)gdt,
+    };
+
+    asm volatile("lgdt %0" : : "m"(cpuPointer));
+    asm volatile("ltr %%ax" : : "a" (TSS_SELECTOR));
 
     reloadSegments();
+
+    //Loading gs cleared the GS base, kernel code always finds its cpu_local there.
+    //The kernel GS base holds the one of user space until the next swapgs.
+    wrmsr(MSR_GS_BASE, (uintptr_t)local);
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+
+    syscall_install();
 }
 
 void set_stack_pointer(uintptr_t stack) {
-    tss.rsp[0] = stack;
+    cpu_local_t* local = get_cpu_local();
+
+    local->tss->rsp[0] = stack;
+    local->kernel_stack = stack;
 }
 
 void set_ist(int index, uintptr_t stack) {
-    tss.ist[index] = stack;
+    get_cpu_local()->tss->ist[index] = stack;
 }
\ No newline at end of file
@@ -36,7 +36,7 @@ void registerKeyEventHandler(keyboard_event_handler_t handler) {
 
 void keyboard_handler(regs_t* regs) {
     unsigned char code = inb(0x60);
-    pic_sendEOI(1);
+    irq_eoi(1);
 
     if(code == 0xE0) {
         state.kbd_extended_state = 1;
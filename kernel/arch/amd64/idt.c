@@ -7,6 +7,9 @@
 #include "io.h"
 #include "../../terminal.h"
 #include "../../proc/process.h"
+#include "../../memmgr.h"
+#include "../../apic.h"
+#include "../../../mlibc/abis/linux/errno.h"
 
 typedef struct {
     uint16_t    isr_low;      // The lower 16 bits of the ISR's address
@@ -27,10 +30,34 @@ __attribute__((aligned(0x10)))
 static idt_entry_t idt[256];
 
 static idtr_t idtr;
-static irq_handler_t irqHandlers[16];
+static irq_handler_t irqHandlers[IRQ_COUNT];
+static bool irqAllocated[IRQ_COUNT];
 
 extern void* isr_stub_table[];
-extern void* isr_stub_128;
+
+//Instructions of the user copy routines that may fault, see uaccess.S
+struct exception_entry {
+    uintptr_t instruction;
+    uintptr_t fixup;
+};
+
+extern struct exception_entry __start___ex_table[];
+extern struct exception_entry __stop___ex_table[];
+
+/**
+ * Continues a faulting kernel access to user memory at its fixup
+ * @return false if the instruction has no fixup
+ */
+static bool exception_fixup(regs_t* regs) {
+    for(struct exception_entry* entry = __start___ex_table; entry < __stop___ex_table; entry++) {
+        if(entry->instruction == regs->rip) {
+            regs->rip = entry->fixup;
+            return true;
+        }
+    }
+
+    return false;
+}
 
 void exception_handler(regs_t * regs) {
     if(regs->int_no < 32) {
@@ -39,20 +66,40 @@ void exception_handler(regs_t * regs) {
             return;
         }
 
+        if(regs->int_no == 14) {
+            uintptr_t faultAddr;
+            __asm__ volatile("mov %%cr2, %0" : "=r"(faultAddr));
+
+            if(memmgr_handle_page_fault(faultAddr, regs->err_code)) {
+                return;
+            }
+
+            if(regs->cs == 0x08 && exception_fixup(regs)) {
+                return;
+            }
+
+            printf("page fault at 0x%x\n", faultAddr);
+        }
+
         printf("exception :(\n");
         printf("no: %d\n", regs->int_no);
         printf("err: 0x%x\n", regs->err_code);
 
         __asm__ volatile ("cli");
         asm volatile("hlt");
-    } else if (regs->int_no >= 32 && regs->int_no < 48) {
-        if(irqHandlers[regs->int_no - 32]) {
-            irqHandlers[regs->int_no - 32](regs);
-        }
     } else if(regs->int_no == 0x80) {
         //Syscalls baby!
         __asm__ volatile("sti");
         syscall_entry(regs);
+    } else if(regs->int_no != APIC_SPURIOUS_VECTOR) {
+        size_t irq = regs->int_no - IRQ_BASE;
+
+        if(irqHandlers[irq]) {
+            irqHandlers[irq](regs);
+        } else {
+            //Nobody acknowledges it otherwise, the APIC would block this priority class for good
+            irq_eoi(irq);
+        }
     }
 
     if(get_current_process() != NULL) {
@@ -62,6 +109,18 @@ void exception_handler(regs_t * regs) {
     __asm__ volatile("sti");
 }
 
+/**
+ * Called by syscall_stub for the SYSCALL instruction, skips the exception and irq dispatch of int 0x80
+ */
+void syscall_handler(regs_t* regs) {
+    __asm__ volatile("sti");
+    syscall_entry(regs);
+
+    if(get_current_process() != NULL) {
+        process_check_signals(regs);
+    }
+}
+
 void sti(uint64_t rflags) {
     // Restore RFLAGS
     __asm__ volatile (
@@ -100,11 +159,40 @@ void idt_set_descriptor(uint8_t vector, void* isr, uint8_t flags) {
 }
 
 void irq_install_handler(size_t irq, irq_handler_t handler) {
-    if(!irqHandlers[irq]) {
+    if(irq < IRQ_COUNT && !irqHandlers[irq]) {
         irqHandlers[irq] = handler;
     }
 }
 
+int irq_alloc(irq_handler_t handler) {
+    uint64_t rflags = cli();
+
+    for(int irq = IRQ_LEGACY; irq < IRQ_DYNAMIC_END; irq++) {
+        if(irq == IRQ_SYSCALL || irqAllocated[irq]) {
+            continue;
+        }
+
+        irqAllocated[irq] = true;
+        irqHandlers[irq] = handler;
+        sti(rflags);
+
+        return irq;
+    }
+
+    sti(rflags);
+
+    return -ENOSPC;
+}
+
+void irq_free(uint8_t irq) {
+    if(irq < IRQ_LEGACY || irq >= IRQ_DYNAMIC_END) {
+        return;
+    }
+
+    irqHandlers[irq] = NULL;
+    irqAllocated[irq] = false;
+}
+
 void irq_install() {
 
 }
@@ -113,15 +201,19 @@ void idt_install() {
     idtr.base = (uintptr_t)&idt[0];
     idtr.limit = (uint16_t)sizeof(idt_entry_t) * 256 - 1;
 
-    for (uint8_t vector = 0; vector < 48; vector++) {
+    for (int vector = 0; vector < 256; vector++) {
         idt_set_descriptor(vector, isr_stub_table[vector], 0x8E);
     }
 
     //Set Page fault stack
     idt[0xD].ist = 0x1;
 
-    //remember to reroute this if more isrs come, rn syscall is at 48
-    idt_set_descriptor(0x80, isr_stub_table[48], 0x8E | 0x60);
+    //User space may raise the syscall gate
+    idt_set_descriptor(0x80, isr_stub_table[0x80], 0x8E | 0x60);
+
+    idt_load();
+}
 
+void idt_load() {
     __asm__ volatile ("lidt %0" : : "m"(idtr)); // load the new IDT
 }
\ No newline at end of file
@@ -10,6 +10,10 @@
 #include "../../lock.h"
 #include "../../serial.h"
 #include "../../gdt.h"
+#include "../../error.h"
+#include "../../shrinker.h"
+#include "../../swap.h"
+#include "../../timer.h"
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -20,10 +24,14 @@
 #define PAGE_LARGE 1 << 7
 #define PAGE_NOCACHE 1 << 4
 #define PAGE_WRITE_THROUGH 1 << 3
+#define PAGE_ACCESSED 1 << 5
+#define PAGE_DIRTY 1 << 6
 
 /* Kernel memory base */
 #define KERNEL_MEMORY 0xfffffe8000000000ull
 #define MMIO_MEMORY   0xfffffe0000000000ull
+/* Start of the higher half shared by all page maps */
+#define KERNEL_ENTRY_HALF 0xffff800000000000ull
 /* Defines the offset from virtual memory to physical memory */
 #define LOW_MEMORY 0x7fffffffffull
 #define LOW_MMIO_MEMORY 0xffffffffull
@@ -37,18 +45,131 @@
 
 #define PAGE_MASK 0xfffffffffffff000ull
 
+/* 2 MiB pages mapped by a single page directory entry */
+#define HUGE_PAGE_SIZE 0x200000ull
+#define HUGE_PAGE_ORDER 9
+#define HUGE_PAGE_MASK 0x000fffffffe00000ull
+
 /********************PHSYICAL MEMORY MANAGEMENT******************/
 
-//Simple bitmap physical memory manager
-// 1 = used, 0 = unused
-uint32_t memory_map[BITMAP_SIZE];
-//Keep the index static so we can allocate up and down
-int idx = 0;
+//Buddy allocator for physical frames
+//Free blocks of 2^order frames are kept in one list per order, the list links are stored
+//inside the free block itself and accessed through the identity mapping.
+#define BUDDY_MAX_ORDER 10
+#define FRAME_FREE 0x80
+#define FRAME_SLAB 0x40
+#define FRAME_CACHED 0x20
+#define FRAME_ORDER_MASK 0x1F
+
+struct free_block {
+    uintptr_t next;
+    uintptr_t prev;
+};
+
+//One byte per frame, FRAME_FREE | order is set on the first frame of each free block
+//FRAME_SLAB | order is set on every frame of a block owned by the slab allocator
+//FRAME_CACHED is set on frames waiting in a magazine
+//Every other frame (used, reserved, inside a free block or not existing) is 0
+uint8_t frame_state[BITMAP_SIZE];
+//Number of page table entries referencing each frame, only frames shared by fork have more than 1
+static uint16_t frame_refcount[BITMAP_SIZE];
+//Physical address of the first free block of each order, 0 if empty
+static uintptr_t free_area[BUDDY_MAX_ORDER + 1];
+static uint64_t free_area_count[BUDDY_MAX_ORDER + 1];
+static uint64_t free_frames = 0;
+
+//Single frames are cached per cpu, so most allocations don't touch PHYS_MEM_LOCK
+//Magazines are refilled and drained in batches of half their size
+#define FRAME_MAGAZINE_SIZE 64
+#define FRAME_MAGAZINE_BATCH (FRAME_MAGAZINE_SIZE / 2)
+
+struct frame_magazine {
+    spin_t lock; //Taken by its cpu and by frame_magazine_drain_all of another cpu
+    int count;
+    uintptr_t frames[FRAME_MAGAZINE_SIZE];
+};
+
+static struct frame_magazine frame_magazines[MAX_CPUS];
+
+//Free frame watermarks, the idle task reclaims cache memory below low until high is reached
+//Only allocations with KALLOC_RECLAIM reclaim directly, the others ask the idle task
+#define WATERMARK_LOW 1024
+#define WATERMARK_HIGH 2048
+#define RECLAIM_BATCH 32
+
+//Swap slot of a swapped out page, stored where present entries keep the frame
+#define SWAP_SLOT_MASK 0x000ffffffffff000ull
+//Page table entries the swap clock looks at per frame it should free
+#define SWAP_SCAN_RATIO 64
+
+//Clock hand of the swap scan, the process and the address it continues at
+static int swap_scan_pid = 0;
+static uintptr_t swap_scan_addr = 0;
+
+//Identical user pages are merged into one copy on write frame by a scanner in the idle task
+//Stable nodes hold a reference on a merged frame, unstable nodes remember where a not yet merged page was seen
+#define MERGE_HASH_BUCKETS 1024
+//Page table entries looked at per scan and the ticks between scans
+#define MERGE_SCAN_PAGES 100
+#define MERGE_SCAN_INTERVAL 2
+
+struct merge_node {
+    uint64_t hash;
+    uintptr_t frame;
+    int pid;
+    uintptr_t addr;
+    struct merge_node* next;
+};
+
+static struct merge_node* merge_stable[MERGE_HASH_BUCKETS];
+static struct merge_node* merge_unstable[MERGE_HASH_BUCKETS];
+static int merge_scan_pid = 0;
+static uintptr_t merge_scan_addr = 0;
+static uint64_t merge_next_scan = 0;
+static uint64_t merge_pages_scanned = 0;
+static uint64_t merge_full_scans = 0;
+static shrinker_t merge_shrinker;
+
+//Kernel stacks of exited threads are kept mapped for the next fork or clone
+//A free stack holds the top of the next free stack in its lowest word
+#define KERNEL_STACK_CACHE_MAX 32
+static uintptr_t kernel_stack_cache = 0;
+static int kernel_stack_cache_count = 0;
+static shrinker_t kernel_stack_shrinker;
+
+//Frames zeroed ahead of time by the idle task, they count as allocated
+#define ZERO_POOL_SIZE 256
+static uintptr_t zero_pool[ZERO_POOL_SIZE];
+static int zero_pool_count = 0;
+//Set by a failed allocation, the idle task reclaims even above the low watermark
+static bool reclaim_requested = false;
 
 /****************************************************************/
 /*********************VIRTUAL MEMORY MANAGEMENT******************/
 // Identity map of all 512 GB of supported memory, this allows the kernel to fully access the memory addressable using 1 GiB Pages
 static uint64_t IDENTITY_MAP_PD[512] __attribute__((aligned(4096)));
+// Fallback for CPUs without 1 GiB pages, maps the first 4 GiB of the identity map using 2 MiB pages
+static uint64_t IDENTITY_MAP_PD_2M[4][512] __attribute__((aligned(4096)));
+//Number of 2 MiB pages currently mapped outside of the identity map
+static uint64_t huge_pages_mapped = 0;
+
+//Address space identifiers for PCID, 0 is used by the boot page map and whenever none is left
+#define ASID_COUNT 4096
+#define CR3_NOFLUSH (1ull << 63)
+#define CR4_PCIDE (1 << 17)
+
+static bool pcid_enabled = false;
+static uint8_t asid_bitmap[ASID_COUNT / 8];
+static uint16_t asid_next = 1;
+//Kernel TLB generation each identifier was last flushed at on the boot cpu, UINT64_MAX forces a flush on the next load
+//There is no TLB shootdown, processes are pinned to cpu 0 and the other cpus never skip a flush
+static uint64_t asid_generation[ASID_COUNT];
+//Incremented whenever a mapping in the shared kernel half is invalidated
+static uint64_t kernel_tlb_generation = 0;
+
+//The page map currently in CR3 of each cpu
+static uintptr_t loaded_page_map[MAX_CPUS];
+static uint16_t loaded_asid[MAX_CPUS];
 /****************************************************************/
 
 //Static location of the identity boot page map
@@ -69,11 +190,20 @@ static unsigned long long _end;
 
 extern void reloadPML();
 
+static bool memmgr_populate_page(uint64_t* pageEntry);
+static bool memmgr_swap_in(uint64_t* pageEntry);
+bool memmgr_check_user_page(uintptr_t virtualAddr);
+
 //The rest after the end. The kernel reserves 4 MB for itself at bootup.
 unsigned long kernel_heap_length = 0x1000;
 
 static spin_t PHYS_MEM_LOCK = ATOMIC_FLAG_INIT;
 static spin_t VIRT_MEM_LOCK = ATOMIC_FLAG_INIT;
+static spin_t ASID_LOCK = ATOMIC_FLAG_INIT;
+static spin_t ZERO_POOL_LOCK = ATOMIC_FLAG_INIT;
+static spin_t SWAP_SCAN_LOCK = ATOMIC_FLAG_INIT;
+static spin_t MERGE_LOCK = ATOMIC_FLAG_INIT;
+static spin_t KERNEL_STACK_LOCK = ATOMIC_FLAG_INIT;
 
 void* memcpy(void* restrict dstptr, const void* restrict srcptr, size_t size) {
     unsigned char* dst = (unsigned char*) dstptr;
@@ -91,798 +221,2744 @@ void* memset(void* bufptr, int value, size_t size) {
 }
 
 
-void memmgr_phys_mark_page(int idx) {
-    if(idx >= BITMAP_SIZE) {
-        return;
+static inline struct free_block* buddy_block(uint64_t page) {
+    return (struct free_block*) memmgr_get_from_physical(PAGE_TO_ADDRESS(page));
+}
+
+static void buddy_push(uint64_t page, int order) {
+    struct free_block* block = buddy_block(page);
+
+    block->prev = 0;
+    block->next = free_area[order];
+
+    if(free_area[order]) {
+        buddy_block(ADDRESS_TO_PAGE(free_area[order]))->prev = PAGE_TO_ADDRESS(page);
     }
 
-    memory_map[idx] = 1;
+    free_area[order] = PAGE_TO_ADDRESS(page);
+    free_area_count[order]++;
+    free_frames += 1ull << order;
+
+    frame_state[page] = FRAME_FREE | order;
 }
 
-void memmgr_phys_free_page(int idx) {
-    if(idx >= BITMAP_SIZE) {
-        return;
+static void buddy_remove(uint64_t page, int order) {
+    struct free_block* block = buddy_block(page);
+
+    if(block->prev) {
+        buddy_block(ADDRESS_TO_PAGE(block->prev))->next = block->next;
+    } else {
+        free_area[order] = block->next;
     }
 
-    memory_map[idx] = 0;
-}
+    if(block->next) {
+        buddy_block(ADDRESS_TO_PAGE(block->next))->prev = block->prev;
+    }
 
-uintptr_t kalloc_frame() {
-    spin_lock(&PHYS_MEM_LOCK);
+    free_area_count[order]--;
+    free_frames -= 1ull << order;
 
-    bool restart = idx > 0;
+    frame_state[page] = 0;
+}
 
-    for(;;) {
-        uint64_t rflags = cli();
-        if(!memory_map[idx]) {
-            //Found free, yay
-            memmgr_phys_mark_page(idx);
+/**
+ * Finds the free block containing the given frame
+ * @param page the frame index
+ * @param order receives the order of the block
+ * @return the index of the first frame of the block or -1 if the frame isn't free
+ */
+static int64_t buddy_find_block(uint64_t page, int* order) {
+    for(int i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        uint64_t head = page & ~((1ull << i) - 1);
 
-            spin_unlock(&PHYS_MEM_LOCK);
-            sti(rflags);
-            return PAGE_TO_ADDRESS(idx);
+        if(frame_state[head] == (FRAME_FREE | i)) {
+            *order = i;
+            return (int64_t) head;
         }
-        sti(rflags);
+    }
 
-        if(idx >= BITMAP_SIZE) {
-            if(restart) {
-                idx = 0;
-                restart = false;
-            } else {
-                break;
-            }
+    return -1;
+}
+
+/**
+ * Returns a block to the free lists and merges it with its buddies
+ * Lock must be held!
+ */
+static void buddy_free(uint64_t page, int order) {
+    while(order < BUDDY_MAX_ORDER) {
+        uint64_t buddy = page ^ (1ull << order);
+
+        if(buddy >= BITMAP_SIZE || frame_state[buddy] != (FRAME_FREE | order)) {
+            break;
         }
 
-        idx++;
+        buddy_remove(buddy, order);
+        page &= ~(1ull << order);
+        order++;
     }
 
+    buddy_push(page, order);
+}
 
-    spin_unlock(&PHYS_MEM_LOCK);
-    //NO FRAME FOUND, WE ARE OFFICIALLY FUCKED (HOW TF DO U USE 64 GB ANYWAY)
-    return 0;
+/**
+ * Adds a range of available frames to the allocator, used at boot
+ * @param start first frame
+ * @param end frame after the last frame
+ */
+static void buddy_add_range(uint64_t start, uint64_t end) {
+    if(end > BITMAP_SIZE) {
+        end = BITMAP_SIZE;
+    }
+
+    while(start < end) {
+        int order = BUDDY_MAX_ORDER;
+
+        while(order > 0 && ((start & ((1ull << order) - 1)) || start + (1ull << order) > end)) {
+            order--;
+        }
+
+        buddy_free(start, order);
+        start += 1ull << order;
+    }
 }
 
-void kfree_frame(uintptr_t addr) {
+void memmgr_phys_mark_page(int idx) {
+    if(idx < 0 || idx >= BITMAP_SIZE) {
+        return;
+    }
+
     uint64_t rflags = cli();
     spin_lock(&PHYS_MEM_LOCK);
-    int frame_idx = ADDRESS_TO_PAGE((size_t)addr);
 
-    memmgr_phys_free_page(frame_idx);
+    int order;
+    int64_t head = buddy_find_block(idx, &order);
+
+    if(head == -1) {
+        //Already used or reserved
+        spin_unlock(&PHYS_MEM_LOCK);
+        sti(rflags);
+        return;
+    }
+
+    buddy_remove(head, order);
+
+    //Split the block and give back every half that doesn't contain our frame
+    while(order > 0) {
+        order--;
+
+        uint64_t upper = head + (1ull << order);
 
-    //if idx is still at our frame, put it down, makes search faster, else, idc
-    if(idx == frame_idx)
-        idx--;
-    else
-        if(frame_idx < idx)
-            idx = frame_idx;
+        if((uint64_t) idx >= upper) {
+            buddy_push(head, order);
+            head = upper;
+        } else {
+            buddy_push(upper, order);
+        }
+    }
 
     spin_unlock(&PHYS_MEM_LOCK);
     sti(rflags);
 }
 
-/**
- * Returns the current Page Map for the kernel process
- * @return
- */
-void* memmgr_get_current_pml4() {
-    return (void*)process_get_current_pml();
-}
+void memmgr_phys_free_page(int idx) {
+    if(idx < 0 || idx >= BITMAP_SIZE) {
+        return;
+    }
 
-/***
- * Returns the physical address for the given memory address in the identity mapping
- * @param virtAddr the virtual addr
- * @return the physical address
- */
-void* memmgr_get_from_virtual(uintptr_t virtAddr) {
-    return (void*)(virtAddr & LOW_MEMORY);
+    kfree_frames(PAGE_TO_ADDRESS((uintptr_t) idx), 0);
 }
 
-/***
- * Returns the physical address for the given memory address
- * @param virtaddr the virtual address
- * @return the mapped address
+/**
+ * Takes a block of the given order out of the free lists
+ * Lock must be held!
+ * @return the index of the first frame or -1 if no block is available
  */
-void* memmgr_get_page_physical(uintptr_t virtaddr) {
-    void* physAddr = memmgr_create_or_get_page(virtaddr, 0, 0);
+static int64_t buddy_alloc(int order) {
+    int current = order;
 
-    if(physAddr == 0) {
-        return 0;
+    while(current <= BUDDY_MAX_ORDER && !free_area[current]) {
+        current++;
     }
 
-    uintptr_t offset = virtaddr % 4096;
+    if(current > BUDDY_MAX_ORDER) {
+        //NO FRAME FOUND, WE ARE OFFICIALLY FUCKED (HOW TF DO U USE 64 GB ANYWAY)
+        return -1;
+    }
 
-    return physAddr + offset;
-}
+    uint64_t page = ADDRESS_TO_PAGE(free_area[current]);
+    buddy_remove(page, current);
 
-/***
- * Returns the identity mapping for the given memory region
- * @param physAddr the physical address
- * @return the virtual memory address for direct access by kernel
- */
-void* memmgr_get_from_physical(uintptr_t physAddr) {
-    if(physAddr == 0x1000) {
-        return (void*)0x1000;
+    //Split down to the requested order, the upper halves go back to the free lists
+    while(current > order) {
+        current--;
+        buddy_push(page + (1ull << current), current);
     }
 
-    return (void*)(physAddr | KERNEL_MEMORY);
+    return (int64_t) page;
 }
 
 /**
- * Returns the identity mapping in MMIO space for the given physical address
- * @param physAddr
- * @return mmio mapping address
+ * Locks the magazine of the executing cpu, only a drain by another cpu can hold it.
+ * Called with interrupts disabled, spins instead of scheduling.
  */
-void* memmgr_get_mmio(uintptr_t physAddr) {
-    return (void*)(physAddr | MMIO_MEMORY);
+static void frame_magazine_lock(struct frame_magazine* magazine) {
+    while(!spin_trylock(&magazine->lock)) {
+        __asm__ volatile("pause");
+    }
 }
 
 /**
- * Returns the physical address for the given MMIO space mapping
- * @param addr the virtual address
- * @return the real physical address
+ * Moves a batch of frames from the free lists into an empty magazine
+ * Magazine lock must be held!
  */
-void* memmgr_get_mmio_physical(uintptr_t addr) {
-  return (void*)(addr & LOW_MMIO_MEMORY);
+static void frame_magazine_refill(struct frame_magazine* magazine) {
+    spin_lock(&PHYS_MEM_LOCK);
+
+    while(magazine->count < FRAME_MAGAZINE_BATCH) {
+        int64_t page = buddy_alloc(0);
+
+        if(page == -1) {
+            break;
+        }
+
+        frame_state[page] = FRAME_CACHED;
+        magazine->frames[magazine->count++] = PAGE_TO_ADDRESS((uint64_t) page);
+    }
+
+    spin_unlock(&PHYS_MEM_LOCK);
 }
 
-extern void load_page_map0(uintptr_t pageMap);
+/**
+ * Returns a batch of frames from a magazine to the free lists
+ * Magazine lock must be held!
+ */
+static void frame_magazine_drain(struct frame_magazine* magazine, int count) {
+    spin_lock(&PHYS_MEM_LOCK);
+
+    for(int i = 0; i < count && magazine->count > 0; i++) {
+        uint64_t page = ADDRESS_TO_PAGE(magazine->frames[--magazine->count]);
+
+        frame_state[page] = 0;
+        buddy_free(page, 0);
+    }
+
+    spin_unlock(&PHYS_MEM_LOCK);
+}
 
 /**
- * Loads a new page map, used by the scheduler
- * @param pageMap the new page map
+ * Returns the frames cached by every cpu to the free lists, they might be the buddies a large block is missing.
+ * A magazine its cpu is using right now is skipped.
  */
-void load_page_map(uintptr_t pageMap) {
-    if(pageMap == 0) {
-        pageMap = 0x1000;
+static void frame_magazine_drain_all() {
+    for(int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct frame_magazine* magazine = &frame_magazines[cpu];
+
+        if(magazine->count == 0 || !spin_trylock(&magazine->lock)) {
+            continue;
+        }
+
+        frame_magazine_drain(magazine, magazine->count);
+        spin_unlock(&magazine->lock);
     }
+}
 
-    asm volatile (
-            "movq %0, %%cr3"
-            : : "r"((uintptr_t)pageMap));
+/**
+ * Checks whether a frame without references is already free, in the free lists or a magazine
+ */
+static bool frame_is_free(uint64_t page) {
+    int order;
+
+    spin_lock(&PHYS_MEM_LOCK);
+    bool free = frame_state[page] == FRAME_CACHED || buddy_find_block(page, &order) != -1;
+    spin_unlock(&PHYS_MEM_LOCK);
+
+    return free;
 }
 
-void* memmgr_create_or_get_page(uintptr_t virtualAddr, int flags, int create) {
-    uint64_t INDEX_PML4 = PML4_INDEX(virtualAddr);
-    uint64_t INDEX_PDP = PDP_INDEX(virtualAddr);
-    uint64_t INDEX_PD = PD_INDEX(virtualAddr);
-    uint64_t INDEX_PT = PT_INDEX(virtualAddr);
+/**
+ * Allocates 2^order physically contiguous frames, aligned to their size
+ * Single frames come from the magazine of the current cpu
+ * @param order the order of the block
+ * @return the physical address of the first frame or 0 if no block is available
+ */
+static uintptr_t frame_alloc(int order) {
+    uint64_t rflags = cli();
+    uintptr_t frame = 0;
 
-#ifdef DEBUG
-    printf("Virtual addr: 0x%x\n", virtualAddr);
-    printf("INDICES: 0x%x, 0x%x, 0x%x, 0x%x\n", INDEX_PML4, INDEX_PDP, INDEX_PD, INDEX_PT);
-#endif
+    if(order == 0) {
+        struct frame_magazine* magazine = &frame_magazines[get_current_core()];
 
-    uint64_t* pageMap = memmgr_get_from_physical((uintptr_t)memmgr_get_current_pml4());
-    uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMap[INDEX_PML4] & PAGE_MASK);
+        frame_magazine_lock(magazine);
 
-    //If PDP doesnt exist, either return or try to create
-    if(pageMap[INDEX_PML4] == 0) {
-        if(!create) {
-            return NULL;
+        if(magazine->count == 0) {
+            frame_magazine_refill(magazine);
         }
 
-        uintptr_t pdp_frame = kalloc_frame();
-
-        if(pdp_frame == UINT64_MAX) {
-            //PANIC
+        if(magazine->count > 0) {
+            frame = magazine->frames[--magazine->count];
+            frame_state[ADDRESS_TO_PAGE(frame)] = 0;
         }
 
-        pageMap[INDEX_PML4] = pdp_frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+        spin_unlock(&magazine->lock);
+    } else {
+        spin_lock(&PHYS_MEM_LOCK);
 
-        pageDirectoryPointer = (uint64_t*)(pdp_frame | KERNEL_MEMORY);
-        memset(pageDirectoryPointer, 0, 0x1000);
-    }
+        int64_t page = buddy_alloc(order);
 
-    uint64_t* pageDirectory = memmgr_get_from_physical(pageDirectoryPointer[INDEX_PDP] & PAGE_MASK);
+        spin_unlock(&PHYS_MEM_LOCK);
 
-    //If PD doesnt exist, either return or try to create
-    if(pageDirectoryPointer[INDEX_PDP] == 0) {
-        if(!create) return NULL;
+        if(page == -1) {
+            frame_magazine_drain_all();
 
-        uintptr_t pd_frame = kalloc_frame();
-        pageDirectoryPointer[INDEX_PDP] = pd_frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+            spin_lock(&PHYS_MEM_LOCK);
+            page = buddy_alloc(order);
+            spin_unlock(&PHYS_MEM_LOCK);
+        }
 
-        pageDirectory = (uint64_t*)(pd_frame | KERNEL_MEMORY);
-        memset(pageDirectory, 0, 0x1000);
+        if(page != -1) {
+            frame = PAGE_TO_ADDRESS((uint64_t) page);
+        }
     }
 
-    if(pageDirectoryPointer[INDEX_PDP] & PAGE_LARGE) {
-        //Skip large page
-        return 0;
+    if(frame != 0) {
+        frame_refcount[ADDRESS_TO_PAGE(frame)] = 1;
     }
 
-    uint64_t* pageTable = memmgr_get_from_physical(pageDirectory[INDEX_PD] & PAGE_MASK);
+    sti(rflags);
 
-    //If PT doesnt exist, either return or try to create
-    if(pageDirectory[INDEX_PD] == 0) {
-        if(!create) return NULL;
-        uintptr_t pt_frame = kalloc_frame();
-        pageDirectory[INDEX_PD] = pt_frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+    return frame;
+}
 
-#ifdef DEBUG
-        printf("Creating page table at 0x%x with index 0x%x in PD 0x%x\n", pt_frame, INDEX_PD, pageDirectory);
-#endif
+uintptr_t kalloc_frames(int order) {
+    return kalloc_frames_flags(order, 0);
+}
 
-        pageTable = (uint64_t*)(pt_frame | KERNEL_MEMORY);
-        memset(pageTable, 0, 0x1000);
+/**
+ * Allocates 2^order frames, with KALLOC_RECLAIM memory is reclaimed from the caches if none are free
+ * Shrinkers give memory back through free and kfree, so a caller below an allocator lock would deadlock
+ */
+uintptr_t kalloc_frames_flags(int order, int flags) {
+    if(order < 0 || order > BUDDY_MAX_ORDER) {
+        return 0;
     }
 
-    if(pageDirectory[INDEX_PD] & PAGE_LARGE) {
-        //Skip large page
-        return 0;
+    uintptr_t frame = frame_alloc(order);
+
+    size_t batch = (1 << order) > RECLAIM_BATCH ? 1 << order : RECLAIM_BATCH;
+
+    //Caches have to give memory back before the allocation fails.
+    //Swapping does polled disk I/O and rewrites other page tables, only the idle task swaps in memmgr_reclaim
+    while(frame == 0 && (flags & KALLOC_RECLAIM) && shrink_caches(batch) > 0) {
+        frame = frame_alloc(order);
     }
 
-    //If page doesnt exist, either return or try to create
-    if(pageTable[INDEX_PT] == 0) {
-        if(!create) return NULL;
-#ifdef DEBUG
-        printf("Creating new page\n");
-#endif
-        pageTable[INDEX_PT] = kalloc_frame() | PAGE_PRESENT | PAGE_WRITABLE | flags;
+    if(frame == 0) {
+        __atomic_store_n(&reclaim_requested, true, __ATOMIC_RELAXED);
     }
 
-    //Return address of new page
-    return (void *) (pageTable[INDEX_PT] & PAGE_MASK);
+    return frame;
 }
 
 /**
- * Creates a new virtual memory mapping
- * @param virtualAddr the virtual addr to map to
- * @param frame the frame to insert at the desired level
- * @param flags the flags for the new page, must include PAGE_PRESENT if you want it to be usable
- * @param create whether to create new page entries
- * @param level the level for the frame and also the maximum creation level
- * @return
+ * Frees cache memory until the high watermark is reached, called by the idle task
+ * @return false if there was nothing to reclaim
  */
-void* memmgr_create_or_get_raw(uintptr_t virtualAddr, uintptr_t frame, int flags, int create, int level) {
-    uint64_t INDEX_PML4 = PML4_INDEX(virtualAddr);
-    uint64_t INDEX_PDP = PDP_INDEX(virtualAddr);
-    uint64_t INDEX_PD = PD_INDEX(virtualAddr);
-    uint64_t INDEX_PT = PT_INDEX(virtualAddr);
-
-#ifdef DEBUG
-    printf("Virtual addr: 0x%x\n", virtualAddr);
-    printf("INDICES: 0x%x, 0x%x, 0x%x, 0x%x\n", INDEX_PML4, INDEX_PDP, INDEX_PD, INDEX_PT);
-#endif
+bool memmgr_reclaim() {
+    uint64_t frames = memmgr_phys_free_frames();
+    bool requested = __atomic_exchange_n(&reclaim_requested, false, __ATOMIC_RELAXED);
 
-    uint64_t* pageMap = memmgr_get_from_physical((uintptr_t)memmgr_get_current_pml4());
-    uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMap[INDEX_PML4] & PAGE_MASK);
+    if(frames >= WATERMARK_LOW && !requested) {
+        return false;
+    }
 
-    //If PDP doesnt exist, either return or try to create
-    if(pageMap[INDEX_PML4] == 0) {
-        if(!create) {
-            return NULL;
-        }
+    //A failed allocation above the watermark was after a larger block, free at least a batch for it
+    size_t target = frames < WATERMARK_HIGH - RECLAIM_BATCH ? WATERMARK_HIGH - frames : RECLAIM_BATCH;
+    size_t freed = shrink_caches(target);
 
-        if(level <= 3) {
-            uintptr_t pdp_frame = kalloc_frame();
+    if(freed < target && frames + freed < WATERMARK_LOW) {
+        freed += memmgr_swap_out(target - freed);
+    }
 
-            if(pdp_frame == UINT64_MAX) {
-                //PANIC
-            }
+    return freed > 0;
+}
 
-            pageMap[INDEX_PML4] = pdp_frame | flags;
+/**
+ * Frees 2^order frames allocated by kalloc_frames
+ * @param addr the physical address of the first frame
+ * @param order the order used for the allocation
+ */
+void kfree_frames(uintptr_t addr, int order) {
+    if(order < 0 || order > BUDDY_MAX_ORDER) {
+        return;
+    }
 
-            pageDirectoryPointer = (uint64_t*)(pdp_frame | KERNEL_MEMORY);
-            memset(pageDirectoryPointer, 0, 0x1000);
-        } else {
-            pageMap[INDEX_PML4] = frame | flags;
-            memset((uint64_t*)(frame | KERNEL_MEMORY), 0, 0x1000);
+    uint64_t page = ADDRESS_TO_PAGE((uint64_t) addr);
 
-            return (void *) (pageMap[INDEX_PML4] & PAGE_MASK);
-        }
+    if(page + (1ull << order) > BITMAP_SIZE) {
+        return;
     }
 
-    uint64_t* pageDirectory = memmgr_get_from_physical(pageDirectoryPointer[INDEX_PDP] & PAGE_MASK);
+    uint16_t references = __atomic_load_n(&frame_refcount[page], __ATOMIC_ACQUIRE);
+
+    //Shared frames are only released by the last owner
+    if(order == 0 && references > 1 && __atomic_sub_fetch(&frame_refcount[page], 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    frame_refcount[page] = 0;
+
+    uint64_t rflags = cli();
+
+    //Allocated frames hold a reference, only frames without one need the locked look into the free lists
+    if(references == 0 && frame_is_free(page)) {
+        serial_printf("[MEMMGR] Double free of frame 0x%x\n", addr);
+    } else if(order == 0) {
+        struct frame_magazine* magazine = &frame_magazines[get_current_core()];
+
+        frame_magazine_lock(magazine);
+
+        if(magazine->count == FRAME_MAGAZINE_SIZE) {
+            frame_magazine_drain(magazine, FRAME_MAGAZINE_BATCH);
+        }
+
+        frame_state[page] = FRAME_CACHED;
+        magazine->frames[magazine->count++] = addr & PAGE_MASK;
+
+        spin_unlock(&magazine->lock);
+    } else {
+        spin_lock(&PHYS_MEM_LOCK);
+        buddy_free(page, order);
+        spin_unlock(&PHYS_MEM_LOCK);
+    }
+
+    sti(rflags);
+}
+
+/**
+ * Takes a frame out of the pre-zeroed pool
+ * @return the physical address or 0 if the pool is empty
+ */
+static uintptr_t memmgr_zero_pool_pop() {
+    uintptr_t frame = 0;
+
+    uint64_t rflags = cli();
+    spin_lock(&ZERO_POOL_LOCK);
+
+    if(zero_pool_count > 0) {
+        frame = zero_pool[--zero_pool_count];
+    }
+
+    spin_unlock(&ZERO_POOL_LOCK);
+    sti(rflags);
+
+    return frame;
+}
+
+uintptr_t kalloc_frame() {
+    uintptr_t frame = kalloc_frames(0);
+
+    if(frame == 0) {
+        //Out of memory, the pool is the last resort
+        frame = memmgr_zero_pool_pop();
+    }
+
+    return frame;
+}
+
+/**
+ * Allocates a zeroed frame, taken from the pool filled by the idle task if possible
+ * @param flags the flags of kalloc_frames_flags
+ * @return the physical address or 0 if no frame is available
+ */
+static uintptr_t kalloc_zeroed_frame_flags(int flags) {
+    uintptr_t frame = memmgr_zero_pool_pop();
+
+    if(frame != 0) {
+        return frame;
+    }
+
+    frame = kalloc_frames_flags(0, flags);
+
+    if(frame != 0) {
+        memset(memmgr_get_from_physical(frame), 0, 0x1000);
+    }
+
+    return frame;
+}
+
+uintptr_t kalloc_zeroed_frame() {
+    return kalloc_zeroed_frame_flags(0);
+}
+
+/**
+ * Zeroes frames for the pool, called by the idle task with interrupts enabled
+ * Non-temporal stores keep the zeroes from evicting the caches of the running processes
+ * @param count the maximum amount of frames to zero
+ * @return false if no frame was added, the idle task halts then
+ */
+bool memmgr_refill_zeroed_frames(int count) {
+    if(__atomic_load_n(&zero_pool_count, __ATOMIC_RELAXED) >= ZERO_POOL_SIZE) {
+        return false;
+    }
+
+    int added = 0;
+
+    for(int i = 0; i < count; i++) {
+        //Leave the last free frames to real allocations
+        if(free_frames < ZERO_POOL_SIZE) {
+            break;
+        }
+
+        //Zeroing ahead is only worth it with free memory, it never reclaims or requests a reclaim
+        uintptr_t frame = frame_alloc(0);
+
+        if(frame == 0) {
+            break;
+        }
+
+        uint64_t* ptr = memmgr_get_from_physical(frame);
+
+        for(int j = 0; j < 512; j++) {
+            __asm__ volatile("movnti %1, %0" : "=m"(ptr[j]) : "r"(0ull));
+        }
+
+        __asm__ volatile("sfence" : : : "memory");
+
+        uint64_t rflags = cli();
+        spin_lock(&ZERO_POOL_LOCK);
+
+        if(zero_pool_count >= ZERO_POOL_SIZE) {
+            spin_unlock(&ZERO_POOL_LOCK);
+            sti(rflags);
+
+            kfree_frame(frame);
+            break;
+        }
+
+        zero_pool[zero_pool_count++] = frame;
+        added++;
+
+        spin_unlock(&ZERO_POOL_LOCK);
+        sti(rflags);
+    }
+
+    return added > 0;
+}
+
+void kfree_frame(uintptr_t addr) {
+    kfree_frames(addr, 0);
+}
+
+/**
+ * Adds a reference to a frame that gets mapped a second time
+ * @param addr the physical address of the frame
+ */
+void memmgr_frame_ref(uintptr_t addr) {
+    uint64_t page = ADDRESS_TO_PAGE((uint64_t) addr);
+
+    if(page >= BITMAP_SIZE) {
+        return;
+    }
+
+    __atomic_add_fetch(&frame_refcount[page], 1, __ATOMIC_ACQ_REL);
+}
+
+/**
+ * Returns the amount of references to a frame
+ * @param addr the physical address of the frame
+ */
+uint16_t memmgr_frame_refcount(uintptr_t addr) {
+    uint64_t page = ADDRESS_TO_PAGE((uint64_t) addr);
+
+    if(page >= BITMAP_SIZE) {
+        return 0;
+    }
+
+    return __atomic_load_n(&frame_refcount[page], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Marks a block from kalloc_frames as slab, so kfree can find the slab of an object
+ * @param addr the physical address of the first frame
+ * @param order the order of the block
+ */
+void memmgr_frame_set_slab(uintptr_t addr, int order) {
+    uint64_t page = ADDRESS_TO_PAGE((uint64_t) addr);
+
+    for(uint64_t i = 0; i < (1ull << order) && page + i < BITMAP_SIZE; i++) {
+        frame_state[page + i] = FRAME_SLAB | order;
+    }
+}
+
+/**
+ * Removes the slab mark before the block goes back to kfree_frames
+ * @param addr the physical address of the first frame
+ * @param order the order of the block
+ */
+void memmgr_frame_clear_slab(uintptr_t addr, int order) {
+    uint64_t page = ADDRESS_TO_PAGE((uint64_t) addr);
+
+    for(uint64_t i = 0; i < (1ull << order) && page + i < BITMAP_SIZE; i++) {
+        frame_state[page + i] = 0;
+    }
+}
+
+/**
+ * Returns the slab containing an object
+ * @param ptr pointer to the object in the identity map
+ * @return the identity mapped start of the slab or NULL if the pointer doesn't belong to a slab
+ */
+void* memmgr_get_slab(void* ptr) {
+    if((uintptr_t) ptr < KERNEL_MEMORY || (uintptr_t) ptr > KERNEL_MEMORY + LOW_MEMORY) {
+        return NULL;
+    }
+
+    uint64_t page = ADDRESS_TO_PAGE((uintptr_t) memmgr_get_from_virtual((uintptr_t) ptr));
+
+    if(page >= BITMAP_SIZE || (frame_state[page] & (FRAME_FREE | FRAME_SLAB)) != FRAME_SLAB) {
+        return NULL;
+    }
+
+    int order = frame_state[page] & FRAME_ORDER_MASK;
+
+    return memmgr_get_from_physical(PAGE_TO_ADDRESS(page & ~((1ull << order) - 1)));
+}
+
+/**
+ * Returns the amount of free physical frames
+ */
+uint64_t memmgr_phys_free_frames() {
+    uint64_t frames = free_frames;
+
+    for(int i = 0; i < MAX_CPUS; i++) {
+        frames += frame_magazines[i].count;
+    }
+
+    return frames;
+}
+
+/**
+ * Returns the current Page Map for the kernel process
+ * @return
+ */
+void* memmgr_get_current_pml4() {
+    return (void*)process_get_current_pml();
+}
+
+/***
+ * Returns the physical address for the given memory address in the identity mapping
+ * @param virtAddr the virtual addr
+ * @return the physical address
+ */
+void* memmgr_get_from_virtual(uintptr_t virtAddr) {
+    return (void*)(virtAddr & LOW_MEMORY);
+}
+
+/***
+ * Returns the physical address for the given memory address
+ * @param virtaddr the virtual address
+ * @return the mapped address
+ */
+void* memmgr_get_page_physical(uintptr_t virtaddr) {
+    //Lazy pages get their frame now, the caller is probably about to hand it to a device
+    uint64_t* pageEntry = memmgr_get_page_entry(virtaddr);
+
+    if(pageEntry != NULL && (*pageEntry & MEMMGR_PAGE_FLAG_LAZY)) {
+        memmgr_populate_page(pageEntry);
+    } else if(pageEntry != NULL && !(*pageEntry & PAGE_PRESENT) && (*pageEntry & MEMMGR_PAGE_FLAG_SWAP)) {
+        memmgr_swap_in(pageEntry);
+    }
+
+    void* physAddr = memmgr_create_or_get_page(virtaddr, 0, 0);
+
+    if(physAddr == 0) {
+        return 0;
+    }
+
+    uintptr_t offset = virtaddr % 4096;
+
+    return physAddr + offset;
+}
+
+/***
+ * Returns the identity mapping for the given memory region
+ * @param physAddr the physical address
+ * @return the virtual memory address for direct access by kernel
+ */
+void* memmgr_get_from_physical(uintptr_t physAddr) {
+    if(physAddr == 0x1000) {
+        return (void*)0x1000;
+    }
+
+    return (void*)(physAddr | KERNEL_MEMORY);
+}
+
+/**
+ * Returns the identity mapping in MMIO space for the given physical address
+ * @param physAddr
+ * @return mmio mapping address
+ */
+void* memmgr_get_mmio(uintptr_t physAddr) {
+    return (void*)(physAddr | MMIO_MEMORY);
+}
+
+/**
+ * Returns the physical address for the given MMIO space mapping
+ * @param addr the virtual address
+ * @return the real physical address
+ */
+void* memmgr_get_mmio_physical(uintptr_t addr) {
+  return (void*)(addr & LOW_MMIO_MEMORY);
+}
+
+extern void load_page_map0(uintptr_t pageMap);
+
+/**
+ * Allocates an address space identifier for a new page map
+ * @return the identifier or 0 if all are in use
+ */
+uint16_t memmgr_asid_alloc() {
+    uint16_t asid = 0;
+
+    uint64_t rflags = cli();
+    spin_lock(&ASID_LOCK);
+
+    for(int i = 0; i < ASID_COUNT - 1; i++) {
+        uint16_t candidate = asid_next;
+
+        asid_next = asid_next == ASID_COUNT - 1 ? 1 : asid_next + 1;
+
+        if(!(asid_bitmap[candidate / 8] & (1 << (candidate % 8)))) {
+            asid_bitmap[candidate / 8] |= 1 << (candidate % 8);
+            asid = candidate;
+            break;
+        }
+    }
+
+    spin_unlock(&ASID_LOCK);
+    sti(rflags);
+
+    return asid;
+}
+
+/**
+ * Releases the address space identifier of a page map that is about to be freed
+ * @param asid the identifier
+ * @param pageMap the page map
+ */
+void memmgr_asid_free(uint16_t asid, uintptr_t pageMap) {
+    uint64_t rflags = cli();
+    spin_lock(&ASID_LOCK);
+
+    //The frame might come back as a different page map, so it can't be skipped on the next load
+    for(int i = 0; i < MAX_CPUS; i++) {
+        if(loaded_page_map[i] == pageMap) {
+            loaded_page_map[i] = 0;
+        }
+    }
+
+    if(asid != 0) {
+        asid_bitmap[asid / 8] &= ~(1 << (asid % 8));
+        asid_generation[asid] = UINT64_MAX;
+    }
+
+    spin_unlock(&ASID_LOCK);
+    sti(rflags);
+}
+
+/**
+ * Loads a new page map, used by the scheduler
+ * Nothing happens if the page map is already loaded, with PCID the TLB entries of the address space survive the switch
+ * @param pageMap the new page map
+ * @param asid the address space identifier of the page map
+ */
+void load_page_map(uintptr_t pageMap, uint16_t asid) {
+    if(pageMap == 0) {
+        pageMap = 0x1000;
+        asid = 0;
+    }
+
+    int cpu = get_current_core();
+
+    if(pageMap == loaded_page_map[cpu] && asid == loaded_asid[cpu]) {
+        return;
+    }
+
+    uint64_t cr3 = pageMap;
+
+    if(pcid_enabled) {
+        cr3 |= asid;
+
+        //The generations only track the TLB of the boot cpu, the other cpus flush the identifier on every load
+        if(cpu == 0) {
+            uint64_t generation = __atomic_load_n(&kernel_tlb_generation, __ATOMIC_ACQUIRE);
+
+            //Identifier 0 is shared by every page map without one of its own
+            if(asid != 0 && asid_generation[asid] == generation) {
+                cr3 |= CR3_NOFLUSH;
+            }
+
+            asid_generation[asid] = generation;
+        }
+    }
+
+    loaded_page_map[cpu] = pageMap;
+    loaded_asid[cpu] = asid;
+
+    asm volatile (
+            "movq %0, %%cr3"
+            : : "r"(cr3));
+}
+
+void* memmgr_create_or_get_page(uintptr_t virtualAddr, int flags, int create) {
+    uint64_t INDEX_PML4 = PML4_INDEX(virtualAddr);
+    uint64_t INDEX_PDP = PDP_INDEX(virtualAddr);
+    uint64_t INDEX_PD = PD_INDEX(virtualAddr);
+    uint64_t INDEX_PT = PT_INDEX(virtualAddr);
+
+#ifdef DEBUG
+    printf("Virtual addr: 0x%x\n", virtualAddr);
+    printf("INDICES: 0x%x, 0x%x, 0x%x, 0x%x\n", INDEX_PML4, INDEX_PDP, INDEX_PD, INDEX_PT);
+#endif
+
+    uint64_t* pageMap = memmgr_get_from_physical((uintptr_t)memmgr_get_current_pml4());
+    uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMap[INDEX_PML4] & PAGE_MASK);
+
+    //If PDP doesnt exist, either return or try to create
+    if(pageMap[INDEX_PML4] == 0) {
+        if(!create) {
+            return NULL;
+        }
+
+        uintptr_t pdp_frame = kalloc_zeroed_frame();
+
+        if(pdp_frame == UINT64_MAX) {
+            //PANIC
+        }
+
+        pageMap[INDEX_PML4] = pdp_frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+
+        pageDirectoryPointer = (uint64_t*)(pdp_frame | KERNEL_MEMORY);
+    }
+
+    uint64_t* pageDirectory = memmgr_get_from_physical(pageDirectoryPointer[INDEX_PDP] & PAGE_MASK);
+
+    //If PD doesnt exist, either return or try to create
+    if(pageDirectoryPointer[INDEX_PDP] == 0) {
+        if(!create) return NULL;
+
+        uintptr_t pd_frame = kalloc_zeroed_frame();
+        pageDirectoryPointer[INDEX_PDP] = pd_frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+
+        pageDirectory = (uint64_t*)(pd_frame | KERNEL_MEMORY);
+    }
+
+    if(pageDirectoryPointer[INDEX_PDP] & PAGE_LARGE) {
+        //1 GiB page, return the frame inside of it
+        return (void*) ((pageDirectoryPointer[INDEX_PDP] & 0x000fffffc0000000ull) + (virtualAddr & 0x3FFFF000ull));
+    }
+
+    uint64_t* pageTable = memmgr_get_from_physical(pageDirectory[INDEX_PD] & PAGE_MASK);
+
+    //If PT doesnt exist, either return or try to create
+    if(pageDirectory[INDEX_PD] == 0) {
+        if(!create) return NULL;
+        uintptr_t pt_frame = kalloc_zeroed_frame();
+        pageDirectory[INDEX_PD] = pt_frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+
+#ifdef DEBUG
+        printf("Creating page table at 0x%x with index 0x%x in PD 0x%x\n", pt_frame, INDEX_PD, pageDirectory);
+#endif
+
+        pageTable = (uint64_t*)(pt_frame | KERNEL_MEMORY);
+    }
+
+    if(pageDirectory[INDEX_PD] & PAGE_LARGE) {
+        //2 MiB page, return the frame inside of it
+        return (void*) ((pageDirectory[INDEX_PD] & HUGE_PAGE_MASK) + (virtualAddr & 0x1FF000ull));
+    }
+
+    //If page doesnt exist, either return or try to create
+    if(pageTable[INDEX_PT] == 0) {
+        if(!create) return NULL;
+#ifdef DEBUG
+        printf("Creating new page\n");
+#endif
+        pageTable[INDEX_PT] = kalloc_frame() | PAGE_PRESENT | PAGE_WRITABLE | flags;
+    }
+
+    //Return address of new page
+    return (void *) (pageTable[INDEX_PT] & PAGE_MASK);
+}
+
+/**
+ * Creates a new virtual memory mapping
+ * @param virtualAddr the virtual addr to map to
+ * @param frame the frame to insert at the desired level
+ * @param flags the flags for the new page, must include PAGE_PRESENT if you want it to be usable
+ * @param create whether to create new page entries
+ * @param level the level for the frame and also the maximum creation level
+ * @return
+ */
+void* memmgr_create_or_get_raw(uintptr_t virtualAddr, uintptr_t frame, int flags, int create, int level) {
+    uint64_t INDEX_PML4 = PML4_INDEX(virtualAddr);
+    uint64_t INDEX_PDP = PDP_INDEX(virtualAddr);
+    uint64_t INDEX_PD = PD_INDEX(virtualAddr);
+    uint64_t INDEX_PT = PT_INDEX(virtualAddr);
+
+#ifdef DEBUG
+    printf("Virtual addr: 0x%x\n", virtualAddr);
+    printf("INDICES: 0x%x, 0x%x, 0x%x, 0x%x\n", INDEX_PML4, INDEX_PDP, INDEX_PD, INDEX_PT);
+#endif
+
+    uint64_t* pageMap = memmgr_get_from_physical((uintptr_t)memmgr_get_current_pml4());
+    uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMap[INDEX_PML4] & PAGE_MASK);
+
+    //If PDP doesnt exist, either return or try to create
+    if(pageMap[INDEX_PML4] == 0) {
+        if(!create) {
+            return NULL;
+        }
+
+        if(level <= 3) {
+            uintptr_t pdp_frame = kalloc_zeroed_frame();
+
+            if(pdp_frame == UINT64_MAX) {
+                //PANIC
+            }
+
+            pageMap[INDEX_PML4] = pdp_frame | flags;
+
+            pageDirectoryPointer = (uint64_t*)(pdp_frame | KERNEL_MEMORY);
+        } else {
+            pageMap[INDEX_PML4] = frame | flags;
+            memset((uint64_t*)(frame | KERNEL_MEMORY), 0, 0x1000);
+
+            return (void *) (pageMap[INDEX_PML4] & PAGE_MASK);
+        }
+    }
+
+    uint64_t* pageDirectory = memmgr_get_from_physical(pageDirectoryPointer[INDEX_PDP] & PAGE_MASK);
 
     //If PD doesnt exist, either return or try to create
     if(pageDirectoryPointer[INDEX_PDP] == 0) {
-        if(!create) return NULL;
+        if(!create) return NULL;
+
+        if(level <= 2) {
+            uintptr_t pd_frame = kalloc_zeroed_frame();
+            pageDirectoryPointer[INDEX_PDP] = pd_frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+
+            pageDirectory = (uint64_t*)(pd_frame | KERNEL_MEMORY);
+        } else {
+            pageDirectoryPointer[INDEX_PDP] = frame | flags;
+
+            pageDirectory = (uint64_t*)(frame | KERNEL_MEMORY);
+            memset(pageDirectory, 0, 0x1000);
+
+            return (void *) (pageDirectoryPointer[INDEX_PDP] & PAGE_MASK);
+        }
+    }
+
+    if(pageDirectoryPointer[INDEX_PDP] & PAGE_LARGE) {
+        //Skip large page
+        return 0;
+    }
+
+    uint64_t* pageTable = memmgr_get_from_physical(pageDirectory[INDEX_PD] & PAGE_MASK);
+
+    //If PT doesnt exist, either return or try to create
+    if(pageDirectory[INDEX_PD] == 0) {
+        if(!create) return NULL;
+
+        if(level <= 1) {
+            uintptr_t pt_frame = kalloc_zeroed_frame();
+            pageDirectory[INDEX_PD] = pt_frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+
+#ifdef DEBUG
+            printf("Creating page table at 0x%x with index 0x%x in PD 0x%x\n", pt_frame, INDEX_PD, pageDirectory);
+#endif
+
+            pageTable = (uint64_t*)(pt_frame | KERNEL_MEMORY);
+        } else {
+            pageDirectory[INDEX_PD] = frame | flags;
+
+#ifdef DEBUG
+            printf("Creating page table at 0x%x with index 0x%x in PD 0x%x\n", pt_frame, INDEX_PD, pageDirectory);
+#endif
+
+            pageTable = (uint64_t*)(frame | KERNEL_MEMORY);
+            memset(pageTable, 0, 0x1000);
+
+            return (void *) (pageDirectory[INDEX_PD] & PAGE_MASK);
+        }
+    }
+
+    if(pageDirectory[INDEX_PD] & PAGE_LARGE) {
+        //Skip large page
+        return 0;
+    }
+
+    //If page doesnt exist, either return or try to create
+    if(pageTable[INDEX_PT] == 0) {
+        if(!create) return NULL;
+#ifdef DEBUG
+        printf("Creating new page\n");
+#endif
+        pageTable[INDEX_PT] = frame | flags;
+    }
+
+    //Return address of new page
+    return (void *) (pageTable[INDEX_PT] & PAGE_MASK);
+}
+
+void* get_free_page(size_t len, bool is_kernel) {
+    uint64_t* pageMap = memmgr_get_from_physical((uintptr_t)memmgr_get_current_pml4());
+    uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMap[is_kernel ? 510 : 0] & PAGE_MASK);
+
+    //printf("Page map loc: 0x%x\n", pageMap);
+    //printf("Page directory pointer: 0x%x\n", pageDirectoryPointer);
+
+    if(pageDirectoryPointer == 0) {
+        //No memory???
+        return (void*)UINT64_MAX;
+    }
+
+    //We use these to calculate the baseAddress and space of the minimum-largest memory pocket we can find.
+    uint64_t freeMemory = 0;
+    uint64_t baseAddress = 0;
+
+    //Go through every page directory
+    for(int i = 0; i < 512; i++) {
+        uint64_t* pageDirectory = memmgr_get_from_physical(pageDirectoryPointer[i] & PAGE_MASK);
+        //printf("Page directory: %d, 0x%x\n", i, pageDirectory);
+
+        if(pageDirectoryPointer[i] & PAGE_LARGE) {
+            //Large page is in use
+            baseAddress = 0;
+            freeMemory = 0;
+
+            continue;
+        }
+
+        if(pageDirectoryPointer[i] == 0) {
+            if(baseAddress == 0) {
+                //free page directory means free page, lets calculate offset
+                baseAddress = (0x40000000UL * i);
+            }
+
+            freeMemory += 0x40000000UL;
+
+            if(freeMemory > len) {
+              return is_kernel ? (void*)KERNEL_ENTRY + baseAddress: (void*)baseAddress;
+            }
+
+            continue;
+        }
+
+
+        if(!is_kernel && !(pageDirectoryPointer[i] & PAGE_USER)) {
+            //No user page directory, skip
+            continue;
+        }
+
+        //Go through every Page Table
+        for(int j = 0; j < 512; j++) {
+            uint64_t* pageTable = memmgr_get_from_physical(pageDirectory[j] & PAGE_MASK);
+            //printf("Page table: %d: 0x%x\n", j, pageTable);
+
+            if(pageDirectory[j] & PAGE_LARGE) {
+                //Large page is in use
+                baseAddress = 0;
+                freeMemory = 0;
+
+                continue;
+            }
+
+            if(pageDirectory[j] == 0) {
+                if(baseAddress == 0) {
+                    //free page table means free page, lets calculate offset
+                    baseAddress = (0x40000000UL * i) + (0x200000UL * j);
+                }
+
+                freeMemory += 0x200000UL;
+
+                if(freeMemory > len) {
+#ifdef DEBUG
+                    printf("cool: 0x%x\n", baseAddress);
+#endif
+                    return is_kernel ? (void*)KERNEL_ENTRY + baseAddress: (void*)baseAddress;
+                }
+
+                continue;
+            }
+
+            if(!is_kernel && !(pageDirectory[j] & PAGE_USER)) {
+                //No user page table, skip
+                continue;
+            }
+
+            for(int k = 0; k < 512; k++) {
+                uint64_t page = pageTable[k];
+
+                if(page != 0 && pageTable[k] != KERNEL_MEMORY) {
+                    baseAddress = 0;
+                    freeMemory = 0;
+
+                    continue;
+                }
+
+                if(baseAddress == 0) {
+                    //free page directory means free page, lets calculate offset
+                    baseAddress = (0x40000000UL * i) + (0x200000UL * j) +(0x1000 * k);
+                }
+
+                freeMemory += 0x1000UL;
+
+                if(freeMemory > len) {
+#ifdef DEBUG
+                    printf("cool2: 0x%x\n", baseAddress);
+#endif
+                    return is_kernel ? (void*)KERNEL_ENTRY + baseAddress: (void*)baseAddress;
+                }
+            }
+        }
+    }
+
+    return (void*)UINT64_MAX;
+}
+
+/**
+ * Walks the current page map down to the entry of the given address
+ * @param virtualAddr the virtual address
+ * @param flags flags for newly created tables
+ * @param create whether missing tables are created
+ * @param depth number of tables to walk through, 3 returns the page table entry and 2 the page directory entry
+ * @return pointer to the entry or NULL if a table doesn't exist or a large page maps the address
+ */
+static uint64_t* memmgr_walk_page_map(uintptr_t virtualAddr, int flags, bool create, int depth) {
+    uint64_t* table = memmgr_get_from_physical((uintptr_t)memmgr_get_current_pml4());
+    int shifts[] = { 39, 30, 21, 12 };
+
+    for(int level = 0; level < depth; level++) {
+        uint64_t* entry = &table[(virtualAddr >> shifts[level]) & 0x1FF];
+
+        if(!(*entry & PAGE_PRESENT)) {
+            if(!create || *entry != 0) {
+                return NULL;
+            }
+
+            uintptr_t frame = kalloc_zeroed_frame();
+
+            if(frame == 0) {
+                return NULL;
+            }
+
+            *entry = frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+        }
+
+        if(*entry & PAGE_LARGE) {
+            return NULL;
+        }
+
+        table = memmgr_get_from_physical(*entry & PAGE_MASK);
+    }
+
+    return &table[(virtualAddr >> shifts[depth]) & 0x1FF];
+}
+
+/**
+ * Returns the page table entry for the given address in the current page map
+ * @param virtualAddr the virtual address
+ * @return pointer to the entry or NULL if the page table doesn't exist or a large page maps the address
+ */
+uint64_t* memmgr_get_page_entry(uintptr_t virtualAddr) {
+    return memmgr_walk_page_map(virtualAddr, 0, false, 3);
+}
+
+/**
+ * Reserves a page that gets a zeroed frame on first access
+ * @param virtualAddr the virtual address
+ * @param flags the flags of the page once populated
+ * @return false if the page is already mapped
+ */
+static bool memmgr_create_lazy_page(uintptr_t virtualAddr, int flags) {
+    uint64_t* pageEntry = memmgr_walk_page_map(virtualAddr, flags & PAGE_USER, true, 3);
+
+    if(pageEntry == NULL || *pageEntry != 0) {
+        return false;
+    }
+
+    *pageEntry = MEMMGR_PAGE_FLAG_LAZY | flags;
+
+    return true;
+}
+
+/**
+ * Populates a lazy page with a zeroed frame
+ * @param pageEntry the page table entry
+ * @return true if the page is present afterwards
+ */
+static bool memmgr_populate_page(uint64_t* pageEntry) {
+    if(*pageEntry & PAGE_PRESENT) {
+        return true;
+    }
+
+    if(!(*pageEntry & MEMMGR_PAGE_FLAG_LAZY)) {
+        return false;
+    }
+
+    uintptr_t frame = kalloc_zeroed_frame_flags(KALLOC_RECLAIM);
+
+    if(frame == 0) {
+        return false;
+    }
+
+
+    *pageEntry = frame | (*pageEntry & ~(PAGE_MASK) & ~(MEMMGR_PAGE_FLAG_LAZY)) | PAGE_PRESENT;
+
+    return true;
+}
+
+/**
+ * Drops a user page from the TLB after its entry changed
+ * Other address spaces drop their stale entries on their next load
+ */
+static void memmgr_invalidate_user(mm_struct_t* mm, uintptr_t virtualAddr) {
+    if(mm->page_directory == loaded_page_map[get_current_core()]) {
+        memmgr_reload(virtualAddr);
+    } else if(pcid_enabled && mm->asid != 0) {
+        asid_generation[mm->asid] = UINT64_MAX;
+    }
+}
+
+/**
+ * Finds the next page table entry of a 4 KiB user page in an address space, missing tables and huge pages are skipped
+ * @param addr the address to start at, set to the address of the returned entry
+ * @return the entry, it might not be present, or NULL once USER_SPACE_END is reached
+ */
+static uint64_t* memmgr_next_user_entry(uint64_t* pageMap, uintptr_t* addr) {
+    while(*addr < USER_SPACE_END) {
+        if(!(pageMap[PML4_INDEX(*addr)] & PAGE_PRESENT)) {
+            *addr = (*addr + (1ull << 39)) & ~((1ull << 39) - 1);
+            continue;
+        }
+
+        uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMap[PML4_INDEX(*addr)] & PAGE_MASK);
+        uint64_t pdpEntry = pageDirectoryPointer[PDP_INDEX(*addr)];
+
+        if(!(pdpEntry & PAGE_PRESENT) || (pdpEntry & PAGE_LARGE)) {
+            *addr = (*addr + (1ull << 30)) & ~((1ull << 30) - 1);
+            continue;
+        }
+
+        uint64_t* pageDirectory = memmgr_get_from_physical(pdpEntry & PAGE_MASK);
+        uint64_t pdEntry = pageDirectory[PD_INDEX(*addr)];
+
+        if(!(pdEntry & PAGE_PRESENT) || (pdEntry & PAGE_LARGE)) {
+            *addr = (*addr + HUGE_PAGE_SIZE) & ~(HUGE_PAGE_SIZE - 1);
+            continue;
+        }
+
+        return (uint64_t*) memmgr_get_from_physical(pdEntry & PAGE_MASK) + PT_INDEX(*addr);
+    }
+
+    return NULL;
+}
+
+/**
+ * Reads a swapped out page back into a new frame
+ * @param pageEntry the page table entry
+ * @return true if the page is present afterwards
+ */
+static bool memmgr_swap_in(uint64_t* pageEntry) {
+    uint64_t entry = *pageEntry;
+
+    if(entry & PAGE_PRESENT) {
+        return true;
+    }
+
+    uint64_t slot = (entry & SWAP_SLOT_MASK) >> 12;
+    uintptr_t frame = kalloc_frame();
+
+    if(frame == 0) {
+        return false;
+    }
+
+    if(!swap_read_slot(slot, memmgr_get_from_physical(frame))) {
+        kfree_frame(frame);
+        return false;
+    }
+
+    *pageEntry = frame | (entry & ~(SWAP_SLOT_MASK) & ~(MEMMGR_PAGE_FLAG_SWAP)) | PAGE_PRESENT;
+    swap_free_slot(slot);
+
+    return true;
+}
+
+/**
+ * Writes a user page to swap and frees its frame
+ * Interrupts stay disabled until the entry is replaced, the polled disk transfer needs none
+ * and nothing can touch the page while it is written
+ * @return true if the frame was freed
+ */
+static bool memmgr_swap_out_page(mm_struct_t* mm, uint64_t* pageEntry, uintptr_t virtualAddr) {
+    uint64_t rflags = cli();
+    uint64_t entry = *pageEntry;
+    uintptr_t frame = entry & SWAP_SLOT_MASK;
+
+    //Shared frames would need every mapping changed, frames without a count aren't allocated by us
+    if(!(entry & PAGE_PRESENT) || memmgr_frame_refcount(frame) != 1) {
+        sti(rflags);
+        return false;
+    }
+
+    uint64_t slot = swap_alloc_slot();
+
+    if(slot == 0 || !swap_write_slot(slot, memmgr_get_from_physical(frame))) {
+        sti(rflags);
+
+        swap_free_slot(slot);
+        return false;
+    }
+
+    *pageEntry = (slot << 12) | (entry & ~(SWAP_SLOT_MASK) & ~((uint64_t) (PAGE_PRESENT | PAGE_ACCESSED | PAGE_DIRTY))) | MEMMGR_PAGE_FLAG_SWAP;
+
+    memmgr_invalidate_user(mm, virtualAddr);
+
+    sti(rflags);
+
+    kfree_frame(frame);
+
+    return true;
+}
+
+/**
+ * Advances the swap clock through one address space
+ * Accessed pages get a second chance, their accessed bit is cleared and they are skipped
+ * @param budget the remaining page table entries to look at
+ * @return the address to continue at, USER_SPACE_END once the address space is done
+ */
+static uintptr_t memmgr_swap_scan(mm_struct_t* mm, uintptr_t addr, size_t* budget, size_t* freed, size_t count) {
+    uint64_t* pageMap = memmgr_get_from_physical(mm->page_directory);
+
+    while(*budget > 0 && *freed < count) {
+        //Huge pages stay resident, they would have to be split first
+        uint64_t* pageEntry = memmgr_next_user_entry(pageMap, &addr);
+
+        if(pageEntry == NULL) {
+            break;
+        }
+
+        (*budget)--;
+
+        if((*pageEntry & PAGE_PRESENT) && (*pageEntry & PAGE_USER)) {
+            if(*pageEntry & PAGE_ACCESSED) {
+                __atomic_and_fetch(pageEntry, ~((uint64_t) (PAGE_ACCESSED)), __ATOMIC_RELAXED);
+            } else if(memmgr_swap_out_page(mm, pageEntry, addr)) {
+                (*freed)++;
+            }
+        }
+
+        addr += PAGE_SIZE;
+    }
+
+    return addr;
+}
+
+size_t memmgr_swap_out(size_t count) {
+    if(!swap_enabled() || !spin_trylock(&SWAP_SCAN_LOCK)) {
+        return 0;
+    }
+
+    size_t freed = 0;
+    size_t budget = count * SWAP_SCAN_RATIO;
+    bool wrapped = false;
+
+    while(freed < count && budget > 0) {
+        int pid = 0;
+        mm_struct_t* mm = process_next_mm(swap_scan_pid, &pid);
+
+        if(mm == NULL && pid != 0) {
+            //Address space is busy, skip it
+            swap_scan_pid = pid;
+            swap_scan_addr = 0;
+            continue;
+        }
+
+        if(mm == NULL) {
+            //End of the process list, start over once
+            if(swap_scan_pid == 0 || wrapped) {
+                break;
+            }
+
+            swap_scan_pid = 0;
+            swap_scan_addr = 0;
+            wrapped = true;
+            continue;
+        }
+
+        //The address space is locked, it can't go away during the scan
+        if(mm->page_directory != (uintptr_t) PAGE_MAP) {
+            swap_scan_addr = memmgr_swap_scan(mm, swap_scan_addr, &budget, &freed, count);
+        } else {
+            swap_scan_addr = USER_SPACE_END;
+        }
+
+        spin_unlock(&mm->lock);
+
+        if(swap_scan_addr >= USER_SPACE_END) {
+            //Continue with the next process
+            swap_scan_pid = pid;
+            swap_scan_addr = 0;
+        } else {
+            //Budget or goal reached, continue in this process next time
+            swap_scan_pid = pid - 1;
+        }
+    }
+
+    spin_unlock(&SWAP_SCAN_LOCK);
+
+    return freed;
+}
+
+static uint64_t memmgr_merge_hash(uintptr_t frame) {
+    uint64_t* words = memmgr_get_from_physical(frame);
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for(int i = 0; i < 512; i++) {
+        hash = (hash ^ words[i]) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+static bool memmgr_frames_equal(uintptr_t a, uintptr_t b) {
+    uint64_t* wordsA = memmgr_get_from_physical(a);
+    uint64_t* wordsB = memmgr_get_from_physical(b);
+
+    for(int i = 0; i < 512; i++) {
+        if(wordsA[i] != wordsB[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Write protects a page, so its content can be compared and shared
+ * A write to it afterwards goes through memmgr_break_cow, which takes the frame back if it is not shared
+ */
+static void memmgr_merge_protect(mm_struct_t* mm, uint64_t* pageEntry, uintptr_t virtualAddr) {
+    uint64_t entry = *pageEntry;
+
+    if(entry & PAGE_WRITABLE) {
+        *pageEntry = (entry & ~((uint64_t) (PAGE_WRITABLE))) | MEMMGR_PAGE_FLAG_COW;
+        memmgr_invalidate_user(mm, virtualAddr);
+    }
+}
+
+/**
+ * Replaces the frame of a page with a merged frame holding the same content
+ * @return true if the page now maps the merged frame
+ */
+static bool memmgr_merge_into(mm_struct_t* mm, uint64_t* pageEntry, uintptr_t virtualAddr, uintptr_t merged) {
+    memmgr_merge_protect(mm, pageEntry, virtualAddr);
+
+    uint64_t entry = *pageEntry;
+    uintptr_t frame = entry & SWAP_SLOT_MASK;
+
+    //The content might have changed before the page was write protected
+    if(!memmgr_frames_equal(frame, merged)) {
+        return false;
+    }
+
+    memmgr_frame_ref(merged);
+    *pageEntry = merged | (entry & ~(SWAP_SLOT_MASK));
+    memmgr_invalidate_user(mm, virtualAddr);
+
+    kfree_frame(frame);
+
+    return true;
+}
+
+/**
+ * Returns the entry of a private, unchanged user page or NULL
+ */
+static uint64_t* memmgr_merge_candidate(uint64_t* pageMap, uintptr_t virtualAddr, uintptr_t frame) {
+    uintptr_t addr = virtualAddr;
+    uint64_t* pageEntry = memmgr_next_user_entry(pageMap, &addr);
+
+    if(pageEntry == NULL || addr != virtualAddr) {
+        return NULL;
+    }
+
+    uint64_t entry = *pageEntry;
+
+    if(!(entry & PAGE_PRESENT) || !(entry & PAGE_USER) || (entry & PAGE_DIRTY) || (entry & SWAP_SLOT_MASK) != frame
+       || memmgr_frame_refcount(frame) != 1) {
+        return NULL;
+    }
+
+    return pageEntry;
+}
+
+/**
+ * Merges a page seen earlier with the page being scanned
+ * Both are write protected before they are compared, the earlier frame becomes the merged frame
+ * @return true if both pages share a frame afterwards
+ */
+static bool memmgr_merge_unstable(mm_struct_t* mm, int pid, uint64_t* pageEntry, uintptr_t virtualAddr, struct merge_node* node) {
+    mm_struct_t* other = mm;
+
+    if(node->pid != pid) {
+        int otherPid = 0;
+        other = process_next_mm(node->pid - 1, &otherPid);
+
+        if(other != NULL && otherPid != node->pid) {
+            spin_unlock(&other->lock);
+            return false;
+        }
+
+        if(other == NULL) {
+            return false;
+        }
+    }
+
+    bool merged = false;
+    uint64_t* otherEntry = memmgr_merge_candidate(memmgr_get_from_physical(other->page_directory), node->addr, node->frame);
+
+    if(otherEntry != NULL) {
+        memmgr_merge_protect(other, otherEntry, node->addr);
+
+        //The stable node holds a reference of its own
+        memmgr_frame_ref(node->frame);
+        merged = memmgr_merge_into(mm, pageEntry, virtualAddr, node->frame);
+
+        if(!merged) {
+            kfree_frame(node->frame);
+        }
+    }
+
+    if(other != mm) {
+        spin_unlock(&other->lock);
+    }
+
+    return merged;
+}
+
+/**
+ * Looks for an identical page for the given one and shares the frame if one is found
+ * Pages written since the last pass are left alone, they would likely be copied again soon
+ */
+static void memmgr_merge_page(mm_struct_t* mm, int pid, uint64_t* pageEntry, uintptr_t virtualAddr) {
+    uint64_t entry = *pageEntry;
+    uintptr_t frame = entry & SWAP_SLOT_MASK;
+
+    //Shared frames are either merged already or shared by fork, frames without a count aren't allocated by us
+    if(!(entry & PAGE_PRESENT) || !(entry & PAGE_USER) || memmgr_frame_refcount(frame) != 1) {
+        return;
+    }
+
+    if(entry & PAGE_DIRTY) {
+        __atomic_and_fetch(pageEntry, ~((uint64_t) (PAGE_DIRTY)), __ATOMIC_RELAXED);
+        memmgr_invalidate_user(mm, virtualAddr);
+        return;
+    }
+
+    uint64_t hash = memmgr_merge_hash(frame);
+    struct merge_node** bucket = &merge_stable[hash % MERGE_HASH_BUCKETS];
+
+    for(struct merge_node* node = *bucket; node != NULL; node = node->next) {
+        if(node->hash == hash && memmgr_frames_equal(node->frame, frame)) {
+            memmgr_merge_into(mm, pageEntry, virtualAddr, node->frame);
+            return;
+        }
+    }
+
+    for(struct merge_node** current = &merge_unstable[hash % MERGE_HASH_BUCKETS]; *current != NULL; current = &(*current)->next) {
+        struct merge_node* node = *current;
+
+        if(node->hash != hash || (node->pid == pid && node->addr == virtualAddr)) {
+            continue;
+        }
+
+        if(memmgr_merge_unstable(mm, pid, pageEntry, virtualAddr, node)) {
+            //The node becomes stable
+            *current = node->next;
+            node->next = *bucket;
+            *bucket = node;
+        }
+
+        return;
+    }
+
+    struct merge_node* node = kmalloc(sizeof(struct merge_node));
+
+    if(node == NULL) {
+        return;
+    }
+
+    node->hash = hash;
+    node->frame = frame;
+    node->pid = pid;
+    node->addr = virtualAddr;
+    node->next = merge_unstable[hash % MERGE_HASH_BUCKETS];
+    merge_unstable[hash % MERGE_HASH_BUCKETS] = node;
+}
+
+/**
+ * Drops merged frames nobody maps anymore
+ * MERGE_LOCK must be held!
+ * @return the amount of frames freed
+ */
+static size_t memmgr_merge_prune(size_t count) {
+    size_t freed = 0;
+
+    for(int i = 0; i < MERGE_HASH_BUCKETS && freed < count; i++) {
+        struct merge_node** current = &merge_stable[i];
+
+        while(*current != NULL && freed < count) {
+            struct merge_node* node = *current;
+
+            if(memmgr_frame_refcount(node->frame) > 1) {
+                current = &node->next;
+                continue;
+            }
+
+            *current = node->next;
+            kfree_frame(node->frame);
+            kfree(node);
+            freed++;
+        }
+    }
+
+    return freed;
+}
+
+//A full pass is done, pages seen in it have to be seen again to be merged
+static void memmgr_merge_end_pass() {
+    for(int i = 0; i < MERGE_HASH_BUCKETS; i++) {
+        while(merge_unstable[i] != NULL) {
+            struct merge_node* node = merge_unstable[i];
+            merge_unstable[i] = node->next;
+            kfree(node);
+        }
+    }
+
+    memmgr_merge_prune(SIZE_MAX);
+    merge_full_scans++;
+}
+
+static uintptr_t memmgr_merge_scan_mm(mm_struct_t* mm, int pid, uintptr_t addr, size_t* budget) {
+    uint64_t* pageMap = memmgr_get_from_physical(mm->page_directory);
+
+    while(*budget > 0) {
+        uint64_t* pageEntry = memmgr_next_user_entry(pageMap, &addr);
+
+        if(pageEntry == NULL) {
+            break;
+        }
+
+        (*budget)--;
+        merge_pages_scanned++;
+
+        //Page faults don't take the address space lock, so nothing may run while the entry is replaced
+        uint64_t rflags = cli();
+        memmgr_merge_page(mm, pid, pageEntry, addr);
+        sti(rflags);
+
+        addr += PAGE_SIZE;
+    }
+
+    return addr;
+}
+
+bool memmgr_merge_scan() {
+    if(get_counter() < merge_next_scan || !spin_trylock(&MERGE_LOCK)) {
+        return false;
+    }
+
+    merge_next_scan = get_counter() + MERGE_SCAN_INTERVAL;
+    size_t budget = MERGE_SCAN_PAGES;
+
+    while(budget > 0) {
+        int pid = 0;
+        mm_struct_t* mm = process_next_mm(merge_scan_pid, &pid);
+
+        if(mm == NULL && pid != 0) {
+            //Address space is busy, skip it
+            merge_scan_pid = pid;
+            merge_scan_addr = 0;
+            continue;
+        }
+
+        if(mm == NULL) {
+            if(merge_scan_pid != 0) {
+                memmgr_merge_end_pass();
+            }
+
+            merge_scan_pid = 0;
+            merge_scan_addr = 0;
+            break;
+        }
+
+        if(mm->page_directory != (uintptr_t) PAGE_MAP) {
+            merge_scan_addr = memmgr_merge_scan_mm(mm, pid, merge_scan_addr, &budget);
+        } else {
+            merge_scan_addr = USER_SPACE_END;
+        }
+
+        spin_unlock(&mm->lock);
+
+        if(merge_scan_addr >= USER_SPACE_END) {
+            merge_scan_pid = pid;
+            merge_scan_addr = 0;
+        } else {
+            merge_scan_pid = pid - 1;
+        }
+    }
+
+    spin_unlock(&MERGE_LOCK);
+
+    return true;
+}
+
+void memmgr_merge_get_stats(merge_stats_t* stats) {
+    stats->pages_shared = 0;
+    stats->pages_sharing = 0;
+
+    uint64_t rflags = cli();
+    spin_lock(&MERGE_LOCK);
+
+    for(int i = 0; i < MERGE_HASH_BUCKETS; i++) {
+        for(struct merge_node* node = merge_stable[i]; node != NULL; node = node->next) {
+            //One reference belongs to the stable node
+            uint16_t mappings = memmgr_frame_refcount(node->frame) - 1;
+
+            if(mappings > 0) {
+                stats->pages_shared++;
+                stats->pages_sharing += mappings - 1;
+            }
+        }
+    }
+
+    stats->pages_scanned = merge_pages_scanned;
+    stats->full_scans = merge_full_scans;
+
+    spin_unlock(&MERGE_LOCK);
+    sti(rflags);
+}
+
+static size_t memmgr_merge_shrinker_count(shrinker_t* shrinker) {
+    size_t count = 0;
+
+    if(!spin_trylock(&MERGE_LOCK)) {
+        return 0;
+    }
+
+    for(int i = 0; i < MERGE_HASH_BUCKETS; i++) {
+        for(struct merge_node* node = merge_stable[i]; node != NULL; node = node->next) {
+            if(memmgr_frame_refcount(node->frame) <= 1) {
+                count++;
+            }
+        }
+    }
+
+    spin_unlock(&MERGE_LOCK);
+
+    return count;
+}
+
+static size_t memmgr_merge_shrinker_scan(shrinker_t* shrinker, size_t count) {
+    if(!spin_trylock(&MERGE_LOCK)) {
+        return 0;
+    }
+
+    size_t freed = memmgr_merge_prune(count);
+
+    spin_unlock(&MERGE_LOCK);
+
+    return freed;
+}
+
+/**
+ * Returns the page directory entry if a 2 MiB page maps the given address
+ * @param virtualAddr the virtual address
+ * @return pointer to the entry or NULL if the address isn't mapped by a 2 MiB page
+ */
+static uint64_t* memmgr_get_huge_entry(uintptr_t virtualAddr) {
+    uint64_t* pageDirectoryEntry = memmgr_walk_page_map(virtualAddr, 0, false, 2);
+
+    if(pageDirectoryEntry == NULL || !(*pageDirectoryEntry & PAGE_PRESENT) || !(*pageDirectoryEntry & PAGE_LARGE)) {
+        return NULL;
+    }
+
+    return pageDirectoryEntry;
+}
+
+/**
+ * Maps a zeroed 2 MiB page backed by contiguous frames
+ * @param virtualAddr the virtual address, must be 2 MiB aligned
+ * @param count the amount of 4 KiB pages left to map starting at virtualAddr
+ * @param flags the flags for the page
+ * @return false if the range is unsuitable or no contiguous frames are available, the caller maps 4 KiB pages then
+ */
+static bool memmgr_create_huge_page(uintptr_t virtualAddr, size_t count, int flags) {
+    if((virtualAddr & (HUGE_PAGE_SIZE - 1)) != 0 || count < HUGE_PAGE_SIZE / 0x1000) {
+        return false;
+    }
+
+    uint64_t* pageDirectoryEntry = memmgr_walk_page_map(virtualAddr, flags & PAGE_USER, true, 2);
+
+    if(pageDirectoryEntry == NULL || *pageDirectoryEntry != 0) {
+        return false;
+    }
+
+    uintptr_t frame = kalloc_frames(HUGE_PAGE_ORDER);
+
+    if(frame == 0) {
+        return false;
+    }
+
+    memset(memmgr_get_from_physical(frame), 0, HUGE_PAGE_SIZE);
+
+    *pageDirectoryEntry = frame | PAGE_PRESENT | PAGE_WRITABLE | PAGE_LARGE | flags;
+    __atomic_add_fetch(&huge_pages_mapped, 1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+/**
+ * Unmaps a 2 MiB page and frees its frames
+ * @param pageDirectoryEntry the page directory entry
+ * @param virtualAddr an address inside of the page
+ */
+static void memmgr_free_huge_page(uint64_t* pageDirectoryEntry, uintptr_t virtualAddr) {
+    kfree_frames(*pageDirectoryEntry & HUGE_PAGE_MASK, HUGE_PAGE_ORDER);
+
+    *pageDirectoryEntry = 0;
+    memmgr_reload(virtualAddr);
+
+    __atomic_sub_fetch(&huge_pages_mapped, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Replaces a 2 MiB page with a page table mapping the same frames, used when only a part of it changes
+ * @param pageDirectoryEntry the page directory entry
+ * @param virtualAddr an address inside of the page
+ * @return false if no frame for the page table is available
+ */
+static bool memmgr_split_huge_page(uint64_t* pageDirectoryEntry, uintptr_t virtualAddr) {
+    uintptr_t table = kalloc_frame();
+
+    if(table == 0) {
+        return false;
+    }
+
+    uintptr_t frame = *pageDirectoryEntry & HUGE_PAGE_MASK;
+    //Bit 7 is PAT in a page table entry
+    uint64_t flags = *pageDirectoryEntry & 0xFFF & ~((uint64_t) (PAGE_LARGE));
+
+    uint64_t* pageTable = memmgr_get_from_physical(table);
+
+    for(int i = 0; i < 512; i++) {
+        pageTable[i] = (frame + i * 0x1000) | flags;
+
+        //Every frame is freed on its own from now on
+        frame_refcount[ADDRESS_TO_PAGE(frame) + i] = 1;
+    }
+
+    *pageDirectoryEntry = table | PAGE_PRESENT | PAGE_WRITABLE | (flags & PAGE_USER);
+    memmgr_reload(virtualAddr);
+
+    __atomic_sub_fetch(&huge_pages_mapped, 1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+/**
+ * Returns the amount of memory mapped by 2 MiB pages outside of the identity map
+ */
+uint64_t memmgr_huge_mapped() {
+    return __atomic_load_n(&huge_pages_mapped, __ATOMIC_RELAXED) * HUGE_PAGE_SIZE;
+}
+
+void memmgr_delete_page(uintptr_t virtualAddr) {
+    uint64_t INDEX_PML4 = PML4_INDEX(virtualAddr);
+    uint64_t INDEX_PDP = PDP_INDEX(virtualAddr);
+    uint64_t INDEX_PD = PD_INDEX(virtualAddr);
+    uint64_t INDEX_PT = PT_INDEX(virtualAddr);
+
+    uint64_t* pageMap = memmgr_get_from_physical((uintptr_t)memmgr_get_current_pml4());
+    uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMap[INDEX_PML4] & PAGE_MASK);
+
+    if(pageDirectoryPointer == 0 || (uintptr_t)pageMap[INDEX_PML4] & PAGE_LARGE) {
+        return;
+    }
+
+    uint64_t* pageDirectory = memmgr_get_from_physical(pageDirectoryPointer[INDEX_PDP] & PAGE_MASK);
+
+    if(pageDirectory == 0 ||(uintptr_t) pageDirectoryPointer[INDEX_PDP] & PAGE_LARGE) {
+        return;
+    }
+
+    uint64_t* pageTable = memmgr_get_from_physical(pageDirectory[INDEX_PD] & PAGE_MASK);
+
+    if(pageTable == 0 || (uintptr_t)pageDirectory[INDEX_PD] & PAGE_LARGE) {
+        return;
+    }
+
+    uintptr_t frame = pageTable[INDEX_PT];
+
+    if(frame & PAGE_PRESENT) {
+        kfree_frame(frame & PAGE_MASK);
+    } else if(frame & MEMMGR_PAGE_FLAG_SWAP) {
+        swap_free_slot((frame & SWAP_SLOT_MASK) >> 12);
+    }
+
+    pageTable[INDEX_PT] = 0;
+}
+
+void memmgr_map_frame_to_virtual(uintptr_t frame_addr, uintptr_t virtual_addr, uintptr_t flags) {
+    uint64_t INDEX_PML4 = PML4_INDEX(virtual_addr);
+    uint64_t INDEX_PDP = PDP_INDEX(virtual_addr);
+    uint64_t INDEX_PD = PD_INDEX(virtual_addr);
+    uint64_t INDEX_PT = PT_INDEX(virtual_addr);
+
+    uint64_t* pageMap = memmgr_get_from_physical((uintptr_t)memmgr_get_current_pml4());
+    uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMap[INDEX_PML4] & PAGE_MASK);
+
+    int pageFlags = flags;
+    //Clear bits that might be different for other page levels
+    //TODO: Find a way to set flags for all levels equally
+    flags &= 0x3f;
+
+    if(pageMap[INDEX_PML4] == 0) {
+        uintptr_t pdp_frame = kalloc_zeroed_frame();
+
+        if(pdp_frame == UINT64_MAX) {
+            //PANIC
+        }
+
+        pageMap[INDEX_PML4] = pdp_frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+
+        pageDirectoryPointer = (uint64_t*)(pdp_frame | KERNEL_MEMORY);
+    }
+
+    uint64_t* pageDirectory = memmgr_get_from_physical(pageDirectoryPointer[INDEX_PDP] & PAGE_MASK);
+
+    if(pageDirectoryPointer[INDEX_PDP] == 0) {
+        uintptr_t pd_frame = kalloc_zeroed_frame();
+        pageDirectoryPointer[INDEX_PDP] = pd_frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+
+        pageDirectory = (uint64_t*)(pd_frame | KERNEL_MEMORY);
+    }
+
+    uint64_t* pageTable = memmgr_get_from_physical(pageDirectory[INDEX_PD] & PAGE_MASK);
+
+    if(pageDirectory[INDEX_PD] == 0) {
+        uintptr_t pt_frame = kalloc_zeroed_frame();
+        pageDirectory[INDEX_PD] = pt_frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+
+        //printf("Creating page table at 0x%x with index 0x%x in PD 0x%x\n", pt_frame, INDEX_PD, pageDirectory);
+
+        pageTable = (uint64_t*)(pt_frame | KERNEL_MEMORY);
+    }
+
+    pageTable[INDEX_PT] = frame_addr | PAGE_PRESENT | PAGE_WRITABLE | pageFlags;
+}
+
+/***
+ * Invalides the tlb at address
+ * @param addr the address
+ */
+void memmgr_reload(uintptr_t addr) {
+    asm volatile (
+            "invlpg (%0)"
+            : : "r"(addr));
+
+    //invlpg only reaches the current identifier, the others drop the shared kernel half on their next load
+    if(pcid_enabled && addr >= KERNEL_ENTRY_HALF) {
+        uint64_t generation = __atomic_add_fetch(&kernel_tlb_generation, 1, __ATOMIC_ACQ_REL);
+
+        if(get_current_core() == 0) {
+            asid_generation[loaded_asid[0]] = generation;
+        }
+    }
+}
+
+void* memmgr_map_mmio(uintptr_t addr, size_t len, int flags, bool is_kernel) {
+    if(addr != 0 && (((uintptr_t)addr % PAGE_SIZE) != 0)) {
+        addr = (uintptr_t)((uintptr_t)addr + PAGE_SIZE) & ~(PAGE_SIZE - 1);
+    }
+
+    //Map as NO_CACHE because Memory-Mapped I/O has to be always fetched new.
+    if(!is_kernel) flags |= PAGE_USER;
+
+    uintptr_t start_addr = MMIO_MEMORY + addr;
+
+    size_t count = len / 4096;
+    if(len % 4096 != 0) {
+        count++;
+    }
+
+    for(size_t i = 0; i < count+1; i++) {
+        memmgr_map_frame_to_virtual(addr + 0x1000 * i, start_addr + 0x1000 * i, flags);
+    }
+
+    return (void*)start_addr;
+}
+
+bool memmgr_change_flags(uintptr_t virt, int flags) {
+    uint64_t INDEX_PML4 = PML4_INDEX(virt);
+    uint64_t INDEX_PDP = PDP_INDEX(virt);
+    uint64_t INDEX_PD = PD_INDEX(virt);
+    uint64_t INDEX_PT = PT_INDEX(virt);
+
+    uint64_t* pagePtr = null;
+
+    uint64_t* pageMap = memmgr_get_from_physical((uintptr_t)memmgr_get_current_pml4());
+    uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMap[INDEX_PML4] & PAGE_MASK);
+
+    if(pageDirectoryPointer == 0) {
+        return false;
+    }
+
+    if((uintptr_t)pageMap[INDEX_PML4] & PAGE_LARGE) {
+        pagePtr = (uint64_t *) pageMap[INDEX_PML4];
+        goto _done;
+    }
+
+    uint64_t* pageDirectory = memmgr_get_from_physical(pageDirectoryPointer[INDEX_PDP] & PAGE_MASK);
+
+    if(pageDirectory == 0) {
+        return false;
+    }
+
+    if((uintptr_t) pageDirectoryPointer[INDEX_PDP] & PAGE_LARGE) {
+        pagePtr = (uint64_t *) pageDirectoryPointer[INDEX_PDP];
+        goto _done;
+    }
+
+    uint64_t* pageTable = memmgr_get_from_physical(pageDirectory[INDEX_PD] & PAGE_MASK);
+
+    if(pageTable == 0) {
+        return false;
+    }
+
+    if((uintptr_t)pageDirectory[INDEX_PD] & PAGE_LARGE) {
+        pagePtr = (uint64_t *) pageDirectoryPointer[INDEX_PDP];
+        goto _done;
+    }
+
+    pagePtr = (uint64_t *) pageTable[INDEX_PT];
+
+_done:
+    *pagePtr |= flags;
+
+    return true;
+}
+
+uint8_t memmgr_get_page_level(uintptr_t virt) {
+    uint64_t INDEX_PML4 = PML4_INDEX(virt);
+    uint64_t INDEX_PDP = PDP_INDEX(virt);
+    uint64_t INDEX_PD = PD_INDEX(virt);
+    uint64_t INDEX_PT = PT_INDEX(virt);
+
+    uint64_t* pagePtr = null;
+
+    uint64_t* pageMap = memmgr_get_from_physical((uintptr_t)memmgr_get_current_pml4());
+    uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMap[INDEX_PML4] & PAGE_MASK);
+
+    if(pageDirectoryPointer == 0) {
+        return -1;
+    }
+
+    if((uintptr_t)pageMap[INDEX_PML4] & PAGE_LARGE) {
+        return 3;
+    }
+
+    uint64_t* pageDirectory = memmgr_get_from_physical(pageDirectoryPointer[INDEX_PDP] & PAGE_MASK);
+
+    if(pageDirectory == 0) {
+        return -1;
+    }
+
+    if((uintptr_t) pageDirectoryPointer[INDEX_PDP] & PAGE_LARGE) {
+        return 2;
+    }
+
+    uint64_t* pageTable = memmgr_get_from_physical(pageDirectory[INDEX_PD] & PAGE_MASK);
+
+    if(pageTable == 0) {
+        return -1;
+    }
+
+    if((uintptr_t)pageDirectory[INDEX_PD] & PAGE_LARGE) {
+        return 1;
+    }
+
+    return 0;
+}
+
+bool memmgr_change_flags_bulk(uintptr_t virt, int size, int flags) {
+    uintptr_t start_addr = virt;
+
+    for(size_t i = 0; i < size;) {
+        uintptr_t page_level = memmgr_get_page_level(virt);
+
+        if(!memmgr_change_flags(start_addr + i, flags)) {
+            return false;
+        }
+
+        switch(page_level) {
+            case 3:
+                i += 0x8000000000;
+                break;
+            case 2:
+                i += 0x40000000;
+                break;
+            case 1:
+                i += 0x200000;
+                break;
+            case 0:
+                i += 0x1000;
+                break;
+            default:
+                break;
+        }
+
+        memmgr_reload(start_addr + i);
+    }
+
+    return true;
+}
+
+/**
+ * Allocates a new memory region, searching for a free place if addr is null or on the address
+ * @param addr the desired address
+ * @param len the length of the memory region
+ * @param is_kernel if is_kernel is set, the length of the map is increased
+ */
+/**************************VIRTUAL MEMORY REGIONS*****************************/
+
+static int memmgr_vma_compare(void* a, void* b) {
+    vma_t* first = a;
+    vma_t* second = b;
+
+    if(first->start < second->start) return -1;
+    if(first->start > second->start) return 1;
+    return 0;
+}
+
+/**
+ * Keeps the span and the largest gap between regions of each subtree up to date
+ */
+static void memmgr_vma_update(avl_tree_node_t* node) {
+    vma_t* vma = node->value;
 
-        if(level <= 2) {
-            uintptr_t pd_frame = kalloc_frame();
-            pageDirectoryPointer[INDEX_PDP] = pd_frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+    vma->subtree_start = vma->start;
+    vma->subtree_end = vma->end;
+    vma->subtree_gap = 0;
 
-            pageDirectory = (uint64_t*)(pd_frame | KERNEL_MEMORY);
-            memset(pageDirectory, 0, 0x1000);
-        } else {
-            pageDirectoryPointer[INDEX_PDP] = frame | flags;
+    if(node->left) {
+        vma_t* left = node->left->value;
 
-            pageDirectory = (uint64_t*)(frame | KERNEL_MEMORY);
-            memset(pageDirectory, 0, 0x1000);
+        vma->subtree_start = left->subtree_start;
+        vma->subtree_gap = left->subtree_gap;
 
-            return (void *) (pageDirectoryPointer[INDEX_PDP] & PAGE_MASK);
+        if(vma->start - left->subtree_end > vma->subtree_gap) {
+            vma->subtree_gap = vma->start - left->subtree_end;
         }
     }
 
-    if(pageDirectoryPointer[INDEX_PDP] & PAGE_LARGE) {
-        //Skip large page
-        return 0;
-    }
+    if(node->right) {
+        vma_t* right = node->right->value;
 
-    uint64_t* pageTable = memmgr_get_from_physical(pageDirectory[INDEX_PD] & PAGE_MASK);
+        vma->subtree_end = right->subtree_end;
 
-    //If PT doesnt exist, either return or try to create
-    if(pageDirectory[INDEX_PD] == 0) {
-        if(!create) return NULL;
+        if(right->subtree_gap > vma->subtree_gap) {
+            vma->subtree_gap = right->subtree_gap;
+        }
 
-        if(level <= 1) {
-            uintptr_t pt_frame = kalloc_frame();
-            pageDirectory[INDEX_PD] = pt_frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+        if(right->subtree_start - vma->end > vma->subtree_gap) {
+            vma->subtree_gap = right->subtree_start - vma->end;
+        }
+    }
+}
 
-#ifdef DEBUG
-            printf("Creating page table at 0x%x with index 0x%x in PD 0x%x\n", pt_frame, INDEX_PD, pageDirectory);
-#endif
+/**
+ * Propagates a changed start or end of a region up to the root
+ */
+static void memmgr_vma_propagate(vma_t* vma) {
+    for(avl_tree_node_t* node = vma->node; node != NULL; node = node->parent) {
+        memmgr_vma_update(node);
+    }
+}
 
-            pageTable = (uint64_t*)(pt_frame | KERNEL_MEMORY);
-            memset(pageTable, 0, 0x1000);
-        } else {
-            pageDirectory[INDEX_PD] = frame | flags;
+static vma_t* memmgr_vma_find_overlap(mm_struct_t* mm, uintptr_t start, uintptr_t end) {
+    if(mm->vmas == NULL) {
+        return NULL;
+    }
 
-#ifdef DEBUG
-            printf("Creating page table at 0x%x with index 0x%x in PD 0x%x\n", pt_frame, INDEX_PD, pageDirectory);
-#endif
+    avl_tree_node_t* node = mm->vmas->root;
 
-            pageTable = (uint64_t*)(frame | KERNEL_MEMORY);
-            memset(pageTable, 0, 0x1000);
+    while(node != NULL) {
+        vma_t* vma = node->value;
 
-            return (void *) (pageDirectory[INDEX_PD] & PAGE_MASK);
+        if(end <= vma->start) {
+            node = node->left;
+        } else if(start >= vma->end) {
+            node = node->right;
+        } else {
+            return vma;
         }
     }
 
-    if(pageDirectory[INDEX_PD] & PAGE_LARGE) {
-        //Skip large page
-        return 0;
+    return NULL;
+}
+
+static vma_t* memmgr_vma_add(mm_struct_t* mm, uintptr_t start, uintptr_t end, int prot, int flags) {
+    if(mm->vmas == NULL) {
+        mm->vmas = avl_tree_create(memmgr_vma_compare, memmgr_vma_update);
     }
 
-    //If page doesnt exist, either return or try to create
-    if(pageTable[INDEX_PT] == 0) {
-        if(!create) return NULL;
-#ifdef DEBUG
-        printf("Creating new page\n");
-#endif
-        pageTable[INDEX_PT] = frame | flags;
+    vma_t* vma = calloc(1, sizeof(vma_t));
+
+    if(vma == NULL) {
+        return NULL;
     }
 
-    //Return address of new page
-    return (void *) (pageTable[INDEX_PT] & PAGE_MASK);
-}
+    vma->start = start;
+    vma->end = end;
+    vma->prot = prot;
+    vma->flags = flags;
+    vma->node = avl_tree_insert(mm->vmas, vma);
 
-void* get_free_page(size_t len, bool is_kernel) {
-    uint64_t* pageMap = memmgr_get_from_physical((uintptr_t)memmgr_get_current_pml4());
-    uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMap[is_kernel ? 510 : 0] & PAGE_MASK);
+    return vma;
+}
 
-    //printf("Page map loc: 0x%x\n", pageMap);
-    //printf("Page directory pointer: 0x%x\n", pageDirectoryPointer);
+/**
+ * Splits a region at the given address
+ * @return the upper part or NULL without memory, the region is unchanged then
+ */
+static vma_t* memmgr_vma_split(mm_struct_t* mm, vma_t* vma, uintptr_t addr) {
+    vma_t* upper = memmgr_vma_add(mm, addr, vma->end, vma->prot, vma->flags);
 
-    if(pageDirectoryPointer == 0) {
-        //No memory???
-        return (void*)UINT64_MAX;
+    if(upper == NULL) {
+        return NULL;
     }
 
-    //We use these to calculate the baseAddress and space of the minimum-largest memory pocket we can find.
-    uint64_t freeMemory = 0;
-    uint64_t baseAddress = 0;
+    vma->end = addr;
+    memmgr_vma_propagate(vma);
 
-    //Go through every page directory
-    for(int i = 0; i < 512; i++) {
-        uint64_t* pageDirectory = memmgr_get_from_physical(pageDirectoryPointer[i] & PAGE_MASK);
-        //printf("Page directory: %d, 0x%x\n", i, pageDirectory);
+    return upper;
+}
 
-        if(pageDirectoryPointer[i] & PAGE_LARGE) {
-            //Skip large page
-            continue;
-        }
+/**
+ * Returns the region containing the given address
+ * @param mm the address space
+ * @param addr the address
+ * @return the region or NULL if the address isn't mapped
+ */
+vma_t* memmgr_vma_find(mm_struct_t* mm, uintptr_t addr) {
+    spin_lock(&mm->vma_lock);
+    vma_t* vma = memmgr_vma_find_overlap(mm, addr, addr + 1);
+    spin_unlock(&mm->vma_lock);
 
-        if(pageDirectoryPointer[i] == 0) {
-            if(baseAddress == 0) {
-                //free page directory means free page, lets calculate offset
-                baseAddress = (0x40000000UL * i);
-            }
+    return vma;
+}
 
-            freeMemory += 0x40000000UL;
+/**
+ * Registers a new region
+ * @param mm the address space
+ * @param start page aligned start
+ * @param end page aligned end
+ * @param prot PROT_* flags
+ * @param flags VMA_* flags
+ * @return 0, -EEXIST if the range overlaps another region or -ENOMEM
+ */
+int memmgr_vma_insert(mm_struct_t* mm, uintptr_t start, uintptr_t end, int prot, int flags) {
+    spin_lock(&mm->vma_lock);
 
-            if(freeMemory > len) {
-              return is_kernel ? (void*)KERNEL_ENTRY + baseAddress: (void*)baseAddress;
-            }
+    if(memmgr_vma_find_overlap(mm, start, end)) {
+        spin_unlock(&mm->vma_lock);
+        return -EEXIST;
+    }
 
-            continue;
-        }
+    vma_t* vma = memmgr_vma_add(mm, start, end, prot, flags);
 
+    spin_unlock(&mm->vma_lock);
+    return vma ? 0 : -ENOMEM;
+}
 
-        if(!is_kernel && !(pageDirectoryPointer[i] & PAGE_USER)) {
-            //No user page directory, skip
-            continue;
-        }
+/**
+ * Removes a range from the address space, regions partially inside are trimmed or split
+ * @param mm the address space
+ * @param start page aligned start
+ * @param end page aligned end
+ * @return 0 or -ENOMEM if a region couldn't be split, it stays whole then
+ */
+int memmgr_vma_remove_range(mm_struct_t* mm, uintptr_t start, uintptr_t end) {
+    spin_lock(&mm->vma_lock);
 
-        //Go through every Page Table
-        for(int j = 0; j < 512; j++) {
-            uint64_t* pageTable = memmgr_get_from_physical(pageDirectory[j] & PAGE_MASK);
-            //printf("Page table: %d: 0x%x\n", j, pageTable);
+    vma_t* vma;
 
-            if((uintptr_t)pageTable & PAGE_LARGE) {
-                //Skip large page
-                continue;
+    while((vma = memmgr_vma_find_overlap(mm, start, end)) != NULL) {
+        if(vma->start < start && vma->end > end) {
+            vma_t* upper = memmgr_vma_split(mm, vma, start);
+
+            if(upper == NULL) {
+                spin_unlock(&mm->vma_lock);
+                return -ENOMEM;
             }
 
-            if(pageDirectory[j] == 0) {
-                if(baseAddress == 0) {
-                    //free page table means free page, lets calculate offset
-                    baseAddress = (0x40000000UL * i) + (0x200000UL * j);
-                }
+            upper->start = end;
+            memmgr_vma_propagate(upper);
+        } else if(vma->start < start) {
+            vma->end = start;
+            memmgr_vma_propagate(vma);
+        } else if(vma->end > end) {
+            vma->start = end;
+            memmgr_vma_propagate(vma);
+        } else {
+            avl_tree_remove(mm->vmas, vma->node);
+            free(vma);
+        }
+    }
 
-                freeMemory += 0x200000UL;
+    spin_unlock(&mm->vma_lock);
+    return 0;
+}
 
-                if(freeMemory > len) {
-#ifdef DEBUG
-                    printf("cool: 0x%x\n", baseAddress);
-#endif
-                    return is_kernel ? (void*)KERNEL_ENTRY + baseAddress: (void*)baseAddress;
-                }
+/**
+ * Finds the lowest gap of at least len bytes inside a subtree that ends above low
+ */
+static uintptr_t memmgr_vma_find_gap(avl_tree_node_t* node, uintptr_t low, size_t len) {
+    if(node == NULL) {
+        return 0;
+    }
 
-                continue;
-            }
+    vma_t* vma = node->value;
 
-            if(!is_kernel && !(pageDirectory[j] & PAGE_USER)) {
-                //No user page table, skip
-                continue;
-            }
+    if(vma->subtree_gap < len || vma->subtree_end < low + len) {
+        return 0;
+    }
 
-            for(int k = 0; k < 512; k++) {
-                uint64_t page = pageTable[k];
+    uintptr_t result = memmgr_vma_find_gap(node->left, low, len);
 
-                if(page != 0 && pageTable[k] != KERNEL_MEMORY) {
-                    baseAddress = 0;
-                    freeMemory = 0;
+    if(result) {
+        return result;
+    }
 
-                    continue;
-                }
+    if(node->left) {
+        vma_t* left = node->left->value;
+        uintptr_t start = left->subtree_end > low ? left->subtree_end : low;
 
-                if(baseAddress == 0) {
-                    //free page directory means free page, lets calculate offset
-                    baseAddress = (0x40000000UL * i) + (0x200000UL * j) +(0x1000 * k);
-                }
+        if(start + len <= vma->start) {
+            return start;
+        }
+    }
 
-                freeMemory += 0x1000UL;
+    if(node->right) {
+        vma_t* right = node->right->value;
+        uintptr_t start = vma->end > low ? vma->end : low;
 
-                if(freeMemory > len) {
-#ifdef DEBUG
-                    printf("cool2: 0x%x\n", baseAddress);
-#endif
-                    return is_kernel ? (void*)KERNEL_ENTRY + baseAddress: (void*)baseAddress;
-                }
-            }
+        if(start + len <= right->subtree_start) {
+            return start;
         }
     }
 
-    return (void*)UINT64_MAX;
+    return memmgr_vma_find_gap(node->right, low, len);
 }
 
-void memmgr_delete_page(uintptr_t virtualAddr) {
-    uint64_t INDEX_PML4 = PML4_INDEX(virtualAddr);
-    uint64_t INDEX_PDP = PDP_INDEX(virtualAddr);
-    uint64_t INDEX_PD = PD_INDEX(virtualAddr);
-    uint64_t INDEX_PT = PT_INDEX(virtualAddr);
+/**
+ * Searches free space for a new user mapping between USER_MMAP_BASE and USER_MMAP_END
+ * @param mm the address space
+ * @param len the page aligned length
+ * @return the start address or 0 if the address space is full
+ */
+uintptr_t memmgr_vma_find_free(mm_struct_t* mm, size_t len) {
+    uintptr_t result = 0;
 
-    uint64_t* pageMap = memmgr_get_from_physical((uintptr_t)memmgr_get_current_pml4());
-    uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMap[INDEX_PML4] & PAGE_MASK);
+    spin_lock(&mm->vma_lock);
 
-    if(pageDirectoryPointer == 0 || (uintptr_t)pageMap[INDEX_PML4] & PAGE_LARGE) {
-        return;
+    if(mm->vmas == NULL || mm->vmas->root == NULL) {
+        spin_unlock(&mm->vma_lock);
+        return USER_MMAP_BASE;
     }
 
-    uint64_t* pageDirectory = memmgr_get_from_physical(pageDirectoryPointer[INDEX_PDP] & PAGE_MASK);
+    vma_t* root = mm->vmas->root->value;
 
-    if(pageDirectory == 0 ||(uintptr_t) pageDirectoryPointer[INDEX_PDP] & PAGE_LARGE) {
-        return;
-    }
+    if(USER_MMAP_BASE + len <= root->subtree_start) {
+        result = USER_MMAP_BASE;
+    } else {
+        result = memmgr_vma_find_gap(mm->vmas->root, USER_MMAP_BASE, len);
 
-    uint64_t* pageTable = memmgr_get_from_physical(pageDirectory[INDEX_PD] & PAGE_MASK);
+        if(result == 0) {
+            uintptr_t start = root->subtree_end > USER_MMAP_BASE ? root->subtree_end : USER_MMAP_BASE;
 
-    if(pageTable == 0 || (uintptr_t)pageDirectory[INDEX_PD] & PAGE_LARGE) {
-        return;
+            if(start + len <= USER_MMAP_END) {
+                result = start;
+            }
+        }
     }
 
-    uintptr_t frame = pageTable[INDEX_PT];
+    spin_unlock(&mm->vma_lock);
 
-    if(frame & PAGE_PRESENT) {
-        kfree_frame(frame & PAGE_MASK);
+    if(result + len > USER_MMAP_END) {
+        return 0;
     }
 
-    pageTable[INDEX_PT] = 0;
+    return result;
 }
 
-void memmgr_map_frame_to_virtual(uintptr_t frame_addr, uintptr_t virtual_addr, uintptr_t flags) {
-    uint64_t INDEX_PML4 = PML4_INDEX(virtual_addr);
-    uint64_t INDEX_PDP = PDP_INDEX(virtual_addr);
-    uint64_t INDEX_PD = PD_INDEX(virtual_addr);
-    uint64_t INDEX_PT = PT_INDEX(virtual_addr);
-
-    uint64_t* pageMap = memmgr_get_from_physical((uintptr_t)memmgr_get_current_pml4());
-    uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMap[INDEX_PML4] & PAGE_MASK);
+/**
+ * Copies all regions of an address space, used by fork
+ * @return 0 or -ENOMEM, the regions copied so far stay in the new address space
+ */
+int memmgr_vma_clone(mm_struct_t* old, mm_struct_t* new) {
+    if(old->vmas == NULL) {
+        return 0;
+    }
 
-    int pageFlags = flags;
-    //Clear bits that might be different for other page levels
-    //TODO: Find a way to set flags for all levels equally
-    flags &= 0x3f;
+    spin_lock(&old->vma_lock);
 
-    if(pageMap[INDEX_PML4] == 0) {
-        uintptr_t pdp_frame = kalloc_frame();
+    for(avl_tree_node_t* node = avl_tree_first(old->vmas); node != NULL; node = avl_tree_next(node)) {
+        vma_t* vma = node->value;
 
-        if(pdp_frame == UINT64_MAX) {
-            //PANIC
+        if(memmgr_vma_add(new, vma->start, vma->end, vma->prot, vma->flags) == NULL) {
+            spin_unlock(&old->vma_lock);
+            return -ENOMEM;
         }
+    }
 
-        pageMap[INDEX_PML4] = pdp_frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+    spin_unlock(&old->vma_lock);
+    return 0;
+}
 
-        pageDirectoryPointer = (uint64_t*)(pdp_frame | KERNEL_MEMORY);
-        memset(pageDirectoryPointer, 0, 0x1000);
+/**
+ * Frees all regions of an address space
+ */
+void memmgr_vma_destroy(mm_struct_t* mm) {
+    if(mm->vmas == NULL) {
+        return;
     }
 
-    uint64_t* pageDirectory = memmgr_get_from_physical(pageDirectoryPointer[INDEX_PDP] & PAGE_MASK);
+    avl_tree_destroy(mm->vmas);
+    mm->vmas = NULL;
+}
 
-    if(pageDirectoryPointer[INDEX_PDP] == 0) {
-        uintptr_t pd_frame = kalloc_frame();
-        pageDirectoryPointer[INDEX_PDP] = pd_frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+/**
+ * Returns the address space of the current process or NULL while the kernel boots
+ */
+static mm_struct_t* memmgr_current_mm() {
+    process_t* process = get_current_process();
 
-        pageDirectory = (uint64_t*)(pd_frame | KERNEL_MEMORY);
-        memset(pageDirectory, 0, 0x1000);
+    if(process == NULL) {
+        return NULL;
     }
 
-    uint64_t* pageTable = memmgr_get_from_physical(pageDirectory[INDEX_PD] & PAGE_MASK);
+    return process->page_directory;
+}
 
-    if(pageDirectory[INDEX_PD] == 0) {
-        uintptr_t pt_frame = kalloc_frame();
-        pageDirectory[INDEX_PD] = pt_frame | PAGE_PRESENT | PAGE_WRITABLE | flags;
+int memmgr_map_kernel_frames(uintptr_t virtualAddr, const uintptr_t* frames, size_t count, int prot) {
+    mm_struct_t* mm = memmgr_current_mm();
 
-        //printf("Creating page table at 0x%x with index 0x%x in PD 0x%x\n", pt_frame, INDEX_PD, pageDirectory);
+    if(mm == NULL) {
+        return -EINVAL;
+    }
 
-        pageTable = (uint64_t*)(pt_frame | KERNEL_MEMORY);
-        memset(pageTable, 0, 0x1000);
+    int result = memmgr_vma_insert(mm, virtualAddr, virtualAddr + count * PAGE_SIZE, prot & ~(PROT_WRITE), 0);
+
+    if(result) {
+        return result;
     }
 
-    pageTable[INDEX_PT] = frame_addr | PAGE_PRESENT | PAGE_WRITABLE | pageFlags;
-}
+    for(size_t i = 0; i < count; i++) {
+        uint64_t* pageEntry = memmgr_walk_page_map(virtualAddr + i * PAGE_SIZE, PAGE_USER, true, 3);
 
-/***
- * Invalides the tlb at address
- * @param addr the address
- */
-void memmgr_reload(uintptr_t addr) {
-    asm volatile (
-            "invlpg (%0)"
-            : : "r"(addr));
-}
+        if(pageEntry == NULL) {
+            //Drops the references of the pages mapped so far and the region
+            munmap((void*) virtualAddr, count * PAGE_SIZE);
+            return -ENOMEM;
+        }
 
-void* memmgr_map_mmio(uintptr_t addr, size_t len, int flags, bool is_kernel) {
-    if(addr != 0 && (((uintptr_t)addr % PAGE_SIZE) != 0)) {
-        addr = (uintptr_t)((uintptr_t)addr + PAGE_SIZE) & ~(PAGE_SIZE - 1);
+        //The mapping holds its own reference, unmapping it never frees the kernel's frame
+        memmgr_frame_ref(frames[i]);
+        *pageEntry = frames[i] | PAGE_PRESENT | PAGE_USER;
+
+        memmgr_reload(virtualAddr + i * PAGE_SIZE);
     }
 
-    //Map as NO_CACHE because Memory-Mapped I/O has to be always fetched new.
-    if(!is_kernel) flags |= PAGE_USER;
+    return 0;
+}
 
-    uintptr_t start_addr = MMIO_MEMORY + addr;
+/**
+ * Returns the page flags used for user memory with the given protection
+ */
+static int memmgr_prot_to_flags(int prot) {
+    int flags = 0;
 
-    size_t count = len / 4096;
-    if(len % 4096 != 0) {
-        count++;
+    if(prot != PROT_NONE) {
+        flags |= PAGE_USER;
     }
 
-    for(size_t i = 0; i < count+1; i++) {
-        memmgr_map_frame_to_virtual(addr + 0x1000 * i, start_addr + 0x1000 * i, flags);
+    if(prot & PROT_WRITE) {
+        flags |= PAGE_WRITABLE;
     }
 
-    return (void*)start_addr;
+    return flags;
 }
 
-bool memmgr_change_flags(uintptr_t virt, int flags) {
-    uint64_t INDEX_PML4 = PML4_INDEX(virt);
-    uint64_t INDEX_PDP = PDP_INDEX(virt);
-    uint64_t INDEX_PD = PD_INDEX(virt);
-    uint64_t INDEX_PT = PT_INDEX(virt);
+/**
+ * Applies the protection to all pages in the range that are mapped or reserved
+ */
+static void memmgr_apply_prot(uintptr_t start, uintptr_t end, int prot) {
+    for(uintptr_t addr = start; addr < end; addr += 0x1000) {
+        uint64_t* hugeEntry = memmgr_get_huge_entry(addr);
 
-    uint64_t* pagePtr = null;
+        if(hugeEntry != NULL) {
+            uintptr_t base = addr & ~(HUGE_PAGE_SIZE - 1);
 
-    uint64_t* pageMap = memmgr_get_from_physical((uintptr_t)memmgr_get_current_pml4());
-    uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMap[INDEX_PML4] & PAGE_MASK);
+            if(base >= start && base + HUGE_PAGE_SIZE <= end) {
+                //Huge pages are never shared, so no copy on write here
+                *hugeEntry = (*hugeEntry & ~((uint64_t) (PAGE_USER | PAGE_WRITABLE))) | memmgr_prot_to_flags(prot);
+                memmgr_reload(addr);
 
-    if(pageDirectoryPointer == 0) {
-        return false;
-    }
+                addr = base + HUGE_PAGE_SIZE - 0x1000;
+                continue;
+            }
 
-    if((uintptr_t)pageMap[INDEX_PML4] & PAGE_LARGE) {
-        pagePtr = (uint64_t *) pageMap[INDEX_PML4];
-        goto _done;
-    }
+            //Only a part of the huge page changes
+            if(!memmgr_split_huge_page(hugeEntry, addr)) {
+                continue;
+            }
+        }
 
-    uint64_t* pageDirectory = memmgr_get_from_physical(pageDirectoryPointer[INDEX_PDP] & PAGE_MASK);
+        uint64_t* pageEntry = memmgr_get_page_entry(addr);
 
-    if(pageDirectory == 0) {
-        return false;
-    }
+        if(pageEntry == NULL || *pageEntry == 0) {
+            continue;
+        }
 
-    if((uintptr_t) pageDirectoryPointer[INDEX_PDP] & PAGE_LARGE) {
-        pagePtr = (uint64_t *) pageDirectoryPointer[INDEX_PDP];
-        goto _done;
-    }
+        if(!(*pageEntry & PAGE_PRESENT) && !(*pageEntry & (MEMMGR_PAGE_FLAG_LAZY | MEMMGR_PAGE_FLAG_SWAP))) {
+            continue;
+        }
 
-    uint64_t* pageTable = memmgr_get_from_physical(pageDirectory[INDEX_PD] & PAGE_MASK);
+        uint64_t entry = *pageEntry & ~((uint64_t) (PAGE_USER | PAGE_WRITABLE));
+        entry |= memmgr_prot_to_flags(prot);
 
-    if(pageTable == 0) {
-        return false;
-    }
+        //Shared frames stay read only, the write fault gives us a private copy
+        if((entry & PAGE_PRESENT) && (entry & PAGE_WRITABLE) && memmgr_frame_refcount(entry & PAGE_MASK) > 1) {
+            entry = (entry & ~((uint64_t) (PAGE_WRITABLE))) | MEMMGR_PAGE_FLAG_COW;
+        }
 
-    if((uintptr_t)pageDirectory[INDEX_PD] & PAGE_LARGE) {
-        pagePtr = (uint64_t *) pageDirectoryPointer[INDEX_PDP];
-        goto _done;
+        *pageEntry = entry;
+        memmgr_reload(addr);
     }
+}
 
-    pagePtr = (uint64_t *) pageTable[INDEX_PT];
+int mprotect(void* addr, size_t len, int prot) {
+    mm_struct_t* mm = memmgr_current_mm();
 
-_done:
-    *pagePtr |= flags;
+    if(mm == NULL || ((uintptr_t) addr % PAGE_SIZE) != 0) {
+        return -EINVAL;
+    }
 
-    return true;
-}
+    uintptr_t start = (uintptr_t) addr;
+    uintptr_t end = (start + len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 
-uint8_t memmgr_get_page_level(uintptr_t virt) {
-    uint64_t INDEX_PML4 = PML4_INDEX(virt);
-    uint64_t INDEX_PDP = PDP_INDEX(virt);
-    uint64_t INDEX_PD = PD_INDEX(virt);
-    uint64_t INDEX_PT = PT_INDEX(virt);
+    if(end <= start) {
+        return len == 0 ? 0 : -EINVAL;
+    }
 
-    uint64_t* pagePtr = null;
+    spin_lock(&mm->vma_lock);
 
-    uint64_t* pageMap = memmgr_get_from_physical((uintptr_t)memmgr_get_current_pml4());
-    uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMap[INDEX_PML4] & PAGE_MASK);
+    //The entire range has to be mapped
+    uintptr_t current = start;
 
-    if(pageDirectoryPointer == 0) {
-        return -1;
-    }
+    while(current < end) {
+        vma_t* vma = memmgr_vma_find_overlap(mm, current, current + 1);
 
-    if((uintptr_t)pageMap[INDEX_PML4] & PAGE_LARGE) {
-        return 3;
+        if(vma == NULL) {
+            spin_unlock(&mm->vma_lock);
+            return -ENOMEM;
+        }
+
+        current = vma->end;
     }
 
-    uint64_t* pageDirectory = memmgr_get_from_physical(pageDirectoryPointer[INDEX_PDP] & PAGE_MASK);
+    current = start;
 
-    if(pageDirectory == 0) {
-        return -1;
-    }
+    while(current < end) {
+        vma_t* vma = memmgr_vma_find_overlap(mm, current, current + 1);
 
-    if((uintptr_t) pageDirectoryPointer[INDEX_PDP] & PAGE_LARGE) {
-        return 2;
-    }
+        if(vma->start < current) {
+            vma = memmgr_vma_split(mm, vma, current);
+        }
 
-    uint64_t* pageTable = memmgr_get_from_physical(pageDirectory[INDEX_PD] & PAGE_MASK);
+        if(vma == NULL || (vma->end > end && memmgr_vma_split(mm, vma, end) == NULL)) {
+            //The regions before keep their new protection, like Linux after a failed mprotect
+            spin_unlock(&mm->vma_lock);
+            memmgr_apply_prot(start, current, prot);
+            return -ENOMEM;
+        }
 
-    if(pageTable == 0) {
-        return -1;
+        vma->prot = prot;
+        current = vma->end;
     }
 
-    if((uintptr_t)pageDirectory[INDEX_PD] & PAGE_LARGE) {
-        return 1;
-    }
+    spin_unlock(&mm->vma_lock);
+
+    memmgr_apply_prot(start, end, prot);
 
     return 0;
 }
 
-bool memmgr_change_flags_bulk(uintptr_t virt, int size, int flags) {
-    uintptr_t start_addr = virt;
-
-    for(size_t i = 0; i < size;) {
-        uintptr_t page_level = memmgr_get_page_level(virt);
+/****************************************************************************/
 
-        if(!memmgr_change_flags(start_addr + i, flags)) {
-            return false;
-        }
+void* mmap(void* addr, size_t len, bool is_kernel) {
+    return mmap_flags(addr, len, is_kernel, PROT_READ | PROT_WRITE | PROT_EXEC, 0);
+}
 
-        switch(page_level) {
-            case 3:
-                i += 0x8000000000;
-                break;
-            case 2:
-                i += 0x40000000;
-                break;
-            case 1:
-                i += 0x200000;
-                break;
-            case 0:
-                i += 0x1000;
-                break;
-            default:
-                break;
+/**
+ * Undoes a populated mapping that ran out of frames, the pages mapped so far are freed and the region removed
+ * @param mapped the amount of pages mapped before the failure
+ * @param count the amount of pages of the region
+ */
+static void mmap_unwind(mm_struct_t* mm, uintptr_t start, size_t mapped, size_t count) {
+    for(size_t i = 0; i < mapped; i++) {
+        uintptr_t address = start + 0x1000 * i;
+        uint64_t* hugeEntry = memmgr_get_huge_entry(address);
+
+        //Huge pages are only created at their boundary
+        if(hugeEntry != NULL) {
+            memmgr_free_huge_page(hugeEntry, address);
+            i += HUGE_PAGE_SIZE / 0x1000 - 1;
+            continue;
         }
 
-        memmgr_reload(start_addr + i);
+        memmgr_delete_page(address);
+        memmgr_reload(address);
     }
 
-    return true;
+    if(mm != NULL) {
+        memmgr_vma_remove_range(mm, start, start + count * 0x1000);
+    }
 }
 
-/**
- * Allocates a new memory region, searching for a free place if addr is null or on the address
- * @param addr the desired address
- * @param len the length of the memory region
- * @param is_kernel if is_kernel is set, the length of the map is increased
- */
-void* mmap(void* addr, size_t len, bool is_kernel) {
+void* mmap_flags(void* addr, size_t len, bool is_kernel, int prot, int flags) {
     //Page-align
     if(addr != 0 && (((uintptr_t)addr % PAGE_SIZE) != 0)) {
         addr = (void*)((uintptr_t)((uintptr_t)addr) & ~(PAGE_SIZE - 1));
     }
 
-    if(addr == 0) {
-        if(is_kernel) {
-            /*uintptr_t start_addr = (uintptr_t)(_end);
-            if((((uintptr_t)start_addr % PAGE_SIZE) != 0)) {
-                start_addr = (uintptr_t)((uintptr_t)start_addr + PAGE_SIZE) & ~(PAGE_SIZE - 1);
-            }*/
-            uintptr_t start_addr = (uintptr_t) get_free_page(len, true);
-
-            //Divide by pages, so we get to count of pages to create
-            size_t count = len / 4096;
-            if(len % 4096 != 0) {
-                count++;
-            }
+    //Kernel memory is always populated, the kernel can't take page faults everywhere
+    bool populate = is_kernel || (flags & MAP_POPULATE);
+    int pageFlags = is_kernel ? 0 : memmgr_prot_to_flags(prot);
 
-#ifdef DEBUG
-            printf("Start addr: %x\n", start_addr);
-#endif
+    //User memory is tracked in the regions of the current address space
+    mm_struct_t* mm = is_kernel ? NULL : memmgr_current_mm();
 
-            //Create the actual pages and reload the TLB at that location
-            for(size_t i = 0; i < count; i++) {
-                memmgr_create_or_get_page(start_addr + 0x1000 * i, 0, 1);
-                //memmgr_reload(start_addr + 0x1000 * i);
-            }
+    //Divide by pages, so we get to count of pages to create
+    size_t count = len / 4096;
+    if(len % 4096 != 0) {
+        count++;
+    }
 
-            return (void*)start_addr;
-        } else {
+    if(addr == 0) {
 #ifdef DEBUG
-            printf("Get next free page...\n");
+        printf("Get next free page...\n");
 #endif
-            //Search new space
-            uintptr_t start_addr = (uintptr_t) get_free_page(len, is_kernel);
+        //Large mappings get room to start on a 2 MiB boundary so they can use huge pages
+        size_t search = count * 0x1000;
 
-            //Divide by pages, so we get to count of pages to create
-            size_t count = len / 4096;
-            if(len % 4096 != 0) {
-                count++;
+        if(search >= HUGE_PAGE_SIZE) {
+            search += HUGE_PAGE_SIZE - 0x1000;
+        }
+
+        //Search new space
+        uintptr_t start_addr = mm ? memmgr_vma_find_free(mm, search) : (uintptr_t) get_free_page(search, is_kernel);
+
+        if(start_addr != 0 && start_addr != UINT64_MAX && search != count * 0x1000) {
+            start_addr = (start_addr + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        }
+
+        if(mm) {
+            if(start_addr == 0 || memmgr_vma_insert(mm, start_addr, start_addr + count * 0x1000, prot, VMA_ANONYMOUS)) {
+                return (void*)UINT64_MAX;
             }
+        }
 
 #ifdef DEBUG
-            printf("Start addr: 0x%x, Count: %d\n", start_addr, count);
+        printf("Start addr: 0x%x, Count: %d\n", start_addr, count);
 #endif
 
-            //Create the actual pages and reload the TLB at that location
-            for(size_t i = 0; i < count; i++) {
-                memmgr_create_or_get_page(start_addr + 0x1000 * i, PAGE_USER, 1);
-                //memmgr_reload(start_addr + 0x1000 * i);
-            }
+        //Create the actual pages
+        for(size_t i = 0; i < count; i++) {
+            if(populate) {
+                if(memmgr_create_huge_page(start_addr + 0x1000 * i, count - i, is_kernel ? 0 : PAGE_USER)) {
+                    i += HUGE_PAGE_SIZE / 0x1000 - 1;
+                    continue;
+                }
+
+                uintptr_t frame = kalloc_zeroed_frame_flags(is_kernel ? 0 : KALLOC_RECLAIM);
 
-            return (void*)start_addr;
+                if(frame == 0) {
+                    mmap_unwind(mm, start_addr, i, count);
+                    return (void*)UINT64_MAX;
+                }
+
+                memmgr_map_frame_to_virtual(frame, start_addr + 0x1000 * i, is_kernel ? 0 : PAGE_USER);
+            } else {
+                memmgr_create_lazy_page(start_addr + 0x1000 * i, pageFlags);
+            }
         }
-    } else {
-        //Divide by pages, so we get to count of pages to create
-        size_t count = len / 4096;
-        if(len % 4096 != 0) {
-            count++;
+
+        if(populate && !is_kernel) {
+            memmgr_apply_prot(start_addr, start_addr + count * 0x1000, prot);
         }
 
-        //Create the actual pages and reload the TLB at that location
+        return (void*)start_addr;
+    } else {
         for(size_t i = 0; i < count; i++) {
-            if(memmgr_create_or_get_page((uintptr_t)addr + 0x1000 * i, is_kernel ? 0 : PAGE_USER, 0)) {
+            uint64_t* pageEntry = memmgr_get_page_entry((uintptr_t)addr + 0x1000 * i);
+
+            if((pageEntry != NULL && *pageEntry != 0) || memmgr_get_huge_entry((uintptr_t)addr + 0x1000 * i) != NULL) {
                 return 0;
             }
         }
 
-        //Create the actual pages and reload the TLB at that location
+        if(mm && memmgr_vma_insert(mm, (uintptr_t)addr, (uintptr_t)addr + count * 0x1000, prot, VMA_ANONYMOUS)) {
+            return 0;
+        }
+
+        //Create the actual pages
         for(size_t i = 0; i < count; i++) {
-            memmgr_create_or_get_page((uintptr_t)addr + 0x1000 * i, is_kernel ? 0 : PAGE_USER, 1);
-            //memmgr_reload((uintptr_t)addr + 0x1000 * i);
+            if(populate) {
+                if(memmgr_create_huge_page((uintptr_t)addr + 0x1000 * i, count - i, is_kernel ? 0 : PAGE_USER)) {
+                    i += HUGE_PAGE_SIZE / 0x1000 - 1;
+                    continue;
+                }
+
+                uintptr_t frame = kalloc_zeroed_frame_flags(is_kernel ? 0 : KALLOC_RECLAIM);
+
+                //Frame 0 would end up in the address space otherwise
+                if(frame == 0) {
+                    mmap_unwind(mm, (uintptr_t)addr, i, count);
+                    return 0;
+                }
+
+                memmgr_map_frame_to_virtual(frame, (uintptr_t)addr + 0x1000 * i, is_kernel ? 0 : PAGE_USER);
+            } else {
+                memmgr_create_lazy_page((uintptr_t)addr + 0x1000 * i, pageFlags);
+            }
+        }
 
-            memset(addr + 0x1000 * i, 0, 0x1000);
+        if(populate && !is_kernel) {
+            memmgr_apply_prot((uintptr_t)addr, (uintptr_t)addr + count * 0x1000, prot);
         }
 
         return addr;
@@ -900,8 +2976,40 @@ void munmap(void* addr, size_t len) {
         count++;
     }
 
-    for(size_t i = 1; i < count+1; i++) {
-        if(!memmgr_check_user((uintptr_t)addr + 0x1000 * i)) {
+    mm_struct_t* mm = memmgr_current_mm();
+
+    if(mm != NULL && mm->vmas != NULL) {
+        for(size_t i = 0; i < count; i++) {
+            if(!memmgr_vma_find(mm, (uintptr_t)addr + 0x1000 * i)) {
+                continue;
+            }
+
+            uint64_t* hugeEntry = memmgr_get_huge_entry((uintptr_t)addr + 0x1000 * i);
+
+            if(hugeEntry != NULL) {
+                uintptr_t base = ((uintptr_t)addr + 0x1000 * i) & ~(HUGE_PAGE_SIZE - 1);
+
+                if(base >= (uintptr_t)addr && base + HUGE_PAGE_SIZE <= (uintptr_t)addr + count * 0x1000) {
+                    memmgr_free_huge_page(hugeEntry, base);
+
+                    i = (base + HUGE_PAGE_SIZE - (uintptr_t)addr) / 0x1000 - 1;
+                    continue;
+                }
+
+                //Only a part of the huge page goes away
+                memmgr_split_huge_page(hugeEntry, base);
+            }
+
+            memmgr_delete_page((uintptr_t)addr + 0x1000 * i);
+            memmgr_reload((uintptr_t)addr + 0x1000 * i);
+        }
+
+        memmgr_vma_remove_range(mm, (uintptr_t)addr, (uintptr_t)addr + count * 0x1000);
+        return;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        if(!memmgr_check_user_page((uintptr_t)addr + 0x1000 * i)) {
             continue;
         }
 
@@ -911,9 +3019,11 @@ void munmap(void* addr, size_t len) {
 }
 
 /**
- * Allocates a new stack
+ * Allocates a new stack with a guard page below it
+ * Kernel stacks are populated right away, user stacks only reserve their region and grow when touched
  * @param user whether it is a userspace stack
  * @param len the length of the memory region
+ * @return the lowest address above the guard page, NULL if a user stack found no room
  */
 void* memmgr_create_stack(bool user, uint64_t len) {
     if(!user) {
@@ -945,33 +3055,141 @@ void* memmgr_create_stack(bool user, uint64_t len) {
         //Increase kernel heap so we dont get overwritten on sbrk
         kernel_heap_length += len;
 
-        return (void*)start_addr + 0x1000;
-    } else {
-#ifdef DEBUG
-        printf("Get next free page...\n");
-#endif
-        //Search new space
-        uintptr_t start_addr = (uintptr_t) get_free_page(len + 4096, false);
+        return (void*)start_addr + 0x1000;
+    } else {
+#ifdef DEBUG
+        printf("Get next free page...\n");
+#endif
+        //Divide by pages, so we get to count of pages to create
+        size_t count = len / 4096;
+        if(len % 4096 != 0) {
+            count++;
+        }
+
+        //Search new space
+        mm_struct_t* mm = memmgr_current_mm();
+        uintptr_t start_addr;
+
+        if(mm != NULL) {
+            start_addr = memmgr_vma_find_free(mm, (count + 1) * 0x1000);
+
+            if(start_addr == 0) {
+                return NULL;
+            }
+
+            //The guard page is a region of its own so nothing gets mapped there
+            if(memmgr_vma_insert(mm, start_addr, start_addr + 0x1000, PROT_NONE, VMA_STACK)) {
+                return NULL;
+            }
+
+            if(memmgr_vma_insert(mm, start_addr + 0x1000, start_addr + (count + 1) * 0x1000, PROT_READ | PROT_WRITE, VMA_STACK)) {
+                memmgr_vma_remove_range(mm, start_addr, start_addr + 0x1000);
+                return NULL;
+            }
+        } else {
+            start_addr = (uintptr_t) get_free_page(len + 4096, false);
+        }
+
+#ifdef DEBUG
+        printf("Start addr: 0x%x, Count: %d\n", start_addr, count);
+#endif
+
+        memmgr_create_or_get_raw(start_addr, 0, MEMMGR_PAGE_FLAG_STACK_GUARD, 1, 0);
+
+        //The stack grows on demand, the region alone is enough for the page fault handler to populate it
+        //Without regions the pages are reserved instead, which only costs the page tables
+        if(mm == NULL) {
+            for(size_t i = 1; i < count+1; i++) {
+                memmgr_create_lazy_page(start_addr + 0x1000 * i, PAGE_USER | PAGE_WRITABLE);
+            }
+        }
+
+        return (void*)start_addr + 0x1000;
+    }
+}
+
+//Unmaps a kernel stack, the guard page stays reserved
+static void memmgr_kernel_stack_release(uintptr_t top) {
+    for(uintptr_t addr = top - KERNEL_STACK_SIZE; addr < top; addr += 0x1000) {
+        memmgr_delete_page(addr);
+        memmgr_reload(addr);
+    }
+}
+
+uintptr_t memmgr_kernel_stack_alloc() {
+    uint64_t rflags = cli();
+    spin_lock(&KERNEL_STACK_LOCK);
+
+    uintptr_t top = kernel_stack_cache;
+
+    if(top != 0) {
+        kernel_stack_cache = *(uintptr_t*) (top - KERNEL_STACK_SIZE);
+        kernel_stack_cache_count--;
+    }
+
+    spin_unlock(&KERNEL_STACK_LOCK);
+    sti(rflags);
+
+    if(top == 0) {
+        top = (uintptr_t) memmgr_create_stack(false, KERNEL_STACK_SIZE) + KERNEL_STACK_SIZE;
+    }
+
+    return top;
+}
+
+void memmgr_kernel_stack_free(uintptr_t top) {
+    if(top == 0) {
+        return;
+    }
+
+    uint64_t rflags = cli();
+    spin_lock(&KERNEL_STACK_LOCK);
+
+    if(kernel_stack_cache_count < KERNEL_STACK_CACHE_MAX) {
+        *(uintptr_t*) (top - KERNEL_STACK_SIZE) = kernel_stack_cache;
+        kernel_stack_cache = top;
+        kernel_stack_cache_count++;
+        top = 0;
+    }
+
+    spin_unlock(&KERNEL_STACK_LOCK);
+    sti(rflags);
+
+    if(top != 0) {
+        memmgr_kernel_stack_release(top);
+    }
+}
+
+static size_t memmgr_kernel_stack_shrinker_count(shrinker_t* shrinker) {
+    return kernel_stack_cache_count * (KERNEL_STACK_SIZE / 0x1000);
+}
 
-        //Divide by pages, so we get to count of pages to create
-        size_t count = len / 4096;
-        if(len % 4096 != 0) {
-            count++;
+static size_t memmgr_kernel_stack_shrinker_scan(shrinker_t* shrinker, size_t count) {
+    size_t freed = 0;
+
+    while(freed < count) {
+        if(!spin_trylock(&KERNEL_STACK_LOCK)) {
+            break;
         }
 
-#ifdef DEBUG
-        printf("Start addr: 0x%x, Count: %d\n", start_addr, count);
-#endif
+        uintptr_t top = kernel_stack_cache;
 
-        memmgr_create_or_get_raw(start_addr, 0, MEMMGR_PAGE_FLAG_STACK_GUARD, 1, 0);
+        if(top != 0) {
+            kernel_stack_cache = *(uintptr_t*) (top - KERNEL_STACK_SIZE);
+            kernel_stack_cache_count--;
+        }
 
-        //Create the actual pages and reload the TLB at that location
-        for(size_t i = 1; i < count+1; i++) {
-            memmgr_create_or_get_page(start_addr + 0x1000 * i, PAGE_USER | PAGE_PRESENT | PAGE_WRITABLE, 1);
+        spin_unlock(&KERNEL_STACK_LOCK);
+
+        if(top == 0) {
+            break;
         }
 
-        return (void*)start_addr + 0x1000;
+        memmgr_kernel_stack_release(top);
+        freed += KERNEL_STACK_SIZE / 0x1000;
     }
+
+    return freed;
 }
 
 /**
@@ -980,42 +3198,59 @@ void* memmgr_create_stack(bool user, uint64_t len) {
  */
 void memmgr_clear_page_map(uintptr_t pageMap) {
     uint64_t* pageMapVirt = memmgr_get_from_physical(pageMap);
-    uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMapVirt[0] & PAGE_MASK);
-
-    for(int i = 0; i < 512; i++) {
-        if(!(pageDirectoryPointer[i] & PAGE_PRESENT)) {
-            continue;
-        }
 
-        if(pageDirectoryPointer[i] & PAGE_LARGE) {
+    //The lower half belongs to the process, user mappings aren't limited to the first 512 GiB
+    for(int l = 0; l < 256; l++) {
+        if(!(pageMapVirt[l] & PAGE_PRESENT)) {
             continue;
         }
 
-        uint64_t* pageDirectory = memmgr_get_from_physical(pageDirectoryPointer[i] & PAGE_MASK);
+        uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMapVirt[l] & PAGE_MASK);
 
-        for(int j = 0; j < 512; j++) {
-            if(!(pageDirectory[j] & PAGE_PRESENT)) {
+        for(int i = 0; i < 512; i++) {
+            if(!(pageDirectoryPointer[i] & PAGE_PRESENT)) {
                 continue;
             }
 
-            if(pageDirectory[j] & PAGE_LARGE) {
+            if(pageDirectoryPointer[i] & PAGE_LARGE) {
                 continue;
             }
 
-            uint64_t* pageTable = memmgr_get_from_physical(pageDirectory[j] & PAGE_MASK);
-            for(int k = 0; k < 512; k++) {
-                if(pageTable[k] & PAGE_PRESENT) {
-                    kfree_frame(pageTable[k] & PAGE_MASK);
+            uint64_t* pageDirectory = memmgr_get_from_physical(pageDirectoryPointer[i] & PAGE_MASK);
+
+            for(int j = 0; j < 512; j++) {
+                if(!(pageDirectory[j] & PAGE_PRESENT)) {
+                    continue;
+                }
+
+                if(pageDirectory[j] & PAGE_LARGE) {
+                    //Huge user pages are private, the boot identity map isn't ours
+                    if(pageDirectory[j] & PAGE_USER) {
+                        kfree_frames(pageDirectory[j] & HUGE_PAGE_MASK, HUGE_PAGE_ORDER);
+                        __atomic_sub_fetch(&huge_pages_mapped, 1, __ATOMIC_RELAXED);
+                    }
+
+                    continue;
+                }
+
+                uint64_t* pageTable = memmgr_get_from_physical(pageDirectory[j] & PAGE_MASK);
+                for(int k = 0; k < 512; k++) {
+                    if(pageTable[k] & PAGE_PRESENT) {
+                        kfree_frame(pageTable[k] & PAGE_MASK);
+                    } else if(pageTable[k] & MEMMGR_PAGE_FLAG_SWAP) {
+                        swap_free_slot((pageTable[k] & SWAP_SLOT_MASK) >> 12);
+                    }
                 }
+
+                kfree_frame(pageDirectory[j] & PAGE_MASK);
             }
 
-            kfree_frame(pageDirectory[j] & PAGE_MASK);
+            kfree_frame(pageDirectoryPointer[i] & PAGE_MASK);
         }
 
-        kfree_frame(pageDirectoryPointer[i] & PAGE_MASK);
+        kfree_frame(pageMapVirt[l] & PAGE_MASK);
     }
 
-    kfree_frame(pageMapVirt[0]);
     kfree_frame((uintptr_t) pageMap);
 }
 
@@ -1072,7 +3307,17 @@ void* brk(size_t len) {
  * @param pageMapOld the old page map
  * @param pageMapNew the new location
  */
+static void memmgr_clone_page_map_internal(uint64_t* pageMapOld, uint64_t* pageMapNew, bool copyUser);
+
 void memmgr_clone_page_map(uint64_t* pageMapOld, uint64_t* pageMapNew) {
+    memmgr_clone_page_map_internal(pageMapOld, pageMapNew, true);
+}
+
+void memmgr_clone_kernel_page_map(uint64_t* pageMapOld, uint64_t* pageMapNew) {
+    memmgr_clone_page_map_internal(pageMapOld, pageMapNew, false);
+}
+
+static void memmgr_clone_page_map_internal(uint64_t* pageMapOld, uint64_t* pageMapNew, bool copyUser) {
     memset(pageMapNew, 0, 4096);
 
     for(int i = 0; i < 511; i++) {
@@ -1080,9 +3325,6 @@ void memmgr_clone_page_map(uint64_t* pageMapOld, uint64_t* pageMapNew) {
 
         if(pageMapOld[i] & PAGE_LARGE) {
             //Large page, just copy
-            printf("Copying PDPT %d\n", i);
-            printf("Copying large pdpt\n");
-
             pageMapNew[i] = pageMapOld[i];
             continue;
         }
@@ -1091,27 +3333,22 @@ void memmgr_clone_page_map(uint64_t* pageMapOld, uint64_t* pageMapNew) {
             continue;
         }
 
-        printf("Copying PDPT %d\n", i);
-
         if(i == 508 || i == 509 || i == 510) {
             //Kernel space, just copy old PDP
             pageMapNew[i] = pageMapOld[i];
             continue;
         }
 
-        uintptr_t pdp_frame = kalloc_frame();
+        uintptr_t pdp_frame = kalloc_zeroed_frame();
 
         pageMapNew[i] = (uintptr_t) pdp_frame | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
         uint64_t* pageDirectoryPointer = (uint64_t*) memmgr_get_from_physical(pdp_frame);
-        memset(pageDirectoryPointer, 0, 4096);
 
         for(int j = 0; j < 512; j++) {
             uint64_t* pageDirectoryOld = memmgr_get_from_physical(pageDirectoryPointerOld[j] & PAGE_MASK);
 
             if(pageDirectoryPointerOld[j] & PAGE_LARGE) {
                 //Large page, just copy
-                printf("Copying PD %d-%d\n", i, j);
-                printf("Copying large pd\n");
                 pageDirectoryPointer[j] = pageDirectoryPointerOld[j];
                 continue;
             }
@@ -1120,21 +3357,35 @@ void memmgr_clone_page_map(uint64_t* pageMapOld, uint64_t* pageMapNew) {
                 continue;
             }
 
-            printf("Copying PD %d-%d\n", i, j);
-
-            uintptr_t pd_frame = kalloc_frame();
+            uintptr_t pd_frame = kalloc_zeroed_frame();
             pageDirectoryPointer[j] = pd_frame | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
 
             uint64_t* pageDirectory = (uint64_t*) memmgr_get_from_physical(pd_frame);
-            memset(pageDirectory, 0, 4096);
 
             for(int k = 0; k < 512; k++) {
                 uint64_t* pageTableOld = memmgr_get_from_physical(pageDirectoryOld[k] & PAGE_MASK);
 
+                if((pageDirectoryOld[k] & PAGE_LARGE) && (pageDirectoryOld[k] & PAGE_USER)) {
+                    //Huge user pages get copied right away, breaking them up on a write fault would cost more
+                    if(!copyUser) {
+                        continue;
+                    }
+
+                    uintptr_t huge_frame = kalloc_frames(HUGE_PAGE_ORDER);
+
+                    if(huge_frame == 0) {
+                        continue;
+                    }
+
+                    memcpy(memmgr_get_from_physical(huge_frame), memmgr_get_from_physical(pageDirectoryOld[k] & HUGE_PAGE_MASK), HUGE_PAGE_SIZE);
+
+                    pageDirectory[k] = huge_frame | (pageDirectoryOld[k] & ~(HUGE_PAGE_MASK));
+                    __atomic_add_fetch(&huge_pages_mapped, 1, __ATOMIC_RELAXED);
+                    continue;
+                }
+
                 if(pageDirectoryOld[k] & PAGE_LARGE) {
                     //Large page, just copy
-                    printf("Copying PT %d-%d-%d\n", i, j, k);
-                    printf("Copying large pt\n");
                     pageDirectory[k] = pageDirectoryOld[k];
                     continue;
                 }
@@ -1143,13 +3394,10 @@ void memmgr_clone_page_map(uint64_t* pageMapOld, uint64_t* pageMapNew) {
                     continue;
                 }
 
-                printf("Copying PT %d-%d-%d\n", i, j, k);
-
-                uintptr_t pt_frame = kalloc_frame();
+                uintptr_t pt_frame = kalloc_zeroed_frame();
                 pageDirectory[k] = pt_frame | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
 
                 uint64_t* pageTable = (uint64_t*) memmgr_get_from_physical(pt_frame);
-                memset(pageTable, 0, 4096);
 
                 for(int l = 0; l < 512; l++) {
                     uintptr_t page = pageTableOld[l];
@@ -1158,17 +3406,29 @@ void memmgr_clone_page_map(uint64_t* pageMapOld, uint64_t* pageMapNew) {
                         continue;
                     }
 
-                    //printf("Copying page %d-%d-%d-%d\n", i, j, k, l);
+                    if(!copyUser && (!(page & PAGE_PRESENT) || (page & PAGE_USER))) {
+                        //New image, user memory isn't inherited
+                        continue;
+                    }
 
-                    if(page & PAGE_USER) {
-                        uintptr_t page_frame = kalloc_frame();
-                        pageTable[l] = page_frame | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+                    if(!(page & PAGE_PRESENT)) {
+                        //Stack guards and other markers, swapped out pages are shared through their slot
+                        if(page & MEMMGR_PAGE_FLAG_SWAP) {
+                            swap_dup_slot((page & SWAP_SLOT_MASK) >> 12);
+                        }
 
-                        //Copy page
-                        memcpy(memmgr_get_from_physical(page_frame), memmgr_get_from_physical(page & PAGE_MASK), 4096);
-                    } else {
                         pageTable[l] = page;
+                        continue;
+                    }
+
+                    //Writable user pages are shared read only until one side writes to them
+                    if((page & PAGE_USER) && (page & (PAGE_WRITABLE | MEMMGR_PAGE_FLAG_COW))) {
+                        page = (page & ~(PAGE_WRITABLE)) | MEMMGR_PAGE_FLAG_COW;
+                        pageTableOld[l] = page;
                     }
+
+                    memmgr_frame_ref(page & PAGE_MASK);
+                    pageTable[l] = page;
                 }
             }
         }
@@ -1176,18 +3436,201 @@ void memmgr_clone_page_map(uint64_t* pageMapOld, uint64_t* pageMapNew) {
 
     pageMapNew[511] = (uint64_t) memmgr_get_from_virtual((uintptr_t) pageMapNew);
 
-    //Dump new page map
-    for(int i = 0; i < 512; i++) {
-        uint64_t* pageDirectoryPointer = memmgr_get_from_physical(pageMapNew[i] & PAGE_MASK);
+    //The old mappings lost their write permission
+    if(memmgr_get_from_virtual((uintptr_t) pageMapOld) == memmgr_get_current_pml4()) {
+        reloadPML();
+    }
+}
+
+/**
+ * Populates the 2 MiB region around a lazy page with a single huge page
+ * Only done if the region lies inside one anonymous mapping and none of its pages were touched yet
+ * @param virtualAddr the faulting address
+ * @return true if the region is mapped by a huge page afterwards
+ */
+static bool memmgr_populate_huge_page(uintptr_t virtualAddr) {
+    mm_struct_t* mm = memmgr_current_mm();
+    uintptr_t base = virtualAddr & ~(HUGE_PAGE_SIZE - 1);
+
+    if(mm == NULL || mm->vmas == NULL) {
+        return false;
+    }
+
+    vma_t* vma = memmgr_vma_find(mm, virtualAddr);
+
+    if(vma == NULL || !(vma->flags & VMA_ANONYMOUS) || vma->start > base || vma->end < base + HUGE_PAGE_SIZE) {
+        return false;
+    }
+
+    uint64_t* pageDirectoryEntry = memmgr_walk_page_map(base, 0, false, 2);
+
+    if(pageDirectoryEntry == NULL || !(*pageDirectoryEntry & PAGE_PRESENT) || (*pageDirectoryEntry & PAGE_LARGE)) {
+        return false;
+    }
+
+    uint64_t* pageTable = memmgr_get_from_physical(*pageDirectoryEntry & PAGE_MASK);
+    uint64_t lazy = pageTable[0];
+
+    if(!(lazy & MEMMGR_PAGE_FLAG_LAZY)) {
+        return false;
+    }
+
+    for(int i = 1; i < 512; i++) {
+        if(pageTable[i] != lazy) {
+            return false;
+        }
+    }
+
+    uintptr_t frame = kalloc_frames(HUGE_PAGE_ORDER);
+
+    if(frame == 0) {
+        return false;
+    }
+
+    memset(memmgr_get_from_physical(frame), 0, HUGE_PAGE_SIZE);
+
+    uintptr_t table = *pageDirectoryEntry & PAGE_MASK;
+
+    *pageDirectoryEntry = frame | (lazy & ~(PAGE_MASK) & ~(MEMMGR_PAGE_FLAG_LAZY)) | PAGE_PRESENT | PAGE_LARGE;
+    memmgr_reload(base);
+
+    kfree_frame(table);
+    __atomic_add_fetch(&huge_pages_mapped, 1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+/**
+ * Resolves a write fault on a copy on write page
+ * The last owner takes the frame back, everyone else gets a private copy
+ * @param virtualAddr the faulting address
+ * @return true if the fault was resolved
+ */
+static bool memmgr_break_cow(uintptr_t virtualAddr) {
+    uint64_t* pageEntry = memmgr_get_page_entry(virtualAddr);
+
+    if(pageEntry == NULL || !(*pageEntry & PAGE_PRESENT) || !(*pageEntry & MEMMGR_PAGE_FLAG_COW)) {
+        return false;
+    }
+
+    //The region might have been made read only after the fork
+    mm_struct_t* mm = memmgr_current_mm();
+
+    if(mm != NULL && mm->vmas != NULL) {
+        vma_t* vma = memmgr_vma_find(mm, virtualAddr);
+
+        if(vma == NULL || !(vma->prot & PROT_WRITE)) {
+            return false;
+        }
+    }
+
+    uintptr_t frame = *pageEntry & PAGE_MASK;
+    uintptr_t flags = (*pageEntry & ~(PAGE_MASK) & ~(MEMMGR_PAGE_FLAG_COW)) | PAGE_WRITABLE;
+
+    if(memmgr_frame_refcount(frame) <= 1) {
+        *pageEntry = frame | flags;
+        memmgr_reload(virtualAddr & PAGE_MASK);
+        return true;
+    }
+
+    uintptr_t copy = kalloc_frame();
+
+    if(copy == 0) {
+        return false;
+    }
+
+    memcpy(memmgr_get_from_physical(copy), memmgr_get_from_physical(frame), 4096);
+
+    *pageEntry = copy | flags;
+    memmgr_reload(virtualAddr & PAGE_MASK);
+
+    kfree_frame(frame);
 
-        //printf("PML4 entry is 0x%x\n", pageDirectoryPointer);
-        if(pageMapNew[i] & PAGE_PRESENT) {
-            printf("PML4 Entry #%d is set.\n", i);
+    return true;
+}
+
+/**
+ * Maps a zeroed frame for an untouched page of a stack region, page tables are created as needed
+ * The guard page below a stack is a region without access, so running into it still faults
+ * @param virtualAddr the faulting address
+ * @return true if the page is present afterwards
+ */
+static bool memmgr_populate_stack(uintptr_t virtualAddr) {
+    mm_struct_t* mm = memmgr_current_mm();
+
+    if(mm == NULL || virtualAddr >= USER_SPACE_END) {
+        return false;
+    }
+
+    vma_t* vma = memmgr_vma_find(mm, virtualAddr);
+
+    if(vma == NULL || !(vma->flags & VMA_STACK) || vma->prot == PROT_NONE) {
+        return false;
+    }
+
+    uint64_t* pageEntry = memmgr_walk_page_map(virtualAddr, PAGE_USER, true, 3);
+
+    if(pageEntry == NULL || *pageEntry != 0) {
+        return false;
+    }
+
+    uintptr_t frame = kalloc_zeroed_frame_flags(KALLOC_RECLAIM);
+
+    if(frame == 0) {
+        return false;
+    }
+
+    *pageEntry = frame | PAGE_PRESENT | memmgr_prot_to_flags(vma->prot);
+
+    return true;
+}
+
+/**
+ * Handles page faults that the memory manager can resolve
+ * @param faultAddr the faulting address from CR2
+ * @param errorCode the error code pushed by the cpu
+ * @return true if the faulting instruction can be restarted
+ */
+bool memmgr_handle_page_fault(uintptr_t faultAddr, uint64_t errorCode) {
+    if(!(errorCode & PF_PRESENT)) {
+        uint64_t* pageEntry = memmgr_get_page_entry(faultAddr);
+
+        if((pageEntry == NULL || *pageEntry == 0) && memmgr_populate_stack(faultAddr)) {
+            return true;
+        }
+
+        if(pageEntry == NULL) {
+            return false;
+        }
+
+        //User space may only touch its own pages
+        if((errorCode & PF_USER) && !(*pageEntry & PAGE_USER)) {
+            return false;
+        }
+
+        if(*pageEntry & MEMMGR_PAGE_FLAG_SWAP) {
+            return memmgr_swap_in(pageEntry);
         }
+
+        if(memmgr_populate_huge_page(faultAddr)) {
+            return true;
+        }
+
+        return memmgr_populate_page(pageEntry);
+    }
+
+    if((errorCode & PF_PRESENT) && (errorCode & PF_WRITE)) {
+        return memmgr_break_cow(faultAddr);
     }
+
+    return false;
 }
 
-bool __attribute__((optimize("O0"))) memmgr_check_user(uintptr_t virtualAddr) {
+/**
+ * Checks if a user page is mapped by walking the page tables
+ * Only used for address spaces without regions
+ */
+bool __attribute__((optimize("O0"))) memmgr_check_user_page(uintptr_t virtualAddr) {
     uint64_t INDEX_PML4 = PML4_INDEX(virtualAddr);
     uint64_t INDEX_PDP = PDP_INDEX(virtualAddr);
     uint64_t INDEX_PD = PD_INDEX(virtualAddr);
@@ -1227,35 +3670,62 @@ bool __attribute__((optimize("O0"))) memmgr_check_user(uintptr_t virtualAddr) {
     return pageTable[INDEX_PT] & PAGE_USER;
 }
 
+/**
+ * Checks if user space may access the given address
+ * @param virtualAddr the address
+ * @return true if the address belongs to an accessible region
+ */
+bool memmgr_check_user(uintptr_t virtualAddr) {
+    mm_struct_t* mm = memmgr_current_mm();
+
+    if(mm != NULL && mm->vmas != NULL) {
+        vma_t* vma = memmgr_vma_find(mm, virtualAddr);
+
+        return vma != NULL && vma->prot != PROT_NONE;
+    }
+
+    return memmgr_check_user_page(virtualAddr);
+}
+
 size_t get_kernel_heap_length() {
     return kernel_heap_length;
 }
 
-//Dumps the internal bitmap
+//Dumps the free lists of the buddy allocator
 void memmgr_dump() {
-    int startAddr = -1;
-    int endAddr = -1;
-    int size = 0;
-
-    for(int i = 0; i < BITMAP_SIZE; i++) {
-        if(memory_map[i]) {
-            if(startAddr == -1) {
-                startAddr = PAGE_TO_ADDRESS(i);
-            }
+    for(int i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        printf("ORDER %d: %d FREE BLOCKS OF %d KB\n", i, free_area_count[i], 4 << i);
+    }
 
-            size += 0x1000;
-        } else {
-            if(startAddr != -1) {
-                endAddr = PAGE_TO_ADDRESS(i);
+    printf("FREE MEMORY: %d KB\n", memmgr_phys_free_frames() * 4);
+    printf("HUGE MAPPED: %d KB\n", memmgr_huge_mapped() / 1024);
+    printf("ZEROED POOL: %d FRAMES\n", zero_pool_count);
 
-                printf("MEM START: %x, MEM END: %x, MEM SIZE: %d\n", startAddr, endAddr, size);
+    swap_stats_t swap;
+    swap_get_stats(&swap);
+    printf("SWAP: %d OF %d KB USED, %d PAGES IN, %d PAGES OUT\n", swap.used_slots * 4, swap.total_slots * 4, swap.swap_ins, swap.swap_outs);
 
-                startAddr = -1;
-                endAddr = -1;
-                size = 0;
-            }
-        }
+    merge_stats_t merge;
+    memmgr_merge_get_stats(&merge);
+    printf("MERGED: %d FRAMES SHARED BY %d MORE PAGES, %d KB SAVED, %d PAGES SCANNED IN %d PASSES\n", merge.pages_shared,
+           merge.pages_sharing, merge.pages_sharing * 4, merge.pages_scanned, merge.full_scans);
+}
+
+/**
+ * Checks CPUID for 1 GiB page support
+ */
+static bool memmgr_has_gigabyte_pages() {
+    uint32_t eax, ebx, ecx, edx;
+
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000000));
+
+    if(eax < 0x80000001) {
+        return false;
     }
+
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001));
+
+    return edx & (1 << 26);
 }
 
 void memmgr_init_pat() {
@@ -1275,7 +3745,40 @@ void memmgr_init(struct multiboot_tag_mmap* tag, uintptr_t kernel_end) {
 
     spin_unlock(&PHYS_MEM_LOCK);
 
-    //Process memory map from GRUB and mark used and reserved pages
+    //Apply Identity Mapping for the entire supported address space
+    uint64_t* IDENTITY_MAP_PD_TEMP = (uint64_t *) (((uintptr_t) &IDENTITY_MAP_PD) - 0xffffff0000000000ull + ((uintptr_t) &_bootstrap_end));
+
+    serial_printf("IDENTITY MAP LOC: 0x%x\n", IDENTITY_MAP_PD_TEMP);
+
+    for(uint64_t i = 0; i < 512; i++) {
+        IDENTITY_MAP_PD[i] = 0;
+    }
+
+    if(memmgr_has_gigabyte_pages()) {
+        //Identity map 512 GiB of memory to high memory
+        for(uint64_t i = 0; i < 512; i++) {
+            IDENTITY_MAP_PD[i] = (i * 0x40000000ULL | PAGE_PRESENT | PAGE_WRITABLE | PAGE_LARGE);
+        }
+    } else {
+        //No 1 GiB pages, identity map the first 4 GiB using 2 MiB pages
+        for(uint64_t i = 0; i < 4; i++) {
+            for(uint64_t j = 0; j < 512; j++) {
+                IDENTITY_MAP_PD_2M[i][j] = ((i * 0x40000000ULL + j * HUGE_PAGE_SIZE) | PAGE_PRESENT | PAGE_WRITABLE | PAGE_LARGE);
+            }
+
+            uintptr_t pd = ((uintptr_t) &IDENTITY_MAP_PD_2M[i]) - 0xffffff0000000000ull + ((uintptr_t) &_bootstrap_end);
+            IDENTITY_MAP_PD[i] = pd | PAGE_PRESENT | PAGE_WRITABLE;
+        }
+
+        serial_printf("No 1 GiB page support, identity map limited to 4 GiB\n");
+    }
+
+    PAGE_MAP[509] = (uintptr_t)IDENTITY_MAP_PD_TEMP | PAGE_PRESENT | PAGE_WRITABLE;
+
+    //The buddy allocator keeps its free lists inside the free frames, so the identity mapping has to be live
+    reloadPML();
+
+    //Process memory map from GRUB, only available memory is handed to the buddy allocator
     for (mmap = ((struct multiboot_tag_mmap *) tag)->entries;
          (multiboot_uint8_t *) mmap
          < (multiboot_uint8_t *) tag + tag->size;
@@ -1284,44 +3787,91 @@ void memmgr_init(struct multiboot_tag_mmap* tag, uintptr_t kernel_end) {
                   + ((struct multiboot_tag_mmap *) tag)->entry_size)) {
         serial_printf("Mmap start: 0x%x, Mmap end: 0x%x, Mmap size: %d, Mmap type: %d \n", mmap->addr, mmap->addr + mmap->len, mmap->len, mmap->type);
 
+        if(mmap->type == MULTIBOOT_MEMORY_AVAILABLE) {
+            //Kernel low memory is never handed out
+            uint64_t start = ADDRESS_TO_PAGE(mmap->addr + 0xFFF);
+            uint64_t end = ADDRESS_TO_PAGE(mmap->addr + mmap->len);
+
+            if(start < ADDRESS_TO_PAGE(0x1001000)) {
+                start = ADDRESS_TO_PAGE(0x1001000);
+            }
+
+            if(start < end) {
+                buddy_add_range(start, end);
+            }
+        }
+    }
+
+    //Entries may overlap, reserved memory always wins
+    for (mmap = ((struct multiboot_tag_mmap *) tag)->entries;
+         (multiboot_uint8_t *) mmap
+         < (multiboot_uint8_t *) tag + tag->size;
+         mmap = (multiboot_memory_map_t *)
+                 ((unsigned long) mmap
+                  + ((struct multiboot_tag_mmap *) tag)->entry_size)) {
         if(mmap->type != MULTIBOOT_MEMORY_AVAILABLE) {
-            for(unsigned long i = mmap->addr; i < mmap->addr + mmap->len; i += 0x1000) {
+            for(unsigned long i = mmap->addr; i < mmap->addr + mmap->len && ADDRESS_TO_PAGE(i) < BITMAP_SIZE; i += 0x1000) {
                 memmgr_phys_mark_page(ADDRESS_TO_PAGE(i));
             }
         }
     }
 
-    //Map kernel low memory
-    for(int i = 0x0; i < 0x1001000; i += 0x1000) {
-        memmgr_phys_mark_page(ADDRESS_TO_PAGE(i));
-    }
-    spin_unlock(&PHYS_MEM_LOCK);
+    kernel_heap_length = 0x0;
 
-    //Apply Identity Mapping for the entire supported address space
-    uint64_t* IDENTITY_MAP_PD_TEMP = (uint64_t *) (((uintptr_t) &IDENTITY_MAP_PD) - 0xffffff0000000000ull + ((uintptr_t) &_bootstrap_end));
+    set_ist(0, (uintptr_t) memmgr_create_stack(false, 16384)); //Setup Interrupt Stack for Page Fault
 
-    serial_printf("IDENTITY MAP LOC: 0x%x\n", IDENTITY_MAP_PD_TEMP);
+    //Reload PML to apply our mappings
+    reloadPML();
+    memmgr_init_pat();
 
-    for(uint64_t i = 0; i < 512; i++) {
-        IDENTITY_MAP_PD[i] = 0;
-    }
+    //Set CR0.WP, kernel writes to copy on write pages have to fault as well
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" : : "r"(cr0 | (1 << 16)));
 
-    //Identity map 512 GiB of memory to high memory
-    for(uint64_t i = 0; i < 512; i++) {
-        IDENTITY_MAP_PD[i] = (i * 0x40000000ULL | PAGE_PRESENT | PAGE_WRITABLE | PAGE_LARGE);
+    //Tag TLB entries with the address space, CR3 still holds 0x1000 with identifier 0 here
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+
+    if(ecx & (1 << 17)) {
+        uint64_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4" : : "r"(cr4 | CR4_PCIDE));
+
+        pcid_enabled = true;
     }
 
-    PAGE_MAP[509] = (uintptr_t)IDENTITY_MAP_PD_TEMP | PAGE_PRESENT | PAGE_WRITABLE;
+    serial_printf("PCID: %s\n", pcid_enabled ? "enabled" : "unavailable");
 
-    kernel_heap_length = 0x0;
+    loaded_page_map[0] = 0x1000;
+    loaded_asid[0] = 0;
 
-    set_ist(0, (uintptr_t) memmgr_create_stack(false, 16384)); //Setup Interrupt Stack for Page Fault
+    merge_shrinker.name = "merged_pages";
+    merge_shrinker.count = memmgr_merge_shrinker_count;
+    merge_shrinker.scan = memmgr_merge_shrinker_scan;
+    register_shrinker(&merge_shrinker);
 
-    //Reload PML to apply our mappings
-    reloadPML();
-    memmgr_init_pat();
+    kernel_stack_shrinker.name = "kernel_stacks";
+    kernel_stack_shrinker.count = memmgr_kernel_stack_shrinker_count;
+    kernel_stack_shrinker.scan = memmgr_kernel_stack_shrinker_scan;
+    register_shrinker(&kernel_stack_shrinker);
 
     //Register commonly used memory structures
 
     //memmgr_dump();
 }
+
+void memmgr_init_cpu() {
+    memmgr_init_pat();
+
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" : : "r"(cr0 | (1 << 16)));
+
+    //load_page_map sets an address space identifier on every cpu once the boot cpu enabled them
+    if(pcid_enabled) {
+        uint64_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4" : : "r"(cr4 | CR4_PCIDE));
+    }
+}
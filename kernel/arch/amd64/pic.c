@@ -41,6 +41,10 @@ void pic_disable() {
     outb(PIC2_DATA, 0xff);
 }
 
+uint16_t pic_get_mask() {
+    return inb(PIC1_DATA) | (inb(PIC2_DATA) << 8);
+}
+
 void pic_enableInterrupt(uint8_t irq) {
     if(irq >= 8) {
         uint8_t bitMask = (1 << (irq-8));
@@ -57,6 +61,15 @@ void pic_enableInterrupt(uint8_t irq) {
     outb(PIC1_DATA, data);
 }
 
+void pic_disableInterrupt(uint8_t irq) {
+    if(irq >= 8) {
+        outb(PIC2_DATA, inb(PIC2_DATA) | (1 << (irq-8)));
+        return;
+    }
+
+    outb(PIC1_DATA, inb(PIC1_DATA) | (1 << irq));
+}
+
 /**
  * This function sets up the Programmable Interrupt Controller. It enables the keyboard, pit and hdd interrupt on line 10
  */
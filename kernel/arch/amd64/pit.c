@@ -5,7 +5,9 @@
 #include "io.h"
 #include "../../idt.h"
 #include "../../terminal.h"
-#include "../../proc/process.h"
+#include "../../ktime.h"
+#include "../../hrtimer.h"
+#include <string.h>
 
 #define PIT0 0x40
 #define PIT1 0x41
@@ -15,21 +17,72 @@
 #define PIT_MASK 0xFF
 #define PIT_SCALE 1193180
 
+#define CMOS_ADDRESS 0x70
+#define CMOS_DATA 0x71
+
+#define CMOS_SECONDS 0x00
+#define CMOS_MINUTES 0x02
+#define CMOS_HOURS 0x04
+#define CMOS_DAY 0x07
+#define CMOS_MONTH 0x08
+#define CMOS_YEAR 0x09
+#define CMOS_STATUS_A 0x0A
+#define CMOS_STATUS_B 0x0B
+
+#define CMOS_UPDATE_IN_PROGRESS 0x80
+#define CMOS_24_HOURS 0x02
+#define CMOS_BINARY 0x04
+#define CMOS_PM 0x80
+
 static volatile uint64_t counter = 0;
+static uint64_t boot_time = 0;
+
+static uint64_t pit_read() {
+    return counter;
+}
+
+//Fallback without a TSC, one cycle is one tick
+static clocksource_t pit_clocksource = {
+    .name = "pit",
+    .rating = 100,
+    .flags = CLOCK_SOURCE_CONTINUOUS,
+    .read = pit_read,
+    .mult = TICK_NSEC,
+    .shift = 0,
+};
+
+static void pit_set_periodic() {
+    int divisor = PIT_SCALE / 100;
+    outb(PIT_CMD, 0x34);
+    outb(PIT0, divisor & PIT_MASK);
+    outb(PIT0, divisor >> 8);
+
+    irq_enable(0);
+}
+
+static void pit_shutdown() {
+    irq_disable(0);
+}
+
+//Fallback until the local APIC timer of the boot cpu takes over
+static clock_event_device_t pit_clockevent = {
+    .name = "pit",
+    .rating = 100,
+    .features = CLOCK_EVT_FEAT_PERIODIC,
+    .set_periodic = pit_set_periodic,
+    .shutdown = pit_shutdown,
+};
 
 /**
- * This function is called every 10 milliseconds and starts the context switch with schedule(false);
+ * This function is called every 10 milliseconds while the PIT is the clock event device, hrtimer_interrupt runs the tick
  * @param regs
  */
 void pit_interrupt(regs_t* regs) {
     counter++;
+    ktime_tick(counter);
 
-    pic_sendEOI(0);
-    if(regs->cs == 0x08) return;
-
-    //We got pre-empted, so no sleep
-    wakeup_sleeping();
-    schedule(false);
+    irq_eoi(0);
+    hrtimer_interrupt(regs);
 }
 
 /**
@@ -37,29 +90,107 @@ void pit_interrupt(regs_t* regs) {
  * @param milliseconds the milliseconds to wait
  */
 void ksleep(long milliseconds) {
-    int endCounter = (milliseconds / 10) + 1 + counter;
+    uint64_t end = ktime_get_ns() + milliseconds * NSEC_PER_MSEC;
 
     while(1) {
-        if(counter >= endCounter) {
+        uint64_t now = ktime_get_ns();
+
+        if(now >= end) {
             return;
         }
 
-        __asm__ volatile("hlt");
+        //Only the timer wakes us up, the rest of a tick is spun away
+        if(end - now > TICK_NSEC) {
+            __asm__ volatile("hlt");
+        } else {
+            __asm__ volatile("pause");
+        }
     }
 }
 
 unsigned long get_counter() {
-    return counter;
+    //The PIT stops once a one shot device takes over, count the ticks of the clock instead
+    return ktime_get_ns() / TICK_NSEC;
+}
+
+uint64_t get_boot_time() {
+    return boot_time;
+}
+
+static uint8_t cmos_read(uint8_t reg) {
+    outb(CMOS_ADDRESS, reg);
+    return inb(CMOS_DATA);
+}
+
+static uint8_t cmos_from_bcd(uint8_t value) {
+    return (value & 0x0F) + (value >> 4) * 10;
+}
+
+/**
+ * Reads the real time clock as seconds since the epoch
+ * The clock is read until two reads match, so an update in between can't tear the values
+ */
+static uint64_t cmos_read_time() {
+    uint8_t time[6];
+    uint8_t last[6];
+    const uint8_t registers[6] = { CMOS_SECONDS, CMOS_MINUTES, CMOS_HOURS, CMOS_DAY, CMOS_MONTH, CMOS_YEAR };
+
+    do {
+        while(cmos_read(CMOS_STATUS_A) & CMOS_UPDATE_IN_PROGRESS);
+
+        for(int i = 0; i < 6; i++) {
+            last[i] = cmos_read(registers[i]);
+        }
+
+        while(cmos_read(CMOS_STATUS_A) & CMOS_UPDATE_IN_PROGRESS);
+
+        for(int i = 0; i < 6; i++) {
+            time[i] = cmos_read(registers[i]);
+        }
+    } while(memcmp(time, last, sizeof(time)) != 0);
+
+    uint8_t status = cmos_read(CMOS_STATUS_B);
+    bool pm = time[2] & CMOS_PM;
+    time[2] &= ~CMOS_PM;
+
+    if(!(status & CMOS_BINARY)) {
+        for(int i = 0; i < 6; i++) {
+            time[i] = cmos_from_bcd(time[i]);
+        }
+    }
+
+    if(!(status & CMOS_24_HOURS)) {
+        time[2] %= 12;
+
+        if(pm) {
+            time[2] += 12;
+        }
+    }
+
+    //Days since the epoch of the civil date, the century register isn't reliable
+    int64_t year = 2000 + time[5];
+    int64_t month = time[4];
+    int64_t day = time[3];
+
+    year -= month <= 2;
+    int64_t era = year / 400;
+    int64_t yearOfEra = year - era * 400;
+    int64_t dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    int64_t days = era * 146097 + dayOfEra - 719468;
+
+    return days * 86400 + time[2] * 3600 + time[1] * 60 + time[0];
 }
 
 /**
  * This function initializes the PIT timer with a scale of approximately every 10 milliseconds
  */
 void timer_init() {
+    boot_time = cmos_read_time();
+
     irq_install_handler(0, pit_interrupt);
 
-    int counter = PIT_SCALE / 100;
-    outb(PIT_CMD, 0x34);
-    outb(PIT0, counter & PIT_MASK);
-    outb(PIT0, counter >> 8);
+    clocksource_register(&pit_clocksource);
+    clockevent_register(&pit_clockevent);
+    tsc_init();
 }
\ No newline at end of file
@@ -0,0 +1,219 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+#include "../../smp.h"
+#include "../../apic.h"
+#include "../../gdt.h"
+#include "../../idt.h"
+#include "../../memmgr.h"
+#include "../../ktime.h"
+#include "../../terminal.h"
+#include "../../proc/process.h"
+#include <stdbool.h>
+#include <string.h>
+
+#define ICR_INIT 0x500
+#define ICR_STARTUP 0x600
+#define ICR_LEVEL_ASSERT (1 << 14)
+
+//Real mode entry of the application processors, start.S cleared this page below 1 MiB and never used it
+#define SMP_TRAMPOLINE 0x4000
+//The boot page map still identity maps the first 2 MiB the trampoline enables paging in
+#define SMP_TRAMPOLINE_PML4 0x1000
+
+//Layout of smp_trampoline_data in smp.S
+typedef struct smp_trampoline_data {
+    uint64_t pml4;
+    uint64_t stack;
+    uint64_t entry;
+    uint64_t cpu;
+} smp_trampoline_data_t;
+
+typedef struct smp_cpu {
+    uint8_t apic_id;
+    uintptr_t interrupt_stack;
+    volatile bool online;
+} smp_cpu_t;
+
+extern char smp_trampoline_start[];
+extern char smp_trampoline_data[];
+extern char smp_trampoline_end[];
+
+static smp_cpu_t cpus[MAX_CPUS];
+static int cpu_count = 0;
+static int cpus_online = 1;
+
+static void smp_delay(uint64_t nanoseconds) {
+    uint64_t end = ktime_get_ns() + nanoseconds;
+
+    while(ktime_get_ns() < end) {
+        __asm__ volatile("pause");
+    }
+}
+
+void smp_parse_madt(MADT* madt) {
+    uintptr_t lapicBase = madt->LocalApicAddress;
+    cpu_count = 0;
+
+    uint8_t* entry = madt->entries;
+    uint8_t* end = (uint8_t*) madt + madt->h.Length;
+
+    while(entry + sizeof(MADTEntryHeader) <= end) {
+        MADTEntryHeader* header = (MADTEntryHeader*) entry;
+
+        if(header->length < sizeof(MADTEntryHeader)) {
+            break;
+        }
+
+        switch(header->type) {
+            case MADT_LOCAL_APIC:
+            {
+                MADTLocalApic* local = (MADTLocalApic*) entry;
+
+                if(!(local->Flags & (MADT_LOCAL_APIC_ENABLED | MADT_LOCAL_APIC_ONLINE_CAPABLE))) {
+                    break;
+                }
+
+                if(cpu_count == MAX_CPUS) {
+                    printf("SMP: ignoring APIC %d, at most %d cpus are supported\n", local->ApicId, MAX_CPUS);
+                    break;
+                }
+
+                cpus[cpu_count++].apic_id = local->ApicId;
+            }
+                break;
+            case MADT_IO_APIC:
+            {
+                MADTIoApic* ioapic = (MADTIoApic*) entry;
+                apic_add_ioapic(ioapic->IoApicId, ioapic->Address, ioapic->GlobalSystemInterruptBase);
+            }
+                break;
+            case MADT_INTERRUPT_OVERRIDE:
+            {
+                MADTInterruptOverride* override = (MADTInterruptOverride*) entry;
+
+                //Bus 0 is ISA, the only bus with overrides
+                if(override->Bus == 0) {
+                    apic_add_override(override->Source, override->GlobalSystemInterrupt, override->Flags);
+                }
+            }
+                break;
+            case MADT_LOCAL_APIC_OVERRIDE:
+                lapicBase = ((MADTLocalApicOverride*) entry)->Address;
+                break;
+        }
+
+        entry += header->length;
+    }
+
+    apic_set_lapic_base(lapicBase);
+
+    printf("SMP: %d cpus, local APIC at 0x%x\n", cpu_count, lapicBase);
+}
+
+/**
+ * Continues an application processor after the trampoline, it runs on the stack of its idle task
+ */
+static _Noreturn void smp_ap_main(int cpu) {
+    gdt_install_cpu(cpu, process_get_pcb(cpu)->kernel_idle_process->main_thread.kernel_stack);
+    set_ist(0, cpus[cpu].interrupt_stack);
+    idt_load();
+    memmgr_init_cpu();
+    lapic_init_cpu();
+    lapic_timer_init();
+
+    __asm__ volatile("fninit");
+
+    __atomic_store_n(&cpus[cpu].online, true, __ATOMIC_RELEASE);
+
+    //Starts over at the top of the stack we are running on
+    process_enter_idle();
+}
+
+/**
+ * Starts one application processor and waits until it runs its idle task
+ * @return false if the cpu didn't respond, the trampoline can't be reused safely then
+ */
+static bool smp_start_cpu(int cpu) {
+    cpus[cpu].interrupt_stack = memmgr_kernel_stack_alloc();
+    process_create_idle(cpu);
+
+    smp_trampoline_data_t* data = memmgr_get_from_physical(SMP_TRAMPOLINE + (smp_trampoline_data - smp_trampoline_start));
+    data->pml4 = SMP_TRAMPOLINE_PML4;
+    data->stack = process_get_pcb(cpu)->kernel_idle_process->main_thread.kernel_stack;
+    data->entry = (uintptr_t) smp_ap_main;
+    data->cpu = cpu;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    lapic_send_ipi(cpus[cpu].apic_id, ICR_INIT | ICR_LEVEL_ASSERT);
+    smp_delay(10 * NSEC_PER_MSEC);
+
+    //The second startup IPI is only for cpus that missed the first one
+    for(int i = 0; i < 2 && !__atomic_load_n(&cpus[cpu].online, __ATOMIC_ACQUIRE); i++) {
+        lapic_send_ipi(cpus[cpu].apic_id, ICR_STARTUP | (SMP_TRAMPOLINE >> 12));
+        smp_delay(200 * NSEC_PER_USEC);
+    }
+
+    uint64_t deadline = ktime_get_ns() + NSEC_PER_SEC;
+
+    while(!__atomic_load_n(&cpus[cpu].online, __ATOMIC_ACQUIRE)) {
+        if(ktime_get_ns() >= deadline) {
+            return false;
+        }
+
+        __asm__ volatile("pause");
+    }
+
+    return true;
+}
+
+void smp_init() {
+    //apic_init mapped the local APIC, without it there is no way to send IPIs
+    if(cpu_count <= 1 || !apic_enabled()) {
+        return;
+    }
+
+    //The MADT lists the cpus in any order, the boot cpu is always cpu 0
+    uint8_t bootApic = lapic_id();
+
+    for(int i = 0; i < cpu_count; i++) {
+        if(cpus[i].apic_id == bootApic) {
+            cpus[i].apic_id = cpus[0].apic_id;
+            cpus[0].apic_id = bootApic;
+            break;
+        }
+    }
+
+    cpus[0].online = true;
+
+    memcpy(memmgr_get_from_physical(SMP_TRAMPOLINE), smp_trampoline_start, smp_trampoline_end - smp_trampoline_start);
+
+    for(int cpu = 1; cpu < cpu_count; cpu++) {
+        if(!smp_start_cpu(cpu)) {
+            printf("SMP: cpu %d (APIC %d) didn't start\n", cpu, cpus[cpu].apic_id);
+            break;
+        }
+
+        cpus_online++;
+    }
+
+    printf("SMP: %d of %d cpus online\n", cpus_online, cpu_count);
+}
+
+int smp_cpu_count() {
+    return cpus_online;
+}
+
+int smp_apic_id(int cpu) {
+    if(cpu < 0 || cpu >= cpus_online) {
+        return -1;
+    }
+
+    //Before smp_init sorted the boot cpu to the front
+    if(cpu == 0 && !cpus[0].online) {
+        return apic_enabled() ? (int) lapic_id() : -1;
+    }
+
+    return cpus[cpu].apic_id;
+}
@@ -0,0 +1,117 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+#include <stddef.h>
+#include "../../ktime.h"
+#include "../../terminal.h"
+#include "io.h"
+#include <stdbool.h>
+
+#define PIT2 0x42
+#define PIT_CMD 0x43
+#define PIT_GATE 0x61
+
+#define PIT_GATE_ENABLE 0x01
+#define PIT_GATE_SPEAKER 0x02
+#define PIT_GATE_OUT2 0x20
+
+#define PIT_FREQUENCY 1193182
+//Calibration window of 10 ms
+#define TSC_CALIBRATE_LATCH (PIT_FREQUENCY / 100)
+#define TSC_CALIBRATE_RUNS 3
+
+#define CPUID_TSC (1 << 4)
+#define CPUID_INVARIANT_TSC (1 << 8)
+
+static uint64_t tsc_frequency = 0;
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    __asm__ volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+static clocksource_t tsc_clocksource = {
+    .name = "tsc",
+    .read = rdtsc,
+};
+
+/**
+ * Counts TSC cycles while PIT channel 2 counts down from TSC_CALIBRATE_LATCH
+ * Interrupts (SMIs included) can only make a run longer, the shortest run is the most accurate
+ * @return the TSC frequency in Hz or 0 if the PIT never finished
+ */
+static uint64_t tsc_calibrate_pit() {
+    uint64_t best = UINT64_MAX;
+
+    for(int run = 0; run < TSC_CALIBRATE_RUNS; run++) {
+        //Gate channel 2 without the speaker, mode 0 raises OUT2 at the terminal count
+        outb(PIT_GATE, (inb(PIT_GATE) & ~PIT_GATE_SPEAKER) | PIT_GATE_ENABLE);
+        outb(PIT_CMD, 0xB0);
+        outb(PIT2, TSC_CALIBRATE_LATCH & 0xFF);
+        outb(PIT2, TSC_CALIBRATE_LATCH >> 8);
+
+        uint64_t start = rdtsc();
+        uint64_t loops = 0;
+
+        while(!(inb(PIT_GATE) & PIT_GATE_OUT2)) {
+            if(++loops > 100000000) {
+                return 0;
+            }
+        }
+
+        uint64_t cycles = rdtsc() - start;
+
+        if(cycles < best) {
+            best = cycles;
+        }
+    }
+
+    return best * PIT_FREQUENCY / TSC_CALIBRATE_LATCH;
+}
+
+void tsc_init() {
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    if(!(edx & CPUID_TSC)) {
+        printf("TSC: not available\n");
+        return;
+    }
+
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    bool invariant = false;
+
+    if(eax >= 0x80000007) {
+        cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+        invariant = edx & CPUID_INVARIANT_TSC;
+    }
+
+    uint64_t frequency = tsc_calibrate_pit();
+
+    if(frequency == 0) {
+        printf("TSC: calibration failed\n");
+        return;
+    }
+
+    clocksource_calc_mult_shift(&tsc_clocksource, frequency);
+
+    //Without the invariant bit the TSC may stop in deep sleep states or follow the cpu frequency,
+    //it then only interpolates between timer ticks
+    if(invariant) {
+        tsc_clocksource.rating = 300;
+        tsc_clocksource.flags = CLOCK_SOURCE_CONTINUOUS | CLOCK_SOURCE_VDSO_TSC | CLOCK_SOURCE_VALID_FOR_HRES;
+    } else {
+        tsc_clocksource.rating = 200;
+        tsc_clocksource.flags = 0;
+    }
+
+    printf("TSC: %d kHz, %s\n", frequency / 1000, invariant ? "invariant" : "not invariant");
+
+    tsc_frequency = frequency;
+
+    clocksource_register(&tsc_clocksource);
+}
+
+uint64_t tsc_get_frequency() {
+    return tsc_frequency;
+}
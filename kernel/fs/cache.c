@@ -7,8 +7,10 @@
 #include <string.h>
 #include "../terminal.h"
 #include "../../mlibc/abis/linux/errno.h"
+#include "../shrinker.h"
 
 vfs_cache_t* cache;
+static shrinker_t cache_shrinker;
 
 //TODO: Rework to use error codes
 static void cache_remove_entry(int i, vfs_cache_entry_t* entry) {
@@ -25,7 +27,7 @@ static void cache_add_entry(vfs_cache_entry_t* entry) {
 
 static void cache_evict(bool flush) {
   while ((cache->total_size > CACHE_MAX_SIZE || flush) && cache->entries.head) {
-    vfs_cache_entry_t* to_evict = (vfs_cache_entry_t*) cache->entries.head;
+    vfs_cache_entry_t* to_evict = (vfs_cache_entry_t*) cache->entries.head->value;
     cache_remove_entry(0, to_evict);
 
     if (to_evict->dirty) {
@@ -79,14 +81,56 @@ static vfs_cache_entry_t* cache_find(file_node_t* file, size_t offset, size_t si
   return NULL;
 }
 
+static size_t cache_shrinker_count(shrinker_t* shrinker) {
+  return (cache->total_size + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+}
+
+/**
+ * Drops the oldest clean entries, dirty entries would need a write back to the file
+ */
+static size_t cache_shrinker_scan(shrinker_t* shrinker, size_t count) {
+  if (!spin_trylock(&cache->lock)) {
+    return 0;
+  }
+
+  size_t freed = 0;
+  list_entry_t* list_entry = cache->entries.head;
+
+  while (list_entry != NULL && freed < count) {
+    vfs_cache_entry_t* entry = (vfs_cache_entry_t*) list_entry->value;
+    list_entry_t* next = list_entry->next;
+
+    if (!entry->dirty) {
+      list_delete(&cache->entries, list_entry);
+      cache->total_size -= entry->size;
+      freed += (entry->size + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+
+      free(entry->data);
+      kfree(entry);
+    }
+
+    list_entry = next;
+  }
+
+  spin_unlock(&cache->lock);
+
+  return freed;
+}
+
 void vfs_cache_init(void) {
   alloc_register_object_size(sizeof(vfs_cache_entry_t));
 
   cache = kcalloc(1, sizeof(vfs_cache_t));
   cache->total_size = 0;
+  spin_unlock(&cache->lock);
+
+  cache_shrinker.name = "vfs_cache";
+  cache_shrinker.count = cache_shrinker_count;
+  cache_shrinker.scan = cache_shrinker_scan;
+  register_shrinker(&cache_shrinker);
 }
 
-int vfs_cache_read(file_node_t* file, char* buffer, size_t offset, size_t size) {
+static int cache_read(file_node_t* file, char* buffer, size_t offset, size_t size) {
   vfs_cache_entry_t* entry = cache_find(file, offset, size, false);
 
   printf("VFS: Cache: read\n");
@@ -131,7 +175,7 @@ int vfs_cache_read(file_node_t* file, char* buffer, size_t offset, size_t size)
   return read;
 }
 
-int vfs_cache_write(file_node_t* file, const char* buffer, size_t offset, size_t size) {
+static int cache_write(file_node_t* file, const char* buffer, size_t offset, size_t size) {
   vfs_cache_entry_t* entry = cache_find(file, offset, size, true);
 
   if (entry) {
@@ -159,7 +203,25 @@ int vfs_cache_write(file_node_t* file, const char* buffer, size_t offset, size_t
   return size;
 }
 
+int vfs_cache_read(file_node_t* file, char* buffer, size_t offset, size_t size) {
+  spin_lock(&cache->lock);
+  int result = cache_read(file, buffer, offset, size);
+  spin_unlock(&cache->lock);
+
+  return result;
+}
+
+int vfs_cache_write(file_node_t* file, const char* buffer, size_t offset, size_t size) {
+  spin_lock(&cache->lock);
+  int result = cache_write(file, buffer, offset, size);
+  spin_unlock(&cache->lock);
+
+  return result;
+}
+
 void vfs_cache_flush(file_node_t* file) {
+  spin_lock(&cache->lock);
+
   for (list_entry_t* list_entry = cache->entries.head; list_entry != NULL; list_entry = list_entry->next) {
     vfs_cache_entry_t* entry = (vfs_cache_entry_t*) list_entry->value;
     if (entry->file == file &&
@@ -168,4 +230,6 @@ void vfs_cache_flush(file_node_t* file) {
       entry->dirty = false;
     }
   }
+
+  spin_unlock(&cache->lock);
 }
\ No newline at end of file
@@ -6,6 +6,7 @@
 #define NIGHTOS_CACHE_H
 
 #include "vfs.h"
+#include "../lock.h"
 
 #define CACHE_MAX_SIZE 1024 * 1024 * 64  // 64 MB cache size
 #define CACHE_BLOCK_SIZE 4096            // 4 KB cache block size
@@ -22,6 +23,7 @@ typedef struct cache {
   uint64_t total_size;
 
   list_t entries;
+  spin_t lock; //Taken by the shrinker with spin_trylock, so it never waits for a cache operation
 } vfs_cache_t;
 
 void vfs_cache_init(void);
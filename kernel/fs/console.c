@@ -179,7 +179,7 @@ void key_event(key_event_t* event) {
 void console_init(int terminalWidthIn, int terminalHeightIn) {
     console.state = STATE_NORMAL;
 
-    file_node_t* node = calloc(1, sizeof(file_node_t));
+    file_node_t* node = vfs_alloc_node();
     node->id = get_next_file_id();
     node->ref_count = 0;
     node->size = 0;
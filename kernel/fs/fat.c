@@ -227,7 +227,7 @@ bool fat_create_file(struct FILE *dir, char *name, int mode) {
     fat_update_fat(fs, cluster, 0x0FFFFFFF);
 
     // Create and return new file node
-    file_node_t *new_file = calloc(1, sizeof(file_node_t));
+    file_node_t *new_file = vfs_alloc_node();
 
     if(!new_file) {
       set_last_error(ENOMEM);
@@ -279,7 +279,7 @@ bool fat_mkdir(struct FILE *dir, char *name) {
     fat_update_fat(fs, cluster, 0x0FFFFFFF);
 
     // Create and return new file node
-    file_node_t *new_file = calloc(1, sizeof(file_node_t));
+    file_node_t *new_file = vfs_alloc_node();
 
     if(!new_file) {
       set_last_error(ENOMEM);
@@ -644,7 +644,7 @@ file_node_t* fat_find_dir(file_node_t* node, char* name) {
             clean_fat_filename((char*)fatDirPointer->filename, filename);
 
             if(strcmp(filename, name) == 0) {
-                file_node_t* newNode = calloc(1, sizeof(file_node_t));
+                file_node_t* newNode = vfs_alloc_node();
 
                 if(!newNode) {
                   set_last_error(ENOMEM);
@@ -722,7 +722,7 @@ file_node_t* fat_find_dir(file_node_t* node, char* name) {
         clean_fat_filename((char*)fatDirPointer->filename, (char*)filename);
 
         if(strcmp(filename, name) == 0) {
-            file_node_t* newNode = calloc(1, sizeof(file_node_t));
+            file_node_t* newNode = vfs_alloc_node();
             if(!newNode) {
               set_last_error(ENOMEM);
               return NULL;
@@ -1121,7 +1121,7 @@ file_node_t* fat_mount(char* device, char* name) {
     }
 
     //TODO: Make utility function to create file_nodes
-    file_node_t* fatNode = calloc(1, sizeof(file_node_t));
+    file_node_t* fatNode = vfs_alloc_node();
 
     if(!fatNode) {
       free(fatFs);
@@ -47,7 +47,7 @@ file_node_t* isofs_find_dir(file_node_t* node, char* name) {
       clean_iso_name(isoDirPointer->filename, filename);
 
       if(strcmp(filename, name) == 0) {
-        file_node_t* newNode = calloc(1, sizeof(file_node_t));
+        file_node_t* newNode = vfs_alloc_node();
         strcpy(newNode->name, filename);
 
         newNode->type = isoDirPointer->flags & DIRECTORY_FLAG_DIR ? FILE_TYPE_DIR : FILE_TYPE_FILE;
@@ -106,7 +106,7 @@ file_node_t* isofs_find_dir(file_node_t* node, char* name) {
     clean_iso_name(isoDirPointer->filename, filename);
 
     if(strcmp(filename, name) == 0) {
-      file_node_t* newNode = calloc(1, sizeof(file_node_t));
+      file_node_t* newNode = vfs_alloc_node();
       strcpy(newNode->name, filename);
 
       newNode->type = isoDirPointer->flags & DIRECTORY_FLAG_DIR ? FILE_TYPE_DIR : FILE_TYPE_FILE;
@@ -359,7 +359,7 @@ file_node_t* isofs_mount(char* device, char* name) {
       fs->root = rootDir;
       fs->volumeDescriptor = primary;
 
-      root = calloc(1, sizeof(file_node_t));
+      root = vfs_alloc_node();
 
       root->fs = fs;
       root->type = FILE_TYPE_MOUNT_POINT;
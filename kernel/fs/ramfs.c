@@ -12,7 +12,7 @@
 void ramfs_init(char* path) {
     char* file_name = strrchr(path, '/')+1; //Get file name
 
-    file_node_t* root = calloc(1, sizeof(file_node_t));
+    file_node_t* root = vfs_alloc_node();
 
     root->id = get_next_file_id(); // is the root
     root->size = 0; //Is a directory
@@ -42,7 +42,7 @@ bool ramfs_mkdir(file_node_t* parent, char* dirname) {
         return false;
     }
 
-    file_node_t* node = calloc(1, sizeof(file_node_t));
+    file_node_t* node = vfs_alloc_node();
 
     node->type = FILE_TYPE_DIR; //Is set to mount point, because mount point is the most free to change type
     node->id = get_next_file_id(); //id 1 will always be the root
@@ -128,7 +128,7 @@ bool ramfs_create(file_node_t* parent, char* name, int mode) {
         return false;
     }
 
-    file_node_t* node = calloc(1, sizeof(file_node_t));
+    file_node_t* node = vfs_alloc_node();
 
     node->type = FILE_TYPE_FILE; //Is set to mount point, because mount point is the most free to change type
     node->id = get_next_file_id(); //id 1 will always be the root
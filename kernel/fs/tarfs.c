@@ -139,7 +139,7 @@ file_node_t* tarfs_find_dir(file_node_t* node, char* name) {
                     node_context->fs = context->fs;
                     node_context->entry = current;
 
-                    file_node_t* node = calloc(1, sizeof(file_node_t));
+                    file_node_t* node = vfs_alloc_node();
                     strncpy(node->name, name, strlen(name));
                     strncpy(node->full_path, filename, strlen(filename));
                     node->id = id;
@@ -195,7 +195,7 @@ file_node_t* tarfs_find_dir(file_node_t* node, char* name) {
                 node_context->fs = context->fs;
                 node_context->entry = current;
 
-                file_node_t* node = calloc(1, sizeof(file_node_t));
+                file_node_t* node = vfs_alloc_node();
                 strncpy(node->name, name, strlen(name));
                 strncpy(node->full_path, filename, strlen(filename));
                 node->id = id;
@@ -446,7 +446,7 @@ void tar_free(tar_t* ptr) {
 file_node_t* tarfs_mount(char* name) {
     char* file_name = strrchr(name, '/'); //Get file name
 
-    file_node_t* root = calloc(1, sizeof(file_node_t));
+    file_node_t* root = vfs_alloc_node();
 
     root->id = 0; // is the root
     root->size = 0; //Is a directory
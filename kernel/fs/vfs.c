@@ -20,6 +20,7 @@ tree_t* file_tree;
 file_node_t* resolve_path(char* cwd, char* file, file_node_t** outParent, char** outFileName);
 
 static int id_generator = 1;
+static kmem_cache_t* file_node_cache;
 
 int vfs_read_dir(struct FILE* node, struct list_dir* buffer, int count) {
     int i = 0;
@@ -58,7 +59,7 @@ bool vfs_create(struct FILE* parent, char* filename, int mode) {
         return false;
     }
 
-    file_node_t* node = calloc(1, sizeof(file_node_t));
+    file_node_t* node = vfs_alloc_node();
 
     node->type = FILE_TYPE_FILE;
     node->size = 0;
@@ -119,7 +120,7 @@ int register_mount(char* name, mount_func func) {
 }
 
 int mount_empty(char* name, int fileType) {
-    file_node_t* node = calloc(1, sizeof(file_node_t));
+    file_node_t* node = vfs_alloc_node();
 
     memset(&node->name, 0, 256);
     memcpy(&node->name, name, strlen(name));
@@ -507,7 +508,7 @@ file_node_t* mkdir_vfs(char* dirname) {
         return NULL;
     }
 
-    node = calloc(1, sizeof(file_node_t));
+    node = vfs_alloc_node();
 
     node->type = FILE_TYPE_DIR; //Is set to mount point, because mount point is the most free to change type
     node->id = id_generator++; //id 1 will always be the root
@@ -786,11 +787,21 @@ void vfs_teardown() {
   tree_destroy(file_tree);
 }
 
+file_node_t* vfs_alloc_node() {
+    if(file_node_cache) {
+        return kmem_cache_zalloc(file_node_cache);
+    }
+
+    return calloc(1, sizeof(file_node_t));
+}
+
 void vfs_install() {
     printf("VFS INIT");
+    file_node_cache = kmem_cache_create("file_node", sizeof(file_node_t), 8, NULL);
+    vfs_cache_init();
     file_tree = tree_create();
 
-    root_node = calloc(1, sizeof(file_node_t));
+    root_node = vfs_alloc_node();
 
     root_node->type = FILE_TYPE_MOUNT_POINT; //Is set to mount point, because mount point is the most free to change type
     root_node->id = id_generator++; //id 1 will always be the root
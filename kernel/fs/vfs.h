@@ -150,6 +150,10 @@ int mount_empty(char* name, int fileType);
 bool insert_file(file_node_t* parent, file_node_t* new);
 
 //Sets up the virtual file system
+/**
+ * Allocates a zeroed file node, free works on the node like on any other allocation
+ */
+file_node_t* vfs_alloc_node();
 void vfs_install();
 void vfs_teardown();
 
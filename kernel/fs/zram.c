@@ -0,0 +1,456 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+
+#include "zram.h"
+#include "../alloc.h"
+#include "../idt.h"
+#include "../terminal.h"
+#include "../../mlibc/abis/linux/errno.h"
+#include <string.h>
+#include <stdlib.h>
+
+//LZ4 block format, a sequence is a token, literals, a 16 bit offset and the match length
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_LAST_LITERALS 5 //The last bytes are always literals
+#define LZ_MF_LIMIT 12 //No match may start this close to the end
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t lz_read32(const uint8_t* ptr) {
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t* lz_write_length(uint8_t* out, size_t length) {
+    while(length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+
+    *out++ = (uint8_t) length;
+
+    return out;
+}
+
+/**
+ * Compresses a buffer with a greedy single probe match finder
+ * @param table scratch table of 2^LZ_HASH_BITS positions
+ * @return the compressed length or 0 if it doesn't fit into capacity
+ */
+static size_t lz_compress(const uint8_t* src, size_t srcLength, uint8_t* dst, size_t capacity, uint16_t* table) {
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + srcLength;
+    uint8_t* op = dst;
+    uint8_t* opEnd = dst + capacity;
+
+    memset(table, 0, sizeof(uint16_t) << LZ_HASH_BITS);
+
+    if(srcLength >= LZ_MF_LIMIT) {
+        const uint8_t* matchStartLimit = end - LZ_MF_LIMIT;
+        const uint8_t* matchEndLimit = end - LZ_LAST_LITERALS;
+
+        ip++;
+
+        while(ip < matchStartLimit) {
+            uint32_t sequence = lz_read32(ip);
+            uint32_t hash = lz_hash(sequence);
+            const uint8_t* ref = src + table[hash];
+
+            table[hash] = ip - src;
+
+            if(ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != sequence) {
+                ip++;
+                continue;
+            }
+
+            const uint8_t* matchEnd = ip + LZ_MIN_MATCH;
+            const uint8_t* refEnd = ref + LZ_MIN_MATCH;
+
+            while(matchEnd < matchEndLimit && *matchEnd == *refEnd) {
+                matchEnd++;
+                refEnd++;
+            }
+
+            size_t literals = ip - anchor;
+            size_t matchLength = matchEnd - ip - LZ_MIN_MATCH;
+
+            if(op + 1 + literals / 255 + 1 + literals + 2 + matchLength / 255 + 1 > opEnd) {
+                return 0;
+            }
+
+            uint8_t* token = op++;
+
+            if(literals >= 15) {
+                *token = 15 << 4;
+                op = lz_write_length(op, literals - 15);
+            } else {
+                *token = literals << 4;
+            }
+
+            memcpy(op, anchor, literals);
+            op += literals;
+
+            uint16_t offset = ip - ref;
+            *op++ = offset & 0xFF;
+            *op++ = offset >> 8;
+
+            if(matchLength >= 15) {
+                *token |= 15;
+                op = lz_write_length(op, matchLength - 15);
+            } else {
+                *token |= matchLength;
+            }
+
+            ip = matchEnd;
+            anchor = ip;
+        }
+    }
+
+    size_t literals = end - anchor;
+
+    if(op + 1 + literals / 255 + 1 + literals > opEnd) {
+        return 0;
+    }
+
+    if(literals >= 15) {
+        *op++ = 15 << 4;
+        op = lz_write_length(op, literals - 15);
+    } else {
+        *op++ = literals << 4;
+    }
+
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return op - dst;
+}
+
+/**
+ * Decompresses a buffer, malformed input never writes outside of dst
+ * @return true if exactly dstLength bytes were produced
+ */
+static bool lz_decompress(const uint8_t* src, size_t srcLength, uint8_t* dst, size_t dstLength) {
+    const uint8_t* ip = src;
+    const uint8_t* end = src + srcLength;
+    uint8_t* op = dst;
+    uint8_t* opEnd = dst + dstLength;
+
+    while(ip < end) {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+
+        if(literals == 15) {
+            uint8_t extra;
+
+            do {
+                if(ip >= end) {
+                    return false;
+                }
+
+                extra = *ip++;
+                literals += extra;
+            } while(extra == 255);
+        }
+
+        if(literals > (size_t) (end - ip) || literals > (size_t) (opEnd - op)) {
+            return false;
+        }
+
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+
+        //The last sequence has no match
+        if(ip >= end) {
+            break;
+        }
+
+        if(end - ip < 2) {
+            return false;
+        }
+
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if(offset == 0 || offset > (size_t) (op - dst)) {
+            return false;
+        }
+
+        size_t matchLength = token & 15;
+
+        if(matchLength == 15) {
+            uint8_t extra;
+
+            do {
+                if(ip >= end) {
+                    return false;
+                }
+
+                extra = *ip++;
+                matchLength += extra;
+            } while(extra == 255);
+        }
+
+        matchLength += LZ_MIN_MATCH;
+
+        if(matchLength > (size_t) (opEnd - op)) {
+            return false;
+        }
+
+        //Matches may overlap their own output
+        const uint8_t* ref = op - offset;
+
+        while(matchLength--) {
+            *op++ = *ref++;
+        }
+    }
+
+    return op == opEnd;
+}
+
+static bool zram_is_zero(const uint8_t* page) {
+    const uint64_t* words = (const uint64_t*) page;
+
+    for(int i = 0; i < ZRAM_PAGE_SIZE / 8; i++) {
+        if(words[i] != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void zram_free_page(zram_device_t* device, uint64_t index) {
+    if(device->data[index] == NULL) {
+        return;
+    }
+
+    kfree(device->data[index]);
+
+    device->data[index] = NULL;
+    device->stored_pages--;
+    device->compressed_size -= device->length[index];
+    device->length[index] = 0;
+}
+
+/**
+ * Decompresses a page into the scratch page of the device
+ * Lock of the device must be held!
+ */
+static bool zram_load_page(zram_device_t* device, uint64_t index) {
+    if(device->data[index] == NULL) {
+        memset(device->page, 0, ZRAM_PAGE_SIZE);
+        return true;
+    }
+
+    if(device->length[index] == ZRAM_PAGE_SIZE) {
+        memcpy(device->page, device->data[index], ZRAM_PAGE_SIZE);
+        return true;
+    }
+
+    return lz_decompress(device->data[index], device->length[index], device->page, ZRAM_PAGE_SIZE);
+}
+
+/**
+ * Compresses the scratch page of the device and stores it
+ * Lock of the device must be held!
+ */
+static bool zram_store_page(zram_device_t* device, uint64_t index) {
+    if(zram_is_zero(device->page)) {
+        zram_free_page(device, index);
+        return true;
+    }
+
+    size_t length = lz_compress(device->page, ZRAM_PAGE_SIZE, device->compressed, ZRAM_PAGE_SIZE - 1, device->table);
+    uint8_t* source = device->compressed;
+
+    if(length == 0) {
+        //Incompressible, storing it as is costs less than the decompression
+        length = ZRAM_PAGE_SIZE;
+        source = device->page;
+    }
+
+    //The slab size classes make up the pool, so compressed pages share frames
+    uint8_t* data = kmalloc(length);
+
+    if(data == NULL) {
+        return false;
+    }
+
+    memcpy(data, source, length);
+
+    zram_free_page(device, index);
+
+    device->data[index] = data;
+    device->length[index] = length;
+    device->stored_pages++;
+    device->compressed_size += length;
+
+    return true;
+}
+
+int zram_read(file_node_t* node, char* buffer, size_t offset, size_t length) {
+    zram_device_t* device = (zram_device_t*) node->fs;
+
+    if(offset >= device->size) {
+        return 0;
+    }
+
+    if(length > device->size - offset) {
+        length = device->size - offset;
+    }
+
+    uint64_t rflags = cli();
+    spin_lock(&device->lock);
+
+    size_t done = 0;
+
+    while(done < length) {
+        uint64_t index = (offset + done) / ZRAM_PAGE_SIZE;
+        size_t pageOffset = (offset + done) % ZRAM_PAGE_SIZE;
+        size_t count = ZRAM_PAGE_SIZE - pageOffset < length - done ? ZRAM_PAGE_SIZE - pageOffset : length - done;
+
+        if(device->data[index] == NULL) {
+            memset(buffer + done, 0, count);
+        } else if(pageOffset == 0 && count == ZRAM_PAGE_SIZE && device->length[index] != ZRAM_PAGE_SIZE) {
+            //Whole pages are decompressed right into the buffer
+            if(!lz_decompress(device->data[index], device->length[index], (uint8_t*) buffer + done, ZRAM_PAGE_SIZE)) {
+                break;
+            }
+        } else {
+            if(!zram_load_page(device, index)) {
+                break;
+            }
+
+            memcpy(buffer + done, device->page + pageOffset, count);
+        }
+
+        done += count;
+    }
+
+    spin_unlock(&device->lock);
+    sti(rflags);
+
+    return done == length ? (int) length : -EIO;
+}
+
+int zram_write(file_node_t* node, char* buffer, size_t offset, size_t length) {
+    zram_device_t* device = (zram_device_t*) node->fs;
+
+    if(offset >= device->size) {
+        return -ENOSPC;
+    }
+
+    if(length > device->size - offset) {
+        length = device->size - offset;
+    }
+
+    uint64_t rflags = cli();
+    spin_lock(&device->lock);
+
+    size_t done = 0;
+
+    while(done < length) {
+        uint64_t index = (offset + done) / ZRAM_PAGE_SIZE;
+        size_t pageOffset = (offset + done) % ZRAM_PAGE_SIZE;
+        size_t count = ZRAM_PAGE_SIZE - pageOffset < length - done ? ZRAM_PAGE_SIZE - pageOffset : length - done;
+
+        //Partial writes have to keep the rest of the page
+        if(count != ZRAM_PAGE_SIZE && !zram_load_page(device, index)) {
+            break;
+        }
+
+        memcpy(device->page + pageOffset, buffer + done, count);
+
+        if(!zram_store_page(device, index)) {
+            break;
+        }
+
+        done += count;
+    }
+
+    spin_unlock(&device->lock);
+    sti(rflags);
+
+    if(done != length) {
+        return done > 0 ? (int) done : -ENOMEM;
+    }
+
+    return (int) length;
+}
+
+void zram_get_stats(file_node_t* node, zram_stats_t* stats) {
+    zram_device_t* device = (zram_device_t*) node->fs;
+
+    uint64_t rflags = cli();
+    spin_lock(&device->lock);
+
+    stats->original_size = device->stored_pages * ZRAM_PAGE_SIZE;
+    stats->compressed_size = device->compressed_size;
+
+    spin_unlock(&device->lock);
+    sti(rflags);
+
+    stats->saved_size = stats->original_size - stats->compressed_size;
+    stats->ratio = stats->compressed_size ? stats->original_size * 100 / stats->compressed_size : 0;
+}
+
+void zram_dump(file_node_t* node) {
+    zram_stats_t stats;
+    zram_get_stats(node, &stats);
+
+    printf("%s: %d KB stored in %d KB, ratio %d%%, %d KB saved\n", node->name, stats.original_size / 1024,
+           stats.compressed_size / 1024, stats.ratio, stats.saved_size / 1024);
+}
+
+file_node_t* zram_create(int index, uint64_t size) {
+    zram_device_t* device = calloc(1, sizeof(zram_device_t));
+
+    if(device == NULL) {
+        return NULL;
+    }
+
+    device->pages = size / ZRAM_PAGE_SIZE;
+    device->size = device->pages * ZRAM_PAGE_SIZE;
+    device->data = calloc(device->pages, sizeof(uint8_t*));
+    device->length = calloc(device->pages, sizeof(uint16_t));
+    device->page = kmalloc(ZRAM_PAGE_SIZE);
+    device->compressed = kmalloc(ZRAM_PAGE_SIZE);
+    device->table = kmalloc(sizeof(uint16_t) << LZ_HASH_BITS);
+
+    if(device->data == NULL || device->length == NULL || device->page == NULL || device->compressed == NULL || device->table == NULL) {
+        free(device->data);
+        free(device->length);
+        kfree(device->page);
+        kfree(device->compressed);
+        kfree(device->table);
+        free(device);
+
+        return NULL;
+    }
+
+    file_node_t* node = vfs_alloc_node();
+    node->id = get_next_file_id();
+    node->type = FILE_TYPE_BLOCK_DEVICE;
+    node->fs = device;
+    node->size = device->size;
+    node->ref_count = 0;
+
+    snprintf(node->name, 16, "zram%d", index);
+    node->file_ops.read = zram_read;
+    node->file_ops.write = zram_write;
+
+    char path[32];
+    snprintf(path, 32, "/dev/%s", node->name);
+    mount_directly(path, node);
+
+    return node;
+}
@@ -0,0 +1,56 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+
+#ifndef NIGHTOS_ZRAM_H
+#define NIGHTOS_ZRAM_H
+
+#include <stdint.h>
+#include "vfs.h"
+#include "../lock.h"
+
+//A block device in RAM that stores its pages LZ4 compressed. Everything written to it is lost on restart.
+
+#define ZRAM_PAGE_SIZE 4096
+#define ZRAM_DEFAULT_SIZE (64 * 1024 * 1024)
+
+typedef struct ZramDevice {
+    uint64_t size;
+    uint64_t pages;
+
+    //Compressed data of every page, NULL if the page only holds zeroes
+    uint8_t** data;
+    //Compressed length of every page, ZRAM_PAGE_SIZE if the page didn't compress and is stored as is
+    uint16_t* length;
+
+    //Scratch buffers for a decompressed page, a compressed page and the match table of the compressor
+    uint8_t* page;
+    uint8_t* compressed;
+    uint16_t* table;
+
+    uint64_t stored_pages;
+    uint64_t compressed_size;
+
+    spin_t lock;
+} zram_device_t;
+
+typedef struct ZramStats {
+    uint64_t original_size; //Bytes of all pages holding data
+    uint64_t compressed_size; //Bytes actually stored
+    uint64_t saved_size;
+    uint64_t ratio; //original_size / compressed_size in percent, 0 if nothing is stored
+} zram_stats_t;
+
+/**
+ * Creates a compressed RAM disk and mounts it at /dev/zram<index>
+ * @param index the device number
+ * @param size the size of the disk, rounded down to whole pages
+ * @return the device node or NULL if no memory is available
+ */
+file_node_t* zram_create(int index, uint64_t size);
+int zram_read(file_node_t* node, char* buffer, size_t offset, size_t length);
+int zram_write(file_node_t* node, char* buffer, size_t offset, size_t length);
+void zram_get_stats(file_node_t* node, zram_stats_t* stats);
+void zram_dump(file_node_t* node);
+
+#endif //NIGHTOS_ZRAM_H
@@ -6,6 +6,14 @@
 #define NIGHTOS_GDT_H
 
 #include <stdint.h>
+#include <stddef.h>
+
+//Selectors of the GDT in start.S
+#define KERNEL_CODE_SELECTOR 0x08
+#define KERNEL_DATA_SELECTOR 0x10
+#define USER_DATA_SELECTOR (0x18 | 0x03)
+#define USER_CODE_SELECTOR (0x20 | 0x03)
+#define TSS_SELECTOR 0x28
 
 struct gdt_descriptor {
     uint16_t limit_low;
@@ -47,8 +55,32 @@ typedef struct {
     uintptr_t base;
 } __attribute__((packed)) gdt_pointer_t;
 
+struct process_control_block;
+
+//Per cpu data, the GS base points to it whenever the cpu runs kernel code. Interrupts and syscalls from user space swap it in.
+//The offsets of kernel_stack, user_stack and self are used by idt.S and context_switch.S.
+typedef struct cpu_local {
+    uintptr_t kernel_stack; //Top of the kernel stack of the running thread, same as rsp0 of the TSS
+    uintptr_t user_stack;   //User stack pointer during a syscall
+    struct cpu_local* self; //Address of this structure, the GS base can't be read without rdmsr
+    struct process_control_block* pcb;
+    tss_entry_t* tss;
+} cpu_local_t;
+
+static inline cpu_local_t* get_cpu_local() {
+    cpu_local_t* local;
+    __asm__ volatile("mov %%gs:%c1, %0" : "=r"(local) : "i"(offsetof(cpu_local_t, self)));
+    return local;
+}
+
 void gdt_install();
+/**
+ * Loads a GDT and TSS of the cpu and points the GS base to its cpu_local
+ * @param cpu the index of the executing cpu
+ * @param stack the kernel stack used for interrupts until the first thread runs
+ */
+void gdt_install_cpu(int cpu, uintptr_t stack);
 void set_stack_pointer(uintptr_t stack);
 void set_ist(int index, uintptr_t stack);
 
-#endif //NIGHTOS_GDT_H
+#endif //NIGHTOS_GDT_H
\ No newline at end of file
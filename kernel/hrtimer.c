@@ -0,0 +1,240 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+#include "hrtimer.h"
+#include "ktime.h"
+#include "vdso.h"
+#include "terminal.h"
+#include "proc/process.h"
+
+//Timers and the clock event device of one cpu, only touched by that cpu with interrupts disabled
+typedef struct hrtimer_cpu_base {
+    avl_tree_t timers; //Sorted by expiry, set up by the first enqueue
+    clock_event_device_t* device;
+
+    bool oneshot; //The device is programmed for every event, otherwise it ticks periodically
+    bool tick_stopped;
+    uint64_t next_tick;
+    uint64_t next_event; //Programmed into the device, UINT64_MAX if nothing is
+} hrtimer_cpu_base_t;
+
+static hrtimer_cpu_base_t bases[MAX_CPUS];
+
+static int hrtimer_compare(void* a, void* b) {
+    hrtimer_t* first = a;
+    hrtimer_t* second = b;
+
+    if(first->expires < second->expires) {
+        return -1;
+    }
+
+    return first->expires > second->expires;
+}
+
+static hrtimer_t* hrtimer_first(hrtimer_cpu_base_t* base) {
+    avl_tree_node_t* node = avl_tree_first(&base->timers);
+
+    return node ? node->value : NULL;
+}
+
+static void hrtimer_enqueue(hrtimer_cpu_base_t* base, hrtimer_t* timer) {
+    if(base->timers.compare == NULL) {
+        avl_tree_init(&base->timers, hrtimer_compare, NULL);
+    }
+
+    timer->node.value = timer;
+    avl_tree_insert_node(&base->timers, &timer->node);
+    timer->queued = true;
+}
+
+static void hrtimer_dequeue(hrtimer_cpu_base_t* base, hrtimer_t* timer) {
+    avl_tree_unlink(&base->timers, &timer->node);
+    timer->queued = false;
+}
+
+/**
+ * Programs the device for the earliest of the tick, the first timer and on cpu 0 the first sleeper
+ */
+static void hrtimer_reprogram(hrtimer_cpu_base_t* base, int cpu) {
+    if(!base->oneshot) {
+        return;
+    }
+
+    uint64_t next = base->tick_stopped ? UINT64_MAX : base->next_tick;
+    hrtimer_t* first = hrtimer_first(base);
+
+    if(first != NULL && first->expires < next) {
+        next = first->expires;
+    }
+
+    //Sleepers are woken by cpu 0, without the tick it has to wake up for them
+    if(base->tick_stopped && cpu == 0) {
+        uint64_t wakeup = process_next_wakeup();
+
+        if(wakeup < next) {
+            next = wakeup;
+        }
+    }
+
+    base->next_event = next;
+    base->device->set_next_event(next);
+}
+
+static void hrtimer_run_expired(hrtimer_cpu_base_t* base, uint64_t now) {
+    hrtimer_t* timer;
+
+    while((timer = hrtimer_first(base)) != NULL && timer->expires <= now) {
+        hrtimer_dequeue(base, timer);
+
+        if(timer->function(timer) == HRTIMER_RESTART) {
+            hrtimer_enqueue(base, timer);
+        }
+    }
+}
+
+void clockevent_register(clock_event_device_t* device) {
+    int cpu = get_current_core();
+    hrtimer_cpu_base_t* base = &bases[cpu];
+
+    if(base->device != NULL && base->device->rating >= device->rating) {
+        return;
+    }
+
+    uint64_t rflags = cli();
+
+    if(base->device != NULL) {
+        base->device->shutdown();
+    }
+
+    base->device = device;
+    base->tick_stopped = false;
+
+    //A coarse clocksource can't tell when a one shot event is due, tick periodically then
+    base->oneshot = (device->features & CLOCK_EVT_FEAT_ONESHOT) && ktime_hres_capable();
+
+    if(base->oneshot) {
+        device->set_oneshot();
+
+        base->next_tick = (ktime_get_ns() / TICK_NSEC + 1) * TICK_NSEC;
+        hrtimer_reprogram(base, cpu);
+    } else {
+        base->next_event = UINT64_MAX;
+        device->set_periodic();
+    }
+
+    sti(rflags);
+
+    printf("clockevent: cpu %d uses %s, %s\n", cpu, device->name, base->oneshot ? "one shot" : "periodic");
+}
+
+void hrtimer_interrupt(regs_t* regs) {
+    int cpu = get_current_core();
+    hrtimer_cpu_base_t* base = &bases[cpu];
+    uint64_t now = ktime_get_ns();
+
+    hrtimer_run_expired(base, now);
+
+    bool tick = !base->oneshot;
+
+    if(base->oneshot && !base->tick_stopped && now >= base->next_tick) {
+        tick = true;
+
+        //Missed ticks are dropped, the tick stays on its grid
+        base->next_tick += ((now - base->next_tick) / TICK_NSEC + 1) * TICK_NSEC;
+    }
+
+    hrtimer_reprogram(base, cpu);
+
+    if(tick && cpu == 0) {
+        vdso_update_time();
+    }
+
+    if(regs->cs == 0x08) return;
+
+    if(tick) {
+        if(cpu == 0) {
+            wakeup_sleeping();
+        }
+
+        sched_tick();
+    }
+
+    //Set by the slice timer, a wakeup or the tick. We got pre-empted, so no sleep
+    if(get_pcb()->need_resched) {
+        schedule(false);
+    }
+}
+
+void hrtimer_init(hrtimer_t* timer, hrtimer_restart_t (*function)(hrtimer_t* timer)) {
+    timer->expires = 0;
+    timer->function = function;
+    timer->queued = false;
+    timer->cpu = -1;
+}
+
+void hrtimer_start(hrtimer_t* timer, uint64_t expires) {
+    uint64_t rflags = cli();
+    int cpu = get_current_core();
+    hrtimer_cpu_base_t* base = &bases[cpu];
+
+    if(timer->queued) {
+        hrtimer_dequeue(&bases[timer->cpu], timer);
+    }
+
+    timer->expires = expires;
+    timer->cpu = cpu;
+    hrtimer_enqueue(base, timer);
+
+    //Without a device the timer waits until one is registered
+    if(base->device != NULL && expires < base->next_event) {
+        hrtimer_reprogram(base, cpu);
+    }
+
+    sti(rflags);
+}
+
+bool hrtimer_cancel(hrtimer_t* timer) {
+    uint64_t rflags = cli();
+
+    if(!timer->queued) {
+        sti(rflags);
+        return false;
+    }
+
+    //The device may fire once more for it, the interrupt finds nothing expired
+    hrtimer_dequeue(&bases[timer->cpu], timer);
+
+    sti(rflags);
+
+    return true;
+}
+
+void tick_nohz_idle_enter() {
+    int cpu = get_current_core();
+    hrtimer_cpu_base_t* base = &bases[cpu];
+
+    if(!base->oneshot || base->tick_stopped) {
+        return;
+    }
+
+    base->tick_stopped = true;
+    hrtimer_reprogram(base, cpu);
+}
+
+void tick_nohz_idle_exit() {
+    int cpu = get_current_core();
+    hrtimer_cpu_base_t* base = &bases[cpu];
+
+    if(!base->tick_stopped) {
+        return;
+    }
+
+    base->tick_stopped = false;
+    base->next_tick = (ktime_get_ns() / TICK_NSEC + 1) * TICK_NSEC;
+
+    if(cpu == 0) {
+        vdso_update_time();
+    }
+
+    hrtimer_reprogram(base, cpu);
+}
@@ -0,0 +1,90 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+
+#ifndef NIGHTOS_HRTIMER_H
+#define NIGHTOS_HRTIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "idt.h"
+#include "../libc/include/kernel/tree.h"
+
+//The device fires once at a programmed time
+#define CLOCK_EVT_FEAT_ONESHOT (1 << 0)
+//The device fires every TICK_NSEC on its own
+#define CLOCK_EVT_FEAT_PERIODIC (1 << 1)
+
+//A timer interrupt source of one cpu, the device with the highest rating is used.
+//Its interrupt handler acknowledges the interrupt and calls hrtimer_interrupt.
+typedef struct clock_event_device {
+    const char* name;
+    int rating;
+    int features;
+
+    void (*set_oneshot)();
+    void (*set_periodic)();
+    /**
+     * Programs the next interrupt, UINT64_MAX stops the device until the next call
+     * @param expires ktime in nanoseconds, times in the past fire right away
+     */
+    void (*set_next_event)(uint64_t expires);
+    void (*shutdown)();
+} clock_event_device_t;
+
+typedef enum hrtimer_restart {
+    HRTIMER_NORESTART,
+    HRTIMER_RESTART, //The callback moved expires forward, queue the timer again
+} hrtimer_restart_t;
+
+typedef struct hrtimer {
+    uint64_t expires; //ktime in nanoseconds
+    hrtimer_restart_t (*function)(struct hrtimer* timer); //Runs in the timer interrupt
+
+    avl_tree_node_t node; //Embedded, queueing a timer never allocates
+    bool queued;
+    int cpu;
+} hrtimer_t;
+
+/**
+ * Uses the device for the executing cpu if it is rated higher than the current one.
+ * One shot devices only run tickless if the clocksource keeps time without timer interrupts.
+ */
+void clockevent_register(clock_event_device_t* device);
+
+/**
+ * Runs the expired timers of the executing cpu and the scheduler tick, called by the clock event device.
+ * Switches processes if the interrupted user process should give up the cpu.
+ */
+void hrtimer_interrupt(regs_t* regs);
+
+void hrtimer_init(hrtimer_t* timer, hrtimer_restart_t (*function)(hrtimer_t* timer));
+
+/**
+ * Queues the timer on the executing cpu, a queued timer is moved
+ * @param expires ktime in nanoseconds
+ */
+void hrtimer_start(hrtimer_t* timer, uint64_t expires);
+
+/**
+ * Removes the timer from its queue, has to run on the cpu the timer was started on
+ * @return true if the timer was queued
+ */
+bool hrtimer_cancel(hrtimer_t* timer);
+
+static inline bool hrtimer_active(hrtimer_t* timer) {
+    return timer->queued;
+}
+
+/**
+ * Stops the scheduler tick before the idle task halts, the cpu only wakes for timers, sleepers and interrupts.
+ * Called with interrupts disabled.
+ */
+void tick_nohz_idle_enter();
+
+/**
+ * Restarts the scheduler tick once the idle task woke up, called with interrupts disabled
+ */
+void tick_nohz_idle_exit();
+
+#endif //NIGHTOS_HRTIMER_H
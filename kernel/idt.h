@@ -19,17 +19,59 @@ typedef struct exception_registers {
 
 typedef void (*irq_handler_t)(regs_t* regs);
 
+//Irq n arrives at vector IRQ_BASE + n, the first 16 are the ISA lines
+#define IRQ_BASE 0x20
+#define IRQ_LEGACY 16
+#define IRQ_COUNT (256 - IRQ_BASE)
+//int 0x80 is the syscall gate, vectors from 0xF0 on are local to the cpu
+#define IRQ_SYSCALL (0x80 - IRQ_BASE)
+#define IRQ_DYNAMIC_END (0xF0 - IRQ_BASE)
+
 void irq_install_handler(size_t irq, irq_handler_t handler);
 
+/**
+ * Reserves a vector above the ISA lines, for MSI or IOAPIC pins above 15
+ * @return the irq or -ENOSPC
+ */
+int irq_alloc(irq_handler_t handler);
+void irq_free(uint8_t irq);
+
+/**
+ * Acknowledges the irq, handlers call it before they might switch away
+ */
+void irq_eoi(uint8_t irq);
+
+/**
+ * Unmasks an ISA line at the IOAPIC or the PIC
+ */
+void irq_enable(uint8_t irq);
+void irq_disable(uint8_t irq);
+
+/**
+ * Delivers an IOAPIC routed irq to another cpu, its handler has to cope with running there
+ * @return 0, -EINVAL for an offline cpu or -ENODEV without IOAPIC
+ */
+int irq_set_affinity(uint8_t irq, int cpu);
+
 void pic_disable();
 void pic_setup();
 void pic_enableInterrupt(uint8_t irq);
+void pic_disableInterrupt(uint8_t irq);
 void pic_sendEOI(uint8_t irq);
+/**
+ * @return the mask of both PICs, a set bit is a disabled line
+ */
+uint16_t pic_get_mask();
 void idt_install();
+/**
+ * Loads the IDT on the executing cpu, all cpus share the same table
+ */
+void idt_load();
 void irq_install();
 
 void exception_handler(regs_t * regs);
 void syscall_entry(regs_t* regs);
+void syscall_handler(regs_t* regs);
 
 inline void sti(uint64_t rflags);
 inline uint64_t cli();
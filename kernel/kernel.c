@@ -23,6 +23,10 @@
 #include "acpi.h"
 #include "symbol.h"
 #include "fs/ramfs.h"
+#include "fs/zram.h"
+#include "vdso.h"
+#include "smp.h"
+#include "apic.h"
 #include "proc/message.h"
 #include "../mlibc/abis/linux/fcntl.h"
 #define SSFN_CONSOLEBITMAP_TRUECOLOR        /* use the special renderer for 32 bit truecolor packed pixels */
@@ -608,6 +612,7 @@ void kernel_main(unsigned long magic, unsigned long header)
             case MULTIBOOT_TAG_TYPE_CMDLINE:
                 serial_printf ("Command line = %s\n",
                                ((struct multiboot_tag_string *) tag)->string);
+                sched_parse_cmdline(((struct multiboot_tag_string *) tag)->string);
                 break;
             case MULTIBOOT_TAG_TYPE_BOOT_LOADER_NAME:
                 serial_printf ("Boot loader name = %s\n",
@@ -707,9 +712,9 @@ void kernel_main(unsigned long magic, unsigned long header)
     timer_init();
     init_kernel_symbols();
 
-    alloc_register_object_size(sizeof(list_entry_t));
+    list_init();
+    tree_init();
     alloc_register_object_size(sizeof(list_t));
-    alloc_register_object_size(sizeof(process_t));
     alloc_register_object_size(sizeof(message_t));
 
     //Setup filesystem and modules
@@ -743,6 +748,8 @@ void kernel_main(unsigned long magic, unsigned long header)
 
     //Init pci
     pci_init(rsdp);
+    //The MADT is known now, move the interrupts from the PIC to the IOAPIC
+    apic_init();
 
 	//terminal_writestring("Hello Kernel\n");
 
@@ -755,21 +762,32 @@ void kernel_main(unsigned long magic, unsigned long header)
     }*/
     console_init(terminalWidth, terminalHeight);
     syscall_init();
+    vdso_init();
 
     //Load filesystem at hd0
     mount_directly("/mnt", fat_mount("/dev/hd0", "/mnt"));
     ramfs_init("/tmp");
+    zram_create(0, ZRAM_DEFAULT_SIZE);
 
     printf("Performing list test now...\n");
     //list_test();
     printf("Performing tree test now...\n");
     //tree_test();
+    printf("Performing AVL tree test now...\n");
+    //avl_tree_test();
     printf("Performing VFS test now...\n");
     vfs_test();
     printf("Performing FAT test now...\n");
     fat_test();
 
     kmalloc_test();
+    kmem_cache_test();
+    zram_test();
+    uaccess_test();
+    ktime_test();
+    vdso_test();
+    apic_test();
+    run_queue_test();
 
     //Try opening console
     file_node_t* console0 = open("/dev/tty", 0);
@@ -778,10 +796,18 @@ void kernel_main(unsigned long magic, unsigned long header)
     write(hConsole, "test", strlen("test")+1);
 
     process_init();
-    process_create_idle();
+    process_create_idle(0);
 
     __asm__ volatile ("sti"); // set the interrupt flag
 
+    //Start the other cpus, the calibration delays need the timer
+    smp_init();
+    smp_test();
+    hrtimer_test();
+    sleep_heap_test();
+    swap_test();
+    merge_test();
+
     process_create_task("/usr/bin/bash", false);
 
     __asm__ volatile("cli");
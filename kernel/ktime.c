@@ -0,0 +1,145 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+#include "ktime.h"
+#include "idt.h"
+#include "terminal.h"
+
+static clocksource_t* clocksource = NULL;
+
+//Odd while the base is updated, readers retry
+static volatile uint32_t ktime_seq = 0;
+static uint64_t ktime_base_ns = 0;
+static uint64_t ktime_base_cycles = 0;
+
+static uint64_t clocksource_cyc2ns(clocksource_t* source, uint64_t cycles) {
+    return (uint64_t) (((unsigned __int128) cycles * source->mult) >> source->shift);
+}
+
+/**
+ * Reads the base the time is calculated from
+ * @return the clocksource the base belongs to
+ */
+static clocksource_t* ktime_read_base(uint64_t* ns, uint64_t* cycles) {
+    uint32_t seq;
+    clocksource_t* source;
+
+    do {
+        seq = ktime_seq;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        source = clocksource;
+        *ns = ktime_base_ns;
+        *cycles = ktime_base_cycles;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while((seq & 1) || ktime_seq != seq);
+
+    return source;
+}
+
+static void ktime_write_base(clocksource_t* source, uint64_t ns, uint64_t cycles) {
+    __atomic_store_n(&ktime_seq, ktime_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    clocksource = source;
+    ktime_base_ns = ns;
+    ktime_base_cycles = cycles;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&ktime_seq, ktime_seq + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Converts a counter value read after the base into nanoseconds
+ */
+static uint64_t ktime_from_cycles(clocksource_t* source, uint64_t ns, uint64_t base, uint64_t cycles) {
+    uint64_t delta = clocksource_cyc2ns(source, cycles - base);
+
+    //Sources that stop or drift between ticks never reach the next anchor, the time stays monotonic
+    if(!(source->flags & CLOCK_SOURCE_CONTINUOUS) && delta >= TICK_NSEC) {
+        delta = TICK_NSEC - 1;
+    }
+
+    return ns + delta;
+}
+
+clocksource_t* ktime_get_snapshot(uint64_t* ns, uint64_t* cycles) {
+    uint64_t baseNs, baseCycles;
+    clocksource_t* source = ktime_read_base(&baseNs, &baseCycles);
+
+    if(source == NULL) {
+        *ns = 0;
+        *cycles = 0;
+        return NULL;
+    }
+
+    *cycles = source->read();
+    *ns = ktime_from_cycles(source, baseNs, baseCycles, *cycles);
+
+    return source;
+}
+
+uint64_t ktime_get_ns() {
+    uint64_t ns, cycles;
+
+    ktime_get_snapshot(&ns, &cycles);
+
+    return ns;
+}
+
+bool ktime_hres_capable() {
+    uint64_t ns, cycles;
+    clocksource_t* source = ktime_read_base(&ns, &cycles);
+
+    return source != NULL && (source->flags & CLOCK_SOURCE_VALID_FOR_HRES);
+}
+
+void ktime_tick(uint64_t ticks) {
+    uint64_t ns, cycles;
+    clocksource_t* source = ktime_read_base(&ns, &cycles);
+
+    if(source == NULL || (source->flags & CLOCK_SOURCE_CONTINUOUS)) {
+        return;
+    }
+
+    //The tick is the reference, the counter only interpolates until the next one
+    uint64_t anchor = ticks * TICK_NSEC;
+
+    if(anchor > ns) {
+        ktime_write_base(source, anchor, source->read());
+    }
+}
+
+void clocksource_calc_mult_shift(clocksource_t* source, uint64_t frequency) {
+    //The largest shift that keeps mult in 32 bits gives the best precision
+    for(uint32_t shift = 32; shift > 0; shift--) {
+        uint64_t mult = (((unsigned __int128) NSEC_PER_SEC << shift) + frequency / 2) / frequency;
+
+        if(mult <= UINT32_MAX) {
+            source->mult = mult;
+            source->shift = shift;
+            return;
+        }
+    }
+
+    source->mult = NSEC_PER_SEC / frequency;
+    source->shift = 0;
+}
+
+void clocksource_register(clocksource_t* source) {
+    uint64_t rflags = cli();
+
+    if(clocksource != NULL && clocksource->rating >= source->rating) {
+        sti(rflags);
+        return;
+    }
+
+    //Continue at the current time, the new counter starts counting from here
+    uint64_t now = ktime_get_ns();
+    ktime_write_base(source, now, source->read());
+
+    sti(rflags);
+
+    printf("ktime: using clocksource %s\n", source->name);
+}
@@ -0,0 +1,71 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+
+#ifndef NIGHTOS_KTIME_H
+#define NIGHTOS_KTIME_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef NSEC_PER_SEC
+#define NSEC_PER_SEC 1000000000ll
+#endif
+#define NSEC_PER_MSEC 1000000ll
+#define NSEC_PER_USEC 1000ll
+
+//Length of a timer tick, the PIT runs at 100 Hz
+#define TICK_NSEC (10 * NSEC_PER_MSEC)
+
+//The counter runs on between ticks, it doesn't stop when the cpu halts and never changes its frequency
+#define CLOCK_SOURCE_CONTINUOUS (1 << 0)
+//The counter is the TSC and user space may read it in the vDSO
+#define CLOCK_SOURCE_VDSO_TSC (1 << 1)
+//The counter runs without timer interrupts, one shot timers and a stopped tick keep their precision
+#define CLOCK_SOURCE_VALID_FOR_HRES (1 << 2)
+
+//A free running counter the kernel time is derived from, the source with the highest rating is used.
+//Cycles are converted with (cycles * mult) >> shift.
+typedef struct clocksource {
+    const char* name;
+    int rating;
+    int flags;
+
+    uint64_t (*read)();
+    uint32_t mult;
+    uint32_t shift;
+} clocksource_t;
+
+/**
+ * Switches to the clocksource if it is rated higher than the current one, the structure must stay valid
+ */
+void clocksource_register(clocksource_t* clocksource);
+
+/**
+ * Calculates mult and shift for a counter running at the given frequency
+ */
+void clocksource_calc_mult_shift(clocksource_t* clocksource, uint64_t frequency);
+
+/**
+ * @return nanoseconds since boot, never goes backwards
+ */
+uint64_t ktime_get_ns();
+
+/**
+ * Reads the time together with the counter value it was derived from
+ * @return the current clocksource
+ */
+clocksource_t* ktime_get_snapshot(uint64_t* ns, uint64_t* cycles);
+
+/**
+ * @return true if the current clocksource is valid for high resolution timers
+ */
+bool ktime_hres_capable();
+
+/**
+ * Called every timer tick, anchors clocksources that don't run on between ticks
+ * @param ticks the ticks since boot
+ */
+void ktime_tick(uint64_t ticks);
+
+#endif //NIGHTOS_KTIME_H
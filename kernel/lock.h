@@ -18,6 +18,11 @@ static inline void spin_lock(spin_t * lock) {
     }
 }
 
+//Returns false instead of waiting if the lock is taken
+static inline bool spin_trylock(spin_t * lock) {
+    return !atomic_flag_test_and_set(lock);
+}
+
 static inline void spin_unlock(spin_t * lock) {
     atomic_flag_clear(lock);
 }
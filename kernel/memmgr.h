@@ -10,13 +10,34 @@
 #include <stdbool.h>
 #include "alloc.h"
 
-#define PROT_EXEC 1<<0
-#define PROT_READ 1<<1
-#define PROT_WRITE 1<<2
+//Same values as the Linux ABI, user space passes them through mmap and mprotect unchanged
+#define PROT_READ (1 << 0)
+#define PROT_WRITE (1 << 1)
+#define PROT_EXEC (1 << 2)
 #define PROT_NONE 0
 
 #define MEMMGR_PAGE_FLAG_COW 1 << 9
 
+/**
+ * This flag is only available when the page is set to non-present!
+ *
+ * The page is reserved but has no frame yet, a zeroed frame is mapped on first access.
+ * The remaining flags of the entry are the flags of the populated page.
+ */
+#define MEMMGR_PAGE_FLAG_LAZY 1 << 10
+
+/**
+ * This flag is only available when the page is set to non-present!
+ *
+ * The page was moved to swap, the address bits of the entry hold the swap slot.
+ * The remaining flags of the entry are the flags of the page once it is read back.
+ */
+#define MEMMGR_PAGE_FLAG_SWAP 1 << 11
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0x08000
+#endif
+
 /**
  * This flag is only available when the page is set to non-present!
  *
@@ -27,10 +48,17 @@
  */
 #define MEMMGR_PAGE_FLAG_STACK_GUARD 1 << 1
 
+/**
+ * Page fault error code bits
+ */
+#define PF_PRESENT 1 << 0
+#define PF_WRITE 1 << 1
+#define PF_USER 1 << 2
+
 #define CHECK_PTR(ptr) (ptr < 0xfffffe0000000000ull && memmgr_check_user(ptr))
 
-#define ADDRESS_TO_PAGE(addr) ((addr >> 12))
-#define PAGE_TO_ADDRESS(page) ((page << 12))
+#define ADDRESS_TO_PAGE(addr) (((addr)) >> 12)
+#define PAGE_TO_ADDRESS(page) (((page)) << 12)
 
 #define FLAG_WB 0x0
 #define FLAG_WT 0x8
@@ -39,10 +67,37 @@
 #define FLAG_WP 0x80
 #define FLAG_WC 0x88
 
+#define VMA_ANONYMOUS 1 << 0
+#define VMA_STACK 1 << 1
+
+/**
+ * Address space reserved for every user stack, its pages are only populated when touched
+ */
+#define USER_STACK_SIZE (8 * 1024 * 1024)
+
+/**
+ * Start and end of the window searched for free user memory
+ */
+#define USER_MMAP_BASE 0x0000100000000000ull
+#define USER_MMAP_END 0x00007ffffffff000ull
+//End of the canonical lower half
+#define USER_SPACE_END 0x0000800000000000ull
+
+struct AVLTreeNode;
+struct mm_struct;
+
 typedef struct VirtualMemoryRegion {
     uintptr_t start;
     uintptr_t end;
     uintptr_t flags;
+    int prot;
+
+    //Augmented values of the subtree rooted at this region, used by the free range search
+    uintptr_t subtree_start;
+    uintptr_t subtree_end;
+    uintptr_t subtree_gap;
+
+    struct AVLTreeNode* node;
 } vma_t;
 
 struct page {
@@ -53,14 +108,99 @@ struct page {
 };
 
 void memmgr_init(struct multiboot_tag_mmap* info, uintptr_t kernel_end);
+/**
+ * Applies the PAT, write protection and PCID setup of memmgr_init to an application processor
+ */
+void memmgr_init_cpu();
 
 uintptr_t kalloc_frame();
 void kfree_frame(uintptr_t addr);
+//Flags of kalloc_frames_flags
+#define KALLOC_RECLAIM (1 << 0) //Runs the shrinkers before failing, the caller may not hold an allocator or cache lock
+
+/**
+ * Allocates 2^order physically contiguous frames, aligned to their size
+ * A failed allocation leaves the reclaim to the idle task
+ * @param order the order of the block, at most 10
+ * @return the physical address of the first frame or 0 if no block is available
+ */
+uintptr_t kalloc_frames(int order);
+uintptr_t kalloc_frames_flags(int order, int flags);
+/**
+ * Frees cache memory while the free frames are below the low watermark or an allocation failed, called by the idle task
+ * @return false if there was nothing to reclaim
+ */
+bool memmgr_reclaim();
+/**
+ * Moves user pages that weren't accessed recently to swap, a clock hand walks all address spaces
+ * Called by the idle task, the caller must not be changing page tables
+ * @param count the amount of frames to free
+ * @return the amount of frames freed
+ */
+size_t memmgr_swap_out(size_t count);
+
+typedef struct MergeStats {
+    uint64_t pages_shared; //Frames holding merged pages
+    uint64_t pages_sharing; //Further pages mapping them, each one is a frame saved
+    uint64_t pages_scanned;
+    uint64_t full_scans;
+} merge_stats_t;
+
+/**
+ * Merges identical user pages into one copy on write frame, a few pages are scanned per call at most every MERGE_SCAN_INTERVAL ticks
+ * @return false if no scan was due
+ */
+bool memmgr_merge_scan();
+void memmgr_merge_get_stats(merge_stats_t* stats);
+/**
+ * Frees 2^order frames allocated by kalloc_frames
+ * @param addr the physical address of the first frame
+ * @param order the order used for the allocation
+ */
+void kfree_frames(uintptr_t addr, int order);
+/**
+ * Allocates a zeroed frame, taken from the pool filled by the idle task if possible
+ * @return the physical address or 0 if no frame is available
+ */
+uintptr_t kalloc_zeroed_frame();
+/**
+ * Zeroes up to count frames for the pool of kalloc_zeroed_frame
+ * @return false if no frame was added because the pool is full or memory is low
+ */
+bool memmgr_refill_zeroed_frames(int count);
+uint64_t memmgr_phys_free_frames();
+void memmgr_frame_ref(uintptr_t addr);
+uint16_t memmgr_frame_refcount(uintptr_t addr);
+/**
+ * Marks a block from kalloc_frames as owned by the slab allocator
+ */
+void memmgr_frame_set_slab(uintptr_t addr, int order);
+/**
+ * Removes the slab mark before the block is freed
+ */
+void memmgr_frame_clear_slab(uintptr_t addr, int order);
+/**
+ * Returns the identity mapped start of the slab containing ptr or NULL
+ */
+void* memmgr_get_slab(void* ptr);
+/**
+ * Returns the amount of memory in bytes mapped by 2 MiB pages outside of the identity map
+ */
+uint64_t memmgr_huge_mapped();
 
 void memmgr_phys_mark_page(int idx);
 void memmgr_phys_free_page(int idx);
 
 void memmgr_map_frame_to_virtual(uintptr_t frame_addr, uintptr_t virtual_addr, uintptr_t flags);
+/**
+ * Maps frames owned by the kernel read only into the current address space, like the vDSO
+ * @param virtualAddr page aligned user address
+ * @param frames one frame per page
+ * @param count the amount of pages
+ * @param prot PROT_READ, optionally with PROT_EXEC
+ * @return 0, -EEXIST if the range is taken or -ENOMEM, nothing stays mapped on failure
+ */
+int memmgr_map_kernel_frames(uintptr_t virtualAddr, const uintptr_t* frames, size_t count, int prot);
 /**
  * Deallocates a memory region
  * @param addr the desired address
@@ -74,11 +214,57 @@ void munmap(void* addr, size_t len);
  * @param is_kernel if is_kernel is set, the length of the map is increased
  */
 void* mmap(void* addr, size_t len, bool is_kernel);
+/**
+ * Allocates a new memory region like mmap
+ * User memory is only reserved and populated on first access unless MAP_POPULATE is set
+ * @param addr the desired address
+ * @param len the length of the memory region
+ * @param is_kernel if is_kernel is set, the length of the map is increased
+ * @param prot PROT_* flags of user memory
+ * @param flags MAP_* flags
+ */
+void* mmap_flags(void* addr, size_t len, bool is_kernel, int prot, int flags);
+/**
+ * Changes the protection of a user memory region
+ * @param addr the page aligned start
+ * @param len the length of the region
+ * @param prot PROT_* flags
+ * @return 0 or a negative error code
+ */
+int mprotect(void* addr, size_t len, int prot);
+
+vma_t* memmgr_vma_find(struct mm_struct* mm, uintptr_t addr);
+int memmgr_vma_insert(struct mm_struct* mm, uintptr_t start, uintptr_t end, int prot, int flags);
+int memmgr_vma_remove_range(struct mm_struct* mm, uintptr_t start, uintptr_t end);
+uintptr_t memmgr_vma_find_free(struct mm_struct* mm, size_t len);
+int memmgr_vma_clone(struct mm_struct* old, struct mm_struct* new);
+void memmgr_vma_destroy(struct mm_struct* mm);
 
 void* memmgr_create_stack(bool user, uint64_t size);
+
+#define KERNEL_STACK_SIZE 16384
+
+/**
+ * Takes a mapped kernel stack with a guard page below it, stacks freed earlier are reused first
+ * @return the top of the stack
+ */
+uintptr_t memmgr_kernel_stack_alloc();
+/**
+ * Gives a stack from memmgr_kernel_stack_alloc back, it must not be in use anymore
+ * @param top the top of the stack
+ */
+void memmgr_kernel_stack_free(uintptr_t top);
 void memmgr_delete_page(uintptr_t virtualAddr);
+/**
+ * Invalidates the TLB entry of the address
+ */
+void memmgr_reload(uintptr_t addr);
 
 void memmgr_clone_page_map(uint64_t* pageMapOld, uint64_t* pageMapNew);
+/**
+ * Clones only the kernel part of a page map, used for new program images
+ */
+void memmgr_clone_kernel_page_map(uint64_t* pageMapOld, uint64_t* pageMapNew);
 /**
  * Returns the current Page Map for the kernel process
  * @return
@@ -93,7 +279,21 @@ void* memmgr_map_mmio(uintptr_t addr, size_t len, int flags, bool is_kernel);
 void* memmgr_get_mmio(uintptr_t addr);
 void* memmgr_get_mmio_physical(uintptr_t addr);
 
-void load_page_map(uintptr_t pageMap);
+/**
+ * Loads a new page map, does nothing if it is already loaded
+ * @param pageMap the physical address of the page map, 0 for the boot page map
+ * @param asid the address space identifier of the page map
+ */
+void load_page_map(uintptr_t pageMap, uint16_t asid);
+/**
+ * Allocates an address space identifier for a new page map
+ * @return the identifier or 0 if all are in use
+ */
+uint16_t memmgr_asid_alloc();
+/**
+ * Releases the identifier of a page map that is about to be freed
+ */
+void memmgr_asid_free(uint16_t asid, uintptr_t pageMap);
 
 /***
  * Returns the physical address for the given memory address in the identity mapping
@@ -131,6 +331,14 @@ void* sbrk(intptr_t len);
 void* brk(size_t len);
 
 bool memmgr_check_user(uintptr_t addr);
+uint64_t* memmgr_get_page_entry(uintptr_t virtualAddr);
+/**
+ * Handles page faults that the memory manager can resolve
+ * @param faultAddr the faulting address from CR2
+ * @param errorCode the error code pushed by the cpu
+ * @return true if the faulting instruction can be restarted
+ */
+bool memmgr_handle_page_fault(uintptr_t faultAddr, uint64_t errorCode);
 
 size_t get_heap_length();
 
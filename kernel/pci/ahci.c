@@ -60,7 +60,7 @@ static void ahci_cache_evict(struct SATADevice* device) {
     }
     ahci_cache_remove_entry(cache, 0, to_evict);
 
-    kfree(to_evict->data);
+    free(to_evict->data);
     kfree(to_evict);
   }
 }
@@ -89,11 +89,67 @@ static void ahci_cache_flush(struct SATADevice* device) {
     }
     ahci_cache_remove_entry(cache, 0, to_evict);
 
-    kfree(to_evict->data);
+    free(to_evict->data);
     kfree(to_evict);
   }
 }
 
+static size_t ahci_cache_count(shrinker_t* shrinker) {
+  disk_cache* cache = shrinker->data;
+
+  return (cache->total_size + 4095) / 4096;
+}
+
+/**
+ * Drops the oldest clean entries, dirty entries would need a write to the disk
+ */
+static size_t ahci_cache_scan(shrinker_t* shrinker, size_t count) {
+  disk_cache* cache = shrinker->data;
+
+  if (!spin_trylock(&cache->lock)) {
+    return 0;
+  }
+
+  size_t freed = 0;
+  list_entry_t* list_entry = cache->entries.head;
+
+  while (list_entry != NULL && freed < count) {
+    disk_cache_entry_t* entry = list_entry->value;
+    list_entry_t* next = list_entry->next;
+
+    if (!entry->dirty) {
+      list_delete(&cache->entries, list_entry);
+      cache->total_size -= entry->size;
+      freed += (entry->size + 4095) / 4096;
+
+      free(entry->data);
+      kfree(entry);
+    }
+
+    list_entry = next;
+  }
+
+  spin_unlock(&cache->lock);
+
+  return freed;
+}
+
+static disk_cache* ahci_cache_create() {
+  disk_cache* cache = kcalloc(1, sizeof(disk_cache));
+
+  if (!cache) {
+    return NULL;
+  }
+
+  cache->shrinker.name = "disk_cache";
+  cache->shrinker.count = ahci_cache_count;
+  cache->shrinker.scan = ahci_cache_scan;
+  cache->shrinker.data = cache;
+  register_shrinker(&cache->shrinker);
+
+  return cache;
+}
+
 static disk_cache_entry_t* ahci_cache_find(disk_cache* cache, size_t offset, size_t size) {
   for (list_entry_t* list_entry = cache->entries.head; list_entry != NULL; list_entry = list_entry->next) {
     disk_cache_entry_t* entry = (disk_cache_entry_t*) list_entry->value;
@@ -414,7 +470,7 @@ bool atapi_send_command(struct SATADevice* ataDevice, io_request_t* ioRequest, i
     return true;
 }
 
-int ahci_read(file_node_t* node, char* buf, size_t offset, size_t length) {
+static int ahci_cache_read(file_node_t* node, char* buf, size_t offset, size_t length) {
     struct SATADevice* thisDevice = (struct SATADevice*)node->fs;
 
     disk_cache_entry_t* entry = ahci_cache_find(thisDevice->diskCache, offset, length);
@@ -463,7 +519,7 @@ int ahci_read(file_node_t* node, char* buf, size_t offset, size_t length) {
     return length;
 }
 
-int ahci_write(file_node_t* node, char* buf, size_t offset, size_t length) {
+static int ahci_cache_write(file_node_t* node, char* buf, size_t offset, size_t length) {
     struct SATADevice* thisDevice = (struct SATADevice*)node->fs;
 
     disk_cache_entry_t* entry = ahci_cache_find(thisDevice->diskCache, offset, length);
@@ -520,15 +576,72 @@ int atapi_read(file_node_t* node, char* buf, size_t offset, size_t length) {
     return length;
 }
 
+int ahci_read(file_node_t* node, char* buf, size_t offset, size_t length) {
+    disk_cache* cache = ((struct SATADevice*)node->fs)->diskCache;
+
+    spin_lock(&cache->lock);
+    int result = ahci_cache_read(node, buf, offset, length);
+    spin_unlock(&cache->lock);
+
+    return result;
+}
+
+int ahci_write(file_node_t* node, char* buf, size_t offset, size_t length) {
+    disk_cache* cache = ((struct SATADevice*)node->fs)->diskCache;
+
+    spin_lock(&cache->lock);
+    int result = ahci_cache_write(node, buf, offset, length);
+    spin_unlock(&cache->lock);
+
+    return result;
+}
+
+int ahci_read_direct(file_node_t* node, void* buf, size_t offset, size_t length) {
+    struct SATADevice* thisDevice = (struct SATADevice*)node->fs;
+
+    io_request_t ioRequest = {0};
+    ioRequest.type = IO_READ;
+    ioRequest.count = length;
+    ioRequest.offset = offset;
+    ioRequest.buffer = buf;
+
+    if(thisDevice->deviceType != DRIVE_TYPE_SATA_HDD || !ahci_send_command(thisDevice, &ioRequest, ATA_CMD_READ_DMA_EXT)) {
+        return -EIO;
+    }
+
+    return length;
+}
+
+int ahci_write_direct(file_node_t* node, void* buf, size_t offset, size_t length) {
+    struct SATADevice* thisDevice = (struct SATADevice*)node->fs;
+
+    io_request_t ioRequest = {0};
+    ioRequest.type = IO_WRITE;
+    ioRequest.count = length;
+    ioRequest.offset = offset;
+    ioRequest.buffer = buf;
+
+    if(thisDevice->deviceType != DRIVE_TYPE_SATA_HDD || !ahci_send_command(thisDevice, &ioRequest, ATA_CMD_WRITE_DMA_EXT)) {
+        return -EIO;
+    }
+
+    return length;
+}
 
 void ahci_close(file_node_t* node) {
   struct SATADevice* thisDevice = (struct SATADevice*)node->fs;
 
+  spin_lock(&thisDevice->diskCache->lock);
   ahci_cache_flush(thisDevice);
+  spin_unlock(&thisDevice->diskCache->lock);
+}
+
+bool ahci_is_device(file_node_t* node) {
+    return node->file_ops.read == ahci_read;
 }
 
 file_node_t* create_ahci_device(struct SATADevice* sataDevice) {
-    file_node_t* node = calloc(1, sizeof(file_node_t));
+    file_node_t* node = vfs_alloc_node();
     node->type = FILE_TYPE_BLOCK_DEVICE;
     node->fs = sataDevice;
     node->size = sataDevice->size;
@@ -617,7 +730,7 @@ void ahci_setup(void* abar, uint16_t interruptVector) {
 
     printf("HBA interrupt on line %d\n", interruptVector);
 
-    pic_enableInterrupt(interruptVector);
+    irq_enable(interruptVector);
     irq_install_handler(interruptVector, ahci_interrupt_handler);
 
     if(mem->cap.S64A == 0) {
@@ -679,7 +792,7 @@ void ahci_setup(void* abar, uint16_t interruptVector) {
         if(mem->ports[i].sig == SATA_SIG_ATA) {
             sataDevice = calloc(1, sizeof(sata_device_t));
             sataDevice->port = i;
-            sataDevice->diskCache = kcalloc(1, sizeof(disk_cache));
+            sataDevice->diskCache = ahci_cache_create();
 
             char* buf = malloc(512 + 511);
 
@@ -716,6 +829,7 @@ void ahci_setup(void* abar, uint16_t interruptVector) {
             sataDevice->node = node;
             sataDevice->port = i;
             sataDevice->size = deviceInfo->capacitySectors * 512;
+            node->size = sataDevice->size;
 
             mount_directly(pathDup, node);
             free(pathDup);
@@ -727,7 +841,7 @@ void ahci_setup(void* abar, uint16_t interruptVector) {
         if(mem->ports[i].sig == SATA_SIG_ATAPI) {
             struct SATADevice* ataDevice = calloc(1, sizeof(sata_device_t));
             ataDevice->port = i;
-            ataDevice->diskCache = kcalloc(1, sizeof(disk_cache));
+            ataDevice->diskCache = ahci_cache_create();
 
             io_request_t ioRequest;
             char* buf = malloc(512 + 511);
@@ -777,6 +891,7 @@ void ahci_setup(void* abar, uint16_t interruptVector) {
 
             ataDevice->node = node;
             ataDevice->size = (capacityData->lba_last+1) * capacityData->block_size;
+            node->size = ataDevice->size;
 
             mount_directly(pathDup, node);
             free(pathDup);
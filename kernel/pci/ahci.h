@@ -7,6 +7,8 @@
 
 #include <stdint.h>
 #include "io.h"
+#include "../lock.h"
+#include "../shrinker.h"
 
 typedef enum DriveType {
     DRIVE_TYPE_UNKNOWN = 0,
@@ -570,6 +572,9 @@ typedef struct disk_cache {
   list_t entries;
 
   uint64_t total_size;
+
+  spin_t lock; //Taken by the shrinker with spin_trylock, so it never waits for a disk operation
+  shrinker_t shrinker;
 } disk_cache;
 
 typedef struct SATADevice {
@@ -585,4 +590,13 @@ typedef struct SATADevice {
 void ahci_setup(void* abar, uint16_t interruptVector);
 bool ahci_send_command(struct SATADevice* sataDevice, io_request_t* ioRequest, int sataCommand);
 bool atapi_send_command(struct SATADevice* ataDevice, io_request_t* ioRequest, int ataCommand);
+/**
+ * Transfers between a disk and a buffer without going through the disk cache, used for swap
+ * The buffer is transferred with a single DMA request, so it must not cross a page boundary
+ * @return the amount of bytes transferred or -EIO
+ */
+int ahci_read_direct(file_node_t* node, void* buf, size_t offset, size_t length);
+int ahci_write_direct(file_node_t* node, void* buf, size_t offset, size_t length);
+//Returns true if the node is a hard disk created by this driver
+bool ahci_is_device(file_node_t* node);
 #endif //NIGHTOS_AHCI_H
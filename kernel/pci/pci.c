@@ -8,6 +8,7 @@
 #include "../terminal.h"
 #include "../arch/amd64/io.h"
 #include "../memmgr.h"
+#include "../smp.h"
 
 extern void ahci_setup(void* abar, uint16_t interruptVector);
 
@@ -436,6 +437,16 @@ void pci_init(RSDP_t* rsdp) {
 
                 pciBase = (uint8_t *) memmgr_get_from_physical(mcfg->csba[j].base);
             }
+        } else if (!strncmp(h->Signature, "APIC", 4)) {
+            MADT* madt = (MADT*) h;
+
+            if(!doChecksum(&madt->h)) {
+                printf("Warning: ACPI MADT wrong checksum");
+
+                continue;
+            }
+
+            smp_parse_madt(madt);
         }
     }
 
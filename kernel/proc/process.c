@@ -10,9 +10,13 @@
 #include "../../libc/include/kernel/tree.h"
 #include "../program/elf.h"
 #include "../timer.h"
+#include "../ktime.h"
+#include "../hrtimer.h"
 #include <signal.h>
 #include <string.h>
 #include "../../mlibc/abis/linux/errno.h"
+#include "../uaccess.h"
+#include "../vdso.h"
 
 #define PUSH_PTR(stack, type, value) { \
             stack -= sizeof(type);     \
@@ -25,6 +29,14 @@
             stack += sizeof(type);     \
 }
 
+//Upper bounds for the argument and environment strings of execve
+#define EXEC_MAX_ARGS 65536
+#define EXEC_MAX_ARG_LENGTH 16384
+
+//Auxiliary vector entries handed to a new image
+#define AT_NULL 0
+#define AT_SYSINFO_EHDR 33
+
 char* push_string_to_userstack(uintptr_t* stack, const char* str) {
     size_t len = strlen(str) + 1;  // Include null terminator
 
@@ -38,17 +50,145 @@ char* push_string_to_userstack(uintptr_t* stack, const char* str) {
     return (char*) *stack;
 }
 
-static struct process_control_block pcb; //currently the only one, we're running single core
+/**
+ * Maps the vDSO and pushes the auxiliary vector, which ends up right above the environment pointers
+ */
+static void push_auxv_to_userstack(uintptr_t* stack) {
+    uintptr_t vdso = vdso_map();
+    uintptr_t sp = *stack;
+
+    PUSH_PTR(sp, uintptr_t, 0);
+    PUSH_PTR(sp, uintptr_t, AT_NULL);
+
+    if(vdso != 0) {
+        PUSH_PTR(sp, uintptr_t, vdso);
+        PUSH_PTR(sp, uintptr_t, AT_SYSINFO_EHDR);
+    }
+
+    *stack = sp;
+}
+
+static struct process_control_block pcbs[MAX_CPUS]; //Reached through the GS base of each cpu, see get_pcb
 static int id_generator = 1;
 list_t* process_list;
 tree_t* process_tree;
-list_t* thread_queue; //Queue of threads for the scheduler
-list_t* sleeping_queue;
+
+static sleep_heap_t sleeping_queue;
 
 spin_t* sleep_lock; //Lock for the sleep queue
 spin_t* process_lock; //Lock for the process list and tree
 spin_t* queue_lock; //Lock for the scheduler queue
 
+static kmem_cache_t* process_cache; //Cache line aligned, the scheduler touches the processes of every cpu
+
+//Weights of nice -20 to 19 like Linux, each level differs by about 1.25
+static const uint32_t prio_to_weight[40] = {
+        88761, 71755, 56483, 46273, 36291,
+        29154, 23254, 18705, 14949, 11916,
+        9548, 7620, 6100, 4904, 3906,
+        3121, 2501, 1991, 1586, 1277,
+        1024, 820, 655, 526, 423,
+        335, 272, 215, 172, 137,
+        110, 87, 70, 56, 45,
+        36, 29, 23, 18, 15,
+};
+
+static uint64_t sched_latency = 6 * NSEC_PER_MSEC; //Every runnable fair process runs once in this period
+static uint64_t sched_min_granularity = 750 * NSEC_PER_USEC; //Shortest timeslice, an eighth of the latency
+static uint64_t sched_wakeup_granularity = 1 * NSEC_PER_MSEC; //A woken process preempts if it is this far behind
+
+static hrtimer_restart_t sched_slice_expired(hrtimer_t* timer);
+
+static void sleep_heap_set(sleep_heap_t* heap, size_t slot, process_t* process) {
+    heap->entries[slot] = process;
+    process->sleepSlot = slot;
+}
+
+static void sleep_heap_sift_up(sleep_heap_t* heap, size_t slot) {
+    process_t* process = heap->entries[slot];
+
+    while(slot > 1 && heap->entries[slot / 2]->sleepUntil > process->sleepUntil) {
+        sleep_heap_set(heap, slot, heap->entries[slot / 2]);
+        slot /= 2;
+    }
+
+    sleep_heap_set(heap, slot, process);
+}
+
+static void sleep_heap_sift_down(sleep_heap_t* heap, size_t slot) {
+    process_t* process = heap->entries[slot];
+
+    while(slot * 2 <= heap->length) {
+        size_t child = slot * 2;
+
+        if(child < heap->length && heap->entries[child + 1]->sleepUntil < heap->entries[child]->sleepUntil) {
+            child++;
+        }
+
+        if(heap->entries[child]->sleepUntil >= process->sleepUntil) {
+            break;
+        }
+
+        sleep_heap_set(heap, slot, heap->entries[child]);
+        slot = child;
+    }
+
+    sleep_heap_set(heap, slot, process);
+}
+
+int sleep_heap_insert(sleep_heap_t* heap, process_t* process) {
+    if(heap->length + 1 >= heap->capacity) {
+        size_t capacity = heap->capacity ? heap->capacity * 2 : 64;
+        process_t** entries = realloc(heap->entries, capacity * sizeof(process_t*));
+
+        if(entries == NULL) {
+            return -ENOMEM;
+        }
+
+        heap->entries = entries;
+        heap->capacity = capacity;
+    }
+
+    heap->length++;
+    heap->entries[heap->length] = process;
+    sleep_heap_sift_up(heap, heap->length);
+
+    return 0;
+}
+
+void sleep_heap_remove(sleep_heap_t* heap, process_t* process) {
+    size_t slot = process->sleepSlot;
+    process_t* last = heap->entries[heap->length--];
+
+    process->sleepSlot = 0;
+
+    if(slot > heap->length) {
+        return;
+    }
+
+    //The last entry fills the gap and moves whichever way it belongs
+    sleep_heap_set(heap, slot, last);
+    sleep_heap_sift_up(heap, slot);
+    sleep_heap_sift_down(heap, last->sleepSlot);
+}
+
+uint64_t sleep_heap_next(sleep_heap_t* heap) {
+    return heap->length > 0 ? heap->entries[1]->sleepUntil : UINT64_MAX;
+}
+
+/**
+ * Removes the process from the sleepers if a timed wait ended early
+ */
+static void sleep_cancel(process_t* process) {
+    spin_lock(sleep_lock);
+
+    if(process->sleepSlot != 0) {
+        sleep_heap_remove(&sleeping_queue, process);
+    }
+
+    spin_unlock(sleep_lock);
+}
+
 extern void longjmp(kernel_thread_t* thread);
 extern int setjmp(kernel_thread_t* thread);
 extern void enter_user(uintptr_t rip, uintptr_t rsp);
@@ -58,8 +198,27 @@ extern void enter_user_2(uintptr_t rip, uintptr_t rsp);
 _Noreturn void idle() {
     while(1) {
         __asm__ volatile("sti"); //Enable interrupts while waiting.
-        __asm__ volatile("hlt");
+
+        //Reclaim cache memory, zero frames for later allocations and merge identical pages, only sleep once there is nothing left to do.
+        //The housekeeping isn't safe to run on several cpus at once, the other cpus only wait for work.
+        if(get_current_core() != 0 || (!memmgr_reclaim() && !memmgr_refill_zeroed_frames(16) && !memmgr_merge_scan())) {
+            __asm__ volatile("cli");
+
+            //Stop the tick unless an interrupt queued work in the meantime, sti only takes effect after hlt
+            if(get_pcb()->run_queue.length == 0) {
+                tick_nohz_idle_enter();
+                __asm__ volatile("sti; hlt; cli");
+                tick_nohz_idle_exit();
+            }
+        }
+
         __asm__ volatile("cli");
+
+        //The tick doesn't wake sleepers while it interrupts kernel code
+        if(get_current_core() == 0) {
+            wakeup_sleeping();
+        }
+
         schedule(false);
     }
 }
@@ -80,6 +239,8 @@ void* copy_app_memory(void* address, size_t len, bool is_kernel) {
 }
 
 void process_init() {
+    process_cache = kmem_cache_create("process", sizeof(process_t), KMEM_CACHE_LINE, NULL);
+
     sleep_lock = calloc(1, sizeof(spin_t));
     process_lock = calloc(1, sizeof(spin_t));
     queue_lock = calloc(1, sizeof(spin_t));
@@ -90,8 +251,11 @@ void process_init() {
 
     process_list = list_create();
     process_tree = tree_create();
-    thread_queue = list_create();
-    sleeping_queue = list_create();
+
+    for(int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        run_queue_init(&pcbs[cpu].run_queue);
+        hrtimer_init(&pcbs[cpu].slice_timer, sched_slice_expired);
+    }
 }
 
 //TODO: Rework to use error codes
@@ -106,7 +270,7 @@ void process_create_task(char* path, bool is_kernel) {
 
     file_handle_t* handle = create_handle(node);
 
-    process_t* process = calloc(1, sizeof(process_t));
+    process_t* process = kmem_cache_zalloc(process_cache);
 
     spin_unlock(&process->lock);
 
@@ -121,9 +285,9 @@ void process_create_task(char* path, bool is_kernel) {
     //memmgr_clone_page_map(memmgr_get_current_pml4(), memmgr_get_from_physical(process->page_directory->page_directory));
     //load_page_map(process->page_directory->page_directory);
 
-    pcb.core = 0;
-    pcb.current_page_map = process->page_directory->page_directory;
-    pcb.current_process = process;
+    pcb_t* pcb = get_pcb();
+    pcb->current_page_map = process->page_directory->page_directory;
+    pcb->current_process = process;
 
     elf_t* elf = load_elf(handle);
     if(exec_elf(elf, 0, 0, 0)) {
@@ -131,10 +295,17 @@ void process_create_task(char* path, bool is_kernel) {
         return;
     }
 
+    void* stack = memmgr_create_stack(1, USER_STACK_SIZE);
+
+    if(stack == NULL) {
+        printf("No room for the user stack.\n");
+        return;
+    }
+
     process->main_thread.process = process;
-    process->main_thread.priority = 0;
-    process->main_thread.user_stack = (uintptr_t) (memmgr_create_stack(1, 16384) + 16384);
-    process->main_thread.kernel_stack = (uintptr_t) (memmgr_create_stack(false, 16384) + 16384);
+    process->main_thread.priority = DEFAULT_PRIO;
+    process->main_thread.user_stack = (uintptr_t) (stack + USER_STACK_SIZE);
+    process->main_thread.kernel_stack = memmgr_kernel_stack_alloc();
     process->main_thread.rip = (uintptr_t)elf->entrypoint;
 
     process->uid = 0;
@@ -173,6 +344,7 @@ void process_create_task(char* path, bool is_kernel) {
     push_string_to_userstack(&userStack, "TERM=nightos");
     envp[1] = (char*)userStack;
 
+    push_auxv_to_userstack(&userStack);
     PUSH_PTR(userStack, uintptr_t, 0); //ENVP ZERO
     PUSH_PTR(userStack, char*, envp[1]);
     PUSH_PTR(userStack, char*, envp[0]);
@@ -193,8 +365,8 @@ void process_create_task(char* path, bool is_kernel) {
     }
 }
 
-void process_create_idle() {
-    process_t* process = calloc(1, sizeof(process_t));
+void process_create_idle(int cpu) {
+    process_t* process = kmem_cache_zalloc(process_cache);
 
     spin_unlock(&process->lock);
 
@@ -205,17 +377,19 @@ void process_create_idle() {
     process->page_directory->page_directory = (uintptr_t)memmgr_get_current_pml4();
     spin_unlock(&process->page_directory->lock);
 
-    pcb.kernel_idle_process = process;
+    pcbs[cpu].core = cpu;
+    pcbs[cpu].kernel_idle_process = process;
 
     process->main_thread.process = process;
-    process->main_thread.priority = 0;
+    process->main_thread.priority = MAX_PRIO - 1; //Never queued, runs when the run queue is empty
     process->main_thread.rip = (uintptr_t) &idle;
-    process->main_thread.kernel_stack = (uintptr_t) memmgr_create_stack(0, 4096);
+    process->main_thread.kernel_stack = memmgr_kernel_stack_alloc();
     process->main_thread.rsp = process->main_thread.kernel_stack;
 
     process->uid = 0;
     process->gid = 0;
     process->flags = PROC_FLAG_KERNEL | PROC_FLAG_RUNNING;
+    process->cpu = cpu;
 
     process->fd_table = calloc(1, sizeof(fd_table_t));
     process->fd_table->capacity = 8;
@@ -228,7 +402,7 @@ void process_create_idle() {
 extern void* fork_exit;
 
 pid_t process_fork() {
-    process_t* process = calloc(1, sizeof(process_t));
+    process_t* process = kmem_cache_zalloc(process_cache);
     process_t* parent = get_current_process();
 
     spin_unlock(&process->lock);
@@ -239,10 +413,15 @@ pid_t process_fork() {
     process->page_directory = calloc(1, sizeof(mm_struct_t));
     process->page_directory->process_count = 1;
     process->page_directory->page_directory = kalloc_frame();
+    process->page_directory->asid = memmgr_asid_alloc();
     spin_unlock(&process->page_directory->lock);
 
     memmgr_clone_page_map(memmgr_get_current_pml4(), memmgr_get_from_physical(process->page_directory->page_directory));
 
+    if(memmgr_vma_clone(parent->page_directory, process->page_directory)) {
+        printf("fork: out of memory while copying the regions of %d\n", parent->id);
+    }
+
     process->main_thread.process = process;
     process->main_thread.priority = parent->main_thread.priority;
 
@@ -251,7 +430,7 @@ pid_t process_fork() {
         return process->id;
     }
     process->main_thread.user_stack = parent->main_thread.user_stack;
-    process->main_thread.kernel_stack = (uintptr_t) (memmgr_create_stack(false, 16384) + 16384);
+    process->main_thread.kernel_stack = memmgr_kernel_stack_alloc();
     process->main_thread.rip = (uintptr_t) &fork_exit;
 
     regs_t registers;
@@ -294,7 +473,7 @@ pid_t process_fork() {
     spin_unlock(&process->fd_table->lock);
 
     list_insert(process_list, process);
-    list_insert(thread_queue, process);
+    schedule_process(process);
 
     tree_node_t* treeNode = tree_find_child_root(process_tree, parent);
 
@@ -308,7 +487,7 @@ pid_t process_fork() {
 }
 
 pid_t process_clone(struct clone_args* args, size_t size) {
-    process_t* process = calloc(1, sizeof(process_t));
+    process_t* process = kmem_cache_zalloc(process_cache);
     process_t* parent = get_current_process();
 
     spin_unlock(&process->lock);
@@ -330,9 +509,14 @@ pid_t process_clone(struct clone_args* args, size_t size) {
         process->page_directory = calloc(1, sizeof(mm_struct_t));
         process->page_directory->process_count = 1;
         process->page_directory->page_directory = kalloc_frame();
+        process->page_directory->asid = memmgr_asid_alloc();
         spin_unlock(&process->page_directory->lock);
 
         memmgr_clone_page_map(memmgr_get_current_pml4(), memmgr_get_from_physical(process->page_directory->page_directory));
+
+        if(memmgr_vma_clone(parent->page_directory, process->page_directory)) {
+            printf("clone: out of memory while copying the regions of %d\n", parent->id);
+        }
     }
 
     process->main_thread.process = process;
@@ -341,14 +525,19 @@ pid_t process_clone(struct clone_args* args, size_t size) {
     //Save parent process state
     setjmp(&process->main_thread);
     process->main_thread.user_stack = parent->main_thread.user_stack;
-    process->main_thread.kernel_stack = (uintptr_t) (malloc(16384) + 16384);
+    process->main_thread.kernel_stack = memmgr_kernel_stack_alloc();
     process->main_thread.rip = (uintptr_t) fork_exit;
-    process->main_thread.rsp = process->main_thread.user_stack;
 
     regs_t registers;
     memcpy(&registers, process->saved_registers, sizeof(regs_t));
     registers.rax = 0;
-    PUSH_PTR(process->main_thread.kernel_stack, regs_t, registers);
+
+    //The top of the stack has to stay intact, it is freed through it
+    unsigned long kernelStack = process->main_thread.kernel_stack;
+    PUSH_PTR(kernelStack, regs_t, registers);
+
+    //fork_exit pops the registers from the kernel stack
+    process->main_thread.rsp = kernelStack;
 
     process->uid = parent->uid;
     process->gid = parent->gid;
@@ -394,95 +583,166 @@ pid_t process_clone(struct clone_args* args, size_t size) {
 
     list_insert(process_list, process);
     tree_insert_child(process_tree, NULL, process);
-    list_insert(thread_queue, process);
+    schedule_process(process);
 
     return process->id;
 }
 
 uintptr_t process_get_current_pml() {
-    return pcb.current_page_map;
+    return get_pcb()->current_page_map;
 }
 
 void process_set_current_pml(uintptr_t pml) {
-    pcb.current_page_map = pml;
+    get_pcb()->current_page_map = pml;
 }
 
 void process_free_pml(uintptr_t pml) {
     memmgr_clear_page_map(pml);
 }
 
-int execve(char* path, char** argv, char** envp) {
-    process_t* process = get_current_process();
-
-    if(process == NULL) return -EINVAL;
+static void process_free_strings(char** strings, int count) {
+    if(strings == NULL) {
+        return;
+    }
 
-    if(process->tgid != 0) {
-        return -2; //Can't replace image in thread
+    for(int i = 0; i < count; i++) {
+        free(strings[i]);
     }
 
-    file_node_t* node = open(path, 0);
+    free(strings);
+}
 
-    if(node == NULL) {
-        printf("Error: can't open %s\n", path);
-        return -1;
+/**
+ * Copies a NULL terminated vector of strings from user memory, the old address space is gone once they are needed
+ * @param out receives the copy, NULL if vector is NULL
+ * @return the amount of strings or a negative error code
+ */
+static int process_copy_strings(char** vector, char*** out) {
+    *out = NULL;
+
+    if(vector == NULL) {
+        return 0;
     }
 
-    file_handle_t* handleElf = create_handle(node);
+    int count = 0;
 
-    int argc = 0;
-    if(argv) {
-        while(argv[argc]) {
-            if(!CHECK_PTR((uintptr_t) argv[argc])) return -EFAULT;
-            argc++;
+    while(true) {
+        char* string;
+
+        if(copy_from_user(&string, &vector[count], sizeof(char*))) {
+            return -EFAULT;
+        }
+
+        if(string == NULL) {
+            break;
         }
-    }
 
-    int envc = 0;
-    if(envp) {
-        while(envp[envc]) {
-            if(!CHECK_PTR((uintptr_t) envp[envc])) return -EFAULT;
-            envc++;
+        if(++count > EXEC_MAX_ARGS) {
+            return -E2BIG;
         }
     }
 
-    char** new_argv = calloc(1, sizeof(char*) * argc);
-    char** new_envp = calloc(1, sizeof(char*) * envc);
+    char** copy = calloc(count > 0 ? count : 1, sizeof(char*));
+    char* scratch = kmalloc(EXEC_MAX_ARG_LENGTH);
 
-    for(int i = 0; i < argc; i++) {
-        char* arg = malloc(strlen(argv[i]) + 1);
-        memcpy(arg, argv[i], strlen(argv[i]));
+    if(copy == NULL || scratch == NULL) {
+        free(copy);
+        kfree(scratch);
+        return -ENOMEM;
+    }
 
-        arg[strlen(argv[i]) + 1] = 0;
+    int error = 0;
 
-        new_argv[i] = arg;
-    }
+    for(int i = 0; i < count; i++) {
+        char* string = NULL;
+        long length = -EFAULT;
 
-    for(int i = 0; i < envc; i++) {
-        char* arg = malloc(strlen(envp[i]) + 1);
-        memcpy(arg, envp[i], strlen(envp[i]));
+        //The vector might have changed since it was counted
+        if(copy_from_user(&string, &vector[i], sizeof(char*)) == 0 && string != NULL) {
+            length = strncpy_from_user(scratch, string, EXEC_MAX_ARG_LENGTH);
+        }
 
-        arg[strlen(envp[i]) + 1] = 0;
+        if(length < 0 || length == EXEC_MAX_ARG_LENGTH) {
+            error = length < 0 ? (int) length : -E2BIG;
+            break;
+        }
 
-        new_envp[i] = arg;
+        copy[i] = malloc(length + 1);
+        memcpy(copy[i], scratch, length + 1);
     }
 
-    load_page_map(0);
+    kfree(scratch);
+
+    if(error != 0) {
+        process_free_strings(copy, count);
+        return error;
+    }
+
+    *out = copy;
+
+    return count;
+}
+
+void process_replace_mm(process_t* process) {
+    load_page_map(0, 0);
 
     spin_lock(&process->page_directory->lock);
     if(process->page_directory->process_count == 1) {
+        memmgr_asid_free(process->page_directory->asid, process->page_directory->page_directory);
         process_free_pml(process->page_directory->page_directory);
+        memmgr_vma_destroy(process->page_directory);
 
         free(process->page_directory);
+    } else {
+        //The other threads keep the old address space
+        process->page_directory->process_count--;
+        spin_unlock(&process->page_directory->lock);
     }
 
     process->page_directory = calloc(1, sizeof(mm_struct_t));
     process->page_directory->process_count = 1;
     process->page_directory->page_directory = kalloc_frame();
+    process->page_directory->asid = memmgr_asid_alloc();
     spin_unlock(&process->page_directory->lock);
-    spin_lock(&process->page_directory->lock);
 
-    memmgr_clone_page_map((uint64_t *) 0x1000, (uint64_t *) memmgr_get_from_physical(process->page_directory->page_directory)); //Clone from init pml
-    load_page_map(process->page_directory->page_directory);
+    memmgr_clone_kernel_page_map((uint64_t *) 0x1000, (uint64_t *) memmgr_get_from_physical(process->page_directory->page_directory)); //Clone kernel part of init pml
+    load_page_map(process->page_directory->page_directory, process->page_directory->asid);
+}
+
+int execve(char* path, char** argv, char** envp) {
+    process_t* process = get_current_process();
+
+    if(process == NULL) return -EINVAL;
+
+    if(process->tgid != 0 && process->tgid != process->id) {
+        return -2; //Can't replace image in thread
+    }
+
+    file_node_t* node = open(path, 0);
+
+    if(node == NULL) {
+        printf("Error: can't open %s\n", path);
+        return -1;
+    }
+
+    file_handle_t* handleElf = create_handle(node);
+
+    char** new_argv = NULL;
+    char** new_envp = NULL;
+    int argc = process_copy_strings(argv, &new_argv);
+
+    if(argc < 0) {
+        return argc;
+    }
+
+    int envc = process_copy_strings(envp, &new_envp);
+
+    if(envc < 0) {
+        process_free_strings(new_argv, argc);
+        return envc;
+    }
+
+    process_replace_mm(process);
 
     if(process->fd_table->length > 0) {
         for(int i = 0; i < process->fd_table->capacity; i++) {
@@ -512,9 +772,16 @@ int execve(char* path, char** argv, char** envp) {
         return -1;
     }
 
+    void* stack = memmgr_create_stack(1, USER_STACK_SIZE);
+
+    if(stack == NULL) {
+        printf("No room for the user stack.\n");
+        return -ENOMEM;
+    }
+
     process->main_thread.process = process;
-    process->main_thread.priority = 0;
-    process->main_thread.user_stack = (uintptr_t) (mmap(0, 16384, false) + 16384);
+    process->main_thread.priority = DEFAULT_PRIO;
+    process->main_thread.user_stack = (uintptr_t) (stack + USER_STACK_SIZE);
     process->main_thread.rip = (uintptr_t)elf->entrypoint;
 
     process->flags = (process->flags & PROC_FLAG_KERNEL) ? PROC_FLAG_KERNEL : 0;
@@ -539,8 +806,8 @@ int execve(char* path, char** argv, char** envp) {
 
     unsigned long userStack = process->main_thread.user_stack;
 
-    char** final_envp = calloc(1, sizeof(char) * envc);
-    char** final_argv = calloc(1, sizeof(char) * argc);
+    char** final_envp = calloc(envc + 1, sizeof(char*));
+    char** final_argv = calloc(argc + 1, sizeof(char*));
 
     for(int i = 0; i < envc; i++) {
         push_string_to_userstack(&userStack, new_envp[i]);
@@ -558,12 +825,14 @@ int execve(char* path, char** argv, char** envp) {
     free(new_argv);
     free(new_envp);
 
+    //Pushed backwards, the first pointer ends up at the lowest address
+    push_auxv_to_userstack(&userStack);
     PUSH_PTR(userStack, uintptr_t, 0); //ENVP ZERO
-    for(int i = 0; i < envc; i++) {
-        PUSH_PTR(userStack, char*, final_argv[i]);
+    for(int i = envc - 1; i >= 0; i--) {
+        PUSH_PTR(userStack, char*, final_envp[i]);
     }
     PUSH_PTR(userStack, uintptr_t, 0); //ARGV ZERO
-    for(int i = 0; i < envc; i++) {
+    for(int i = argc - 1; i >= 0; i--) {
         PUSH_PTR(userStack, char*, final_argv[i]);
     }
     PUSH_PTR(userStack, uintptr_t, argc); //ARGC
@@ -625,59 +894,397 @@ void process_close_fd(int fd) {
 }
 
 process_t* get_current_process() {
-    return pcb.current_process;
+    return get_pcb()->current_process;
+}
+
+int get_current_core() {
+    return get_pcb()->core;
+}
+
+pcb_t* process_get_pcb(int cpu) {
+    return &pcbs[cpu];
+}
+
+static bool process_is_fair(process_t* process) {
+    return process->main_thread.priority >= MAX_RT_PRIO;
+}
+
+static uint32_t process_weight(process_t* process) {
+    return prio_to_weight[process->main_thread.priority - MAX_RT_PRIO];
+}
+
+static int fair_compare(void* a, void* b) {
+    process_t* first = a;
+    process_t* second = b;
+
+    if(first->vruntime < second->vruntime) {
+        return -1;
+    }
+
+    return first->vruntime > second->vruntime;
+}
+
+void run_queue_init(run_queue_t* queue) {
+    memset(queue, 0, sizeof(run_queue_t));
+    avl_tree_init(&queue->fair, fair_compare, NULL);
+}
+
+void run_queue_enqueue(run_queue_t* queue, process_t* process) {
+    int prio = process->main_thread.priority;
+
+    if(process_is_fair(process)) {
+        process->run_node.value = process;
+        avl_tree_insert_node(&queue->fair, &process->run_node);
+
+        //Equal vruntimes go right, so the new node is only leftmost if it is strictly smaller
+        if(queue->leftmost == NULL || fair_compare(process, queue->leftmost->value) < 0) {
+            queue->leftmost = &process->run_node;
+        }
+
+        queue->fair_weight += process_weight(process);
+    } else {
+        process->run_next = NULL;
+        process->run_prev = queue->tails[prio];
+
+        if(queue->tails[prio] != NULL) {
+            queue->tails[prio]->run_next = process;
+        } else {
+            queue->heads[prio] = process;
+        }
+
+        queue->tails[prio] = process;
+        queue->bitmap[prio / 64] |= 1ull << (prio % 64);
+    }
+
+    queue->length++;
+    process->on_run_queue = true;
+}
+
+void run_queue_dequeue(run_queue_t* queue, process_t* process) {
+    int prio = process->main_thread.priority;
+
+    if(process_is_fair(process)) {
+        if(queue->leftmost == &process->run_node) {
+            queue->leftmost = avl_tree_next(&process->run_node);
+        }
+
+        avl_tree_unlink(&queue->fair, &process->run_node);
+        queue->fair_weight -= process_weight(process);
+    } else {
+        if(process->run_prev != NULL) {
+            process->run_prev->run_next = process->run_next;
+        } else {
+            queue->heads[prio] = process->run_next;
+        }
+
+        if(process->run_next != NULL) {
+            process->run_next->run_prev = process->run_prev;
+        } else {
+            queue->tails[prio] = process->run_prev;
+        }
+
+        if(queue->heads[prio] == NULL) {
+            queue->bitmap[prio / 64] &= ~(1ull << (prio % 64));
+        }
+
+        process->run_next = NULL;
+        process->run_prev = NULL;
+    }
+
+    process->on_run_queue = false;
+    queue->length--;
+}
+
+process_t* run_queue_first(run_queue_t* queue) {
+    for(int word = 0; word < RUN_QUEUE_WORDS; word++) {
+        if(queue->bitmap[word] != 0) {
+            return queue->heads[word * 64 + __builtin_ctzll(queue->bitmap[word])];
+        }
+    }
+
+    return queue->leftmost ? queue->leftmost->value : NULL;
+}
+
+/**
+ * Moves min_vruntime up to the smallest vruntime of the running and the queued fair processes
+ */
+static void update_min_vruntime(run_queue_t* queue, process_t* current) {
+    uint64_t vruntime = UINT64_MAX;
+
+    if(current != NULL && process_is_fair(current)) {
+        vruntime = current->vruntime;
+    }
+
+    if(queue->leftmost != NULL && ((process_t*)queue->leftmost->value)->vruntime < vruntime) {
+        vruntime = ((process_t*)queue->leftmost->value)->vruntime;
+    }
+
+    if(vruntime != UINT64_MAX && vruntime > queue->min_vruntime) {
+        queue->min_vruntime = vruntime;
+    }
+}
+
+/**
+ * Charges the time on the cpu since exec_start, fair processes age slower the higher their weight
+ */
+static void update_curr(run_queue_t* queue, process_t* current, uint64_t now) {
+    uint64_t delta = now > current->exec_start ? now - current->exec_start : 0;
+
+    current->exec_start = now;
+    current->sum_exec_runtime += delta;
+
+    if(process_is_fair(current)) {
+        current->vruntime += delta * NICE_0_LOAD / process_weight(current);
+        update_min_vruntime(queue, current);
+    }
+}
+
+/**
+ * Places a new or woken fair process, new ones start at min_vruntime so forking gains nothing.
+ * Sleepers get up to half a latency of credit so interactive processes run soon after waking,
+ * but they can't save up the time they slept.
+ */
+static void place_process(run_queue_t* queue, process_t* process) {
+    if(process->sum_exec_runtime == 0) {
+        process->vruntime = queue->min_vruntime;
+        return;
+    }
+
+    uint64_t credit = sched_latency / 2;
+    uint64_t floor = queue->min_vruntime > credit ? queue->min_vruntime - credit : 0;
+
+    if(process->vruntime < floor) {
+        process->vruntime = floor;
+    }
+}
+
+/**
+ * @return the timeslice of a fair process that was just picked, its share of the latency by weight
+ */
+static uint64_t sched_slice(run_queue_t* queue, process_t* process) {
+    uint64_t weight = process_weight(process);
+    uint64_t slice = sched_latency * weight / (queue->fair_weight + weight);
+
+    return slice < sched_min_granularity ? sched_min_granularity : slice;
+}
+
+/**
+ * Requests a reschedule if the woken process should run before the current one
+ */
+static void check_preempt_wakeup(pcb_t* pcb, process_t* process) {
+    process_t* current = (process_t*)pcb->current_process;
+
+    if(current == NULL || current == pcb->kernel_idle_process) {
+        pcb->need_resched = true;
+        return;
+    }
+
+    if(!process_is_fair(process) || !process_is_fair(current)) {
+        if(process->main_thread.priority < current->main_thread.priority) {
+            pcb->need_resched = true;
+        }
+
+        return;
+    }
+
+    //The vruntime of the current process is as old as its last charge, at most a tick
+    if(process->vruntime + sched_wakeup_granularity < current->vruntime) {
+        pcb->need_resched = true;
+    }
+}
+
+static hrtimer_restart_t sched_slice_expired(hrtimer_t* timer) {
+    (void)timer;
+    get_pcb()->need_resched = true;
+
+    return HRTIMER_NORESTART;
+}
+
+void sched_set_latency(uint64_t ns) {
+    if(ns < NSEC_PER_MSEC) {
+        ns = NSEC_PER_MSEC;
+    }
+
+    sched_latency = ns;
+    sched_min_granularity = ns / 8;
+    sched_wakeup_granularity = ns / 6;
+}
+
+void sched_parse_cmdline(const char* cmdline) {
+    const char* option = strstr(cmdline, "sched_latency_ms=");
+
+    if(option == NULL) {
+        return;
+    }
+
+    uint64_t ms = 0;
+
+    for(option += strlen("sched_latency_ms="); *option >= '0' && *option <= '9'; option++) {
+        ms = ms * 10 + (*option - '0');
+    }
+
+    if(ms != 0) {
+        sched_set_latency(ms * NSEC_PER_MSEC);
+    }
+}
+
+void sched_tick() {
+    pcb_t* pcb = get_pcb();
+    process_t* current = (process_t*)pcb->current_process;
+
+    //Fair processes are preempted by their slice timer, real time ones take turns with their priority every tick
+    if(current != NULL && current != pcb->kernel_idle_process && !process_is_fair(current)) {
+        process_t* next = run_queue_first(&pcb->run_queue);
+
+        if(next != NULL && next->main_thread.priority <= current->main_thread.priority) {
+            pcb->need_resched = true;
+        }
+    }
 }
 
 process_t* get_next_process() {
-    if(thread_queue->length == 0) {
-        return NULL;
+    run_queue_t* queue = &get_pcb()->run_queue;
+    uint64_t rflags = cli();
+    process_t* next = run_queue_first(queue);
+
+    if(next != NULL) {
+        run_queue_dequeue(queue, next);
     }
 
-    list_entry_t* entry = thread_queue->head;
-    list_remove_by_index(thread_queue, 0);
+    sti(rflags);
 
-    return (process_t*)entry->value;
+    return next;
+}
+
+_Noreturn void process_enter_idle() {
+    pcb_t* pcb = get_pcb();
+
+    pcb->current_process = pcb->kernel_idle_process;
+    pcb->current_page_map = pcb->kernel_idle_process->page_directory->page_directory;
+
+    set_stack_pointer(pcb->kernel_idle_process->main_thread.kernel_stack);
+    longjmp(&pcb->kernel_idle_process->main_thread);
+    __builtin_unreachable();
 }
 
 void schedule(bool sleep) {
-    if(pcb.current_process == null) return;
+    pcb_t* pcb = get_pcb();
+
+    if(pcb->current_process == null) return;
 
-    if(pcb.current_process != pcb.kernel_idle_process && setjmp(&pcb.current_process->main_thread)) {
+    if(pcb->current_process != pcb->kernel_idle_process && setjmp(&pcb->current_process->main_thread)) {
         //We are back in kernel space, resume call
         return;
     }
 
-    __sync_and_and_fetch(&pcb.current_process->flags, ~(PROC_FLAG_ON_CPU));
+    __sync_and_and_fetch(&pcb->current_process->flags, ~(PROC_FLAG_ON_CPU));
+
+    uint64_t now = ktime_get_ns();
+    pcb->need_resched = false;
+
+    if(pcb->current_process != pcb->kernel_idle_process) {
+        process_t* previous = (process_t*)pcb->current_process;
+        uint64_t rflags = cli();
 
-    if(pcb.current_process != pcb.kernel_idle_process && !sleep) {
-        schedule_process(pcb.current_process);
+        //Woken before it got to sleep, the tree is ordered by vruntime so it can't change in place
+        bool woken = previous->on_run_queue;
+
+        if(woken) {
+            run_queue_dequeue(&pcb->run_queue, previous);
+        }
+
+        update_curr(&pcb->run_queue, previous, now);
+
+        //A preempted process keeps its vruntime, only wakeups are placed
+        if(!sleep || woken) {
+            run_queue_enqueue(&pcb->run_queue, previous);
+        }
+
+        sti(rflags);
     }
 
-    pcb.previous_process = pcb.current_process;
-    pcb.current_process = get_next_process();
+    pcb->previous_process = pcb->current_process;
+    pcb->current_process = get_next_process();
+
+    if(pcb->current_process == null) {
+        hrtimer_cancel(&pcb->slice_timer);
 
-    if(pcb.current_process == null) {
         //printf("Jumping to idle thread.\n");
-        pcb.current_process = pcb.kernel_idle_process;
+        pcb->current_process = pcb->kernel_idle_process;
 
-        set_stack_pointer(pcb.current_process->main_thread.kernel_stack);
-        longjmp(&pcb.kernel_idle_process->main_thread);
+        set_stack_pointer(pcb->current_process->main_thread.kernel_stack);
+        longjmp(&pcb->kernel_idle_process->main_thread);
     }
 
     //printf("Jumping to thread.\n");
 
-    __sync_or_and_fetch(&pcb.current_process->flags, PROC_FLAG_ON_CPU);
+    process_t* next = (process_t*)pcb->current_process;
+    next->exec_start = now;
+
+    if(process_is_fair(next)) {
+        update_min_vruntime(&pcb->run_queue, next);
+        hrtimer_start(&pcb->slice_timer, now + sched_slice(&pcb->run_queue, next));
+    } else {
+        hrtimer_cancel(&pcb->slice_timer);
+    }
+
+    __sync_or_and_fetch(&pcb->current_process->flags, PROC_FLAG_ON_CPU);
 
-    set_stack_pointer(pcb.current_process->main_thread.kernel_stack);
-    process_set_current_pml(pcb.current_process->page_directory->page_directory);
-    load_page_map(pcb.current_page_map);
-    longjmp(&pcb.current_process->main_thread);
+    set_stack_pointer(pcb->current_process->main_thread.kernel_stack);
+    //Threads sharing the address space keep the loaded page map and its TLB entries
+    process_set_current_pml(pcb->current_process->page_directory->page_directory);
+    load_page_map(pcb->current_page_map, pcb->current_process->page_directory->asid);
+    longjmp(&pcb->current_process->main_thread);
 }
 
 void schedule_process(process_t* process) {
     __sync_and_and_fetch(&process->flags, ~(PROC_FLAG_SLEEP_INTERRUPTIBLE));
 
-    list_insert(thread_queue, process);
+    uint64_t rflags = cli();
+    pcb_t* pcb = &pcbs[process->cpu];
+
+    //Processes stay on the cpu they were created on, a wakeup racing with the tick mustn't queue them twice
+    if(!process->on_run_queue) {
+        if(process_is_fair(process)) {
+            place_process(&pcb->run_queue, process);
+        }
+
+        run_queue_enqueue(&pcb->run_queue, process);
+
+        if(process != pcb->current_process) {
+            check_preempt_wakeup(pcb, process);
+        }
+    }
+
+    sti(rflags);
+}
+
+int process_get_nice(process_t* process) {
+    return PRIO_TO_NICE(process->main_thread.priority);
+}
+
+void process_set_nice(process_t* process, int nice) {
+    if(nice < NICE_MIN) {
+        nice = NICE_MIN;
+    } else if(nice > NICE_MAX) {
+        nice = NICE_MAX;
+    }
+
+    uint64_t rflags = cli();
+    run_queue_t* queue = &pcbs[process->cpu].run_queue;
+    bool queued = process->on_run_queue;
+
+    if(queued) {
+        run_queue_dequeue(queue, process);
+    }
+
+    process->main_thread.priority = NICE_TO_PRIO(nice);
+
+    if(queued) {
+        run_queue_enqueue(queue, process);
+    }
+
+    sti(rflags);
 }
 
 void wait_for_object(mutex_t* mutex) {
@@ -691,7 +1298,7 @@ void wait_for_object(mutex_t* mutex) {
     schedule(true);
 }
 
-int wait_for_object_timeout(mutex_t* mutex, unsigned long timeout) {
+int wait_for_object_timeout(mutex_t* mutex, uint64_t deadline) {
     spin_lock(&mutex->lock);
 
     list_insert(mutex->waiting, get_current_process());
@@ -699,17 +1306,51 @@ int wait_for_object_timeout(mutex_t* mutex, unsigned long timeout) {
     __sync_and_and_fetch(&get_current_process()->flags, ~(PROC_FLAG_ON_CPU));
 
     process_t* process = get_current_process();
-    process->sleepTick = timeout;
+    process->sleepUntil = deadline;
 
     spin_lock(sleep_lock);
-    list_insert(sleeping_queue, process);
+
+    if(sleep_heap_insert(&sleeping_queue, process) != 0) {
+        //Without memory for the timeout it expires right away
+        spin_unlock(sleep_lock);
+
+        list_entry_t* entry = list_find(mutex->waiting, process);
+
+        if(entry != NULL) {
+            list_delete(mutex->waiting, entry);
+        }
+
+        __sync_and_and_fetch(&process->flags, ~(PROC_FLAG_SLEEP_INTERRUPTIBLE));
+        __sync_or_and_fetch(&process->flags, PROC_FLAG_ON_CPU);
+        spin_unlock(&mutex->lock);
+
+        return 1;
+    }
+
     spin_unlock(sleep_lock);
 
     spin_unlock(&mutex->lock);
 
     schedule(true);
 
-    if(get_counter() > timeout) {
+    //Woken by the mutex before the timeout
+    sleep_cancel(process);
+
+    //The timeout leaves the process on the waiting list, the next release mustn't wake it again
+    spin_lock(&mutex->lock);
+
+    list_entry_t* entry = list_find(mutex->waiting, process);
+
+    if(entry != NULL) {
+        list_delete(mutex->waiting, entry);
+        spin_unlock(&mutex->lock);
+
+        return 1;
+    }
+
+    spin_unlock(&mutex->lock);
+
+    if(ktime_get_ns() >= deadline) {
         return 1;
     }
 
@@ -723,6 +1364,8 @@ void wakeup_waiting(list_t* queue) {
         if(entry != NULL && entry->value != NULL) {
             process_t* process = entry->value;
 
+            //A timed waiter mustn't be woken a second time by its timeout
+            sleep_cancel(process);
             schedule_process(process);
         }
 
@@ -807,12 +1450,19 @@ void process_reap(process_t * proc) {
 
     if(proc->page_directory->process_count <= 0) {
         spin_lock(&proc->page_directory->lock);
+        memmgr_asid_free(proc->page_directory->asid, proc->page_directory->page_directory);
         process_free_pml(proc->page_directory->page_directory);
+        memmgr_vma_destroy(proc->page_directory);
 
         free(proc->page_directory);
     }
 
-    free(proc);
+    memmgr_kernel_stack_free(proc->main_thread.kernel_stack);
+
+    //A thread killed during a timed wait is still queued
+    sleep_cancel(proc);
+
+    kmem_cache_free(process_cache, proc);
 }
 
 void process_thread_exit(int retval) {
@@ -825,11 +1475,7 @@ void process_thread_exit(int retval) {
 
     process->status = retval;
     process->flags = PROC_FLAG_FINISHED;
-    //Clear stack
-    for(int i = 0; i < 0x5000; i += 0x1000) {
-        memmgr_delete_page(process->main_thread.kernel_stack - 0x5000 + i);
-    }
-    //Now we wait until someone cleans it up.
+    //Now we wait until someone cleans it up, the kernel stack is still in use until then.
 
     schedule(true);
 }
@@ -902,53 +1548,73 @@ void process_exit(int retval) {
 }
 
 void sleep(long milliseconds) {
-    unsigned long counter = get_counter();
-
-    unsigned long until = counter + (milliseconds / 10) + 1;
+    sleep_ns(milliseconds * NSEC_PER_MSEC);
+}
 
+void sleep_ns(uint64_t nanoseconds) {
     process_t* process = get_current_process();
-    process->sleepTick = until;
+    process->sleepUntil = ktime_get_ns() + nanoseconds;
 
     __sync_or_and_fetch(&process->flags, PROC_FLAG_SLEEP_INTERRUPTIBLE);
     __sync_and_and_fetch(&process->flags, ~(PROC_FLAG_ON_CPU));
 
     spin_lock(sleep_lock);
-    list_insert(sleeping_queue, process);
+
+    if(sleep_heap_insert(&sleeping_queue, process) != 0) {
+        //Nothing would wake us up, return right away instead
+        spin_unlock(sleep_lock);
+
+        __sync_and_and_fetch(&process->flags, ~(PROC_FLAG_SLEEP_INTERRUPTIBLE));
+        __sync_or_and_fetch(&process->flags, PROC_FLAG_ON_CPU);
+
+        return;
+    }
+
     spin_unlock(sleep_lock);
 
     schedule(true);
 }
 
 void wakeup_sleeping() {
-    unsigned long counter = get_counter();
+    uint64_t now = ktime_get_ns();
 
     spin_lock(sleep_lock);
-    if(sleeping_queue->length > 0) {
-        for(list_entry_t* entry = sleeping_queue->head; entry; entry = entry->next) {
-            process_t* proc = (process_t*)entry->value;
 
-            if(proc->sleepTick <= counter) {
-                list_delete(sleeping_queue, entry);
+    //Only the expired sleepers at the top of the heap are touched
+    while(sleeping_queue.length > 0 && sleeping_queue.entries[1]->sleepUntil <= now) {
+        process_t* proc = sleeping_queue.entries[1];
 
-                schedule_process(proc);
-            }
-        }
+        sleep_heap_remove(&sleeping_queue, proc);
+        schedule_process(proc);
     }
+
     spin_unlock(sleep_lock);
 }
 
+uint64_t process_next_wakeup() {
+    //Whoever holds the lock changes the queue, check again at the next tick
+    if(!spin_trylock(sleep_lock)) {
+        return ktime_get_ns() + TICK_NSEC;
+    }
+
+    uint64_t next = sleep_heap_next(&sleeping_queue);
+
+    spin_unlock(sleep_lock);
+
+    return next;
+}
+
 bool wakeup_now(process_t* proc) {
     spin_lock(sleep_lock);
 
-    if(proc->cpu != pcb.core || proc->cpu != -1) {
+    if(proc->cpu != get_current_core() && proc->cpu != -1) {
+        spin_unlock(sleep_lock);
         return false;
     }
 
-    list_entry_t* entry = list_find(sleeping_queue, proc);
-
-    if(entry != NULL) {
-        proc->sleepTick = 0;
-        list_delete(sleeping_queue, entry);
+    if(proc->sleepSlot != 0) {
+        sleep_heap_remove(&sleeping_queue, proc);
+        proc->sleepUntil = 0;
 
         schedule_process(proc);
     }
@@ -1094,6 +1760,36 @@ process_t* get_process_by_id(int pid) {
     return NULL;
 }
 
+mm_struct_t* process_next_mm(int pid, int* outPid) {
+    mm_struct_t* next = NULL;
+    int nextPid = 0;
+
+    if(!spin_trylock(process_lock)) {
+        return NULL;
+    }
+
+    //Threads share the address space of their group leader, a tgid of 0 is a process of its own (clone without CLONE_THREAD)
+    for(list_entry_t* entry = process_list->head; entry; entry = entry->next) {
+        process_t* proc = (process_t*)entry->value;
+
+        if(proc->id > pid && (proc->tgid == 0 || proc->id == proc->tgid) && proc->page_directory != NULL
+           && (nextPid == 0 || proc->id < nextPid)) {
+            next = proc->page_directory;
+            nextPid = proc->id;
+        }
+    }
+
+    //A busy address space still reports its id, so the caller can skip it
+    if(next != NULL && !spin_trylock(&next->lock)) {
+        next = NULL;
+    }
+
+    spin_unlock(process_lock);
+
+    *outPid = nextPid;
+    return next;
+}
+
 /**
  * Acquires the current process tree, thereby locking it
  * @return
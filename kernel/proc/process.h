@@ -10,6 +10,8 @@
 #include "../lock.h"
 #include "../mutex.h"
 #include "../idt.h"
+#include "../gdt.h"
+#include "../hrtimer.h"
 #include "../../mlibc/abis/linux/signal.h"
 
 #define PROC_FLAG_KERNEL 1<<0
@@ -108,10 +110,14 @@ typedef struct file_descriptor_table {
     spin_t lock;
 } fd_table_t;
 
-typedef struct {
+typedef struct mm_struct {
     uintptr_t page_directory;
+    uint16_t asid; //Address space identifier for PCID, 0 if the page map has none
     unsigned long heap; //Current program break
 
+    avl_tree_t* vmas; //Mapped regions of the user address space, sorted by start address
+    spin_t vma_lock;
+
     atomic_int process_count; //Count of threads still existent.
     spin_t lock;
 } mm_struct_t;
@@ -136,7 +142,17 @@ typedef struct process {
     int flags;
 
     int status;
-    uint64_t sleepTick; //The tick until the process sleeps
+    uint64_t sleepUntil; //ktime in nanoseconds until the process sleeps
+    size_t sleepSlot; //Position in the sleep heap counting from 1, 0 while not sleeping
+
+    struct process* run_next; //Neighbours in the real time run queue of main_thread.priority
+    struct process* run_prev;
+    avl_tree_node_t run_node; //Node in the fair run queue
+    bool on_run_queue;
+
+    uint64_t vruntime; //Nanoseconds on the cpu scaled by NICE_0_LOAD / weight, the fair class runs the smallest first
+    uint64_t exec_start; //ktime the process got the cpu or was last charged
+    uint64_t sum_exec_runtime; //Nanoseconds on the cpu, 0 until the process ran once
 
     mm_struct_t* page_directory;
     kernel_thread_t main_thread; // this is the thread that started the process, if it is killed, the process is dead and all threads are killed
@@ -158,6 +174,47 @@ typedef struct process {
     spin_t lock;
 } process_t;
 
+//Upper bound for per cpu data
+#define MAX_CPUS 16
+
+//Priorities like Linux, lower runs first. 0-99 are real time, nice -20 to 19 maps to 100-139.
+//Real time priorities run strictly by priority, the others share the cpu by their weight.
+#define MAX_PRIO 140
+#define MAX_RT_PRIO 100
+#define NICE_MIN -20
+#define NICE_MAX 19
+#define NICE_TO_PRIO(nice) (MAX_RT_PRIO + 20 + (nice))
+#define PRIO_TO_NICE(prio) ((prio) - MAX_RT_PRIO - 20)
+#define DEFAULT_PRIO NICE_TO_PRIO(0)
+
+//Weight of nice 0, every nice level is worth about 10% cpu time
+#define NICE_0_LOAD 1024
+
+#define RUN_QUEUE_WORDS ((MAX_RT_PRIO + 63) / 64)
+
+//Runnable processes of one cpu, nothing is allocated to queue a process.
+//Real time processes wait in a FIFO per priority linked through the processes themselves,
+//the others in a tree ordered by vruntime.
+typedef struct run_queue {
+    uint64_t bitmap[RUN_QUEUE_WORDS]; //Bit set for every real time priority with a queued process
+    process_t* heads[MAX_RT_PRIO];
+    process_t* tails[MAX_RT_PRIO];
+
+    avl_tree_t fair;
+    avl_tree_node_t* leftmost; //Smallest vruntime, picked next
+    uint64_t min_vruntime; //Only grows, waking processes are placed relative to it
+    uint64_t fair_weight; //Sum of the queued weights
+
+    size_t length;
+} run_queue_t;
+
+//Min-heap of sleeping processes ordered by sleepUntil, entries start at index 1
+typedef struct sleep_heap {
+    process_t** entries;
+    size_t length;
+    size_t capacity;
+} sleep_heap_t;
+
 typedef struct process_control_block {
     volatile process_t* current_process;
     volatile process_t* previous_process;
@@ -166,8 +223,21 @@ typedef struct process_control_block {
     int core;
 
     uintptr_t current_page_map;
+
+    run_queue_t run_queue; //Processes waiting for this cpu, only the cpu itself touches it while processes don't migrate
+    hrtimer_t slice_timer; //Ends the timeslice of a fair process
+    volatile bool need_resched; //Set when the current process should give up the cpu at the next interrupt from user mode
 } pcb_t;
 
+/**
+ * @return the control block of the executing cpu, found through the GS base
+ */
+static inline pcb_t* get_pcb() {
+    pcb_t* pcb;
+    __asm__ volatile("mov %%gs:%c1, %0" : "=r"(pcb) : "i"(offsetof(cpu_local_t, pcb)));
+    return pcb;
+}
+
 struct clone_args {
     uint64_t flags;        /* Flags bit mask */
     uint64_t pidfd;        /* Where to store PID file descriptor
@@ -194,7 +264,11 @@ void process_init();
 //Process creation functions
 void process_create_task(char* path, bool is_kernel); //used by the kernel at load to create the init task
 void process_create_thread(void* address); //Creates kernel thread
-void process_create_idle();
+/**
+ * Creates the idle task of a cpu, it runs whenever the run queue of the cpu is empty
+ * @param cpu the index of the cpu
+ */
+void process_create_idle(int cpu);
 pid_t process_fork();
 pid_t process_clone(struct clone_args* args, size_t size);
 
@@ -222,25 +296,100 @@ void process_close_fd(int fd);
 
 //Current process state
 process_t* get_current_process();
+//Index of the executing cpu, below MAX_CPUS
+int get_current_core();
+//Control block of a cpu, valid before the cpu is started
+pcb_t* process_get_pcb(int cpu);
+/**
+ * Continues the executing cpu in its idle task, used by cpus that have nothing else to return to
+ */
+_Noreturn void process_enter_idle();
 file_node_t* get_cwd();
 char* get_cwd_name();
 process_t* get_process_by_id(int pid);
 
+/**
+ * Returns the address space of the process with the next higher id, used to walk all address spaces
+ * Gives up instead of waiting if the process list or the address space is locked
+ * @param pid the id to continue after, 0 for the first process
+ * @param outPid the id of the returned process
+ * @return the locked address space or NULL, release it with spin_unlock(&mm->lock)
+ *         outPid is 0 if there is no further process
+ */
+mm_struct_t* process_next_mm(int pid, int* outPid);
 /**
  * Acquires the current process tree, thereby locking it
  * @return
  */
 process_tree_t* acquire_process_tree_lock();
+//Every process, scanners walk it with the process tree lock held
+extern list_t* process_list;
 void release_process_tree_lock();
 
+/**
+ * Gives the process a new address space holding only the kernel half, the old one is freed unless other threads use it
+ * Loads the new page map, so the process has to be the current one
+ */
+void process_replace_mm(process_t* process);
 int execve(char* path, char** argv, char** envp);
 
 //Scheduler
 void schedule_process(process_t* process);
+
+void run_queue_init(run_queue_t* queue);
+/**
+ * Appends a real time process to the FIFO of its priority or inserts a fair process by its vruntime, no allocation
+ */
+void run_queue_enqueue(run_queue_t* queue, process_t* process);
+void run_queue_dequeue(run_queue_t* queue, process_t* process);
+/**
+ * @return the oldest process of the highest real time priority, otherwise the fair process with the smallest vruntime or NULL
+ */
+process_t* run_queue_first(run_queue_t* queue);
+
+/**
+ * Queues the process until its sleepUntil, called with the sleep lock held for the global heap
+ * @return 0 or -ENOMEM
+ */
+int sleep_heap_insert(sleep_heap_t* heap, process_t* process);
+/**
+ * Takes the process out of the heap from any position, called with the sleep lock held for the global heap
+ */
+void sleep_heap_remove(sleep_heap_t* heap, process_t* process);
+/**
+ * @return the earliest sleepUntil in the heap or UINT64_MAX if it is empty
+ */
+uint64_t sleep_heap_next(sleep_heap_t* heap);
+
+/**
+ * Sets the period in which every runnable fair process runs once, 6 ms by default.
+ * A timeslice is the share of the process weight but at least an eighth of the period.
+ */
+void sched_set_latency(uint64_t ns);
+/**
+ * Reads sched_latency_ms=N from the kernel command line
+ */
+void sched_parse_cmdline(const char* cmdline);
+/**
+ * Called by the scheduler tick, real time processes of the same priority take turns every tick
+ */
+void sched_tick();
+
+int process_get_nice(process_t* process);
+/**
+ * Changes the priority of the process, a queued process moves to its new FIFO
+ * @param nice clamped to NICE_MIN and NICE_MAX
+ */
+void process_set_nice(process_t* process, int nice);
 void schedule(bool sleep);
 
 void wait_for_object(mutex_t* mutex);
-int wait_for_object_timeout(mutex_t* mutex, unsigned long timeout);
+/**
+ * Waits until the mutex wakes us up or the deadline passed
+ * @param deadline ktime in nanoseconds
+ * @return 1 if the deadline passed
+ */
+int wait_for_object_timeout(mutex_t* mutex, uint64_t deadline);
 void wakeup_waiting(list_t* queue);
 
 /***
@@ -248,7 +397,15 @@ void wakeup_waiting(list_t* queue);
  * @param milliseconds the amount of milliseconds passed since call
  */
 void sleep(long milliseconds);
+/**
+ * Sleeps for at least the given nanoseconds, an idle cpu 0 wakes up at the deadline and a busy one on the next tick
+ */
+void sleep_ns(uint64_t nanoseconds);
 void wakeup_sleeping();
+/**
+ * @return the ktime the first sleeper wakes up at or UINT64_MAX
+ */
+uint64_t process_next_wakeup();
 bool wakeup_now(process_t* proc);
 
 #endif //NIGHTOS_PROCESS_H
@@ -45,7 +45,12 @@ int exec_elf(elf_t* elf_file, int argc, char* argv, char* envp) {
            elf_file->handle->offset = programHeader.offset;
            read(elf_file->handle, (void*)programHeader.virt_addr, programHeader.file_size);
 
-           memset((void*)programHeader.virt_addr + programHeader.file_size, 0, programHeader.mem_size - programHeader.file_size);
+           //Only the page shared with the file contents needs clearing, the pages after it are zero filled on first access
+           uintptr_t bss = programHeader.virt_addr + programHeader.file_size;
+           uintptr_t end = programHeader.virt_addr + programHeader.mem_size;
+           uintptr_t pageEnd = (bss + 0xFFF) & ~0xFFFull;
+
+           memset((void*)bss, 0, (end < pageEnd ? end : pageEnd) - bss);
        }
    }
 
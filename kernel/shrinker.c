@@ -0,0 +1,81 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+#include "shrinker.h"
+#include "lock.h"
+#include "memmgr.h"
+
+static shrinker_t* shrinkers = NULL;
+//Held while shrinkers run, allocations of a shrinker can't recurse into reclaim this way
+static spin_t SHRINKER_LOCK = ATOMIC_FLAG_INIT;
+
+void register_shrinker(shrinker_t* shrinker) {
+    spin_lock(&SHRINKER_LOCK);
+
+    shrinker->next = shrinkers;
+    shrinkers = shrinker;
+
+    spin_unlock(&SHRINKER_LOCK);
+}
+
+void unregister_shrinker(shrinker_t* shrinker) {
+    spin_lock(&SHRINKER_LOCK);
+
+    for(shrinker_t** current = &shrinkers; *current != NULL; current = &(*current)->next) {
+        if(*current == shrinker) {
+            *current = shrinker->next;
+            break;
+        }
+    }
+
+    shrinker->next = NULL;
+
+    spin_unlock(&SHRINKER_LOCK);
+}
+
+size_t shrink_caches(size_t count) {
+    if(!spin_trylock(&SHRINKER_LOCK)) {
+        return 0;
+    }
+
+    size_t freed = 0;
+    size_t progress = 1;
+
+    while(freed < count && progress > 0) {
+        size_t total = 0;
+        progress = 0;
+
+        for(shrinker_t* shrinker = shrinkers; shrinker != NULL; shrinker = shrinker->next) {
+            total += shrinker->count(shrinker);
+        }
+
+        if(total == 0) {
+            break;
+        }
+
+        //Every cache gives back its share, so large caches shrink the most
+        for(shrinker_t* shrinker = shrinkers; shrinker != NULL && freed < count; shrinker = shrinker->next) {
+            size_t reclaimable = shrinker->count(shrinker);
+
+            if(reclaimable == 0) {
+                continue;
+            }
+
+            size_t share = (count - freed) * reclaimable / total;
+
+            //Memory given to free() mostly stays in the heap, only frames that reached the frame allocator count
+            uint64_t before = memmgr_phys_free_frames();
+            shrinker->scan(shrinker, share > 0 ? share : 1);
+            uint64_t after = memmgr_phys_free_frames();
+
+            size_t released = after > before ? after - before : 0;
+
+            freed += released;
+            progress += released;
+        }
+    }
+
+    spin_unlock(&SHRINKER_LOCK);
+
+    return freed;
+}
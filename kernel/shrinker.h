@@ -0,0 +1,41 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+
+#pragma once
+#ifndef NIGHTOS_SHRINKER_H
+#define NIGHTOS_SHRINKER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+//A cache that can give memory back when the frame allocator runs low.
+//Shrinkers run from the idle task and from allocations with KALLOC_RECLAIM, so they must not allocate memory
+//and must skip (not wait for) anything locked by the interrupted code. They may free to the heap.
+typedef struct shrinker {
+    const char* name;
+
+    //Returns the amount of frames the cache could free right now
+    size_t (*count)(struct shrinker* shrinker);
+    //Frees objects worth up to count frames, returns their size in frames.
+    //shrink_caches only counts the frames that reached the frame allocator.
+    size_t (*scan)(struct shrinker* shrinker, size_t count);
+
+    void* data;
+    struct shrinker* next;
+} shrinker_t;
+
+/**
+ * Registers a shrinker, the structure must stay valid until it is unregistered
+ */
+void register_shrinker(shrinker_t* shrinker);
+void unregister_shrinker(shrinker_t* shrinker);
+
+/**
+ * Asks the registered caches to free memory, every cache gives back a share proportional to its size
+ * @param count the amount of frames to free
+ * @return the amount of free frames gained, 0 if nothing could be freed or a reclaim is already running
+ */
+size_t shrink_caches(size_t count);
+
+#endif //NIGHTOS_SHRINKER_H
@@ -0,0 +1,32 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+
+#ifndef NIGHTOS_SMP_H
+#define NIGHTOS_SMP_H
+
+#include "acpi.h"
+
+/**
+ * Collects the local APICs, IOAPICs and interrupt source overrides from the MADT,
+ * called by pci_init while it walks the ACPI tables
+ */
+void smp_parse_madt(MADT* madt);
+
+/**
+ * Starts the application processors one after another with INIT-SIPI-SIPI
+ * Every started cpu loads its own GDT, TSS and control block and runs its idle task
+ */
+void smp_init();
+
+/**
+ * @return the amount of running cpus, the boot cpu included
+ */
+int smp_cpu_count();
+
+/**
+ * @return the local APIC id of a running cpu or -1
+ */
+int smp_apic_id(int cpu);
+
+#endif //NIGHTOS_SMP_H
@@ -0,0 +1,222 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+#include "swap.h"
+#include "lock.h"
+#include "idt.h"
+#include "fs/vfs.h"
+#include "pci/ahci.h"
+#include "terminal.h"
+#include "../mlibc/abis/linux/errno.h"
+#include <stdlib.h>
+
+#define SWAP_PAGE_SIZE 4096
+#define SWAP_MAX_REFS 0xFF
+
+static file_node_t* swap_device = NULL;
+//Disks bypass their cache, every other block device (e.g. zram) is accessed through its file operations
+static int (*swap_read_io)(file_node_t*, void*, size_t, size_t) = NULL;
+static int (*swap_write_io)(file_node_t*, void*, size_t, size_t) = NULL;
+//Reference count of every slot, slot 0 is never handed out so it can mean "no slot"
+static uint8_t* swap_map = NULL;
+static uint64_t swap_slots = 0;
+static uint64_t swap_used = 0;
+static uint64_t swap_next = 1;
+
+static uint64_t swap_ins = 0;
+static uint64_t swap_outs = 0;
+
+static spin_t SWAP_LOCK = ATOMIC_FLAG_INIT;
+
+/**
+ * Gives back a device opened by swapon that can't be used or isn't needed anymore
+ * @return error, so the error paths of swapon can return the call
+ */
+static int swap_close(file_node_t* node, int error) {
+    if(node->file_ops.close) {
+        node->file_ops.close(node);
+    }
+
+    return error;
+}
+
+int swapon(char* path) {
+    file_node_t* node = open(path, 0);
+
+    if(node == NULL) {
+        return -ENOENT;
+    }
+
+    if(node->type != FILE_TYPE_BLOCK_DEVICE || node->file_ops.read == NULL || node->file_ops.write == NULL) {
+        return swap_close(node, -EINVAL);
+    }
+
+    uint64_t slots = node->size / SWAP_PAGE_SIZE;
+
+    if(slots < 2) {
+        return swap_close(node, -EINVAL);
+    }
+
+    uint8_t* map = calloc(slots, sizeof(uint8_t));
+
+    if(map == NULL) {
+        return swap_close(node, -ENOMEM);
+    }
+
+    uint64_t rflags = cli();
+    spin_lock(&SWAP_LOCK);
+
+    if(swap_device != NULL) {
+        spin_unlock(&SWAP_LOCK);
+        sti(rflags);
+
+        free(map);
+        return swap_close(node, -EBUSY);
+    }
+
+    swap_map = map;
+    swap_slots = slots;
+    swap_used = 0;
+    swap_next = 1;
+    swap_device = node;
+
+    if(ahci_is_device(node)) {
+        swap_read_io = ahci_read_direct;
+        swap_write_io = ahci_write_direct;
+    } else {
+        swap_read_io = (int (*)(file_node_t*, void*, size_t, size_t)) node->file_ops.read;
+        swap_write_io = (int (*)(file_node_t*, void*, size_t, size_t)) node->file_ops.write;
+    }
+
+    spin_unlock(&SWAP_LOCK);
+    sti(rflags);
+
+    printf("Swap: %d KB on %s\n", (slots - 1) * 4, path);
+
+    return 0;
+}
+
+int swapoff() {
+    uint64_t rflags = cli();
+    spin_lock(&SWAP_LOCK);
+
+    if(swap_device == NULL || swap_used > 0) {
+        int error = swap_device == NULL ? -EINVAL : -EBUSY;
+
+        spin_unlock(&SWAP_LOCK);
+        sti(rflags);
+
+        return error;
+    }
+
+    file_node_t* node = swap_device;
+    uint8_t* map = swap_map;
+
+    swap_device = NULL;
+    swap_map = NULL;
+    swap_slots = 0;
+
+    spin_unlock(&SWAP_LOCK);
+    sti(rflags);
+
+    free(map);
+    swap_close(node, 0);
+
+    return 0;
+}
+
+bool swap_enabled() {
+    return swap_device != NULL && swap_used + 1 < swap_slots;
+}
+
+uint64_t swap_alloc_slot() {
+    uint64_t slot = 0;
+
+    uint64_t rflags = cli();
+    spin_lock(&SWAP_LOCK);
+
+    if(swap_device != NULL && swap_used + 1 < swap_slots) {
+        //Next fit, consecutive evictions end up next to each other on the disk
+        for(uint64_t i = 0; i < swap_slots; i++) {
+            uint64_t candidate = swap_next + i;
+
+            if(candidate >= swap_slots) {
+                candidate -= swap_slots - 1;
+            }
+
+            if(swap_map[candidate] == 0) {
+                swap_map[candidate] = 1;
+                swap_used++;
+                swap_next = candidate + 1 < swap_slots ? candidate + 1 : 1;
+
+                slot = candidate;
+                break;
+            }
+        }
+    }
+
+    spin_unlock(&SWAP_LOCK);
+    sti(rflags);
+
+    return slot;
+}
+
+void swap_dup_slot(uint64_t slot) {
+    if(slot == 0 || slot >= swap_slots) {
+        return;
+    }
+
+    uint64_t rflags = cli();
+    spin_lock(&SWAP_LOCK);
+
+    if(swap_map[slot] > 0 && swap_map[slot] < SWAP_MAX_REFS) {
+        swap_map[slot]++;
+    }
+
+    spin_unlock(&SWAP_LOCK);
+    sti(rflags);
+}
+
+void swap_free_slot(uint64_t slot) {
+    if(slot == 0 || slot >= swap_slots) {
+        return;
+    }
+
+    uint64_t rflags = cli();
+    spin_lock(&SWAP_LOCK);
+
+    //Saturated slots stay allocated, the references aren't known anymore
+    if(swap_map[slot] > 0 && swap_map[slot] < SWAP_MAX_REFS && --swap_map[slot] == 0) {
+        swap_used--;
+    }
+
+    spin_unlock(&SWAP_LOCK);
+    sti(rflags);
+}
+
+bool swap_write_slot(uint64_t slot, void* page) {
+    if(swap_write_io(swap_device, page, slot * SWAP_PAGE_SIZE, SWAP_PAGE_SIZE) != SWAP_PAGE_SIZE) {
+        return false;
+    }
+
+    __atomic_add_fetch(&swap_outs, 1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+bool swap_read_slot(uint64_t slot, void* page) {
+    if(swap_read_io(swap_device, page, slot * SWAP_PAGE_SIZE, SWAP_PAGE_SIZE) != SWAP_PAGE_SIZE) {
+        return false;
+    }
+
+    __atomic_add_fetch(&swap_ins, 1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+void swap_get_stats(swap_stats_t* stats) {
+    stats->total_slots = swap_slots > 0 ? swap_slots - 1 : 0;
+    stats->used_slots = swap_used;
+    stats->swap_ins = __atomic_load_n(&swap_ins, __ATOMIC_RELAXED);
+    stats->swap_outs = __atomic_load_n(&swap_outs, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,52 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+
+#ifndef NIGHTOS_SWAP_H
+#define NIGHTOS_SWAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct swap_stats {
+    uint64_t total_slots;
+    uint64_t used_slots;
+
+    //Pages moved in either direction since boot, rates are the difference between two samples
+    uint64_t swap_ins;
+    uint64_t swap_outs;
+} swap_stats_t;
+
+/**
+ * Uses a whole AHCI disk as swap area, its first page is left untouched
+ * @param path the path of the block device
+ * @return 0 on success, -EBUSY if swap is already enabled
+ */
+int swapon(char* path);
+/**
+ * Stops using the swap area, pages still swapped out would be lost so they have to be swapped in first
+ * @return 0 on success, -EINVAL if swap is off, -EBUSY while slots are in use
+ */
+int swapoff();
+/**
+ * @return true if a swap area is in use and has free slots
+ */
+bool swap_enabled();
+
+/**
+ * Reserves a free slot of the swap area
+ * @return the slot or 0 if the swap area is full
+ */
+uint64_t swap_alloc_slot();
+/**
+ * Adds a reference to a slot, used when fork copies a swapped out page
+ */
+void swap_dup_slot(uint64_t slot);
+void swap_free_slot(uint64_t slot);
+
+bool swap_write_slot(uint64_t slot, void* page);
+bool swap_read_slot(uint64_t slot, void* page);
+
+void swap_get_stats(swap_stats_t* stats);
+
+#endif //NIGHTOS_SWAP_H
@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include "../timer.h"
+#include "../ktime.h"
 #include "../../mlibc/abis/linux/errno.h"
 
 mutex_t* create_mutex() {
@@ -40,18 +41,18 @@ void mutex_acquire(mutex_t* mutex) {
 }
 
 int mutex_acquire_timeout(mutex_t* mutex, unsigned long timeout_ms) {
-    unsigned long start_time = get_counter();
+    uint64_t deadline = ktime_get_ns() + timeout_ms * NSEC_PER_MSEC;
 
     spin_lock(&mutex->lock);
 
     while(mutex->owner) {
         spin_unlock(&mutex->lock);
-        if (wait_for_object_timeout(mutex, timeout_ms - (get_counter() - start_time)) != 0) {
+        if (wait_for_object_timeout(mutex, deadline) != 0) {
             return -ETIMEDOUT;
         }
         spin_lock(&mutex->lock);
 
-        if (get_counter() - start_time >= timeout_ms) {
+        if (ktime_get_ns() >= deadline) {
             spin_unlock(&mutex->lock);
             return -ETIMEDOUT;
         }
@@ -12,6 +12,7 @@
 #include "../../mlibc/abis/linux/wait.h"
 #include "../../mlibc/options/ansi/include/bits/ansi/timespec.h"
 #include "../../mlibc/options/posix/include/bits/posix/iovec.h"
+#include "../../mlibc/options/posix/include/bits/posix/timeval.h"
 #include "../../mlibc/options/posix/include/sys/poll.h"
 #include "../error.h"
 #include "../fs/cache.h"
@@ -19,8 +20,12 @@
 #include "../memmgr.h"
 #include "../proc/process.h"
 #include "../serial.h"
+#include "../swap.h"
 #include "../terminal.h"
 #include "../timer.h"
+#include "../uaccess.h"
+#include "../vdso.h"
+#include "../ktime.h"
 #include <signal.h>
 #include <stdio.h>
 
@@ -29,25 +34,149 @@ typedef int (*syscall_t)(long,long,long,long,long);
 spin_t* futex_lock;
 struct hashtable* futex_queue;
 
+//Data between files and user buffers goes through a kernel buffer of at most this size,
+//a fault on the user buffer is then caught by the copy and never happens inside a driver
+#define SYSCALL_BOUNCE_SIZE 16384
+#define SYSCALL_MAX_PATH 4096
+#define SYSCALL_MAX_IOV 1024
+#define SYSCALL_MAX_POLLFDS 1024
+
+/**
+ * Reads from a file into a user buffer, advancing the offset of the handle
+ * A short read of a chunk ends the read, like a short read of the whole buffer would
+ * @return the bytes read or a negative error code if nothing was read
+ */
+static long syscall_read_user(file_handle_t* handle, char* buffer, size_t size) {
+    if(!access_ok(buffer, size)) {
+        return -EFAULT;
+    }
+
+    if(size == 0) {
+        return 0;
+    }
+
+    char* bounce = kmalloc(size < SYSCALL_BOUNCE_SIZE ? size : SYSCALL_BOUNCE_SIZE);
+
+    if(bounce == NULL) {
+        return -ENOMEM;
+    }
+
+    long total = 0;
+
+    while((size_t) total < size) {
+        size_t chunk = size - total < SYSCALL_BOUNCE_SIZE ? size - total : SYSCALL_BOUNCE_SIZE;
+        int readBytes = read(handle, bounce, chunk);
+
+        if(readBytes <= 0) {
+            total = total > 0 ? total : readBytes;
+            break;
+        }
+
+        handle->offset += readBytes;
+
+        if(copy_to_user(buffer + total, bounce, readBytes)) {
+            total = total > 0 ? total : -EFAULT;
+            break;
+        }
+
+        total += readBytes;
+
+        if((size_t) readBytes < chunk) {
+            break;
+        }
+    }
+
+    kfree(bounce);
+
+    return total;
+}
+
+/**
+ * Writes a user buffer to a file, advancing the offset of the handle
+ * @return the bytes written or a negative error code if nothing was written
+ */
+static long syscall_write_user(file_handle_t* handle, const char* buffer, size_t size) {
+    if(!access_ok(buffer, size)) {
+        return -EFAULT;
+    }
+
+    if(size == 0) {
+        return 0;
+    }
+
+    char* bounce = kmalloc(size < SYSCALL_BOUNCE_SIZE ? size : SYSCALL_BOUNCE_SIZE);
+
+    if(bounce == NULL) {
+        return -ENOMEM;
+    }
+
+    long total = 0;
+
+    while((size_t) total < size) {
+        size_t chunk = size - total < SYSCALL_BOUNCE_SIZE ? size - total : SYSCALL_BOUNCE_SIZE;
+
+        if(copy_from_user(bounce, buffer + total, chunk)) {
+            total = total > 0 ? total : -EFAULT;
+            break;
+        }
+
+        int written = write(handle, bounce, chunk);
+
+        if(written <= 0) {
+            total = total > 0 ? total : written;
+            break;
+        }
+
+        handle->offset += written;
+        total += written;
+
+        if((size_t) written < chunk) {
+            break;
+        }
+    }
+
+    kfree(bounce);
+
+    return total;
+}
+
+/**
+ * Copies a path from user memory
+ * @return the path, it has to be freed, or NULL with the error code in error
+ */
+static char* syscall_copy_path(const char* path, int* error) {
+    char* buffer = kmalloc(SYSCALL_MAX_PATH);
+
+    if(buffer == NULL) {
+        *error = -ENOMEM;
+        return NULL;
+    }
+
+    long length = strncpy_from_user(buffer, path, SYSCALL_MAX_PATH);
+
+    if(length < 0 || length == SYSCALL_MAX_PATH) {
+        *error = length < 0 ? (int) length : -ENAMETOOLONG;
+        kfree(buffer);
+        return NULL;
+    }
+
+    return buffer;
+}
+
 int sys_read(long fd, long buffer, long size) {
     process_t* proc = get_current_process();
 
-    file_handle_t* handle = proc->fd_table->handles[fd];
-
     if(fd > proc->fd_table->capacity) {
         return -1;
     }
 
-    if(handle == NULL) {
-        return -1;
-    }
+    file_handle_t* handle = proc->fd_table->handles[fd];
 
-    if(!CHECK_PTR(buffer)) {
+    if(handle == NULL) {
         return -1;
     }
 
-    int readBytes = read(handle, (char*)buffer, size);
-    handle->offset += readBytes;
+    int readBytes = syscall_read_user(handle, (char*)buffer, size);
 
     clear_error();
 
@@ -67,12 +196,7 @@ int sys_write(long fd, long buffer, long size) {
         return -1;
     }
 
-    if(!CHECK_PTR(buffer)) {
-        return -1;
-    }
-
-    int written = write(handle, (char*)buffer, size);
-    handle->offset += written;
+    int written = syscall_write_user(handle, (char*)buffer, size);
 
     clear_error();
 
@@ -80,14 +204,15 @@ int sys_write(long fd, long buffer, long size) {
 }
 
 int sys_open(long ptr, long mode) {
-    char* nameBuf = (char*)ptr;
-    int nameLen = strlen(nameBuf);
+    int error = 0;
+    char* nameBuf = syscall_copy_path((char*)ptr, &error);
 
-    if(nameLen > 4096) {
-        return -EFAULT; //dafuq?
+    if(nameBuf == NULL) {
+        return error;
     }
 
     file_node_t* node = open(nameBuf, (int)mode);
+    kfree(nameBuf);
 
     if(node == NULL) {
         return -ENOENT;
@@ -296,61 +421,63 @@ long sys_fstat(long fd, long statbuf) {
     return 0;
 }
 
-int sys_poll(long fdbuf, long nfds, int timeout) {
-    struct pollfd* pollfds = (struct pollfd*) fdbuf;
+/**
+ * Polls the descriptors until one is ready or the timeout passed
+ * @param timeout nanoseconds, 0 returns immediately and a negative value waits forever
+ */
+static int syscall_poll(long fdbuf, long nfds, int64_t timeout) {
+    if(nfds < 0 || nfds > SYSCALL_MAX_POLLFDS) {
+        return -EINVAL;
+    }
 
-    for(int i = 0; i < nfds; i++) {
-        if(!CHECK_PTR((uintptr_t) pollfds)) {
-            return -EFAULT;
-        }
+    //Polling works on a copy, only the results are written back
+    struct pollfd* pollfds = kmalloc(sizeof(struct pollfd) * (nfds > 0 ? nfds : 1));
 
-        pollfds++;
+    if(pollfds == NULL) {
+        return -ENOMEM;
+    }
+
+    if(copy_from_user(pollfds, (void*) fdbuf, sizeof(struct pollfd) * nfds)) {
+        kfree(pollfds);
+        return -EFAULT;
     }
 
     bool one_ready = false;
-    uint64_t time_at_start = get_counter();
-    uint64_t time_end = timeout > 0 ? time_at_start + (timeout / 10) + 1 : -1;
+    uint64_t time_end = timeout > 0 ? ktime_get_ns() + timeout : UINT64_MAX;
 
     while(!one_ready) {
         if (has_pending_signals(get_current_process())) {
+            kfree(pollfds);
             return -ERESTART;
         }
 
-        pollfds = (struct pollfd*) fdbuf;
-
         for(int i = 0; i < nfds; i++) {
-            if(pollfds->fd > get_current_process()->fd_table->capacity) {
-                pollfds->revents = POLLNVAL;
-
-                pollfds++;
+            if(pollfds[i].fd > get_current_process()->fd_table->capacity) {
+                pollfds[i].revents = POLLNVAL;
                 continue;
             }
 
-            file_handle_t* handle = get_current_process()->fd_table->handles[pollfds->fd];
+            file_handle_t* handle = get_current_process()->fd_table->handles[pollfds[i].fd];
 
             if(handle == NULL) {
-                pollfds->revents = POLLNVAL;
-
-                pollfds++;
+                pollfds[i].revents = POLLNVAL;
                 continue;
             }
 
-            pollfds->revents = (short)fpoll(handle, pollfds->events);
+            pollfds[i].revents = (short)fpoll(handle, pollfds[i].events);
 
-            if((pollfds->revents & (POLLIN | POLLOUT))) {
+            if((pollfds[i].revents & (POLLIN | POLLOUT))) {
                 one_ready = true;
             }
-
-            pollfds++;
         }
 
         if(!one_ready) {
             if(timeout == 0) {
-                return 0;
+                break;
             }
 
-            if(timeout >= 0 && time_end < get_counter()) {
-                return 0;
+            if(timeout >= 0 && time_end <= ktime_get_ns()) {
+                break;
             }
 
             schedule(false);
@@ -359,19 +486,26 @@ int sys_poll(long fdbuf, long nfds, int timeout) {
 
     int countChanged = 0;
 
-    pollfds = (struct pollfd*) fdbuf;
-
     for(int i = 0; i < nfds; i++) {
-        if(pollfds->revents & (POLLIN | POLLOUT)) {
+        if(pollfds[i].revents & (POLLIN | POLLOUT)) {
             countChanged++;
         }
 
-        pollfds++;
+        if(copy_to_user(&((struct pollfd*) fdbuf)[i].revents, &pollfds[i].revents, sizeof(short))) {
+            countChanged = -EFAULT;
+            break;
+        }
     }
 
+    kfree(pollfds);
+
     return countChanged;
 }
 
+int sys_poll(long fdbuf, long nfds, int timeout) {
+    return syscall_poll(fdbuf, nfds, timeout < 0 ? -1 : timeout * NSEC_PER_MSEC);
+}
+
 int sys_lseek(long fd, long offset, long whence) {
     process_t* proc = get_current_process();
 
@@ -472,17 +606,20 @@ long sys_brk(long increment, long size) {
     if(proc == NULL) return -1;
 
     spin_lock(&proc->page_directory->lock);
+    uintptr_t heap = proc->page_directory->heap;
+    //mmap and munmap find the regions of the address space themselves, the scanners may lock it again
+    spin_unlock(&proc->page_directory->lock);
 
     if(increment == 1) {
-        return (uintptr_t) mmap((void *) proc->page_directory->heap, size, false);
+        return (uintptr_t) mmap((void *) heap, size, false);
     }
 
-    if(size < proc->page_directory->heap) {
-        munmap((void *) size, proc->page_directory->heap - size);
+    if(size < heap) {
+        munmap((void *) size, heap - size);
 
         return size;
     } else {
-        uintptr_t result = (uintptr_t) mmap((void *) proc->page_directory->heap, size - proc->page_directory->heap, false);
+        uintptr_t result = (uintptr_t) mmap((void *) heap, size - heap, false);
         return result == UINT64_MAX;
     }
 }
@@ -552,25 +689,32 @@ long sys_readv(long fd, const struct iovec* iov, int iovcnt) {
         return -1;
     }
 
-    if(!CHECK_PTR((uintptr_t) iov)) {
+    if(iovcnt < 0 || iovcnt > SYSCALL_MAX_IOV) {
         return -EINVAL;
     }
 
     int totalBytesRead = 0;
 
     for(int i = 0; i < iovcnt; i++) {
-        int readBytes = read(handle, (char*)(iov->iov_base), iov->iov_len);
+        struct iovec vector;
+
+        if(copy_from_user(&vector, &iov[i], sizeof(struct iovec))) {
+            return totalBytesRead > 0 ? totalBytesRead : -EFAULT;
+        }
 
-        if(!readBytes) {
+        if(vector.iov_len == 0) {
+            continue;
+        }
+
+        int readBytes = syscall_read_user(handle, (char*)(vector.iov_base), vector.iov_len);
+
+        if(readBytes <= 0) {
           clear_error();
 
-          return readBytes;
+          return totalBytesRead > 0 ? totalBytesRead : readBytes;
         }
 
-        handle->offset += readBytes;
         totalBytesRead += readBytes;
-
-        iov++;
     }
 
     clear_error();
@@ -591,25 +735,32 @@ long sys_writev(long fd, const struct iovec* iov, int iovcnt) {
         return -1;
     }
 
-    if(!CHECK_PTR((uintptr_t) iov)) {
+    if(iovcnt < 0 || iovcnt > SYSCALL_MAX_IOV) {
         return -EINVAL;
     }
 
     int totalBytesWritten = 0;
 
     for(int i = 0; i < iovcnt; i++) {
-        int written = write(handle, (char*)(iov->iov_base), iov->iov_len);
+        struct iovec vector;
+
+        if(copy_from_user(&vector, &iov[i], sizeof(struct iovec))) {
+            return totalBytesWritten > 0 ? totalBytesWritten : -EFAULT;
+        }
 
-        if(!written) {
+        if(vector.iov_len == 0) {
+            continue;
+        }
+
+        int written = syscall_write_user(handle, (char*)(vector.iov_base), vector.iov_len);
+
+        if(written <= 0) {
           clear_error();
 
-          return written;
+          return totalBytesWritten > 0 ? totalBytesWritten : written;
         }
 
-        handle->offset += written;
         totalBytesWritten += written;
-
-        iov++;
     }
 
     return totalBytesWritten;
@@ -827,19 +978,19 @@ pid_t sys_fork() {
 }
 
 long sys_mmap(unsigned long address, unsigned long length, long prot, long flags, long fd, long offset) {
-    //PROT, FLAGS, FD and OFFSET are ignored currently
+    //FD and OFFSET are ignored currently, MAP_POPULATE is the only flag supported
     //SPECIFYING A DIFFERENT VALUE THAN 0 FOR FD AND OFFSET WILL RESULT IN AN ERROR
     if(fd != 0 || offset != 0) {
         return -ENOSYS;
     }
 
-    uintptr_t result = (uintptr_t) mmap((void *) address, length, 0);
+    uintptr_t result = (uintptr_t) mmap_flags((void *) address, length, 0, prot, flags & MAP_POPULATE);
 
     return result;
 }
 
 long sys_mprotect(unsigned long address, unsigned long size, long prot) {
-    return -ENOSYS;
+    return mprotect((void *) address, size, prot);
 }
 
 long sys_munmap(unsigned long address, unsigned long length)  {
@@ -886,13 +1037,71 @@ long sys_dup(long fd) {
 }
 
 long sys_nanosleep(struct timespec* timespec) {
-    if(!CHECK_PTR((uintptr_t) timespec)) {
+    struct timespec duration;
+
+    if(copy_from_user(&duration, timespec, sizeof(duration))) {
         return -EFAULT;
     }
 
-    long nanosecondsToMs = timespec->tv_nsec / 1000000;
+    if(duration.tv_sec < 0 || duration.tv_nsec < 0 || duration.tv_nsec >= NSEC_PER_SEC) {
+        return -EINVAL;
+    }
 
-    sleep(timespec->tv_sec * 1000 + nanosecondsToMs + 1);
+    sleep_ns(duration.tv_sec * NSEC_PER_SEC + duration.tv_nsec);
+
+    return 0;
+}
+
+//The vDSO answers these without entering the kernel, the syscalls are the fallback
+long sys_clock_gettime(long clock, struct timespec* timespec) {
+    int64_t sec, nsec;
+
+    if(vdso_read_clock(clock, &sec, &nsec) != 0) {
+        return -EINVAL;
+    }
+
+    struct timespec result = { .tv_sec = sec, .tv_nsec = nsec };
+
+    return copy_to_user(timespec, &result, sizeof(result));
+}
+
+long sys_gettimeofday(struct timeval* timeval, void* timezone) {
+    int64_t sec, nsec;
+
+    if(vdso_read_clock(CLOCK_REALTIME, &sec, &nsec) != 0) {
+        return -EINVAL;
+    }
+
+    struct timeval result = { .tv_sec = sec, .tv_usec = nsec / 1000 };
+
+    if(timeval != NULL && copy_to_user(timeval, &result, sizeof(result))) {
+        return -EFAULT;
+    }
+
+    //No time zones, tz_minuteswest and tz_dsttime are 0
+    int zone[2] = { 0, 0 };
+
+    if(timezone != NULL && copy_to_user(timezone, zone, sizeof(zone))) {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+long sys_time(time_t* time) {
+    int64_t sec, nsec;
+
+    if(vdso_read_clock(CLOCK_REALTIME, &sec, &nsec) != 0) {
+        return -EINVAL;
+    }
+
+    time_t result = sec;
+
+    if(time != NULL && copy_to_user(time, &result, sizeof(result))) {
+        return -EFAULT;
+    }
+
+    return result;
 }
 
 long sys_ioctl(long fd, unsigned long operation, unsigned long args) {
@@ -941,51 +1150,20 @@ long sys_clone(unsigned long flags, unsigned long stack, unsigned long parent_ti
 }
 
 long sys_execve(long pathname, long argv, long envp) {
-    if(!(CHECK_PTR(pathname) || CHECK_PTR(argv) || CHECK_PTR(envp))) {
-        return -EINVAL;
-    }
-
     if((void *) pathname == NULL) {
         return -EINVAL;
     }
 
-    char* path = (char*)pathname;
-    char** args = (char**)argv;
-    char** env = (char**)envp;
-
-    if(args != NULL) {
-        char* arg = NULL;
-        int i = 0;
+    //execve doesn't return on success, so the path lives on the stack that gets reset
+    char path[SYSCALL_MAX_PATH];
+    long length = strncpy_from_user(path, (char*)pathname, SYSCALL_MAX_PATH);
 
-        arg = args[0];
-
-        while(arg != NULL) {
-            if(i > 65536) {
-                return -EINVAL;
-            }
-
-            i++;
-            arg = args[i];
-        }
-    }
-
-    if(env != NULL) {
-        char* arg = NULL;
-        int i = 0;
-
-        arg = env[0];
-
-        while(arg != NULL) {
-            if(i > 65536) {
-                return -EINVAL;
-            }
-
-            i++;
-            arg = env[i];
-        }
+    if(length < 0 || length == SYSCALL_MAX_PATH) {
+        return length < 0 ? length : -ENAMETOOLONG;
     }
 
-    return execve(path, args, env);
+    //The arguments are copied by execve, they have to survive the old address space
+    return execve(path, (char**)argv, (char**)envp);
 }
 
 long sys_rename(long oldpathptr, long newpathptr) {
@@ -1108,6 +1286,63 @@ long sys_getgid() {
     return current->gid;
 }
 
+#define PRIO_PROCESS 0
+
+/**
+ * Only PRIO_PROCESS is supported, process groups and users aren't
+ * @return the process or NULL
+ */
+static process_t* priority_target(long who) {
+    return who == 0 ? get_current_process() : get_process_by_id((int)who);
+}
+
+//The raw syscall returns 20 - nice so that it is never negative, libc converts it back
+long sys_getpriority(long which, long who) {
+    if(which != PRIO_PROCESS) {
+        return -EINVAL;
+    }
+
+    process_t* process = priority_target(who);
+
+    if(process == NULL) {
+        return -ESRCH;
+    }
+
+    return 20 - process_get_nice(process);
+}
+
+long sys_setpriority(long which, long who, long nice) {
+    if(which != PRIO_PROCESS) {
+        return -EINVAL;
+    }
+
+    process_t* current = get_current_process();
+    process_t* process = priority_target(who);
+
+    if(process == NULL) {
+        return -ESRCH;
+    }
+
+    if(current->uid != 0 && process->uid != current->uid) {
+        return -EPERM;
+    }
+
+    if(nice < NICE_MIN) {
+        nice = NICE_MIN;
+    } else if(nice > NICE_MAX) {
+        nice = NICE_MAX;
+    }
+
+    //Only root may raise the priority
+    if(current->uid != 0 && nice < process_get_nice(process)) {
+        return -EACCES;
+    }
+
+    process_set_nice(process, (int)nice);
+
+    return 0;
+}
+
 #define FUTEX_WAIT 0
 #define FUTEX_WAKE 1
 
@@ -1129,7 +1364,7 @@ long sys_futex(long pointer, long action, long val, long timeout) {
     }
 
     //check if pointer is mapped
-    if(memmgr_create_or_get_page(pointer, 0, 0) == 0) {
+    if(memmgr_get_page_physical(pointer) == 0) {
         return -EINVAL;
     }
 
@@ -1138,8 +1373,6 @@ long sys_futex(long pointer, long action, long val, long timeout) {
 
     if(action == FUTEX_WAIT) {
         if(__sync_fetch_and_add(ptr, 0) == val) {
-            long nanosecondsToMs = timespec->tv_nsec / 1000000;
-
             char* id = long_to_string(pointer);
 
             if(!id) {
@@ -1150,7 +1383,7 @@ long sys_futex(long pointer, long action, long val, long timeout) {
             ht_insert(futex_queue, id, get_current_process());
             spin_unlock(futex_lock);
 
-            sleep(timespec->tv_sec * 1000 + nanosecondsToMs + 1); //We're just gonna sleep for 10 milliseconds then reschedule; User space shall carry first
+            sleep_ns(timespec->tv_sec * NSEC_PER_SEC + timespec->tv_nsec); //We're just gonna sleep for the timeout then reschedule; User space shall carry first
 
             spin_lock(futex_lock);
             ht_remove_by_key_and_value(futex_queue, id, get_current_process());
@@ -1196,27 +1429,34 @@ int sys_ppoll(long fdbuf, long nfds, long timespec, long sigmask) {
         return -EFAULT;
     }
 
-    int timeout = 0;
+    int64_t timeout = -1;
 
     if(timespec != NULL) {
         struct timespec* time = (struct timespec*) timespec;
-        long nanosecondsToMs = time->tv_nsec / 1000000;
 
-        timeout = time->tv_sec * 1000 + nanosecondsToMs;
-    } else {
-        timeout = -1;
+        timeout = time->tv_sec * NSEC_PER_SEC + time->tv_nsec;
     }
 
     sigset_t old_sigset;
     sigset_t* sigset = (sigset_t*)sigmask;
 
     sys_rt_sigprocmask(SIG_SETMASK, (long)sigset, (long)&old_sigset);
-    int result = sys_poll(fdbuf, nfds, timeout);
+    int result = syscall_poll(fdbuf, nfds, timeout);
     sys_rt_sigprocmask(SIG_SETMASK, (long)&old_sigset, 0);
 
     return result;
 }
 
+long sys_swapon(long path, long flags) {
+    char* pathBuf = (char*)path;
+
+    if(!CHECK_PTR(path) || strlen(pathBuf) > 4096) {
+        return -EFAULT;
+    }
+
+    return swapon(pathBuf);
+}
+
 //Stub for unimplemented syscalls to fill
 int sys_stub() {
     return -ENOSYS;
@@ -1333,7 +1573,7 @@ syscall_t syscall_table[272] = {
         [93] = (syscall_t)sys_stub,    //SYS_FCHOWN
         [94] = (syscall_t)sys_stub,    //SYS_LCHOWN
         [95] = (syscall_t)sys_stub,    //SYS_UMASK
-        [96] = (syscall_t)sys_stub,    //SYS_GETTIMEOFDAY
+        [96] = (syscall_t)sys_gettimeofday,    //SYS_GETTIMEOFDAY
         [97] = (syscall_t)sys_stub,    //SYS_GETRLIMIT
         [98] = (syscall_t)sys_stub,    //SYS_GETRUSAGE
         [99] = (syscall_t)sys_stub,    //SYS_SYSINFO
@@ -1377,8 +1617,8 @@ syscall_t syscall_table[272] = {
         [137] = (syscall_t)sys_stub,   //SYS_STATFS
         [138] = (syscall_t)sys_stub,   //SYS_FSTATFS
         [139] = (syscall_t)sys_stub,   //SYS_SYSFS
-        [140] = (syscall_t)sys_stub,   //SYS_GETPRIORITY
-        [141] = (syscall_t)sys_stub,   //SYS_SETPRIORITY
+        [140] = (syscall_t)sys_getpriority,   //SYS_GETPRIORITY
+        [141] = (syscall_t)sys_setpriority,   //SYS_SETPRIORITY
         [142] = (syscall_t)sys_stub,   //SYS_SCHED_SETPARAM
         [143] = (syscall_t)sys_stub,   //SYS_SCHED_GETPARAM
         [144] = (syscall_t)sys_stub,   //SYS_SCHED_SETSCHEDULER
@@ -1404,7 +1644,7 @@ syscall_t syscall_table[272] = {
         [164] = (syscall_t)sys_stub,   //SYS_SETTIMEOFDAY
         [165] = (syscall_t)sys_stub,   //SYS_MOUNT
         [166] = (syscall_t)sys_stub,   //SYS_UMOUNT2
-        [167] = (syscall_t)sys_stub,   //SYS_SWAPON
+        [167] = (syscall_t)sys_swapon, //SYS_SWAPON
         [168] = (syscall_t)sys_stub,   //SYS_SWAPOFF
         [169] = (syscall_t)sys_stub,   //SYS_REBOOT
         [170] = (syscall_t)sys_stub,   //SYS_SETHOSTNAME
@@ -1438,7 +1678,7 @@ syscall_t syscall_table[272] = {
         [198] = (syscall_t)sys_stub,   //SYS_LREMOVEXATTR
         [199] = (syscall_t)sys_stub,   //SYS_FREMOVEXATTR
         [200] = (syscall_t)sys_stub,   //SYS_TKILL
-        [201] = (syscall_t)sys_stub,   //SYS_TIME
+        [201] = (syscall_t)sys_time,   //SYS_TIME
         [202] = (syscall_t)sys_futex,  //SYS_FUTEX
         [203] = (syscall_t)sys_stub,   //SYS_SCHED_SETAFFINITY
         [204] = (syscall_t)sys_stub,   //SYS_SCHED_GETAFFINITY
@@ -1465,7 +1705,7 @@ syscall_t syscall_table[272] = {
         [225] = (syscall_t)sys_stub,   //SYS_TIMER_GETOVERRUN
         [226] = (syscall_t)sys_stub,   //SYS_TIMER_DELETE
         [227] = (syscall_t)sys_stub,   //SYS_CLOCK_SETTIME
-        [228] = (syscall_t)sys_stub,   //SYS_CLOCK_GETTIME
+        [228] = (syscall_t)sys_clock_gettime,   //SYS_CLOCK_GETTIME
         [229] = (syscall_t)sys_stub,   //SYS_CLOCK_GETRES
         [230] = (syscall_t)sys_stub,   //SYS_CLOCK_NANOSLEEP
         [231] = (syscall_t)sys_exit_group, //SYS_EXIT_GROUP
@@ -1527,10 +1767,12 @@ void restart_syscall(regs_t* regs, int signum) {
 void syscall_entry(regs_t* regs) {
     uintptr_t syscallNo = regs->rax;
 
-    if(syscall_table[syscallNo]) {
+    if(syscallNo < sizeof(syscall_table) / sizeof(syscall_table[0]) && syscall_table[syscallNo]) {
         get_current_process()->saved_registers = regs;
 
+#ifdef DEBUG
         serial_printf("Got syscall with params %d(%d,%d,%d,%d,%d)", syscallNo, regs->rdi, regs->rsi, regs->rdx, regs->r10, regs->r8);
+#endif
 
         int returnCode = syscall_table[syscallNo](regs->rdi, regs->rsi, regs->rdx, regs->r10, regs->r8);
 
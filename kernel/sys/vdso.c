@@ -0,0 +1,113 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+#include "../vdso.h"
+#include "../alloc.h"
+#include "../memmgr.h"
+#include "../proc/process.h"
+#include "../timer.h"
+#include "../ktime.h"
+#include "../terminal.h"
+#include "../../mlibc/abis/linux/errno.h"
+#include <string.h>
+
+#define VDSO_PAGE_SIZE 0x1000
+
+extern char vdso_image_start[];
+extern char vdso_image_end[];
+
+static uintptr_t* vdso_frames = NULL;
+static size_t vdso_pages = 0;
+
+static uintptr_t vdso_data_frame = 0;
+static vdso_time_data_t* vdso_data = NULL;
+
+static uint64_t vdso_boot_time = 0;
+
+void vdso_init() {
+    size_t size = vdso_image_end - vdso_image_start;
+
+    vdso_pages = (size + VDSO_PAGE_SIZE - 1) / VDSO_PAGE_SIZE;
+    vdso_frames = kcalloc(vdso_pages, sizeof(uintptr_t));
+
+    //The embedded image isn't page aligned, every process maps the same copy
+    for(size_t i = 0; i < vdso_pages; i++) {
+        size_t length = size - i * VDSO_PAGE_SIZE;
+
+        if(length > VDSO_PAGE_SIZE) {
+            length = VDSO_PAGE_SIZE;
+        }
+
+        vdso_frames[i] = kalloc_zeroed_frame();
+        memcpy(memmgr_get_from_physical(vdso_frames[i]), vdso_image_start + i * VDSO_PAGE_SIZE, length);
+    }
+
+    vdso_data_frame = kalloc_zeroed_frame();
+    vdso_boot_time = get_boot_time();
+    vdso_data = memmgr_get_from_physical(vdso_data_frame);
+
+    vdso_update_time();
+
+    printf("vDSO: %d pages, boot time %d\n", vdso_pages, vdso_boot_time);
+}
+
+uintptr_t vdso_map() {
+    if(vdso_data == NULL) {
+        return 0;
+    }
+
+    //The time data sits right below the image, vdso.ld addresses it relative to the code
+    size_t length = (vdso_pages + 1) * VDSO_PAGE_SIZE;
+    uintptr_t base = memmgr_vma_find_free(get_current_process()->page_directory, length);
+
+    if(base == 0) {
+        return 0;
+    }
+
+    if(memmgr_map_kernel_frames(base, &vdso_data_frame, 1, PROT_READ) != 0) {
+        return 0;
+    }
+
+    if(memmgr_map_kernel_frames(base + VDSO_PAGE_SIZE, vdso_frames, vdso_pages, PROT_READ | PROT_EXEC) != 0) {
+        //The data page would stay mapped without the code using it
+        munmap((void*) base, VDSO_PAGE_SIZE);
+        return 0;
+    }
+
+    return base + VDSO_PAGE_SIZE;
+}
+
+void vdso_update_time() {
+    if(vdso_data == NULL) {
+        return;
+    }
+
+    uint64_t monotonic, cycles;
+    clocksource_t* clocksource = ktime_get_snapshot(&monotonic, &cycles);
+    bool tsc = clocksource != NULL && (clocksource->flags & CLOCK_SOURCE_VDSO_TSC);
+
+    //Odd while the values are inconsistent, readers retry
+    __atomic_store_n(&vdso_data->seq, vdso_data->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    vdso_data->clock_mode = tsc ? VDSO_CLOCK_TSC : VDSO_CLOCK_TICK;
+    vdso_data->cycle_last = cycles;
+    vdso_data->mult = tsc ? clocksource->mult : 0;
+    vdso_data->shift = tsc ? clocksource->shift : 0;
+    vdso_data->ticks = get_counter();
+    vdso_data->monotonic_sec = monotonic / NSEC_PER_SEC;
+    vdso_data->monotonic_nsec = monotonic % NSEC_PER_SEC;
+    vdso_data->realtime_sec = vdso_boot_time + vdso_data->monotonic_sec;
+    vdso_data->realtime_nsec = vdso_data->monotonic_nsec;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&vdso_data->seq, vdso_data->seq + 1, __ATOMIC_RELAXED);
+}
+
+int vdso_read_clock(int clock, int64_t* sec, int64_t* nsec) {
+    if(vdso_data == NULL || vdso_time_read(vdso_data, clock, sec, nsec) != 0) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
@@ -10,6 +10,17 @@
 #include "serial.h"
 #include "terminal.h"
 #include "memmgr.h"
+#include "fs/zram.h"
+#include "uaccess.h"
+#include "vdso.h"
+#include "ktime.h"
+#include "timer.h"
+#include "smp.h"
+#include "apic.h"
+#include "hrtimer.h"
+#include "idt.h"
+#include "proc/process.h"
+#include "swap.h"
 
 void kmalloc_test() {
     void* ptr1 = kmalloc(32);
@@ -22,6 +33,543 @@ void kmalloc_test() {
     kfree(ptr2);
 }
 
+static void kmem_cache_test_ctor(void* object) {
+    *(uint64_t*) object = 0xC0FFEE;
+}
+
+void kmem_cache_test() {
+    kmem_cache_t* cache = kmem_cache_create("test", 100, KMEM_CACHE_LINE, kmem_cache_test_ctor);
+
+    uint64_t* ptr1 = kmem_cache_alloc(cache);
+    uint64_t* ptr2 = kmem_cache_alloc(cache);
+
+    if(((uintptr_t) ptr1 & (KMEM_CACHE_LINE - 1)) || ((uintptr_t) ptr2 & (KMEM_CACHE_LINE - 1))) {
+        printf("[KMEM_CACHE_TEST] Objects are not cache line aligned: 0x%x 0x%x\n", ptr1, ptr2);
+    }
+
+    if(*ptr1 != 0xC0FFEE || *ptr2 != 0xC0FFEE) {
+        printf("[KMEM_CACHE_TEST] Constructor did not run\n");
+    }
+
+    kmem_cache_free(cache, ptr1);
+    //Objects given to free end up in their cache as well
+    free(ptr2);
+
+    kmem_cache_dump();
+}
+
+void zram_test() {
+    file_node_t* node = open("/dev/zram0", 0);
+
+    if(node == NULL) {
+        printf("[ZRAM_TEST] /dev/zram0 is missing\n");
+        return;
+    }
+
+    char* page = malloc(ZRAM_PAGE_SIZE * 2);
+    char* check = malloc(ZRAM_PAGE_SIZE * 2);
+
+    //A repeating pattern followed by a page that doesn't compress
+    for(int i = 0; i < ZRAM_PAGE_SIZE; i++) {
+        page[i] = "NightOS"[i % 7];
+    }
+
+    uint32_t seed = 42;
+    for(int i = ZRAM_PAGE_SIZE; i < ZRAM_PAGE_SIZE * 2; i++) {
+        seed = seed * 1103515245 + 12345;
+        page[i] = seed >> 16;
+    }
+
+    //Unaligned, so both pages are updated partially first
+    node->file_ops.write(node, page + 100, 100, ZRAM_PAGE_SIZE * 2 - 100);
+    node->file_ops.write(node, page, 0, 100);
+    node->file_ops.read(node, check, 0, ZRAM_PAGE_SIZE * 2);
+
+    if(memcmp(page, check, ZRAM_PAGE_SIZE * 2) != 0) {
+        printf("[ZRAM_TEST] Data read back differs\n");
+    }
+
+    zram_dump(node);
+
+    //Zeroes free the pages again
+    memset(page, 0, ZRAM_PAGE_SIZE * 2);
+    node->file_ops.write(node, page, 0, ZRAM_PAGE_SIZE * 2);
+
+    free(page);
+    free(check);
+}
+
+void uaccess_test() {
+    char buffer[16];
+
+    //Kernel addresses fail the range check, unmapped user addresses fault and end up at the fixup
+    if(copy_from_user(buffer, (void*) 0xffffff0000000000ull, sizeof(buffer)) != -EFAULT) {
+        printf("[UACCESS_TEST] Kernel address was accepted\n");
+    }
+
+    if(copy_to_user((void*) (USER_SPACE_END - 0x1000), buffer, sizeof(buffer)) != -EFAULT) {
+        printf("[UACCESS_TEST] Fault on unmapped page was not caught\n");
+    }
+
+    if(strncpy_from_user(buffer, (char*) (USER_SPACE_END - 4), sizeof(buffer)) != -EFAULT) {
+        printf("[UACCESS_TEST] String past the user half was accepted\n");
+    }
+}
+
+void ktime_test() {
+    uint64_t last = ktime_get_ns();
+
+    for(int i = 0; i < 1000; i++) {
+        uint64_t now = ktime_get_ns();
+
+        if(now < last) {
+            printf("[KTIME_TEST] Time went backwards from %d to %d\n", last, now);
+            return;
+        }
+
+        last = now;
+    }
+
+    //The busy wait has to last at least as long as requested
+    uint64_t start = ktime_get_ns();
+    ksleep(1);
+
+    if(ktime_get_ns() - start < NSEC_PER_MSEC) {
+        printf("[KTIME_TEST] ksleep returned early\n");
+    }
+}
+
+extern char vdso_image_start[];
+
+void vdso_test() {
+    int64_t sec, nsec;
+
+    if(memcmp(vdso_image_start, "\x7f" "ELF", 4) != 0) {
+        printf("[VDSO_TEST] Embedded image is no ELF file\n");
+    }
+
+    //Without the TSC the published time lags behind by at most a tick
+    vdso_update_time();
+
+    if(vdso_read_clock(CLOCK_MONOTONIC, &sec, &nsec) != 0) {
+        printf("[VDSO_TEST] Monotonic clock is missing\n");
+    }
+
+    uint64_t published = sec * NSEC_PER_SEC + nsec;
+    uint64_t now = ktime_get_ns();
+
+    if(published > now || now - published >= TICK_NSEC) {
+        printf("[VDSO_TEST] Monotonic clock doesn't match ktime\n");
+    }
+
+    if(vdso_read_clock(CLOCK_REALTIME, &sec, &nsec) != 0 || sec < get_boot_time()) {
+        printf("[VDSO_TEST] Real time clock is before boot\n");
+    }
+
+    if(vdso_read_clock(2, &sec, &nsec) != -EINVAL) {
+        printf("[VDSO_TEST] CPU time clock was answered from the time data\n");
+    }
+}
+
+void smp_test() {
+    if(get_current_core() != 0 || get_pcb() != process_get_pcb(0)) {
+        printf("[SMP_TEST] Boot cpu doesn't find control block 0 through GS\n");
+    }
+
+    //Started cpus are parked in their idle task
+    for(int cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        pcb_t* pcb = process_get_pcb(cpu);
+
+        if(pcb->core != cpu || pcb->kernel_idle_process == NULL || pcb->kernel_idle_process->cpu != cpu) {
+            printf("[SMP_TEST] cpu %d has no idle task\n", cpu);
+        }
+
+        if(cpu != 0 && pcb->current_process != pcb->kernel_idle_process) {
+            printf("[SMP_TEST] cpu %d doesn't run its idle task\n", cpu);
+        }
+    }
+}
+
+void apic_test() {
+    int first = irq_alloc(NULL);
+    int second = irq_alloc(NULL);
+
+    if(first < IRQ_LEGACY || second < IRQ_LEGACY || first == second || first == IRQ_SYSCALL || second == IRQ_SYSCALL) {
+        printf("[APIC_TEST] Allocated irqs %d and %d overlap the fixed vectors\n", first, second);
+    }
+
+    if(apic_enabled()) {
+        uint64_t address;
+        uint32_t data;
+
+        if(msi_compose(first, 0, &address, &data) != 0 || address != (MSI_ADDRESS_BASE | ((uint64_t) lapic_id() << 12)) || data != IRQ_BASE + first) {
+            printf("[APIC_TEST] MSI message of irq %d doesn't target the boot cpu\n", first);
+        }
+
+        if(irq_set_affinity(0, 0) != 0) {
+            printf("[APIC_TEST] Timer can't be routed to the boot cpu\n");
+        }
+
+        if(irq_set_affinity(0, MAX_CPUS) == 0) {
+            printf("[APIC_TEST] Routed the timer to a missing cpu\n");
+        }
+    }
+
+    irq_free(first);
+    irq_free(second);
+
+    if(irq_alloc(NULL) != first) {
+        printf("[APIC_TEST] Freed irq %d isn't reused\n", first);
+    }
+
+    irq_free(first);
+}
+
+static volatile int hrtimer_test_fired = 0;
+
+static hrtimer_restart_t hrtimer_test_callback(hrtimer_t* timer) {
+    hrtimer_test_fired++;
+
+    if(hrtimer_test_fired < 3) {
+        timer->expires += NSEC_PER_MSEC;
+        return HRTIMER_RESTART;
+    }
+
+    return HRTIMER_NORESTART;
+}
+
+void hrtimer_test() {
+    hrtimer_t timer;
+    hrtimer_init(&timer, hrtimer_test_callback);
+
+    //A cancelled timer never fires
+    hrtimer_start(&timer, ktime_get_ns() + 5 * NSEC_PER_MSEC);
+
+    if(!hrtimer_cancel(&timer) || hrtimer_cancel(&timer) || hrtimer_active(&timer)) {
+        printf("[HRTIMER_TEST] Cancel didn't dequeue the timer\n");
+    }
+
+    ksleep(20);
+
+    if(hrtimer_test_fired != 0) {
+        printf("[HRTIMER_TEST] Cancelled timer fired\n");
+    }
+
+    //Restarts twice, one tick is plenty with a periodic device
+    uint64_t start = ktime_get_ns();
+    hrtimer_start(&timer, start + NSEC_PER_MSEC);
+
+    while(hrtimer_test_fired < 3 && ktime_get_ns() - start < 100 * NSEC_PER_MSEC) {
+        __asm__ volatile("pause");
+    }
+
+    if(hrtimer_test_fired != 3 || hrtimer_active(&timer)) {
+        printf("[HRTIMER_TEST] Timer fired %d times instead of 3\n", hrtimer_test_fired);
+    }
+
+    if(ktime_get_ns() < timer.expires) {
+        printf("[HRTIMER_TEST] Timer fired before it expired\n");
+    }
+
+    hrtimer_cancel(&timer);
+}
+
+void run_queue_test() {
+    //Only the links, the priority and the vruntime are used, the run queue never allocates
+    static run_queue_t queue;
+    static process_t processes[4];
+    int prios[4] = { 60, 20, 20, MAX_RT_PRIO - 1 };
+
+    run_queue_init(&queue);
+
+    for(int i = 0; i < 4; i++) {
+        processes[i].main_thread.priority = prios[i];
+        run_queue_enqueue(&queue, &processes[i]);
+    }
+
+    //Highest real time priority first, FIFO within a priority
+    int order[4] = { 1, 2, 0, 3 };
+
+    for(int i = 0; i < 4; i++) {
+        process_t* next = run_queue_first(&queue);
+
+        if(next != &processes[order[i]]) {
+            printf("[RUN_QUEUE_TEST] Picked process %d instead of %d\n", (int)(next - processes), order[i]);
+        }
+
+        if(next != NULL) {
+            run_queue_dequeue(&queue, next);
+        }
+    }
+
+    if(queue.length != 0 || run_queue_first(&queue) != NULL) {
+        printf("[RUN_QUEUE_TEST] Queue not empty after dequeuing everything\n");
+    }
+
+    //Removing from the middle keeps the FIFO intact
+    for(int i = 0; i < 3; i++) {
+        processes[i].main_thread.priority = 20;
+        run_queue_enqueue(&queue, &processes[i]);
+    }
+
+    run_queue_dequeue(&queue, &processes[1]);
+
+    if(run_queue_first(&queue) != &processes[0] || processes[0].run_next != &processes[2] || processes[2].run_prev != &processes[0]) {
+        printf("[RUN_QUEUE_TEST] Links broken after removing from the middle\n");
+    }
+
+    run_queue_dequeue(&queue, &processes[0]);
+    run_queue_dequeue(&queue, &processes[2]);
+
+    if(queue.bitmap[0] != 0) {
+        printf("[RUN_QUEUE_TEST] Bitmap not cleared\n");
+    }
+
+    //Fair processes run by vruntime, whatever their nice value, and only after every real time process
+    uint64_t vruntimes[4] = { 300, 100, 200, 0 };
+    int nices[4] = { -5, 10, 0, 0 };
+
+    for(int i = 0; i < 3; i++) {
+        processes[i].main_thread.priority = NICE_TO_PRIO(nices[i]);
+        processes[i].vruntime = vruntimes[i];
+        run_queue_enqueue(&queue, &processes[i]);
+    }
+
+    processes[3].main_thread.priority = MAX_RT_PRIO - 1;
+    run_queue_enqueue(&queue, &processes[3]);
+
+    if(queue.fair_weight != 3121 + 110 + NICE_0_LOAD) {
+        printf("[RUN_QUEUE_TEST] Fair weight is %d\n", (int)queue.fair_weight);
+    }
+
+    int fairOrder[4] = { 3, 1, 2, 0 };
+
+    for(int i = 0; i < 4; i++) {
+        process_t* next = run_queue_first(&queue);
+
+        if(next != &processes[fairOrder[i]]) {
+            printf("[RUN_QUEUE_TEST] Picked process %d instead of %d\n", (int)(next - processes), fairOrder[i]);
+        }
+
+        if(next != NULL) {
+            run_queue_dequeue(&queue, next);
+        }
+    }
+
+    if(queue.length != 0 || queue.leftmost != NULL || queue.fair_weight != 0) {
+        printf("[RUN_QUEUE_TEST] Fair queue not empty after dequeuing everything\n");
+    }
+}
+
+void sleep_heap_test() {
+    //Only sleepUntil and sleepSlot are used
+    static sleep_heap_t heap;
+    static process_t processes[6];
+    uint64_t deadlines[6] = { 500, 100, 400, 100, 300, 200 };
+
+    if(sleep_heap_next(&heap) != UINT64_MAX) {
+        printf("[SLEEP_HEAP_TEST] Empty heap has a next wakeup\n");
+    }
+
+    for(int i = 0; i < 6; i++) {
+        processes[i].sleepUntil = deadlines[i];
+        sleep_heap_insert(&heap, &processes[i]);
+    }
+
+    if(sleep_heap_next(&heap) != 100) {
+        printf("[SLEEP_HEAP_TEST] Next wakeup is %d instead of 100\n", (int)sleep_heap_next(&heap));
+    }
+
+    //Removing from the middle keeps the heap ordered and the slots of the moved entries right
+    sleep_heap_remove(&heap, &processes[2]);
+
+    if(processes[2].sleepSlot != 0) {
+        printf("[SLEEP_HEAP_TEST] Removed process still has a slot\n");
+    }
+
+    for(size_t slot = 1; slot <= heap.length; slot++) {
+        if(heap.entries[slot]->sleepSlot != slot || (slot > 1 && heap.entries[slot / 2]->sleepUntil > heap.entries[slot]->sleepUntil)) {
+            printf("[SLEEP_HEAP_TEST] Heap broken at slot %d\n", (int)slot);
+        }
+    }
+
+    uint64_t expected[5] = { 100, 100, 200, 300, 500 };
+
+    for(int i = 0; i < 5; i++) {
+        if(heap.length == 0 || sleep_heap_next(&heap) != expected[i]) {
+            printf("[SLEEP_HEAP_TEST] Wakeup %d is %d instead of %d\n", i, (int)sleep_heap_next(&heap), (int)expected[i]);
+            break;
+        }
+
+        sleep_heap_remove(&heap, heap.entries[1]);
+    }
+
+    if(heap.length != 0 || sleep_heap_next(&heap) != UINT64_MAX) {
+        printf("[SLEEP_HEAP_TEST] Heap not empty after removing everything\n");
+    }
+
+    free(heap.entries);
+
+    //Nothing sleeps before the first task starts
+    if(process_next_wakeup() != UINT64_MAX) {
+        printf("[SLEEP_HEAP_TEST] Process wakes up at %d before anything slept\n", (int)process_next_wakeup());
+    }
+}
+
+static process_t exec_test_process;
+static volatile process_t* exec_test_previous;
+static uintptr_t exec_test_previous_map;
+
+/**
+ * Makes a fake process current and execs it onto an address space of its own, the way the scanners find user processes
+ * @return the new address space or NULL if exec left an address space locked
+ */
+static mm_struct_t* exec_test_begin(const char* name) {
+    //The old address space is still used by another thread, the exec has to leave it unlocked
+    static mm_struct_t shared;
+
+    pcb_t* pcb = get_pcb();
+    exec_test_previous = pcb->current_process;
+    exec_test_previous_map = pcb->current_page_map;
+
+    shared.process_count = 2;
+    shared.page_directory = 0x1000;
+    exec_test_process.id = 0x7FFFFFFF;
+    exec_test_process.page_directory = &shared;
+
+    pcb->current_process = &exec_test_process;
+    process_replace_mm(&exec_test_process);
+
+    mm_struct_t* mm = exec_test_process.page_directory;
+
+    if(shared.process_count != 1 || !spin_trylock(&shared.lock) || !spin_trylock(&mm->lock)) {
+        printf("[%s] Exec left an address space locked\n", name);
+    }
+
+    spin_unlock(&shared.lock);
+    spin_unlock(&mm->lock);
+
+    acquire_process_tree_lock();
+    list_insert(process_list, &exec_test_process);
+    release_process_tree_lock();
+
+    return mm;
+}
+
+static void exec_test_end(mm_struct_t* mm) {
+    acquire_process_tree_lock();
+    list_delete(process_list, list_find(process_list, &exec_test_process));
+    release_process_tree_lock();
+
+    pcb_t* pcb = get_pcb();
+    pcb->current_process = exec_test_previous;
+    pcb->current_page_map = exec_test_previous_map;
+    load_page_map(0, 0);
+
+    memmgr_asid_free(mm->asid, mm->page_directory);
+    memmgr_clear_page_map(mm->page_directory);
+    memmgr_vma_destroy(mm);
+    free(mm);
+}
+
+void swap_test() {
+    //A small compressed RAM disk is the swap area, it is turned off again at the end
+    if(zram_create(1, 64 * ZRAM_PAGE_SIZE) == NULL || swapon("/dev/zram1") != 0) {
+        printf("[SWAP_TEST] No swap area\n");
+        return;
+    }
+
+    uint64_t rflags = cli();
+    mm_struct_t* mm = exec_test_begin("SWAP_TEST");
+
+    size_t count = 8;
+    uint8_t* pages = mmap_flags(NULL, count * 0x1000, false, PROT_READ | PROT_WRITE, MAP_POPULATE);
+
+    if((uintptr_t) pages != UINT64_MAX) {
+        for(size_t i = 0; i < count; i++) {
+            memset(pages + i * 0x1000, 'A' + i, 0x1000);
+        }
+
+        swap_stats_t before;
+        swap_stats_t after;
+        swap_get_stats(&before);
+
+        //The first pass over the pages clears their accessed bits, a later one swaps them out
+        for(int i = 0; i < 4; i++) {
+            memmgr_swap_out(count);
+        }
+
+        swap_get_stats(&after);
+
+        if(after.swap_outs == before.swap_outs) {
+            printf("[SWAP_TEST] No page of the exec'd process was swapped out\n");
+        }
+
+        //Faults bring the pages back
+        for(size_t i = 0; i < count * 0x1000; i++) {
+            if(pages[i] != 'A' + i / 0x1000) {
+                printf("[SWAP_TEST] Page %d differs after swapping it in\n", (int)(i / 0x1000));
+                break;
+            }
+        }
+
+        munmap(pages, count * 0x1000);
+    } else {
+        printf("[SWAP_TEST] mmap failed\n");
+    }
+
+    exec_test_end(mm);
+    sti(rflags);
+
+    if(swapoff() != 0) {
+        printf("[SWAP_TEST] Slots still in use after the pages were freed\n");
+    }
+}
+
+void merge_test() {
+    mm_struct_t* mm = exec_test_begin("MERGE_TEST");
+
+    size_t count = 4;
+    uint8_t* pages = mmap_flags(NULL, count * 0x1000, false, PROT_READ | PROT_WRITE, MAP_POPULATE);
+
+    if((uintptr_t) pages == UINT64_MAX) {
+        printf("[MERGE_TEST] mmap failed\n");
+        exec_test_end(mm);
+        return;
+    }
+
+    //Two pairs of identical pages, each pair can share one frame
+    for(size_t i = 0; i < count; i++) {
+        memset(pages + i * 0x1000, 'A' + i / 2, 0x1000);
+    }
+
+    merge_stats_t before;
+    merge_stats_t after;
+    memmgr_merge_get_stats(&before);
+
+    //Scans are paced by the tick, a page is merged in the second pass that finds it unchanged
+    uint64_t start = ktime_get_ns();
+
+    do {
+        memmgr_merge_scan();
+        memmgr_merge_get_stats(&after);
+    } while(after.pages_shared - before.pages_shared < 2 && ktime_get_ns() - start < NSEC_PER_SEC);
+
+    if(after.pages_shared - before.pages_shared < 2) {
+        printf("[MERGE_TEST] Identical pages of the exec'd process weren't merged\n");
+    }
+
+    //Writing breaks the sharing again
+    pages[0] = 'Z';
+
+    if(pages[0x1000] != 'A' || pages[1] != 'A') {
+        printf("[MERGE_TEST] Write to a merged page reached its twin\n");
+    }
+
+    munmap(pages, count * 0x1000);
+    exec_test_end(mm);
+}
+
 void list_test() {
     list_t* list = list_create();
     printf("List size is %d\n", list->length);
@@ -89,6 +637,49 @@ void tree_test() {
     tree_dump(tree);
 }
 
+static int avl_test_compare(void* a, void* b) {
+    return *(int*)a - *(int*)b;
+}
+
+void avl_tree_test() {
+    avl_tree_t* tree = avl_tree_create(avl_test_compare, NULL);
+    avl_tree_node_t* nodes[64];
+
+    for(int i = 0; i < 64; i++) {
+        int* value = malloc(sizeof(int));
+        (*value) = (i * 37) % 64;
+
+        nodes[i] = avl_tree_insert(tree, value);
+    }
+
+    printf("AVL tree has %d nodes with height %d\n", tree->size, tree->height);
+
+    for(int i = 0; i < 64; i += 2) {
+        free(nodes[i]->value);
+        avl_tree_remove(tree, nodes[i]);
+    }
+
+    int previous = -1;
+    bool sorted = true;
+
+    for(avl_tree_node_t* node = avl_tree_first(tree); node != NULL; node = avl_tree_next(node)) {
+        if(*(int*)node->value < previous) {
+            sorted = false;
+        }
+
+        previous = *(int*)node->value;
+    }
+
+    int search = 37;
+    avl_tree_node_t* result = avl_tree_find_child(tree, &search);
+
+    if(sorted && tree->size == 32 && result == nodes[1]) {
+        printf("Test successful\n");
+    }
+
+    avl_tree_destroy(tree);
+}
+
 void print_fs_tree(tree_node_t* treeNode, int depth) {
     //Gonna print this on serial.
     for(int i = 0; i < depth; i++) {
@@ -7,8 +7,21 @@
 
 void list_test();
 void tree_test();
+void avl_tree_test();
 void vfs_test();
 void fat_test();
 void kmalloc_test();
+void kmem_cache_test();
+void zram_test();
+void uaccess_test();
+void ktime_test();
+void vdso_test();
+void smp_test();
+void apic_test();
+void hrtimer_test();
+void run_queue_test();
+void sleep_heap_test();
+void swap_test();
+void merge_test();
 
 #endif //NIGHTOS_TEST_H
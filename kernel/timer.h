@@ -9,8 +9,20 @@
 #include <bits/ansi/time_t.h>
 
 void timer_init();
+/**
+ * Calibrates the TSC against the PIT and uses it as clocksource if present
+ */
+void tsc_init();
+/**
+ * @return the calibrated TSC frequency in Hz or 0 without a TSC
+ */
+uint64_t tsc_get_frequency();
 void ksleep(long milliseconds);
 unsigned long get_counter();
+/**
+ * @return the real time clock at boot in seconds since the epoch
+ */
+uint64_t get_boot_time();
 
 int wait(volatile uint32_t* mem, uint32_t bit, uint64_t timeout);
 
@@ -0,0 +1,77 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+
+#ifndef NIGHTOS_UACCESS_H
+#define NIGHTOS_UACCESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "memmgr.h"
+#include "../mlibc/abis/linux/errno.h"
+
+//Access to user memory from syscalls. Pointers are only checked to lie in the user half, the pages aren't walked.
+//Faults the memory manager can't resolve are caught by the page fault handler, which continues at the fixup
+//of the copy routine, so the copy fails with -EFAULT instead of taking down the kernel.
+
+//Implemented in the architecture, they return the amount of bytes not copied
+size_t __copy_user(void* dst, const void* src, size_t len);
+//Returns the length of the string, count if it isn't terminated within count bytes or -1 on a fault
+long __strncpy_from_user(char* dst, const char* src, size_t count);
+
+/**
+ * Checks if a range lies completely in the user half
+ */
+static inline bool access_ok(const void* ptr, size_t len) {
+    uintptr_t addr = (uintptr_t) ptr;
+
+    return addr + len >= addr && addr + len <= USER_SPACE_END;
+}
+
+/**
+ * Copies from user memory
+ * @return 0 or -EFAULT if the range isn't accessible
+ */
+static inline int copy_from_user(void* dst, const void* src, size_t len) {
+    if(!access_ok(src, len) || __copy_user(dst, src, len) != 0) {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+/**
+ * Copies to user memory
+ * @return 0 or -EFAULT if the range isn't accessible
+ */
+static inline int copy_to_user(void* dst, const void* src, size_t len) {
+    if(!access_ok(dst, len) || __copy_user(dst, src, len) != 0) {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+/**
+ * Copies a string from user memory including its terminator
+ * @param count the size of dst
+ * @return the length of the string, count if it doesn't fit into dst (dst isn't terminated then) or -EFAULT
+ */
+static inline long strncpy_from_user(char* dst, const char* src, size_t count) {
+    if(!access_ok(src, 0)) {
+        return -EFAULT;
+    }
+
+    //Reading past the user half would be a general protection fault, not a page fault
+    size_t limit = USER_SPACE_END - (uintptr_t) src;
+    long length = __strncpy_from_user(dst, src, count < limit ? count : limit);
+
+    if(length < 0 || (count > limit && (size_t) length == limit)) {
+        return -EFAULT;
+    }
+
+    return length;
+}
+
+#endif //NIGHTOS_UACCESS_H
@@ -0,0 +1,122 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+
+#ifndef NIGHTOS_VDSO_H
+#define NIGHTOS_VDSO_H
+
+#include <stdint.h>
+
+#ifndef CLOCK_REALTIME
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+#define CLOCK_MONOTONIC_RAW 4
+#define CLOCK_REALTIME_COARSE 5
+#define CLOCK_MONOTONIC_COARSE 6
+#define CLOCK_BOOTTIME 7
+#endif
+
+#ifndef NSEC_PER_SEC
+#define NSEC_PER_SEC 1000000000ll
+#endif
+
+//The time only advances with the timer tick
+#define VDSO_CLOCK_TICK 0
+//The TSC runs at a constant rate, readers add the cycles since cycle_last
+#define VDSO_CLOCK_TSC 1
+
+//Timer data shared with user space, mapped read only in the page right below the vDSO image.
+//The kernel is the only writer, readers retry while seq is odd or changed during their read.
+typedef struct vdso_time_data {
+    volatile uint32_t seq;
+    uint32_t clock_mode;
+
+    uint64_t cycle_last;      //TSC at the time below
+    uint32_t mult;            //Nanoseconds are (cycles * mult) >> shift
+    uint32_t shift;
+
+    uint64_t ticks;           //Timer ticks since boot
+    int64_t monotonic_sec;    //Time since boot
+    int64_t monotonic_nsec;
+    int64_t realtime_sec;     //Time since the epoch
+    int64_t realtime_nsec;
+} vdso_time_data_t;
+
+/**
+ * Reads a consistent snapshot of a clock, shared by the kernel and the vDSO
+ * @return 0 or -1 for clocks the data doesn't cover
+ */
+static inline int vdso_time_read(const vdso_time_data_t* data, int clock, int64_t* sec, int64_t* nsec) {
+    uint32_t seq;
+    uint64_t delta;
+
+    do {
+        seq = data->seq;
+
+        if(seq & 1) {
+            __asm__ volatile("pause");
+            continue;
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        switch(clock) {
+            case CLOCK_REALTIME:
+            case CLOCK_REALTIME_COARSE:
+                *sec = data->realtime_sec;
+                *nsec = data->realtime_nsec;
+                break;
+            case CLOCK_MONOTONIC:
+            case CLOCK_MONOTONIC_RAW:
+            case CLOCK_MONOTONIC_COARSE:
+            case CLOCK_BOOTTIME:
+                *sec = data->monotonic_sec;
+                *nsec = data->monotonic_nsec;
+                break;
+            default:
+                return -1;
+        }
+
+        delta = 0;
+
+        if(data->clock_mode == VDSO_CLOCK_TSC) {
+            uint32_t low, high;
+            __asm__ volatile("lfence; rdtsc" : "=a"(low), "=d"(high));
+
+            uint64_t cycles = (((uint64_t) high << 32) | low) - data->cycle_last;
+            delta = (uint64_t) (((unsigned __int128) cycles * data->mult) >> data->shift);
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while((seq & 1) || data->seq != seq);
+
+    *nsec += delta;
+    *sec += *nsec / NSEC_PER_SEC;
+    *nsec %= NSEC_PER_SEC;
+
+    return 0;
+}
+
+/**
+ * Copies the vDSO image into frames shared by every process and sets up the time data
+ */
+void vdso_init();
+
+/**
+ * Maps the time data and the vDSO image into the current address space
+ * @return the address of the ELF header for AT_SYSINFO_EHDR or 0
+ */
+uintptr_t vdso_map();
+
+/**
+ * Publishes the current time, called from the timer interrupt
+ */
+void vdso_update_time();
+
+/**
+ * Reads a clock the same way the vDSO does
+ * @return 0 or -EINVAL for unknown clocks
+ */
+int vdso_read_clock(int clock, int64_t* sec, int64_t* nsec);
+
+#endif //NIGHTOS_VDSO_H
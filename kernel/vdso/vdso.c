@@ -0,0 +1,75 @@
+//
+// Created by Jannik on 17.10.2026.
+//
+#include <time.h>
+#include <sys/time.h>
+#include "../vdso.h"
+
+#define SYS_CLOCK_GETTIME 228
+
+//User space half of the vDSO, linked as a position independent shared object by vdso.ld
+//and embedded into the kernel by vdso.S. Nothing in here may touch data outside of the image
+//and the time data page.
+
+//Placed by vdso.ld in the page right below the image
+extern const vdso_time_data_t vdso_time_data __attribute__((visibility("hidden")));
+
+static long vdso_syscall(long number, long arg1, long arg2) {
+    long ret;
+
+    __asm__ volatile("syscall"
+            : "=a"(ret)
+            : "a"(number), "D"(arg1), "S"(arg2)
+            : "rcx", "r11", "memory");
+
+    return ret;
+}
+
+int __vdso_clock_gettime(clockid_t clock, struct timespec* ts) {
+    int64_t sec, nsec;
+
+    if(vdso_time_read(&vdso_time_data, clock, &sec, &nsec) != 0) {
+        //CPU time clocks need the kernel
+        return vdso_syscall(SYS_CLOCK_GETTIME, clock, (long) ts);
+    }
+
+    ts->tv_sec = sec;
+    ts->tv_nsec = nsec;
+
+    return 0;
+}
+
+int __vdso_gettimeofday(struct timeval* tv, void* tz) {
+    int64_t sec, nsec;
+
+    if(tv) {
+        vdso_time_read(&vdso_time_data, CLOCK_REALTIME, &sec, &nsec);
+
+        tv->tv_sec = sec;
+        tv->tv_usec = nsec / 1000;
+    }
+
+    if(tz) {
+        //There are no time zones in the kernel
+        struct timezone* zone = tz;
+        zone->tz_minuteswest = 0;
+        zone->tz_dsttime = 0;
+    }
+
+    return 0;
+}
+
+time_t __vdso_time(time_t* t) {
+    //Lock free like the other readers, the seconds of a single word can't tear
+    time_t sec = __atomic_load_n(&vdso_time_data.realtime_sec, __ATOMIC_RELAXED);
+
+    if(t) {
+        *t = sec;
+    }
+
+    return sec;
+}
+
+int clock_gettime(clockid_t, struct timespec*) __attribute__((weak, alias("__vdso_clock_gettime")));
+int gettimeofday(struct timeval*, void*) __attribute__((weak, alias("__vdso_gettimeofday")));
+time_t time(time_t*) __attribute__((weak, alias("__vdso_time")));
@@ -20,6 +20,10 @@ typedef struct {
     size_t length;
 } __attribute__((packed)) list_t;
 
+/**
+ * Creates the slab cache for list entries, called once the allocator is up
+ */
+void list_init();
 list_t* list_create();
 void list_destroy(list_t* list); //Frees everything including the value
 void list_free(list_t* list); // Removes all entries and frees them as well as the list
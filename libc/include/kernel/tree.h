@@ -25,16 +25,34 @@ typedef struct AVLTreeNode {
 
     struct AVLTreeNode* left;
     struct AVLTreeNode* right;
+    struct AVLTreeNode* parent;
 
     int height;
     int balanceFactor;
 } avl_tree_node_t;
 
+/**
+ * Compares two values, returns < 0 if a sorts before b, 0 if equal and > 0 otherwise
+ */
+typedef int (*avl_compare_t)(void* a, void* b);
+/**
+ * Called whenever the children of a node changed, used to keep augmented values of a subtree up to date
+ */
+typedef void (*avl_update_t)(avl_tree_node_t* node);
+
 typedef struct AVLTree {
     avl_tree_node_t* root;
     size_t height;
+    size_t size;
+
+    avl_compare_t compare;
+    avl_update_t update;
 } avl_tree_t;
 
+/**
+ * Creates the slab cache for tree nodes, called once the allocator is up
+ */
+void tree_init();
 tree_t* tree_create();
 void tree_destroy(tree_t* tree);
 void tree_destroy_node(tree_node_t* tree_node);
@@ -47,13 +65,18 @@ tree_node_t* tree_find_child_root(tree_t* tree, void* value);
 tree_node_t* tree_find_child(tree_t* tree, tree_node_t* node, void* value);
 void tree_dump(tree_t* tree);
 
-avl_tree_t* avl_tree_create();
+avl_tree_t* avl_tree_create(avl_compare_t compare, avl_update_t update);
+void avl_tree_init(avl_tree_t* tree, avl_compare_t compare, avl_update_t update);
 void avl_tree_destroy(avl_tree_t* tree);
 void avl_tree_destroy_node(avl_tree_node_t * tree_node);
-void avl_tree_set_root_node(avl_tree_t* tree, avl_tree_node_t * root);
-avl_tree_node_t* avl_tree_insert_child(avl_tree_t * tree, avl_tree_node_t * node, void* value);
+avl_tree_node_t* avl_tree_insert(avl_tree_t* tree, void* value);
+void avl_tree_insert_node(avl_tree_t* tree, avl_tree_node_t* node);
 void avl_tree_remove(avl_tree_t* tree, avl_tree_node_t* node);
+void avl_tree_unlink(avl_tree_t* tree, avl_tree_node_t* node);
 avl_tree_node_t* avl_tree_find_child(avl_tree_t* tree, void* value);
-
+avl_tree_node_t* avl_tree_first(avl_tree_t* tree);
+avl_tree_node_t* avl_tree_last(avl_tree_t* tree);
+avl_tree_node_t* avl_tree_next(avl_tree_node_t* node);
+avl_tree_node_t* avl_tree_prev(avl_tree_node_t* node);
 
 #endif //NIGHTOS_TREE_H
@@ -5,6 +5,24 @@
 #include "../../kernel/alloc.h"
 #include "../include/stdio.h"
 
+static kmem_cache_t* list_entry_cache;
+
+void list_init() {
+    list_entry_cache = kmem_cache_create("list_entry", sizeof(list_entry_t), 8, NULL);
+}
+
+/**
+ * Allocates a zeroed entry, lists created before list_init use kmalloc.
+ * Both end up in a slab, so entries are always freed with kfree
+ */
+static list_entry_t* list_entry_alloc() {
+    if(list_entry_cache) {
+        return kmem_cache_zalloc(list_entry_cache);
+    }
+
+    return kcalloc(1, sizeof(list_entry_t));
+}
+
 list_t * list_create() {
     list_t* list = calloc(1, sizeof(list_t));
 
@@ -59,7 +77,7 @@ void list_append(list_t* list, list_entry_t* entry) {
 }
 
 void list_insert(list_t* list, void* item) {
-    list_entry_t * entry = kcalloc(1, sizeof(list_entry_t));
+    list_entry_t * entry = list_entry_alloc();
     entry->value = item;
 
     list_append(list, entry);
@@ -150,7 +168,7 @@ list_t* list_copy(list_t* original) {
     list_t* new = calloc(1, sizeof(list_t));
 
     for(list_entry_t* entry = original->head; entry != NULL; entry = entry->next) {
-        list_entry_t* copy = calloc(1, sizeof(list_entry_t));
+        list_entry_t* copy = list_entry_alloc();
         copy->value = entry->value;
 
         list_append(new, copy);
@@ -175,7 +193,7 @@ void list_append_after(list_t* list, list_entry_t* before, list_entry_t* after)
 }
 
 list_entry_t* list_insert_after(list_t* list, list_entry_t* before, void* item) {
-    list_entry_t* entry = kcalloc(1, sizeof(list_entry_t));
+    list_entry_t* entry = list_entry_alloc();
     entry->value = item;
 
     list_append_after(list, before, entry);
@@ -203,7 +221,7 @@ void list_append_before(list_t* list, list_entry_t* after, list_entry_t* before)
 }
 
 list_entry_t* list_insert_before(list_t* list, list_entry_t* after, void* item) {
-    list_entry_t* entry = kcalloc(1, sizeof(list_entry_t));
+    list_entry_t* entry = list_entry_alloc();
     entry->value = item;
 
     list_append_before(list, after, entry);
@@ -6,6 +6,12 @@
 #include "../../kernel/alloc.h"
 #include "../include/stdio.h"
 
+static kmem_cache_t* tree_node_cache;
+
+void tree_init() {
+    tree_node_cache = kmem_cache_create("tree_node", sizeof(tree_node_t), 8, NULL);
+}
+
 tree_t* tree_create() {
     tree_t* tree = calloc(1, sizeof(tree_t));
 
@@ -87,7 +93,8 @@ void tree_set_root_node(tree_t* tree, tree_node_t* node) {
  * @return the new tree node
  */
 tree_node_t* tree_insert_child(tree_t* tree, tree_node_t* node, void* value) {
-    tree_node_t* tree_node = kcalloc(1, sizeof(tree_node_t));
+    //Nodes from either allocator are freed with kfree
+    tree_node_t* tree_node = tree_node_cache ? kmem_cache_zalloc(tree_node_cache) : kcalloc(1, sizeof(tree_node_t));
 
     tree_node->value = value;
 
@@ -213,4 +220,320 @@ void tree_dump(tree_t* tree) {
     }
 
     tree_dump_preorder(tree->head);
-}
\ No newline at end of file
+}
+/***
+ * Creates a new self-balancing tree
+ * @param compare the function used to order the values
+ * @param update optional callback for augmented values, called bottom-up whenever a subtree changes
+ * @return the tree
+ */
+avl_tree_t* avl_tree_create(avl_compare_t compare, avl_update_t update) {
+    avl_tree_t* tree = calloc(1, sizeof(avl_tree_t));
+
+    avl_tree_init(tree, compare, update);
+
+    return tree;
+}
+
+/**
+ * Initializes a tree embedded in another structure
+ */
+void avl_tree_init(avl_tree_t* tree, avl_compare_t compare, avl_update_t update) {
+    tree->root = NULL;
+    tree->height = 0;
+    tree->size = 0;
+    tree->compare = compare;
+    tree->update = update;
+}
+
+/***
+ * Destroys the tree, this frees all nodes and their values
+ * @param tree the tree
+ */
+void avl_tree_destroy(avl_tree_t* tree) {
+    avl_tree_destroy_node(tree->root);
+
+    free(tree);
+}
+
+void avl_tree_destroy_node(avl_tree_node_t* node) {
+    if(node == NULL) {
+        return;
+    }
+
+    avl_tree_destroy_node(node->left);
+    avl_tree_destroy_node(node->right);
+
+    free(node->value);
+    free(node);
+}
+
+static int avl_tree_height(avl_tree_node_t* node) {
+    return node ? node->height : 0;
+}
+
+static void avl_tree_fix(avl_tree_t* tree, avl_tree_node_t* node) {
+    int left = avl_tree_height(node->left);
+    int right = avl_tree_height(node->right);
+
+    node->height = (left > right ? left : right) + 1;
+    node->balanceFactor = right - left;
+
+    if(tree->update) {
+        tree->update(node);
+    }
+}
+
+static void avl_tree_replace_child(avl_tree_t* tree, avl_tree_node_t* parent, avl_tree_node_t* old, avl_tree_node_t* new) {
+    if(parent == NULL) {
+        tree->root = new;
+    } else if(parent->left == old) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+
+    if(new) {
+        new->parent = parent;
+    }
+}
+
+static avl_tree_node_t* avl_tree_rotate_left(avl_tree_t* tree, avl_tree_node_t* node) {
+    avl_tree_node_t* right = node->right;
+
+    node->right = right->left;
+    if(right->left) {
+        right->left->parent = node;
+    }
+
+    avl_tree_replace_child(tree, node->parent, node, right);
+
+    right->left = node;
+    node->parent = right;
+
+    avl_tree_fix(tree, node);
+    avl_tree_fix(tree, right);
+
+    return right;
+}
+
+static avl_tree_node_t* avl_tree_rotate_right(avl_tree_t* tree, avl_tree_node_t* node) {
+    avl_tree_node_t* left = node->left;
+
+    node->left = left->right;
+    if(left->right) {
+        left->right->parent = node;
+    }
+
+    avl_tree_replace_child(tree, node->parent, node, left);
+
+    left->right = node;
+    node->parent = left;
+
+    avl_tree_fix(tree, node);
+    avl_tree_fix(tree, left);
+
+    return left;
+}
+
+/**
+ * Walks up from node to the root and restores the balance on the way
+ */
+static void avl_tree_rebalance(avl_tree_t* tree, avl_tree_node_t* node) {
+    while(node != NULL) {
+        avl_tree_fix(tree, node);
+
+        if(node->balanceFactor > 1) {
+            if(node->right->balanceFactor < 0) {
+                avl_tree_rotate_right(tree, node->right);
+            }
+
+            node = avl_tree_rotate_left(tree, node);
+        } else if(node->balanceFactor < -1) {
+            if(node->left->balanceFactor > 0) {
+                avl_tree_rotate_left(tree, node->left);
+            }
+
+            node = avl_tree_rotate_right(tree, node);
+        }
+
+        node = node->parent;
+    }
+
+    tree->height = avl_tree_height(tree->root);
+}
+
+/***
+ * Inserts a value into the tree, equal values are inserted after the existing ones
+ * @param tree the tree
+ * @param value the value
+ * @return the new node
+ */
+avl_tree_node_t* avl_tree_insert(avl_tree_t* tree, void* value) {
+    avl_tree_node_t* node = calloc(1, sizeof(avl_tree_node_t));
+    node->value = value;
+
+    avl_tree_insert_node(tree, node);
+
+    return node;
+}
+
+/***
+ * Links a node owned by the caller into the tree, nothing is allocated
+ * @param tree the tree
+ * @param node the node, value has to be set
+ */
+void avl_tree_insert_node(avl_tree_t* tree, avl_tree_node_t* node) {
+    void* value = node->value;
+
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 1;
+    node->balanceFactor = 0;
+
+    avl_tree_node_t* parent = NULL;
+    avl_tree_node_t** link = &tree->root;
+
+    while(*link != NULL) {
+        parent = *link;
+
+        if(tree->compare(value, parent->value) < 0) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
+    }
+
+    node->parent = parent;
+    *link = node;
+    tree->size++;
+
+    avl_tree_rebalance(tree, node);
+}
+
+/***
+ * Removes the node from the tree and frees it, the value is not freed
+ * @param tree the tree
+ * @param node the node
+ */
+void avl_tree_remove(avl_tree_t* tree, avl_tree_node_t* node) {
+    avl_tree_unlink(tree, node);
+    free(node);
+}
+
+/***
+ * Removes the node from the tree without freeing it
+ * @param tree the tree
+ * @param node the node
+ */
+void avl_tree_unlink(avl_tree_t* tree, avl_tree_node_t* node) {
+    avl_tree_node_t* start;
+
+    if(node->left && node->right) {
+        //Replace the node with its successor
+        avl_tree_node_t* successor = node->right;
+
+        while(successor->left) {
+            successor = successor->left;
+        }
+
+        if(successor->parent != node) {
+            start = successor->parent;
+
+            start->left = successor->right;
+            if(successor->right) {
+                successor->right->parent = start;
+            }
+
+            successor->right = node->right;
+            node->right->parent = successor;
+        } else {
+            start = successor;
+        }
+
+        successor->left = node->left;
+        node->left->parent = successor;
+
+        avl_tree_replace_child(tree, node->parent, node, successor);
+    } else {
+        start = node->parent;
+
+        avl_tree_replace_child(tree, node->parent, node, node->left ? node->left : node->right);
+    }
+
+    tree->size--;
+
+    avl_tree_rebalance(tree, start);
+}
+
+avl_tree_node_t* avl_tree_find_child(avl_tree_t* tree, void* value) {
+    avl_tree_node_t* node = tree->root;
+
+    while(node != NULL) {
+        int result = tree->compare(value, node->value);
+
+        if(result == 0) {
+            return node;
+        }
+
+        node = result < 0 ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+avl_tree_node_t* avl_tree_first(avl_tree_t* tree) {
+    avl_tree_node_t* node = tree->root;
+
+    while(node && node->left) {
+        node = node->left;
+    }
+
+    return node;
+}
+
+avl_tree_node_t* avl_tree_last(avl_tree_t* tree) {
+    avl_tree_node_t* node = tree->root;
+
+    while(node && node->right) {
+        node = node->right;
+    }
+
+    return node;
+}
+
+avl_tree_node_t* avl_tree_next(avl_tree_node_t* node) {
+    if(node->right) {
+        node = node->right;
+
+        while(node->left) {
+            node = node->left;
+        }
+
+        return node;
+    }
+
+    while(node->parent && node->parent->right == node) {
+        node = node->parent;
+    }
+
+    return node->parent;
+}
+
+avl_tree_node_t* avl_tree_prev(avl_tree_node_t* node) {
+    if(node->left) {
+        node = node->left;
+
+        while(node->right) {
+            node = node->right;
+        }
+
+        return node;
+    }
+
+    while(node->parent && node->parent->left == node) {
+        node = node->parent;
+    }
+
+    return node->parent;
+}